@@ -6,6 +6,9 @@ namespace player {
 DEFINE_string(uri, "rtmp://127.0.0.1:9527?room=3", "尝试从该处获取媒体数据");
 DEFINE_int32(window_width, 800, "窗口的宽度");
 DEFINE_int32(window_height, 800, "窗口的高度");
+DEFINE_string(trace_file, "",
+              "非空时记录各线程的跟踪事件，退出时写入该文件，格式为 Chrome "
+              "trace JSON");
 
 }  // namespace player
 }  // namespace live
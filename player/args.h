@@ -8,6 +8,7 @@ namespace player {
 DECLARE_string(uri);
 DECLARE_int32(window_width);
 DECLARE_int32(window_height);
+DECLARE_string(trace_file);
 
 }  // namespace player
 }  // namespace live
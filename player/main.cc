@@ -4,6 +4,7 @@
 #include "util/env.h"
 #include "util/renderer.h"
 #include "util/speaker.h"
+#include "util/trace.h"
 #include "util/util.h"
 
 #include <csignal>
@@ -20,6 +21,8 @@ void signal_handler(int signal) {
 
 int main(int argc, char** argv) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
+  live::util::trace::Enable(!FLAGS_trace_file.empty());
+  live::util::trace::SetThreadName("main");
 
   Context context(live::player::FLAGS_uri);
 
@@ -139,5 +142,9 @@ int main(int argc, char** argv) {
   read_future.wait();
   LOG_ERROR << "reading thread exits";
 
+  if (!FLAGS_trace_file.empty()) {
+    live::util::trace::DumpToFile(FLAGS_trace_file);
+  }
+
   return 0;
 }
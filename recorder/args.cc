@@ -19,5 +19,9 @@ DEFINE_bool(enable_output_pts_info, false, "输出 PTS 信息");
 
 DEFINE_string(url, "rtmp://127.0.0.1:9527", "url of rtmp server");
 
+DEFINE_string(trace_file, "",
+              "非空时记录各线程的跟踪事件，退出时写入该文件，格式为 Chrome "
+              "trace JSON");
+
 }  // namespace recorder
 }  // namespace live
@@ -13,6 +13,7 @@ DECLARE_bool(enable_debug_speaker);
 DECLARE_bool(enable_output_pts_info);
 DECLARE_bool(list_devices);
 DECLARE_string(url);
+DECLARE_string(trace_file);
 
 }  // namespace recorder
 }  // namespace live
@@ -1,4 +1,5 @@
 #include "util/env.h"
+#include "util/trace.h"
 #include "util/util.h"
 
 #include "recorder/args.h"
@@ -17,6 +18,8 @@ void signal_handler(int signal) {
 
 int main(int argc, char** argv) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
+  live::util::trace::Enable(!FLAGS_trace_file.empty());
+  live::util::trace::SetThreadName("main");
   if (FLAGS_list_devices) {
     auto format_context_ = avformat_alloc_context();
     auto input_ = av_find_input_format(FLAGS_input_format.c_str());
@@ -44,5 +47,8 @@ int main(int argc, char** argv) {
   } catch (const std::string& err) {
     LOG_ERROR << err;
   }
+  if (!FLAGS_trace_file.empty()) {
+    live::util::trace::DumpToFile(FLAGS_trace_file);
+  }
   return 0;
 }
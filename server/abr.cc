@@ -0,0 +1,622 @@
+#include "server/abr.h"
+#include "server/args.h"
+#include "server/codec.h"
+#include "server/room.h"
+
+#include "util/base.h"
+#include "util/decoder.h"
+#include "util/muxer.h"
+#include "util/queue.h"
+#include "util/trace.h"
+#include "util/video_scale_helper.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <thread>
+
+namespace live {
+namespace util {
+namespace abr {
+
+// 源的 SPS 中没有帧率时按该帧率设置编码器，只影响码率控制
+static const AVRational DEFAULT_FRAME_RATE = {25, 1};
+// 每个档位待编码的数据条数上限，含转发的音频；超出后丢弃音频，
+// 视频丢弃到下一个关键帧
+static const size_t MAX_QUEUED_ITEMS = 16;
+// 待解码的数据上限，单位 byte，超出后丢弃新数据
+static const size_t MAX_QUEUED_BYTES = 16 << 20;
+
+// 一个档位的缩放及编码，在自己的线程中进行，输出发布到档位房间
+class Encoder {
+  struct Item {
+    // 为空时转发 msg，即原样转发的音频
+    AVFrameWrapper frame;
+    bool is_key_frame = false;
+    AVRational frame_rate = {0, 1};
+    MediaMessagePtr msg;
+  };
+
+  const Rendition rendition_;
+  Queue<Item> queue_;
+  std::atomic<bool> running_{true};
+
+  // 只在解码线程中访问
+  bool dropping_ = false;
+
+  // 以下只在编码线程中访问
+  VideoScaleHelper scale_helper_;
+  AVCodecContext* context_ = nullptr;
+  AVPacket* packet_ = nullptr;
+  int32_t source_width_ = 0;
+  int32_t source_height_ = 0;
+  AnnexBConverter converter_;
+
+  std::thread thread_;
+
+  void Run();
+  bool Open(int32_t width, int32_t height, AVRational frame_rate);
+  void Close();
+  void Encode(Item* item, std::vector<MediaMessagePtr>* out);
+
+ public:
+  explicit Encoder(const Rendition& rendition) : rendition_(rendition) {
+    thread_ = std::thread([this]() { Run(); });
+  }
+  ~Encoder();
+  Encoder(const Encoder&) = delete;
+  Encoder& operator=(const Encoder&) = delete;
+
+  // 以下只在解码线程中调用，解码得到的帧在各档位间共享，不拷贝像素
+  void SubmitFrame(const AVFrameWrapper& frame, bool is_key_frame,
+                   AVRational frame_rate);
+  void SubmitMessage(const MediaMessagePtr& msg);
+};
+
+Encoder::~Encoder() {
+  running_ = false;
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  Close();
+}
+
+void Encoder::SubmitFrame(const AVFrameWrapper& frame, bool is_key_frame,
+                          AVRational frame_rate) {
+  if (dropping_ && !is_key_frame) {
+    return;
+  }
+  if (queue_.Size() >= MAX_QUEUED_ITEMS) {
+    if (!dropping_) {
+      LOG_ERROR << "encoder is too slow, drop video until next key frame, "
+                << "room_id: " << rendition_.room_id;
+    }
+    dropping_ = true;
+    return;
+  }
+  dropping_ = false;
+  Item item;
+  item.frame = frame;
+  item.is_key_frame = is_key_frame;
+  item.frame_rate = frame_rate;
+  queue_.Put(std::move(item));
+}
+
+void Encoder::SubmitMessage(const MediaMessagePtr& msg) {
+  // 音频同样受上限约束，编码线程卡住时不无限堆积；sequence header 不丢
+  if (queue_.Size() >= MAX_QUEUED_ITEMS && !msg->IsAACSequenceHeader()) {
+    return;
+  }
+  Item item;
+  item.msg = msg;
+  queue_.Put(std::move(item));
+}
+
+void Encoder::Run() {
+  trace::SetThreadName("abr encoder " + rendition_.name);
+  while (running_) {
+    Item item;
+    if (!queue_.TimedGet(&item, std::chrono::milliseconds(100))) {
+      continue;
+    }
+    std::vector<MediaMessagePtr> messages;
+    if (item.msg) {
+      messages.push_back(std::move(item.msg));
+    } else {
+      Encode(&item, &messages);
+    }
+    RoomManager::GetInstance().Publish(rendition_.room_id,
+                                       std::move(messages));
+  }
+}
+
+bool Encoder::Open(int32_t width, int32_t height, AVRational frame_rate) {
+  const AVCodec* codec = avcodec_find_encoder_by_name("libx264");
+  if (codec == nullptr) {
+    LOG_ERROR << "not found AVCodec by name libx264";
+    return false;
+  }
+  context_ = avcodec_alloc_context3(codec);
+  packet_ = av_packet_alloc();
+  if (!context_ || !packet_) {
+    LOG_ERROR << "alloc encoder failed";
+    Close();
+    return false;
+  }
+
+  MuxerParam mp;
+  mp.video_width = width;
+  mp.video_height = height;
+  mp.video_pix_fmt = AV_PIX_FMT_YUV420P;
+  mp.video_time_base = {1, 1000};
+  SetupVideoEncoder(context_, codec, &mp);
+  // 以下覆盖 Muxer 的设置：时间戳沿用源的毫秒时间戳，帧率取自源；
+  // 关键帧由源决定，不使用 B 帧，dts 与 pts 相同
+  context_->framerate = frame_rate;
+  context_->gop_size = -1;
+  context_->max_b_frames = 0;
+  context_->bit_rate = rendition_.bit_rate;
+  context_->rc_max_rate = rendition_.bit_rate;
+  context_->rc_buffer_size = int(rendition_.bit_rate);
+  // 多个档位同时编码，用较快的 preset；zerolatency 去掉 lookahead，
+  // 每送入一帧即输出一帧，档位房间中的音视频仍按时间戳交错
+  av_opt_set(context_->priv_data, "preset", "veryfast", 0);
+  av_opt_set(context_->priv_data, "tune", "film,zerolatency", 0);
+  // 编码器不自行插入关键帧：各档位丢帧的时机不同，帧数会不一致，按帧数
+  // 或场景切换插入的关键帧不能对齐。只有源的关键帧强制为 IDR 开始新的 GOP
+  av_opt_set(context_->priv_data, "x264-params", "keyint=infinite:scenecut=0",
+             0);
+  av_opt_set(context_->priv_data, "forced-idr", "1", 0);
+
+  int ret = avcodec_open2(context_, codec, nullptr);
+  if (ret < 0) {
+    LOG_ERROR << "avcodec_open2 failed, error: " << av_err2str(ret);
+    Close();
+    return false;
+  }
+  LOG_ERROR << "open abr encoder, rendition: " << rendition_.name
+            << ", room_id: " << rendition_.room_id << ", size: " << width
+            << "x" << height << ", bit rate: " << rendition_.bit_rate;
+  return true;
+}
+
+void Encoder::Close() {
+  avcodec_free_context(&context_);
+  av_packet_free(&packet_);
+  // 重新打开后输出新的 sequence header
+  converter_ = AnnexBConverter();
+}
+
+void Encoder::Encode(Item* item, std::vector<MediaMessagePtr>* out) {
+  TRACE_SCOPE("abr.encode");
+  AVFrameWrapper& frame = item->frame;
+  // 源的分辨率变化时按新的宽高比重新打开编码器。不放大，宽高须为偶数
+  if (frame->width != source_width_ || frame->height != source_height_) {
+    Close();
+    source_width_ = frame->width;
+    source_height_ = frame->height;
+    if (source_width_ <= 0 || source_height_ <= 0) {
+      return;
+    }
+    int32_t height = std::min(rendition_.height, source_height_) & ~1;
+    int32_t width =
+        int32_t(int64_t(source_width_) * height / source_height_) & ~1;
+    if (width <= 0 || height <= 0 ||
+        !Open(width, height, item->frame_rate)) {
+      return;
+    }
+  }
+  if (!context_) {
+    return;
+  }
+
+  if (frame->width != context_->width || frame->height != context_->height ||
+      frame->format != context_->pix_fmt) {
+    if (!scale_helper_.Scale(frame, context_->width, context_->height,
+                             context_->pix_fmt)) {
+      LOG_ERROR << "video frame scale failed";
+      return;
+    }
+  }
+  // 只在源的关键帧处产生关键帧，各档位的 GOP 因此对齐
+  frame->pict_type =
+      item->is_key_frame ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+  int ret = avcodec_send_frame(context_, frame.GetRawPtr());
+  if (ret < 0) {
+    LOG_ERROR << "send frame failed, error: " << av_err2str(ret);
+    return;
+  }
+  for (;;) {
+    ret = avcodec_receive_packet(context_, packet_);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+      break;
+    } else if (ret < 0) {
+      LOG_ERROR << "receive packet failed, error: " << av_err2str(ret);
+      break;
+    }
+    // libx264 输出 Annex B 格式，关键帧前带有 SPS、PPS
+    const uint32_t timestamp = uint32_t(packet_->dts);
+    std::vector<uint8_t> header;
+    std::vector<uint8_t> payload;
+    converter_.Convert(packet_->data, packet_->size,
+                       int32_t(packet_->pts - packet_->dts), &header,
+                       &payload);
+    av_packet_unref(packet_);
+    if (!header.empty()) {
+      out->emplace_back(std::make_shared<const MediaMessage>(
+          9, timestamp, std::move(header)));
+    }
+    if (!payload.empty()) {
+      out->emplace_back(std::make_shared<const MediaMessage>(
+          9, timestamp, std::move(payload)));
+    }
+  }
+}
+
+// 源房间的解码，在自己的线程中进行，解码得到的帧交给各档位的 Encoder
+class Transcoder {
+  struct Task {
+    AbrManager::MediaBatch batch;
+    size_t bytes;
+    // 之前有数据因队列已满被丢弃
+    bool after_gap;
+  };
+
+  const int32_t room_id_;
+  std::vector<std::unique_ptr<Encoder>> encoders_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Task> tasks_;
+  size_t queued_bytes_ = 0;
+  bool dropping_ = false;
+  bool stopped_ = false;
+
+  // 以下只在解码线程中访问
+  Decoder decoder_;
+  // util::Decoder 需要 pkt 所在的 AVStream，这里只用来提供毫秒时间基
+  AVFormatContext* format_context_ = nullptr;
+  AVStream* stream_ = nullptr;
+  AVCodecContext* context_ = nullptr;
+  AVPacket* packet_ = nullptr;
+  bool waiting_for_key_frame_ = true;
+
+  std::thread thread_;
+
+  void Run();
+  void Handle(const MediaMessagePtr& msg);
+  bool OpenDecoder(const MediaMessage& header);
+  void CloseDecoder();
+
+ public:
+  // 失败时抛出 std::string
+  Transcoder(int32_t room_id, const std::vector<Rendition>& renditions);
+  ~Transcoder();
+  Transcoder(const Transcoder&) = delete;
+  Transcoder& operator=(const Transcoder&) = delete;
+
+  // 在主播所在线程调用，不阻塞
+  void Publish(AbrManager::MediaBatch batch);
+};
+
+Transcoder::Transcoder(int32_t room_id,
+                       const std::vector<Rendition>& renditions)
+    : room_id_(room_id) {
+  format_context_ = avformat_alloc_context();
+  if (format_context_) {
+    stream_ = avformat_new_stream(format_context_, nullptr);
+  }
+  packet_ = av_packet_alloc();
+  if (!stream_ || !packet_) {
+    av_packet_free(&packet_);
+    avformat_free_context(format_context_);
+    throw std::string("alloc transcoder failed");
+  }
+  stream_->time_base = AVRational{1, 1000};
+  for (const auto& rendition : renditions) {
+    encoders_.emplace_back(new Encoder(rendition));
+  }
+  thread_ = std::thread([this]() { Run(); });
+}
+
+Transcoder::~Transcoder() {
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    stopped_ = true;
+  }
+  cv_.notify_one();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  // 等待各档位的编码线程退出，之后不会再向档位房间发布数据
+  encoders_.clear();
+  CloseDecoder();
+  av_packet_free(&packet_);
+  avformat_free_context(format_context_);
+}
+
+void Transcoder::Publish(AbrManager::MediaBatch batch) {
+  size_t bytes = 0;
+  for (const auto& msg : *batch) {
+    bytes += msg->payload.size();
+  }
+  bool after_gap = false;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    if (queued_bytes_ + bytes > MAX_QUEUED_BYTES) {
+      if (!dropping_) {
+        LOG_ERROR << "abr decoder is too slow, drop data, room_id: "
+                  << room_id_;
+      }
+      dropping_ = true;
+      return;
+    }
+    after_gap = dropping_;
+    dropping_ = false;
+    queued_bytes_ += bytes;
+    tasks_.push_back({std::move(batch), bytes, after_gap});
+  }
+  cv_.notify_one();
+}
+
+void Transcoder::Run() {
+  trace::SetThreadName("abr decoder " + std::to_string(room_id_));
+  for (;;) {
+    std::deque<Task> tasks;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return stopped_ || !tasks_.empty(); });
+      if (stopped_) {
+        break;
+      }
+      tasks.swap(tasks_);
+    }
+    for (const auto& task : tasks) {
+      if (task.after_gap) {
+        waiting_for_key_frame_ = true;
+      }
+      for (const auto& msg : *task.batch) {
+        Handle(msg);
+      }
+      std::lock_guard<std::mutex> g(mutex_);
+      queued_bytes_ -= task.bytes;
+    }
+  }
+}
+
+void Transcoder::Handle(const MediaMessagePtr& msg) {
+  // 音频原样转发；源的 metadata 中的宽高、码率与档位不符，不转发
+  if (msg->type == 8) {
+    for (auto& encoder : encoders_) {
+      encoder->SubmitMessage(msg);
+    }
+    return;
+  }
+  // 只转码 AVC
+  if (msg->codec != MediaCodec::AVC || msg->DataSize() == 0) {
+    return;
+  }
+  if (msg->IsAVCSequenceHeader()) {
+    OpenDecoder(*msg);
+    return;
+  }
+  const bool is_key_frame = msg->IsKeyFrame();
+  if (!context_ || (waiting_for_key_frame_ && !is_key_frame)) {
+    return;
+  }
+  waiting_for_key_frame_ = false;
+
+  if (av_new_packet(packet_, int(msg->DataSize())) < 0) {
+    LOG_ERROR << "alloc packet failed";
+    return;
+  }
+  memcpy(packet_->data, msg->Data(), msg->DataSize());
+  packet_->dts = msg->timestamp;
+  packet_->pts = msg->Pts();
+  if (is_key_frame) {
+    packet_->flags |= AV_PKT_FLAG_KEY;
+  }
+  std::vector<AVFrameWrapper> frames;
+  if (!decoder_.DecodeVideoPacket(stream_, context_, packet_, &frames)) {
+    LOG_ERROR << "abr decode failed, room_id: " << room_id_;
+    waiting_for_key_frame_ = true;
+  }
+  av_packet_unref(packet_);
+
+  AVRational frame_rate = context_->framerate;
+  if (frame_rate.num <= 0 || frame_rate.den <= 0) {
+    frame_rate = DEFAULT_FRAME_RATE;
+  }
+  for (auto& frame : frames) {
+    if (frame->pts == AV_NOPTS_VALUE) {
+      frame->pts = frame->best_effort_timestamp;
+    }
+    for (auto& encoder : encoders_) {
+      encoder->SubmitFrame(frame, frame->key_frame, frame_rate);
+    }
+  }
+}
+
+bool Transcoder::OpenDecoder(const MediaMessage& header) {
+  CloseDecoder();
+  const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+  if (codec == nullptr) {
+    LOG_ERROR << "not found h264 decoder";
+    return false;
+  }
+  context_ = avcodec_alloc_context3(codec);
+  if (!context_) {
+    LOG_ERROR << "alloc decoder failed";
+    return false;
+  }
+  // AVCDecoderConfigurationRecord 作为 extradata，之后的帧为长度前缀格式
+  const size_t size = header.DataSize();
+  context_->extradata = static_cast<uint8_t*>(
+      av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE));
+  if (!context_->extradata) {
+    LOG_ERROR << "alloc extradata failed";
+    CloseDecoder();
+    return false;
+  }
+  memcpy(context_->extradata, header.Data(), size);
+  context_->extradata_size = int(size);
+  context_->pkt_timebase = stream_->time_base;
+
+  int ret = avcodec_open2(context_, codec, nullptr);
+  if (ret < 0) {
+    LOG_ERROR << "avcodec_open2 failed, error: " << av_err2str(ret);
+    CloseDecoder();
+    return false;
+  }
+  waiting_for_key_frame_ = true;
+  return true;
+}
+
+void Transcoder::CloseDecoder() {
+  avcodec_free_context(&context_);
+}
+
+// 房间号、档位的高度及码率均为不超过 9 位的十进制数
+static bool IsDecimal(const std::string& str) {
+  return !str.empty() && str.size() <= 9 &&
+         str.find_first_not_of("0123456789") == std::string::npos;
+}
+
+AbrManager::AbrManager() {
+  const std::string& list = server::FLAGS_abr_ladder;
+  for (size_t begin = 0, end = 0; begin < list.size(); begin = end + 1) {
+    end = list.find(',', begin);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    std::string item = list.substr(begin, end - begin);
+    size_t colon = item.find(':');
+    std::string height = item.substr(0, colon);
+    std::string kbps = colon == std::string::npos ? "" : item.substr(colon + 1);
+    if (!IsDecimal(height) || !IsDecimal(kbps) || std::stoi(height) < 2 ||
+        std::stoi(kbps) <= 0) {
+      LOG_ERROR << "invalid abr rendition " << item;
+      continue;
+    }
+    Rendition rendition;
+    rendition.name = height + "p";
+    rendition.height = std::stoi(height);
+    rendition.bit_rate = int64_t(std::stoi(kbps)) * 1000;
+    ladder_.push_back(rendition);
+  }
+  if (!ladder_.empty()) {
+    closer_.reset(new ThreadPool(1, "abr closer"));
+  }
+}
+
+bool AbrManager::ParseRenditionName(const std::string& name,
+                                    int32_t* room_id, std::string* rendition) {
+  size_t pos = name.find('_');
+  if (pos == std::string::npos || name.size() < pos + 3 ||
+      name.back() != 'p') {
+    return false;
+  }
+  std::string room = name.substr(0, pos);
+  std::string height = name.substr(pos + 1, name.size() - pos - 2);
+  if (!IsDecimal(room) || !IsDecimal(height)) {
+    return false;
+  }
+  *room_id = std::stoi(room);
+  *rendition = height + "p";
+  return true;
+}
+
+void AbrManager::OpenRoom(int32_t room_id, JoinMode mode) {
+  if (ladder_.empty()) {
+    return;
+  }
+  auto channel = std::make_shared<Channel>();
+  for (const auto& r : ladder_) {
+    Rendition rendition = r;
+    // 档位房间自身不再转码
+    rendition.room_id = RoomManager::GetInstance().CreateRoom(mode, false);
+    if (rendition.room_id < 0) {
+      // 只有部分档位时播放器切换到缺失的档位会失败，归还已建的房间
+      LOG_ERROR << "no room for rendition " << rendition.name
+                << ", room_id: " << room_id << ", skip abr";
+      for (const auto& created : channel->renditions) {
+        RoomManager::GetInstance().CloseRoom(created.room_id);
+      }
+      return;
+    }
+    LOG_ERROR << "create rendition " << room_id << "_" << rendition.name
+              << ", room_id: " << rendition.room_id;
+    channel->renditions.push_back(rendition);
+  }
+  try {
+    channel->transcoder =
+        std::make_shared<Transcoder>(room_id, channel->renditions);
+  } catch (const std::string& e) {
+    LOG_ERROR << e << ", room_id: " << room_id;
+    for (const auto& rendition : channel->renditions) {
+      RoomManager::GetInstance().CloseRoom(rendition.room_id);
+    }
+    return;
+  }
+  std::lock_guard<std::mutex> g(mutex_);
+  channels_[room_id] = channel;
+}
+
+void AbrManager::CloseRoom(int32_t room_id) {
+  std::shared_ptr<Channel> channel;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    auto it = channels_.find(room_id);
+    if (it == channels_.end()) {
+      return;
+    }
+    channel = std::move(it->second);
+    channels_.erase(it);
+  }
+  // 先等编码线程退出再归还档位房间，房间 id 被复用后不会收到旧的数据
+  closer_->Post([channel]() {
+    channel->transcoder.reset();
+    for (const auto& rendition : channel->renditions) {
+      RoomManager::GetInstance().CloseRoom(rendition.room_id);
+    }
+  });
+}
+
+void AbrManager::Publish(int32_t room_id, MediaBatch batch) {
+  if (ladder_.empty()) {
+    return;
+  }
+  std::shared_ptr<Transcoder> transcoder;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    auto it = channels_.find(room_id);
+    if (it == channels_.end()) {
+      return;
+    }
+    transcoder = it->second->transcoder;
+  }
+  transcoder->Publish(std::move(batch));
+}
+
+int32_t AbrManager::FindRendition(int32_t room_id,
+                                  const std::string& rendition) {
+  std::lock_guard<std::mutex> g(mutex_);
+  auto it = channels_.find(room_id);
+  if (it == channels_.end()) {
+    return -1;
+  }
+  for (const auto& r : it->second->renditions) {
+    if (r.name == rendition) {
+      return r.room_id;
+    }
+  }
+  return -1;
+}
+
+}  // namespace abr
+}  // namespace util
+}  // namespace live
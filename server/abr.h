@@ -0,0 +1,88 @@
+#pragma once
+
+#include "server/media_message.h"
+#include "util/thread_pool.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace live {
+namespace util {
+
+// 定义在 room.h 中，room.h 依赖本文件
+enum class JoinMode;
+
+namespace abr {
+
+// 转码档位，由 -abr_ladder 解析
+struct Rendition {
+  // 如 720p，观众以 <room>_720p 播放
+  std::string name;
+  int32_t height = 0;
+  int64_t bit_rate = 0;
+  // 输出的房间，由 AbrManager 在源房间创建时分配
+  int32_t room_id = -1;
+};
+
+// 源房间的转码，定义在 abr.cc 中，依赖 FFmpeg
+class Transcoder;
+
+// 为每个推流房间建立转码档位：源视频只解码一次，每个档位在自己的线程中
+// 缩放、编码，结果发布到各自的档位房间，与普通房间一样可经 RTMP、HTTP-FLV、
+// HLS 等观看。档位只在源的关键帧处产生关键帧，各档位的 GOP 对齐，音频原样
+// 转发。-abr_ladder 为空时关闭
+class AbrManager {
+  struct Channel {
+    std::vector<Rendition> renditions;
+    std::shared_ptr<Transcoder> transcoder;
+  };
+
+  // 构造后不再修改，其中的 room_id 无意义
+  std::vector<Rendition> ladder_;
+
+  std::mutex mutex_;
+  std::unordered_map<int32_t, std::shared_ptr<Channel>> channels_;
+
+  // 等待转码线程退出并归还档位房间，单独的线程，不占用工作线程池
+  std::unique_ptr<ThreadPool> closer_;
+
+  AbrManager();
+  AbrManager(const AbrManager&) = delete;
+  AbrManager& operator=(const AbrManager&) = delete;
+
+ public:
+  static AbrManager& GetInstance() {
+    static AbrManager am;
+    return am;
+  }
+
+  // 播放名形如 3_720p 时取出源房间号及档位名
+  // @return 不是档位的播放名时返回 false
+  static bool ParseRenditionName(const std::string& name, int32_t* room_id,
+                                 std::string* rendition);
+
+  // 有效档位数，为 0 表示关闭转码
+  size_t LadderSize() const {
+    return ladder_.size();
+  }
+
+  // 以下函数线程安全
+  // 为源房间创建各档位的房间，档位房间与源房间的 JoinMode 相同；
+  // 房间不足以建立全部档位时不转码
+  void OpenRoom(int32_t room_id, JoinMode mode);
+  // 转码线程退出后再关闭档位房间，在 closer_ 中进行，不阻塞调用者
+  void CloseRoom(int32_t room_id);
+  using MediaBatch = std::shared_ptr<const std::vector<MediaMessagePtr>>;
+  void Publish(int32_t room_id, MediaBatch batch);
+
+  // @return 源房间没有该档位时返回 -1
+  int32_t FindRendition(int32_t room_id, const std::string& rendition);
+};
+
+}  // namespace abr
+}  // namespace util
+}  // namespace live
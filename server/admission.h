@@ -0,0 +1,219 @@
+#pragma once
+
+#include "server/args.h"
+#include "server/net.h"
+#include "util/util.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <sys/resource.h>
+
+namespace live {
+namespace util {
+
+// 观众准入控制：按节点、房间、IP 限制观众数及预计出口带宽，
+// 节点过载（CPU 或事件循环延迟过高）时拒绝新观众，保护已有观众的播放质量。
+// 预计出口带宽 = 房间的推流码率 × 观众数。
+class AdmissionController {
+  AdmissionController() = default;
+  AdmissionController(const AdmissionController&) = delete;
+  AdmissionController& operator=(const AdmissionController&) = delete;
+
+  struct RoomLoad {
+    uint32_t viewers = 0;
+    // 推流码率，单位 bit/s
+    uint64_t bitrate = 0;
+  };
+
+  std::mutex mutex_;
+  uint32_t viewers_ = 0;
+  std::unordered_map<int32_t, RoomLoad> rooms_;
+  // IP -> 房间 -> 观众数
+  std::unordered_map<std::string, std::unordered_map<int32_t, uint32_t>> ips_;
+
+  // 进程 CPU 使用率，按核数归一化，单位 %，可在任意线程读取
+  std::atomic<double> cpu_usage_{0};
+  // 只在第 0 个 EventLoop 的线程中访问
+  uint64_t cpu_sample_time_us_ = 0;
+  uint64_t cpu_sample_used_us_ = 0;
+
+  static const uint64_t CPU_SAMPLE_INTERVAL_US = 1000000;
+
+  static uint64_t GetProcessCpuTimeInMicroSeconds() {
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) {
+      return 0;
+    }
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ull +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+  }
+
+  static uint32_t GetMaxLoopLagUs() {
+    auto& group = EventLoopGroup::GetInstance();
+    uint32_t lag = 0;
+    for (size_t i = 0; i < group.Size(); i++) {
+      lag = std::max(lag, group.GetLoop(i)->GetLagUs());
+    }
+    return lag;
+  }
+
+  uint64_t GetEgressBandwidth() const {
+    uint64_t bandwidth = 0;
+    for (const auto& pr : rooms_) {
+      bandwidth += pr.second.viewers * pr.second.bitrate;
+    }
+    return bandwidth;
+  }
+
+  uint64_t GetEgressBandwidth(const std::string& ip) const {
+    uint64_t bandwidth = 0;
+    auto it = ips_.find(ip);
+    if (it == ips_.end()) {
+      return 0;
+    }
+    for (const auto& pr : it->second) {
+      auto room = rooms_.find(pr.first);
+      if (room != rooms_.end()) {
+        bandwidth += pr.second * room->second.bitrate;
+      }
+    }
+    return bandwidth;
+  }
+
+  uint32_t GetViewers(const std::string& ip) const {
+    uint32_t viewers = 0;
+    auto it = ips_.find(ip);
+    if (it != ips_.end()) {
+      for (const auto& pr : it->second) {
+        viewers += pr.second;
+      }
+    }
+    return viewers;
+  }
+
+  // 判断带宽是否超出 limit_kbps，limit_kbps 不大于 0 表示不限制
+  static bool ExceedBandwidth(uint64_t bps, int32_t limit_kbps) {
+    return limit_kbps > 0 && bps > uint64_t(limit_kbps) * 1000;
+  }
+
+  // 观众数和码率都归零的房间不再需要记录
+  void EraseRoomIfIdle(int32_t room_id) {
+    auto it = rooms_.find(room_id);
+    if (it != rooms_.end() && it->second.viewers == 0 &&
+        it->second.bitrate == 0) {
+      rooms_.erase(it);
+    }
+  }
+
+ public:
+  static AdmissionController& GetInstance() {
+    static AdmissionController ac;
+    return ac;
+  }
+
+  // 由第 0 个 EventLoop 的延迟检测定时器周期性调用，与观众是否加入无关。
+  // 距上次采样超过 CPU_SAMPLE_INTERVAL_US 才重新计算
+  void SampleCpuUsage() {
+    uint64_t now = GetPassedTimeSinceStartedInMicroSeconds();
+    if (cpu_sample_time_us_ &&
+        now - cpu_sample_time_us_ < CPU_SAMPLE_INTERVAL_US) {
+      return;
+    }
+    uint64_t used = GetProcessCpuTimeInMicroSeconds();
+    if (cpu_sample_time_us_ && now > cpu_sample_time_us_) {
+      uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+      cpu_usage_.store(100.0 * (used - cpu_sample_used_us_) /
+                           (now - cpu_sample_time_us_) / cores,
+                       std::memory_order_relaxed);
+    }
+    cpu_sample_time_us_ = now;
+    cpu_sample_used_us_ = used;
+  }
+
+  // 线程安全。准入成功时计入观众，之后须调用 Release。
+  // @return 拒绝时返回 false，reason 为拒绝原因
+  bool Admit(int32_t room_id, const std::string& ip, std::string* reason) {
+    std::lock_guard<std::mutex> g(mutex_);
+
+    const double cpu_usage = cpu_usage_.load(std::memory_order_relaxed);
+    if (server::FLAGS_max_cpu_usage > 0 &&
+        cpu_usage > server::FLAGS_max_cpu_usage) {
+      std::ostringstream oss;
+      oss << "server overloaded, cpu usage " << uint32_t(cpu_usage) << "%";
+      *reason = oss.str();
+      return false;
+    }
+    uint32_t lag_us = GetMaxLoopLagUs();
+    if (server::FLAGS_max_loop_lag > 0 &&
+        lag_us > uint32_t(server::FLAGS_max_loop_lag) * 1000) {
+      std::ostringstream oss;
+      oss << "server overloaded, event loop lag " << lag_us / 1000 << "ms";
+      *reason = oss.str();
+      return false;
+    }
+
+    RoomLoad& room = rooms_[room_id];
+    if (server::FLAGS_max_viewers > 0 &&
+        viewers_ >= uint32_t(server::FLAGS_max_viewers)) {
+      *reason = "too many viewers on this server";
+    } else if (server::FLAGS_max_room_viewers > 0 &&
+               room.viewers >= uint32_t(server::FLAGS_max_room_viewers)) {
+      *reason = "too many viewers in this room";
+    } else if (server::FLAGS_max_ip_viewers > 0 &&
+               GetViewers(ip) >= uint32_t(server::FLAGS_max_ip_viewers)) {
+      *reason = "too many viewers from this address";
+    } else if (ExceedBandwidth(GetEgressBandwidth() + room.bitrate,
+                               server::FLAGS_max_egress_bandwidth)) {
+      *reason = "egress bandwidth of this server exhausted";
+    } else if (ExceedBandwidth((room.viewers + 1) * room.bitrate,
+                               server::FLAGS_max_room_egress_bandwidth)) {
+      *reason = "egress bandwidth of this room exhausted";
+    } else if (ExceedBandwidth(GetEgressBandwidth(ip) + room.bitrate,
+                               server::FLAGS_max_ip_egress_bandwidth)) {
+      *reason = "egress bandwidth of this address exhausted";
+    } else {
+      viewers_++;
+      room.viewers++;
+      ips_[ip][room_id]++;
+      return true;
+    }
+    EraseRoomIfIdle(room_id);
+    return false;
+  }
+
+  // 线程安全，与成功的 Admit 一一对应
+  void Release(int32_t room_id, const std::string& ip) {
+    std::lock_guard<std::mutex> g(mutex_);
+    auto it = ips_.find(ip);
+    if (it == ips_.end() || !it->second.count(room_id)) {
+      LOG_ERROR << "release unadmitted viewer, room_id: " << room_id
+                << ", ip: " << ip;
+      return;
+    }
+    if (--it->second[room_id] == 0) {
+      it->second.erase(room_id);
+      if (it->second.empty()) {
+        ips_.erase(it);
+      }
+    }
+    viewers_--;
+    rooms_[room_id].viewers--;
+    EraseRoomIfIdle(room_id);
+  }
+
+  // 线程安全，由主播所在线程定期更新房间的推流码率，主播离开时置 0
+  void UpdateRoomBitrate(int32_t room_id, uint64_t bitrate) {
+    std::lock_guard<std::mutex> g(mutex_);
+    rooms_[room_id].bitrate = bitrate;
+    EraseRoomIfIdle(room_id);
+  }
+};
+
+}  // namespace util
+}  // namespace live
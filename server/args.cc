@@ -0,0 +1,127 @@
+#include "server/args.h"
+
+namespace live {
+namespace server {
+
+DEFINE_int32(port, 9527, "对外提供服务的端口");
+DEFINE_int32(http_port, 8080,
+             "HTTP-FLV 服务端口，不大于 0 时不提供 HTTP 服务，"
+             "如 http://127.0.0.1:8080/live/3.flv 播放 3 号房间");
+DEFINE_int32(event_loops, 0, "EventLoop 线程数，不大于 0 时取 CPU 核数");
+DEFINE_int32(room_capacity, 4,
+             "同时存在的房间数上限，开启 -abr_ladder 时每个推流房间另占用"
+             "与档位数相同的房间");
+
+DEFINE_int32(join_burst_rate, 1 << 20,
+             "新观众追赶 GOP 缓存时每个观众的发送速率上限，单位 byte/s");
+DEFINE_int32(join_burst_capacity, 256 << 10,
+             "新观众令牌桶的容量，即加入时可立即发出的字节数");
+DEFINE_int32(join_burst_budget, 512 << 10,
+             "每个 EventLoop 上的房间每次调度最多为新观众发送的字节数");
+DEFINE_int32(join_burst_interval, 10, "新观众追赶数据的调度间隔，单位 ms");
+DEFINE_int32(join_burst_queue_size, 8 << 20,
+             "每个新观众追赶期间积压的字节数上限，超出后丢弃积压，"
+             "视频从最新的关键帧重新开始；不大于 0 表示不限制");
+DEFINE_string(join_mode, "gop",
+              "房间缺省的新观众加入方式，gop/live_edge/keyframe，"
+              "主播可通过推流名的 join 参数覆盖，如 stream?join=live_edge");
+DEFINE_int32(live_edge_burst_rate, 8 << 20,
+             "live_edge 模式下新观众追赶 GOP 缓存的发送速率上限，单位 byte/s");
+
+DEFINE_int32(send_buffer_size, 32 << 10,
+             "每个观众交给 socket 的待发送数据上限，其余数据在各优先级队列中等待，"
+             "越小音频越能及时插队，越大系统调用越少");
+
+DEFINE_int32(max_viewers, 0, "本节点的观众数上限，不大于 0 表示不限制");
+DEFINE_int32(max_room_viewers, 0, "每个房间的观众数上限，不大于 0 表示不限制");
+DEFINE_int32(max_ip_viewers, 0, "每个 IP 的观众数上限，不大于 0 表示不限制");
+DEFINE_int32(max_egress_bandwidth, 0,
+             "本节点预计出口带宽上限，单位 kbit/s，不大于 0 表示不限制");
+DEFINE_int32(max_room_egress_bandwidth, 0,
+             "每个房间预计出口带宽上限，单位 kbit/s，不大于 0 表示不限制");
+DEFINE_int32(max_ip_egress_bandwidth, 0,
+             "每个 IP 预计出口带宽上限，单位 kbit/s，不大于 0 表示不限制");
+DEFINE_int32(max_cpu_usage, 90,
+             "进程 CPU 使用率（按核数归一化）超过该值时拒绝新观众，单位 %，"
+             "不大于 0 表示不检测");
+DEFINE_int32(max_loop_lag, 200,
+             "任一 EventLoop 的调度延迟超过该值时拒绝新观众，单位 ms，"
+             "不大于 0 表示不检测");
+
+DEFINE_string(origin, "",
+              "源站地址，形如 127.0.0.1:9527。非空时本节点作为边缘节点，"
+              "观众播放本地不存在的房间时从源站拉流，最后一个观众离开后停止拉流");
+DEFINE_string(forward, "",
+              "转推地址，多个地址以逗号分隔，如 rtmp://10.0.0.2:1935/live，"
+              "本节点上的每路推流都会以原推流名转推至这些地址");
+DEFINE_int32(forward_queue_size, 4 << 20,
+             "每个转推地址排队等待发送的数据上限，单位 byte，"
+             "超出后丢弃排队的视频帧，从下一个关键帧重新开始");
+
+DEFINE_int32(http_buffer_size, 4 << 20,
+             "每个 HTTP 观众交给 socket 的待发送数据上限，单位 byte，"
+             "超出后丢弃视频帧，从下一个关键帧重新开始");
+
+DEFINE_bool(hls, false,
+            "是否将每个房间切片为 HLS，经 -http_port 以 /live/<room>.m3u8 播放");
+DEFINE_int32(hls_segment_duration, 4000,
+             "HLS 切片的目标时长，单位 ms，实际在此之后的第一个关键帧处切分");
+DEFINE_int32(hls_playlist_size, 5, "HLS 播放列表中的切片个数");
+DEFINE_int32(hls_cache_size, 64 << 20,
+             "HLS 切片及播放列表的内存缓存上限，单位 byte，超出后淘汰最久未访问的");
+DEFINE_bool(llhls, false,
+            "是否为每个房间生成 LL-HLS（CMAF fMP4 part），"
+            "经 -http_port 以 /live/<room>.ll.m3u8 播放");
+DEFINE_int32(llhls_part_duration, 200, "LL-HLS part 的目标时长，单位 ms");
+DEFINE_int32(worker_threads, 2, "执行切片等耗 CPU 任务的工作线程数");
+
+DEFINE_int32(rtsp_port, 8554,
+             "RTSP 服务端口，不大于 0 时不提供 RTSP 服务，"
+             "如 rtsp://127.0.0.1:8554/live/3 播放 3 号房间");
+DEFINE_int32(rtsp_buffer_size, 1 << 20,
+             "每个 RTSP over TCP 观众交给 socket 的待发送数据上限，单位 byte，"
+             "超出后丢弃视频帧，从下一个关键帧重新开始");
+
+DEFINE_string(ts_ingest, "",
+              "接收 MPEG-TS over UDP 推流的地址，多个地址以逗号分隔，"
+              "如 9000,239.0.0.1:9001，每个地址一路推流，收到数据时创建房间");
+DEFINE_int32(ts_ingest_timeout, 5000,
+             "MPEG-TS over UDP 推流超过该时长没有数据时关闭房间，单位 ms");
+DEFINE_string(ts_egress, "",
+              "将房间以 MPEG-TS over UDP 发往单播或组播地址，多项以逗号分隔，"
+              "如 3=239.0.0.1:1234 将 3 号房间发往该组播地址");
+
+DEFINE_string(dvr_dir, "", "DVR 录制目录，非空时将 -dvr_rooms 指定的房间录制为 FLV");
+DEFINE_string(dvr_rooms, "all", "录制的房间，all 或以逗号分隔的房间号，如 0,3");
+DEFINE_int32(dvr_max_duration, 600,
+             "每个录制文件的时长上限，单位 s，之后在下一个关键帧处切分");
+DEFINE_int32(dvr_max_size, 512 << 20,
+             "每个录制文件的大小上限，单位 byte，之后在下一个关键帧处切分");
+DEFINE_int32(dvr_queue_size, 64 << 20,
+             "等待写盘的数据上限，单位 byte，超出后丢弃新数据，"
+             "视频从下一个关键帧重新开始");
+
+DEFINE_int32(timeshift_size, 0,
+             "每个房间时移缓冲区的大小，单位 byte，为 0 时关闭时移");
+DEFINE_string(timeshift_dir, "/tmp", "时移缓冲区文件所在目录，文件打开后即删除");
+DEFINE_int32(timeshift_speed, 2, "时移观众追赶直播时的倍速");
+
+DEFINE_string(vod_dir, "",
+              "点播文件所在目录，非空时以 .flv 结尾的播放名从该目录点播");
+
+DEFINE_string(abr_ladder, "",
+              "转码档位，以逗号分隔的 <高度>:<码率 kbps>，如 720:2500,480:1200，"
+              "非空时每个推流房间解码一次后缩放编码为各档位，"
+              "以 /live/<room>_720p.flv 等播放");
+
+DEFINE_int32(thumbnail_interval, 0,
+             "每个房间生成缩略图的最小间隔，单位 s，为 0 时关闭缩略图，"
+             "以 /live/<room>.jpg 访问");
+DEFINE_int32(thumbnail_width, 320, "缩略图的最大宽度，高度按比例缩放");
+DEFINE_int32(thumbnail_threads, 1, "生成缩略图的低优先级线程数");
+
+DEFINE_bool(trace, false,
+            "记录各线程的跟踪事件，以 /debug/trace 导出为 Chrome trace JSON");
+
+}  // namespace server
+}  // namespace live
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <gflags/gflags.h>
+
+namespace live {
+namespace server {
+
+DECLARE_int32(port);
+DECLARE_int32(http_port);
+DECLARE_int32(event_loops);
+DECLARE_int32(room_capacity);
+
+DECLARE_int32(join_burst_rate);
+DECLARE_int32(join_burst_capacity);
+DECLARE_int32(join_burst_budget);
+DECLARE_int32(join_burst_interval);
+DECLARE_int32(join_burst_queue_size);
+DECLARE_string(join_mode);
+DECLARE_int32(live_edge_burst_rate);
+
+DECLARE_int32(send_buffer_size);
+
+DECLARE_int32(max_viewers);
+DECLARE_int32(max_room_viewers);
+DECLARE_int32(max_ip_viewers);
+DECLARE_int32(max_egress_bandwidth);
+DECLARE_int32(max_room_egress_bandwidth);
+DECLARE_int32(max_ip_egress_bandwidth);
+DECLARE_int32(max_cpu_usage);
+DECLARE_int32(max_loop_lag);
+
+DECLARE_string(origin);
+DECLARE_string(forward);
+DECLARE_int32(forward_queue_size);
+
+DECLARE_int32(http_buffer_size);
+
+DECLARE_bool(hls);
+DECLARE_int32(hls_segment_duration);
+DECLARE_int32(hls_playlist_size);
+DECLARE_int32(hls_cache_size);
+DECLARE_bool(llhls);
+DECLARE_int32(llhls_part_duration);
+DECLARE_int32(worker_threads);
+
+DECLARE_int32(rtsp_port);
+DECLARE_int32(rtsp_buffer_size);
+
+DECLARE_string(ts_ingest);
+DECLARE_int32(ts_ingest_timeout);
+DECLARE_string(ts_egress);
+
+DECLARE_string(dvr_dir);
+DECLARE_string(dvr_rooms);
+DECLARE_int32(dvr_max_duration);
+DECLARE_int32(dvr_max_size);
+DECLARE_int32(dvr_queue_size);
+
+DECLARE_int32(timeshift_size);
+DECLARE_string(timeshift_dir);
+DECLARE_int32(timeshift_speed);
+
+DECLARE_string(vod_dir);
+
+DECLARE_string(abr_ladder);
+
+DECLARE_int32(thumbnail_interval);
+DECLARE_int32(thumbnail_width);
+DECLARE_int32(thumbnail_threads);
+
+DECLARE_bool(trace);
+
+}  // namespace server
+}  // namespace live
@@ -121,19 +121,10 @@ void ChunkSerializeHelper::Serialize(ByteStream& bs) const {
   header.basic.format = 0;
   header.basic.chunk_stream_id = session->GetChunkStreamIdForSending(message);
 
-  if (header.common.type >= 7) {
-    if (message.timestamp) {
-      header.common.timestamp = message.timestamp;
-    } else {
-      header.common.timestamp =
-          GetPassedTimeSinceStartedInMicroSeconds() / 1000;
-    }
-    if (message.stream_id) {
-      header.common.message_stream_id = message.stream_id;
-    } else {
-      header.common.message_stream_id =
-          GetPassedTimeSinceStartedInMicroSeconds();
-    }
+  // 音视频及 metadata 需带上各自的时间戳和 createStream 分配的 msid，其余消息均为 0
+  if (message.type == 8 || message.type == 9 || message.type == 18) {
+    header.common.timestamp = message.timestamp;
+    header.common.message_stream_id = message.stream_id;
   } else {
     header.common.timestamp = 0;
     header.common.message_stream_id = 0;
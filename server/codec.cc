@@ -0,0 +1,381 @@
+#include "server/codec.h"
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+namespace live {
+namespace util {
+
+static const uint8_t START_CODE[] = {0, 0, 0, 1};
+
+// 按位读取 SPS，读取前已去掉防竞争字节
+class BitReader {
+  std::vector<uint8_t> data_;
+  size_t pos_ = 0;
+
+ public:
+  BitReader(const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      // 00 00 03 中的 03 为防竞争字节
+      if (i >= 2 && data[i] == 3 && data[i - 1] == 0 && data[i - 2] == 0) {
+        continue;
+      }
+      data_.push_back(data[i]);
+    }
+  }
+
+  bool Overflow() const {
+    return pos_ > data_.size() * 8;
+  }
+
+  uint32_t ReadBit() {
+    if (pos_ >= data_.size() * 8) {
+      pos_++;
+      return 0;
+    }
+    uint32_t bit = (data_[pos_ / 8] >> (7 - pos_ % 8)) & 1;
+    pos_++;
+    return bit;
+  }
+
+  uint32_t ReadBits(int n) {
+    uint32_t value = 0;
+    for (int i = 0; i < n; i++) {
+      value = (value << 1) | ReadBit();
+    }
+    return value;
+  }
+
+  // Exp-Golomb
+  uint32_t ReadUE() {
+    int zeros = 0;
+    while (!ReadBit() && zeros < 31) {
+      zeros++;
+    }
+    return ((1u << zeros) - 1) + ReadBits(zeros);
+  }
+
+  int32_t ReadSE() {
+    uint32_t v = ReadUE();
+    return (v & 1) ? int32_t((v + 1) / 2) : -int32_t(v / 2);
+  }
+};
+
+// 只解析到 frame_cropping 为止，用于得到分辨率
+static bool ParseSPSResolution(const std::vector<uint8_t>& sps,
+                               uint32_t* width, uint32_t* height) {
+  if (sps.size() < 4) {
+    return false;
+  }
+  BitReader br(&sps[1], sps.size() - 1);
+  uint32_t profile_idc = br.ReadBits(8);
+  br.ReadBits(16);
+  br.ReadUE();
+
+  uint32_t chroma_format_idc = 1;
+  static const uint32_t HIGH_PROFILES[] = {100, 110, 122, 244, 44, 83,
+                                           86,  118, 128, 138, 139, 134, 135};
+  if (std::find(std::begin(HIGH_PROFILES), std::end(HIGH_PROFILES),
+                profile_idc) != std::end(HIGH_PROFILES)) {
+    chroma_format_idc = br.ReadUE();
+    if (chroma_format_idc == 3) {
+      br.ReadBit();
+    }
+    br.ReadUE();
+    br.ReadUE();
+    br.ReadBit();
+    if (br.ReadBit()) {
+      // 跳过 scaling list
+      for (int i = 0; i < (chroma_format_idc == 3 ? 12 : 8); i++) {
+        if (!br.ReadBit()) {
+          continue;
+        }
+        int32_t last = 8, next = 8;
+        for (int j = 0; j < (i < 6 ? 16 : 64) && next != 0; j++) {
+          next = (last + br.ReadSE() + 256) % 256;
+          last = next == 0 ? last : next;
+        }
+      }
+    }
+  }
+
+  br.ReadUE();
+  uint32_t poc_type = br.ReadUE();
+  if (poc_type == 0) {
+    br.ReadUE();
+  } else if (poc_type == 1) {
+    br.ReadBit();
+    br.ReadSE();
+    br.ReadSE();
+    uint32_t n = br.ReadUE();
+    for (uint32_t i = 0; i < n && !br.Overflow(); i++) {
+      br.ReadSE();
+    }
+  }
+  br.ReadUE();
+  br.ReadBit();
+
+  uint32_t width_in_mbs = br.ReadUE() + 1;
+  uint32_t height_in_map_units = br.ReadUE() + 1;
+  uint32_t frame_mbs_only = br.ReadBit();
+  if (!frame_mbs_only) {
+    br.ReadBit();
+  }
+  br.ReadBit();
+  uint32_t crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+  if (br.ReadBit()) {
+    crop_left = br.ReadUE();
+    crop_right = br.ReadUE();
+    crop_top = br.ReadUE();
+    crop_bottom = br.ReadUE();
+  }
+  if (br.Overflow()) {
+    return false;
+  }
+
+  uint32_t crop_unit_x =
+      chroma_format_idc == 0 || chroma_format_idc == 3 ? 1 : 2;
+  uint32_t crop_unit_y =
+      (chroma_format_idc == 1 ? 2 : 1) * (2 - frame_mbs_only);
+  *width = width_in_mbs * 16 - (crop_left + crop_right) * crop_unit_x;
+  *height = (2 - frame_mbs_only) * height_in_map_units * 16 -
+            (crop_top + crop_bottom) * crop_unit_y;
+  return true;
+}
+
+bool AVCConfig::Parse(const uint8_t* data, size_t size) {
+  if (size < 6) {
+    return false;
+  }
+  nal_length_size = (data[4] & 0x03) + 1;
+  sps.clear();
+  pps.clear();
+
+  size_t pos = 5;
+  // 先是 SPS 列表，再是 PPS 列表，各自以一个字节的个数开头
+  for (auto* list : {&sps, &pps}) {
+    if (pos >= size) {
+      return false;
+    }
+    uint8_t count = data[pos++];
+    if (list == &sps) {
+      count &= 0x1F;
+    }
+    for (uint8_t i = 0; i < count; i++) {
+      if (pos + 2 > size) {
+        return false;
+      }
+      size_t len = (data[pos] << 8) | data[pos + 1];
+      pos += 2;
+      if (pos + len > size) {
+        return false;
+      }
+      list->emplace_back(data + pos, data + pos + len);
+      pos += len;
+    }
+  }
+  if (sps.empty() || pps.empty()) {
+    return false;
+  }
+  record.assign(data, data + size);
+  if (!ParseSPSResolution(sps[0], &width, &height)) {
+    width = height = 0;
+  }
+  return true;
+}
+
+const std::vector<NaluRange>* AVCConfig::GetNalus(
+    const MediaMessage& msg, std::vector<NaluRange>* scratch) const {
+  if (!msg.is_frame) {
+    return nullptr;
+  }
+  if (nal_length_size == 4) {
+    return msg.nalus.empty() ? nullptr : &msg.nalus;
+  }
+  scratch->clear();
+  if (!MediaMessage::SplitNalus(msg.Data(), msg.DataSize(), nal_length_size,
+                                msg.data_offset, scratch) ||
+      scratch->empty()) {
+    return nullptr;
+  }
+  return scratch;
+}
+
+bool AVCConfig::ToAnnexB(const MediaMessage& msg,
+                         std::vector<uint8_t>* out) const {
+  std::vector<NaluRange> scratch;
+  const std::vector<NaluRange>* nalus = GetNalus(msg, &scratch);
+  if (!nalus) {
+    return false;
+  }
+  static const uint8_t AUD[] = {0, 0, 0, 1, 0x09, 0xF0};
+  out->insert(out->end(), AUD, AUD + sizeof(AUD));
+  const bool is_key_frame = msg.is_key_frame;
+  if (is_key_frame) {
+    for (auto* list : {&sps, &pps}) {
+      for (const auto& nalu : *list) {
+        out->insert(out->end(), START_CODE, START_CODE + sizeof(START_CODE));
+        out->insert(out->end(), nalu.begin(), nalu.end());
+      }
+    }
+  }
+
+  for (const NaluRange& nalu : *nalus) {
+    const uint8_t* data = &msg.payload[nalu.offset];
+    // 已经加过 AUD，SPS、PPS 也以 sequence header 中的为准
+    uint8_t nal_type = data[0] & 0x1F;
+    if (nal_type != 9 && !(is_key_frame && (nal_type == 7 || nal_type == 8))) {
+      out->insert(out->end(), START_CODE, START_CODE + sizeof(START_CODE));
+      out->insert(out->end(), data, data + nalu.size);
+    }
+  }
+  return true;
+}
+
+std::shared_ptr<const std::vector<uint8_t>> AVCConfig::GetAnnexB(
+    const MediaMessage& msg) const {
+  return msg.GetPackaged<std::vector<uint8_t>>(
+      MediaMessage::ANNEX_B,
+      [this, &msg]() -> std::shared_ptr<const std::vector<uint8_t>> {
+        auto frame = std::make_shared<std::vector<uint8_t>>();
+        frame->reserve(msg.payload.size() + 64);
+        if (!ToAnnexB(msg, frame.get())) {
+          return nullptr;
+        }
+        return frame;
+      });
+}
+
+bool AACConfig::Parse(const uint8_t* data, size_t size) {
+  if (size < 2) {
+    return false;
+  }
+  // 5 bit object type，4 bit 采样率下标，4 bit 声道配置
+  object_type = data[0] >> 3;
+  sample_rate_index = ((data[0] & 0x07) << 1) | (data[1] >> 7);
+  channels = (data[1] >> 3) & 0x0F;
+  record.assign(data, data + size);
+  return object_type > 0 && object_type <= 4 && sample_rate_index < 13;
+}
+
+uint32_t AACConfig::SampleRate() const {
+  static const uint32_t SAMPLE_RATES[] = {96000, 88200, 64000, 48000, 44100,
+                                          32000, 24000, 22050, 16000, 12000,
+                                          11025, 8000,  7350};
+  return sample_rate_index < 13 ? SAMPLE_RATES[sample_rate_index] : 44100;
+}
+
+void AACConfig::BuildADTSHeader(size_t size, uint8_t* out) const {
+  size_t frame_length = size + 7;
+  out[0] = 0xFF;
+  // MPEG-4，无 CRC
+  out[1] = 0xF1;
+  out[2] = uint8_t(((object_type - 1) & 0x03) << 6 |
+                   (sample_rate_index & 0x0F) << 2 | (channels >> 2 & 0x01));
+  out[3] = uint8_t((channels & 0x03) << 6 | (frame_length >> 11 & 0x03));
+  out[4] = uint8_t(frame_length >> 3);
+  out[5] = uint8_t((frame_length & 0x07) << 5 | 0x1F);
+  out[6] = 0xFC;
+}
+
+std::shared_ptr<const std::vector<uint8_t>> AACConfig::GetADTS(
+    const MediaMessage& msg) const {
+  return msg.GetPackaged<std::vector<uint8_t>>(
+      MediaMessage::ADTS,
+      [this, &msg]() -> std::shared_ptr<const std::vector<uint8_t>> {
+        if (!msg.is_frame || msg.codec != MediaCodec::AAC) {
+          return nullptr;
+        }
+        const size_t size = msg.DataSize();
+        auto frame = std::make_shared<std::vector<uint8_t>>(7 + size);
+        BuildADTSHeader(size, frame->data());
+        std::copy(msg.Data(), msg.Data() + size, frame->begin() + 7);
+        return frame;
+      });
+}
+
+void AnnexBConverter::Convert(const uint8_t* data, size_t size, int32_t cts,
+                              std::vector<uint8_t>* header,
+                              std::vector<uint8_t>* frame) {
+  header->clear();
+  frame->clear();
+  // 按起始码 00 00 01 切分 NALU，去掉末尾属于下一个起始码的 0
+  std::vector<std::pair<const uint8_t*, size_t>> nalus;
+  size_t start = 0;
+  bool found = false;
+  for (size_t i = 0; i + 3 <= size;) {
+    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+      if (found) {
+        size_t end = i;
+        while (end > start && data[end - 1] == 0) {
+          end--;
+        }
+        nalus.emplace_back(data + start, end - start);
+      }
+      i += 3;
+      start = i;
+      found = true;
+    } else {
+      i++;
+    }
+  }
+  if (found) {
+    nalus.emplace_back(data + start, size - start);
+  }
+
+  std::vector<uint8_t> sps = sps_;
+  std::vector<uint8_t> pps = pps_;
+  bool is_key_frame = false;
+  // FLV payload：FrameType/CodecID、AVCPacketType、CompositionTime，
+  // 之后是 4 字节长度前缀的 NALU
+  std::vector<uint8_t> payload(5);
+  for (const auto& nalu : nalus) {
+    if (nalu.second == 0) {
+      continue;
+    }
+    uint8_t type = nalu.first[0] & 0x1F;
+    if (type == 7) {
+      sps.assign(nalu.first, nalu.first + nalu.second);
+    } else if (type == 8) {
+      pps.assign(nalu.first, nalu.first + nalu.second);
+    } else if (type != 9) {
+      is_key_frame |= type == 5;
+      for (int i = 0; i < 4; i++) {
+        payload.push_back(uint8_t(nalu.second >> (24 - 8 * i)));
+      }
+      payload.insert(payload.end(), nalu.first, nalu.first + nalu.second);
+    }
+  }
+
+  if (!sps.empty() && !pps.empty() && sps.size() >= 4 &&
+      (sps != sps_ || pps != pps_)) {
+    sps_ = sps;
+    pps_ = pps;
+    // AVCDecoderConfigurationRecord，长度前缀为 4 字节
+    *header = {0x17, 0, 0, 0, 0, 1, sps_[1], sps_[2], sps_[3], 0xFF, 0xE1};
+    header->push_back(uint8_t(sps_.size() >> 8));
+    header->push_back(uint8_t(sps_.size()));
+    header->insert(header->end(), sps_.begin(), sps_.end());
+    header->push_back(1);
+    header->push_back(uint8_t(pps_.size() >> 8));
+    header->push_back(uint8_t(pps_.size()));
+    header->insert(header->end(), pps_.begin(), pps_.end());
+  }
+  // 收到 SPS、PPS 之前的帧无法解码
+  if (sps_.empty() || payload.size() == 5) {
+    return;
+  }
+  if (cts < 0 || cts > 0x7FFFFF) {
+    cts = 0;
+  }
+  payload[0] = is_key_frame ? 0x17 : 0x27;
+  payload[1] = 1;
+  payload[2] = uint8_t(cts >> 16);
+  payload[3] = uint8_t(cts >> 8);
+  payload[4] = uint8_t(cts);
+  frame->swap(payload);
+}
+
+}  // namespace util
+}  // namespace live
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "server/media_message.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace live {
+namespace util {
+
+// FLV 中 AVC sequence header 携带的 AVCDecoderConfigurationRecord
+struct AVCConfig {
+  // NALU 前长度字段的字节数
+  uint8_t nal_length_size = 4;
+  std::vector<std::vector<uint8_t>> sps;
+  std::vector<std::vector<uint8_t>> pps;
+  // 原始的 AVCDecoderConfigurationRecord，封装 fMP4 时原样写入 avcC
+  std::vector<uint8_t> record;
+  // 由第一个 SPS 解析得到，解析失败时为 0
+  uint32_t width = 0;
+  uint32_t height = 0;
+
+  // data 为 AVCPacketType 之后的数据，即 payload + 5
+  bool Parse(const uint8_t* data, size_t size);
+
+  // msg 中的各 NALU，长度前缀为 4 字节时即创建 msg 时解析的结果，
+  // 否则切分到 scratch 中
+  // @return 数据不完整时返回空指针
+  const std::vector<NaluRange>* GetNalus(const MediaMessage& msg,
+                                         std::vector<NaluRange>* scratch) const;
+
+  // 将长度前缀格式的一帧转为 Annex B 格式，追加到 out。
+  // 帧前加 AUD，关键帧前加 SPS、PPS，使每个切片都能独立解码
+  bool ToAnnexB(const MediaMessage& msg, std::vector<uint8_t>* out) const;
+
+  // 缓存在 msg 上的 ToAnnexB 结果，HLS 与 MPEG-TS 输出共用
+  // @return 失败时返回空指针
+  std::shared_ptr<const std::vector<uint8_t>> GetAnnexB(
+      const MediaMessage& msg) const;
+};
+
+// FLV 中 AAC sequence header 携带的 AudioSpecificConfig
+struct AACConfig {
+  uint8_t object_type = 2;
+  uint8_t sample_rate_index = 4;
+  uint8_t channels = 2;
+  // 原始的 AudioSpecificConfig，封装 fMP4 时写入 esds
+  std::vector<uint8_t> record;
+
+  // data 为 AACPacketType 之后的数据，即 payload + 2
+  bool Parse(const uint8_t* data, size_t size);
+
+  uint32_t SampleRate() const;
+
+  // 为长度为 size 的 raw AAC 帧生成 7 字节的 ADTS header
+  void BuildADTSHeader(size_t size, uint8_t* out) const;
+
+  // 缓存在 msg 上的带 ADTS header 的 AAC 帧，HLS 与 MPEG-TS 输出共用
+  // @return 失败时返回空指针
+  std::shared_ptr<const std::vector<uint8_t>> GetADTS(
+      const MediaMessage& msg) const;
+};
+
+// 将 Annex B 格式的 H.264 访问单元转为 FLV 的 AVC payload，MPEG-TS 接入及
+// 转码输出共用。SPS、PPS 首次出现或变化时另外生成 sequence header
+class AnnexBConverter {
+  std::vector<uint8_t> sps_;
+  std::vector<uint8_t> pps_;
+
+ public:
+  // cts 为 pts 与 dts 之差，单位 ms。header 非空时须先于 frame 发送，
+  // 收到 SPS、PPS 之前的帧无法解码，frame 为空
+  void Convert(const uint8_t* data, size_t size, int32_t cts,
+               std::vector<uint8_t>* header, std::vector<uint8_t>* frame);
+};
+
+}  // namespace util
+}  // namespace live
@@ -0,0 +1,357 @@
+#include "server/dvr.h"
+#include "server/args.h"
+#include "server/flv.h"
+
+#include "util/trace.h"
+#include "util/util.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <ctime>
+
+namespace live {
+namespace util {
+namespace dvr {
+
+// 每次写盘的数据量为其整数倍，与页大小对齐
+static const size_t WRITE_SIZE = 256 << 10;
+
+static const uint64_t SYNC_INTERVAL_US = 5000000;
+
+// 文件内的相对时间戳。音视频交错时可能有略早于文件起点的帧，记为 0，
+// 不回绕成很大的时间戳，也不据此误判文件已超出最大时长
+static uint32_t RelativeTimestamp(uint32_t timestamp, uint32_t start) {
+  return timestamp > start ? timestamp - start : 0;
+}
+
+static int SyncFile(int fd) {
+#ifdef __APPLE__
+  return fsync(fd);
+#else
+  return fdatasync(fd);
+#endif
+}
+
+DvrManager::DvrManager() {
+  const std::string& dir = server::FLAGS_dvr_dir;
+  if (dir.empty()) {
+    return;
+  }
+  const std::string& list = server::FLAGS_dvr_rooms;
+  all_rooms_ = list == "all";
+  for (size_t begin = 0, end = 0; !all_rooms_ && begin < list.size();
+       begin = end + 1) {
+    end = list.find(',', begin);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    std::string id = list.substr(begin, end - begin);
+    if (!id.empty() && id.size() <= 9 &&
+        id.find_first_not_of("0123456789") == std::string::npos) {
+      rooms_.insert(std::stoi(id));
+    }
+  }
+  if (mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+    LOG_ERROR << "create dvr dir " << dir << " failed, errno: " << errno;
+    return;
+  }
+  enabled_ = true;
+  thread_ = std::thread([this]() { Run(); });
+}
+
+DvrManager::~DvrManager() {
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    stopped_ = true;
+  }
+  cv_.notify_one();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void DvrManager::Post(Task&& task) {
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    queued_bytes_ += task.bytes;
+    tasks_.push_back(std::move(task));
+  }
+  cv_.notify_one();
+}
+
+void DvrManager::OpenRoom(int32_t room_id) {
+  if (IsRecorded(room_id)) {
+    Post({Task::OPEN, room_id, nullptr, 0, false});
+  }
+}
+
+void DvrManager::CloseRoom(int32_t room_id) {
+  if (IsRecorded(room_id)) {
+    Post({Task::CLOSE, room_id, nullptr, 0, false});
+  }
+}
+
+void DvrManager::Publish(int32_t room_id, MediaBatch batch) {
+  if (!IsRecorded(room_id)) {
+    return;
+  }
+  size_t bytes = 0;
+  for (const auto& msg : *batch) {
+    bytes += msg->payload.size();
+  }
+  bool after_gap = false;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    if (queued_bytes_ + bytes > size_t(std::max(server::FLAGS_dvr_queue_size,
+                                                0))) {
+      if (gap_rooms_.insert(room_id).second) {
+        LOG_ERROR << "dvr queue full, drop data, room_id: " << room_id
+                  << ", queued bytes: " << queued_bytes_;
+      }
+      return;
+    }
+    after_gap = gap_rooms_.erase(room_id) > 0;
+  }
+  Post({Task::DATA, room_id, std::move(batch), bytes, after_gap});
+}
+
+void DvrManager::Run() {
+  trace::SetThreadName("dvr writer");
+  for (;;) {
+    std::deque<Task> tasks;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait_for(lock, std::chrono::seconds(1),
+                   [this]() { return stopped_ || !tasks_.empty(); });
+      if (stopped_ && tasks_.empty()) {
+        break;
+      }
+      tasks.swap(tasks_);
+    }
+
+    TRACE_SCOPE("dvr.write");
+    size_t bytes = 0;
+    for (const auto& task : tasks) {
+      Handle(task);
+      bytes += task.bytes;
+    }
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      queued_bytes_ -= bytes;
+    }
+
+    const uint64_t now = GetPassedTimeSinceStartedInMicroSeconds();
+    if (now - last_sync_us_ >= SYNC_INTERVAL_US) {
+      SyncAll();
+      last_sync_us_ = now;
+    }
+  }
+  for (auto& r : recorders_) {
+    CloseFile(&r.second);
+  }
+}
+
+void DvrManager::Handle(const Task& task) {
+  switch (task.type) {
+    case Task::OPEN: {
+      recorders_[task.room_id] = Recorder();
+      break;
+    }
+    case Task::CLOSE: {
+      auto it = recorders_.find(task.room_id);
+      if (it != recorders_.end()) {
+        CloseFile(&it->second);
+        recorders_.erase(it);
+      }
+      break;
+    }
+    case Task::DATA: {
+      auto it = recorders_.find(task.room_id);
+      if (it == recorders_.end()) {
+        break;
+      }
+      // 丢弃过数据，视频须从下一个关键帧重新开始
+      if (task.after_gap) {
+        it->second.waiting_for_key_frame = true;
+      }
+      for (const auto& msg : *task.batch) {
+        Write(task.room_id, &it->second, msg);
+      }
+      break;
+    }
+  }
+}
+
+void DvrManager::Write(int32_t room_id, Recorder* r,
+                       const MediaMessagePtr& msg) {
+  if (msg->payload.empty()) {
+    return;
+  }
+  if (msg->type == 18 || msg->is_config) {
+    if (msg->type == 18) {
+      r->meta = msg;
+    } else if (msg->type == 9) {
+      r->avc_header = msg;
+    } else {
+      r->aac_header = msg;
+    }
+    if (r->fd >= 0) {
+      AppendTag(r, *msg,
+                RelativeTimestamp(msg->timestamp, r->start_timestamp));
+    }
+    return;
+  }
+  if (msg->type != 8 && msg->type != 9) {
+    return;
+  }
+
+  // 有视频时在关键帧处切分，纯音频时任意音频帧均可
+  const bool cut_point =
+      r->avc_header ? msg->IsKeyFrame() : msg->type == 8;
+  if (cut_point) {
+    if (r->fd >= 0 &&
+        (RelativeTimestamp(msg->timestamp, r->start_timestamp) >=
+             uint32_t(std::max(server::FLAGS_dvr_max_duration, 1)) * 1000 ||
+         r->file_size >= uint64_t(std::max(server::FLAGS_dvr_max_size, 0)))) {
+      CloseFile(r);
+    }
+    if (r->fd < 0 && !OpenFile(room_id, r, msg->timestamp)) {
+      return;
+    }
+    if (msg->type == 9) {
+      r->waiting_for_key_frame = false;
+    }
+  }
+  if (r->fd < 0 || (msg->type == 9 && r->waiting_for_key_frame)) {
+    return;
+  }
+  AppendTag(r, *msg, RelativeTimestamp(msg->timestamp, r->start_timestamp));
+}
+
+void DvrManager::AppendTag(Recorder* r, const MediaMessage& msg,
+                           uint32_t timestamp) {
+  const size_t size = msg.payload.size();
+  ByteStream(r->buffer) << flv::TagHeader(msg.type, size, timestamp)
+                        << ByteStream::ConstRawPtrWrapper(&msg.payload[0],
+                                                          size)
+                        << uint32_t(MediaMessage::FLV_TAG_HEADER_SIZE + size)
+                        << ByteStream::Commit();
+  r->file_size += MediaMessage::FLV_TAG_HEADER_SIZE + size + 4;
+  if (r->buffer.size() >= WRITE_SIZE) {
+    FlushBuffer(r, false);
+  }
+}
+
+bool DvrManager::OpenFile(int32_t room_id, Recorder* r, uint32_t timestamp) {
+  char now[32];
+  time_t t = time(nullptr);
+  tm local;
+  localtime_r(&t, &local);
+  strftime(now, sizeof(now), "%Y%m%d-%H%M%S", &local);
+  std::string name =
+      server::FLAGS_dvr_dir + "/" + std::to_string(room_id) + "-" + now;
+  // 同一秒内切分出的文件加上序号
+  std::string path = name + ".flv";
+  int fd = -1;
+  for (int i = 1; i < 100; i++) {
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd >= 0 || errno != EEXIST) {
+      break;
+    }
+    path = name + "-" + std::to_string(i) + ".flv";
+  }
+  if (fd < 0) {
+    LOG_ERROR << "open dvr file " << path << " failed, errno: " << errno;
+    return false;
+  }
+  LOG_ERROR << "dvr room " << room_id << " to " << path;
+
+  r->fd = fd;
+  r->path = path;
+  r->buffer.clear();
+  r->buffer.reserve(WRITE_SIZE * 2);
+  r->buffer_offset = 0;
+  r->tail_written = 0;
+  r->file_size = 0;
+  r->start_timestamp = timestamp;
+  r->dirty = false;
+
+  ByteStream(r->buffer) << flv::Header() << uint32_t(0)
+                        << ByteStream::Commit();
+  r->file_size = r->buffer.size();
+  for (const MediaMessagePtr* msg : {&r->meta, &r->avc_header,
+                                     &r->aac_header}) {
+    if (*msg) {
+      AppendTag(r, **msg, 0);
+    }
+  }
+  return true;
+}
+
+void DvrManager::CloseFile(Recorder* r) {
+  if (r->fd < 0) {
+    return;
+  }
+  FlushBuffer(r, true);
+  if (r->fd < 0) {
+    return;
+  }
+  SyncFile(r->fd);
+  close(r->fd);
+  r->fd = -1;
+  LOG_ERROR << "dvr file " << r->path << " closed, size: " << r->file_size;
+}
+
+void DvrManager::FlushBuffer(Recorder* r, bool all) {
+  const size_t full = r->buffer.size() / WRITE_SIZE * WRITE_SIZE;
+  const size_t size = all ? r->buffer.size() : full;
+  // 尾部没有新数据时不必重写
+  if (size == 0 || (full == 0 && size == r->tail_written)) {
+    return;
+  }
+  size_t pos = 0;
+  while (pos < size) {
+    ssize_t n = pwrite(r->fd, &r->buffer[pos], size - pos,
+                       off_t(r->buffer_offset + pos));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // 放弃这个文件，下一个切分点重新打开
+      LOG_ERROR << "write dvr file " << r->path
+                << " failed, errno: " << errno;
+      close(r->fd);
+      r->fd = -1;
+      r->buffer.clear();
+      return;
+    }
+    pos += size_t(n);
+  }
+  r->buffer.erase(r->buffer.begin(), r->buffer.begin() + full);
+  r->buffer_offset += full;
+  r->tail_written = size - full;
+  r->dirty = true;
+}
+
+void DvrManager::SyncAll() {
+  for (auto& it : recorders_) {
+    Recorder* r = &it.second;
+    if (r->fd < 0) {
+      continue;
+    }
+    // 数据量小的房间也要定期落盘，尾部写入后仍保持写入对齐
+    FlushBuffer(r, true);
+    if (r->fd >= 0 && r->dirty) {
+      SyncFile(r->fd);
+      r->dirty = false;
+    }
+  }
+}
+
+}  // namespace dvr
+}  // namespace util
+}  // namespace live
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "server/media_message.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace live {
+namespace util {
+namespace dvr {
+
+// 将 -dvr_rooms 指定的房间录制为 -dvr_dir 下的 FLV 文件，文件名形如
+// <room>-<YYYYmmdd-HHMMSS>.flv，按时长或大小在关键帧处切分，每个文件的
+// 时间戳从 0 开始。序列化及写盘都在单独的写盘线程中进行，EventLoop 只投递
+// 共享的消息批次；排队的数据超出 -dvr_queue_size 时丢弃，视频从下一个
+// 关键帧重新开始，慢盘不会影响直播观众
+class DvrManager {
+  using MediaBatch = std::shared_ptr<const std::vector<MediaMessagePtr>>;
+
+  struct Task {
+    enum Type {
+      OPEN,
+      DATA,
+      CLOSE,
+    };
+    Type type;
+    int32_t room_id;
+    MediaBatch batch;
+    size_t bytes;
+    // 之前有数据因队列已满被丢弃
+    bool after_gap;
+  };
+
+  // 一个房间的录制状态，只在写盘线程中访问
+  struct Recorder {
+    int fd = -1;
+    std::string path;
+    // 未写盘的数据，凑满 WRITE_SIZE 的整数倍后写入
+    std::vector<uint8_t> buffer;
+    // buffer 开头在文件中的偏移，总是 WRITE_SIZE 的整数倍
+    uint64_t buffer_offset = 0;
+    // 定期落盘时已写入的不足 WRITE_SIZE 的尾部长度，这部分仍留在 buffer 中
+    size_t tail_written = 0;
+    uint64_t file_size = 0;
+    uint32_t start_timestamp = 0;
+    // 上次 fdatasync 之后有新写入
+    bool dirty = false;
+    bool waiting_for_key_frame = false;
+    // 每个新文件开头重新写入
+    MediaMessagePtr meta;
+    MediaMessagePtr avc_header;
+    MediaMessagePtr aac_header;
+  };
+
+  // 以下在构造后不再修改
+  bool enabled_ = false;
+  bool all_rooms_ = false;
+  std::unordered_set<int32_t> rooms_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Task> tasks_;
+  size_t queued_bytes_ = 0;
+  std::unordered_set<int32_t> gap_rooms_;
+  bool stopped_ = false;
+  std::thread thread_;
+
+  // 以下只在写盘线程中访问
+  std::unordered_map<int32_t, Recorder> recorders_;
+  uint64_t last_sync_us_ = 0;
+
+  DvrManager();
+  ~DvrManager();
+  DvrManager(const DvrManager&) = delete;
+  DvrManager& operator=(const DvrManager&) = delete;
+
+  bool IsRecorded(int32_t room_id) const {
+    return enabled_ && (all_rooms_ || rooms_.count(room_id));
+  }
+  void Post(Task&& task);
+
+  void Run();
+  void Handle(const Task& task);
+  void Write(int32_t room_id, Recorder* r, const MediaMessagePtr& msg);
+  void AppendTag(Recorder* r, const MediaMessage& msg, uint32_t timestamp);
+  bool OpenFile(int32_t room_id, Recorder* r, uint32_t timestamp);
+  void CloseFile(Recorder* r);
+  // 写入 buffer 中 WRITE_SIZE 的整数倍，并从 buffer 中移除。all 为 true 时
+  // 不足 WRITE_SIZE 的尾部也写入但仍保留，之后凑满时从同一偏移重写，
+  // 每次写入都从 WRITE_SIZE 对齐的偏移开始
+  void FlushBuffer(Recorder* r, bool all);
+  void SyncAll();
+
+ public:
+  static DvrManager& GetInstance() {
+    static DvrManager dm;
+    return dm;
+  }
+
+  // 以下函数线程安全，未开启录制的房间什么都不做
+  void OpenRoom(int32_t room_id);
+  void CloseRoom(int32_t room_id);
+  void Publish(int32_t room_id, MediaBatch batch);
+};
+
+}  // namespace dvr
+}  // namespace util
+}  // namespace live
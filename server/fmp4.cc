@@ -0,0 +1,374 @@
+#include "server/fmp4.h"
+
+#include <cstring>
+
+namespace live {
+namespace util {
+namespace fmp4 {
+
+// 顺序写 box，Begin 时先占位 size，End 时回填
+class BoxWriter {
+  std::vector<uint8_t>* out_;
+
+ public:
+  explicit BoxWriter(std::vector<uint8_t>* out) : out_(out) {}
+
+  size_t Begin(const char* type) {
+    size_t offset = out_->size();
+    U32(0);
+    Bytes(reinterpret_cast<const uint8_t*>(type), 4);
+    return offset;
+  }
+
+  size_t BeginFull(const char* type, uint8_t version, uint32_t flags) {
+    size_t offset = Begin(type);
+    U32(uint32_t(version) << 24 | (flags & 0xFFFFFF));
+    return offset;
+  }
+
+  void End(size_t offset) {
+    Patch32(offset, uint32_t(out_->size() - offset));
+  }
+
+  void Patch32(size_t offset, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+      (*out_)[offset + i] = uint8_t(value >> (24 - 8 * i));
+    }
+  }
+
+  size_t Size() const {
+    return out_->size();
+  }
+
+  void U8(uint8_t v) {
+    out_->push_back(v);
+  }
+
+  void U16(uint16_t v) {
+    U8(uint8_t(v >> 8));
+    U8(uint8_t(v));
+  }
+
+  void U32(uint32_t v) {
+    U16(uint16_t(v >> 16));
+    U16(uint16_t(v));
+  }
+
+  void U64(uint64_t v) {
+    U32(uint32_t(v >> 32));
+    U32(uint32_t(v));
+  }
+
+  void Zeros(size_t n) {
+    out_->insert(out_->end(), n, 0);
+  }
+
+  void Bytes(const uint8_t* data, size_t size) {
+    out_->insert(out_->end(), data, data + size);
+  }
+};
+
+static void WriteMatrix(BoxWriter* w) {
+  static const uint32_t MATRIX[] = {0x00010000, 0, 0, 0, 0x00010000,
+                                    0,          0, 0, 0x40000000};
+  for (uint32_t v : MATRIX) {
+    w->U32(v);
+  }
+}
+
+static void WriteTkhd(BoxWriter* w, uint32_t track_id, bool is_audio,
+                      uint32_t width, uint32_t height) {
+  // track_enabled | track_in_movie
+  size_t box = w->BeginFull("tkhd", 0, 0x000003);
+  w->U32(0);
+  w->U32(0);
+  w->U32(track_id);
+  w->U32(0);
+  w->U32(0);
+  w->Zeros(8);
+  w->U16(0);
+  w->U16(0);
+  w->U16(is_audio ? 0x0100 : 0);
+  w->U16(0);
+  WriteMatrix(w);
+  w->U32(width << 16);
+  w->U32(height << 16);
+  w->End(box);
+}
+
+static void WriteMdhdHdlr(BoxWriter* w, uint32_t timescale, bool is_audio) {
+  size_t mdhd = w->BeginFull("mdhd", 0, 0);
+  w->U32(0);
+  w->U32(0);
+  w->U32(timescale);
+  w->U32(0);
+  // und
+  w->U16(0x55C4);
+  w->U16(0);
+  w->End(mdhd);
+
+  size_t hdlr = w->BeginFull("hdlr", 0, 0);
+  w->U32(0);
+  w->Bytes(reinterpret_cast<const uint8_t*>(is_audio ? "soun" : "vide"), 4);
+  w->Zeros(12);
+  const char* name = is_audio ? "SoundHandler" : "VideoHandler";
+  w->Bytes(reinterpret_cast<const uint8_t*>(name), strlen(name) + 1);
+  w->End(hdlr);
+}
+
+static void WriteDinf(BoxWriter* w) {
+  size_t dinf = w->Begin("dinf");
+  size_t dref = w->BeginFull("dref", 0, 0);
+  w->U32(1);
+  // 数据就在本文件中
+  size_t url = w->BeginFull("url ", 0, 0x000001);
+  w->End(url);
+  w->End(dref);
+  w->End(dinf);
+}
+
+// 各 sample 表均为空，sample 信息都在 moof 中
+static void WriteEmptySampleTables(BoxWriter* w) {
+  for (const char* type : {"stts", "stsc", "stco"}) {
+    size_t box = w->BeginFull(type, 0, 0);
+    w->U32(0);
+    w->End(box);
+  }
+  size_t stsz = w->BeginFull("stsz", 0, 0);
+  w->U32(0);
+  w->U32(0);
+  w->End(stsz);
+}
+
+static void WriteVideoTrack(BoxWriter* w, const AVCConfig& avc) {
+  size_t trak = w->Begin("trak");
+  WriteTkhd(w, Fmp4Muxer::VIDEO_TRACK_ID, false, avc.width, avc.height);
+  size_t mdia = w->Begin("mdia");
+  WriteMdhdHdlr(w, Fmp4Muxer::VIDEO_TIMESCALE, false);
+  size_t minf = w->Begin("minf");
+  size_t vmhd = w->BeginFull("vmhd", 0, 0x000001);
+  w->Zeros(8);
+  w->End(vmhd);
+  WriteDinf(w);
+
+  size_t stbl = w->Begin("stbl");
+  size_t stsd = w->BeginFull("stsd", 0, 0);
+  w->U32(1);
+  size_t avc1 = w->Begin("avc1");
+  w->Zeros(6);
+  // data_reference_index
+  w->U16(1);
+  w->Zeros(16);
+  w->U16(uint16_t(avc.width));
+  w->U16(uint16_t(avc.height));
+  // 72 dpi
+  w->U32(0x00480000);
+  w->U32(0x00480000);
+  w->U32(0);
+  // frame_count
+  w->U16(1);
+  // compressorname
+  w->Zeros(32);
+  w->U16(0x0018);
+  w->U16(0xFFFF);
+  size_t avcc = w->Begin("avcC");
+  w->Bytes(avc.record.data(), avc.record.size());
+  w->End(avcc);
+  w->End(avc1);
+  w->End(stsd);
+  WriteEmptySampleTables(w);
+  w->End(stbl);
+
+  w->End(minf);
+  w->End(mdia);
+  w->End(trak);
+}
+
+// MPEG-4 descriptor，长度均小于 128，只用一个字节
+static void WriteDescriptorHeader(BoxWriter* w, uint8_t tag, size_t size) {
+  w->U8(tag);
+  w->U8(uint8_t(size));
+}
+
+static void WriteAudioTrack(BoxWriter* w, const AACConfig& aac) {
+  size_t trak = w->Begin("trak");
+  WriteTkhd(w, Fmp4Muxer::AUDIO_TRACK_ID, true, 0, 0);
+  size_t mdia = w->Begin("mdia");
+  WriteMdhdHdlr(w, aac.SampleRate(), true);
+  size_t minf = w->Begin("minf");
+  size_t smhd = w->BeginFull("smhd", 0, 0);
+  w->U32(0);
+  w->End(smhd);
+  WriteDinf(w);
+
+  size_t stbl = w->Begin("stbl");
+  size_t stsd = w->BeginFull("stsd", 0, 0);
+  w->U32(1);
+  size_t mp4a = w->Begin("mp4a");
+  w->Zeros(6);
+  w->U16(1);
+  w->Zeros(8);
+  w->U16(aac.channels);
+  w->U16(16);
+  w->U32(0);
+  w->U32(aac.SampleRate() << 16);
+
+  const size_t asc_size = aac.record.size();
+  size_t esds = w->BeginFull("esds", 0, 0);
+  // ES_Descriptor 包含 DecoderConfigDescriptor 及 SLConfigDescriptor
+  WriteDescriptorHeader(w, 0x03, 3 + (2 + 13 + 2 + asc_size) + 3);
+  w->U16(Fmp4Muxer::AUDIO_TRACK_ID);
+  w->U8(0);
+  WriteDescriptorHeader(w, 0x04, 13 + 2 + asc_size);
+  // Audio ISO/IEC 14496-3，AudioStream
+  w->U8(0x40);
+  w->U8(0x15);
+  w->Zeros(3);
+  w->U32(0);
+  w->U32(0);
+  WriteDescriptorHeader(w, 0x05, asc_size);
+  w->Bytes(aac.record.data(), asc_size);
+  WriteDescriptorHeader(w, 0x06, 1);
+  w->U8(0x02);
+  w->End(esds);
+
+  w->End(mp4a);
+  w->End(stsd);
+  WriteEmptySampleTables(w);
+  w->End(stbl);
+
+  w->End(minf);
+  w->End(mdia);
+  w->End(trak);
+}
+
+void Fmp4Muxer::WriteInitSegment(std::vector<uint8_t>* out) const {
+  BoxWriter w(out);
+  size_t ftyp = w.Begin("ftyp");
+  w.Bytes(reinterpret_cast<const uint8_t*>("iso6"), 4);
+  w.U32(0);
+  for (const char* brand : {"iso6", "cmfc", "mp41"}) {
+    w.Bytes(reinterpret_cast<const uint8_t*>(brand), 4);
+  }
+  w.End(ftyp);
+
+  size_t moov = w.Begin("moov");
+  size_t mvhd = w.BeginFull("mvhd", 0, 0);
+  w.U32(0);
+  w.U32(0);
+  w.U32(1000);
+  w.U32(0);
+  // rate 1.0，volume 1.0
+  w.U32(0x00010000);
+  w.U16(0x0100);
+  w.Zeros(10);
+  WriteMatrix(&w);
+  w.Zeros(24);
+  w.U32(AUDIO_TRACK_ID + 1);
+  w.End(mvhd);
+
+  if (avc_) {
+    WriteVideoTrack(&w, *avc_);
+  }
+  if (aac_) {
+    WriteAudioTrack(&w, *aac_);
+  }
+
+  size_t mvex = w.Begin("mvex");
+  for (uint32_t track_id : {VIDEO_TRACK_ID, AUDIO_TRACK_ID}) {
+    if ((track_id == VIDEO_TRACK_ID && !avc_) ||
+        (track_id == AUDIO_TRACK_ID && !aac_)) {
+      continue;
+    }
+    size_t trex = w.BeginFull("trex", 0, 0);
+    w.U32(track_id);
+    w.U32(1);
+    w.U32(0);
+    w.U32(0);
+    w.U32(0);
+    w.End(trex);
+  }
+  w.End(mvex);
+  w.End(moov);
+}
+
+// sample_depends_on 2 表示不依赖其他帧，1 加上 non_sync 表示依赖其他帧
+static const uint32_t SYNC_SAMPLE_FLAGS = 0x02000000;
+static const uint32_t NON_SYNC_SAMPLE_FLAGS = 0x01010000;
+
+// @return trun 中 data_offset 字段的位置
+static size_t WriteTraf(BoxWriter* w, uint32_t track_id, uint64_t decode_time,
+                        const std::vector<Sample>& samples) {
+  size_t traf = w->Begin("traf");
+  // default-base-is-moof
+  size_t tfhd = w->BeginFull("tfhd", 0, 0x020000);
+  w->U32(track_id);
+  w->End(tfhd);
+
+  size_t tfdt = w->BeginFull("tfdt", 1, 0);
+  w->U64(decode_time);
+  w->End(tfdt);
+
+  // data-offset、duration、size、flags、composition offset
+  size_t trun = w->BeginFull("trun", 1, 0x000F01);
+  w->U32(uint32_t(samples.size()));
+  size_t data_offset = w->Size();
+  w->U32(0);
+  for (const Sample& s : samples) {
+    w->U32(s.duration);
+    w->U32(uint32_t(s.size));
+    w->U32(s.is_key_frame ? SYNC_SAMPLE_FLAGS : NON_SYNC_SAMPLE_FLAGS);
+    w->U32(uint32_t(s.composition_offset));
+  }
+  w->End(trun);
+  w->End(traf);
+  return data_offset;
+}
+
+void Fmp4Muxer::WriteChunk(uint64_t video_decode_time,
+                           const std::vector<Sample>& video,
+                           uint64_t audio_decode_time,
+                           const std::vector<Sample>& audio,
+                           std::vector<uint8_t>* out) {
+  BoxWriter w(out);
+  const size_t moof_offset = w.Size();
+  size_t moof = w.Begin("moof");
+  size_t mfhd = w.BeginFull("mfhd", 0, 0);
+  w.U32(++sequence_number_);
+  w.End(mfhd);
+
+  size_t video_data_offset = 0;
+  size_t audio_data_offset = 0;
+  if (!video.empty()) {
+    video_data_offset = WriteTraf(&w, VIDEO_TRACK_ID, video_decode_time, video);
+  }
+  if (!audio.empty()) {
+    audio_data_offset = WriteTraf(&w, AUDIO_TRACK_ID, audio_decode_time, audio);
+  }
+  w.End(moof);
+
+  // data_offset 相对于 moof 的起始位置，mdat 中先视频后音频
+  size_t video_size = 0;
+  for (const Sample& s : video) {
+    video_size += s.size;
+  }
+  size_t data_start = w.Size() - moof_offset + 8;
+  if (!video.empty()) {
+    w.Patch32(video_data_offset, uint32_t(data_start));
+  }
+  if (!audio.empty()) {
+    w.Patch32(audio_data_offset, uint32_t(data_start + video_size));
+  }
+
+  size_t mdat = w.Begin("mdat");
+  for (const auto* samples : {&video, &audio}) {
+    for (const Sample& s : *samples) {
+      w.Bytes(s.data, s.size);
+    }
+  }
+  w.End(mdat);
+}
+
+}  // namespace fmp4
+}  // namespace util
+}  // namespace live
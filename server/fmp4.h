@@ -0,0 +1,55 @@
+#pragma once
+
+#include "server/codec.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace live {
+namespace util {
+namespace fmp4 {
+
+// CMAF fMP4 封装：init segment 中至多一路 H.264 视频（track 1）及一路 AAC 音频
+// （track 2），之后每个 chunk 为一个 moof + mdat。
+// 视频时间单位为 90kHz，音频为采样率
+struct Sample {
+  // 视频为长度前缀格式的一帧，音频为 raw AAC 帧
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+  uint32_t duration = 0;
+  int32_t composition_offset = 0;
+  bool is_key_frame = false;
+};
+
+class Fmp4Muxer {
+ public:
+  static const uint32_t VIDEO_TRACK_ID = 1;
+  static const uint32_t AUDIO_TRACK_ID = 2;
+  static const uint32_t VIDEO_TIMESCALE = 90000;
+
+ private:
+  const AVCConfig* avc_ = nullptr;
+  const AACConfig* aac_ = nullptr;
+  uint32_t sequence_number_ = 0;
+
+ public:
+  // 传入 nullptr 表示没有该轨道，config 须在 Fmp4Muxer 使用期间有效
+  void SetTracks(const AVCConfig* avc, const AACConfig* aac) {
+    avc_ = avc;
+    aac_ = aac;
+  }
+
+  void WriteInitSegment(std::vector<uint8_t>* out) const;
+
+  // 写入一个 moof + mdat，两路的 decode_time 为各自第一个 sample 的解码时间
+  void WriteChunk(uint64_t video_decode_time,
+                  const std::vector<Sample>& video,
+                  uint64_t audio_decode_time,
+                  const std::vector<Sample>& audio,
+                  std::vector<uint8_t>* out);
+};
+
+}  // namespace fmp4
+}  // namespace util
+}  // namespace live
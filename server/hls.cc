@@ -0,0 +1,302 @@
+#include "server/hls.h"
+#include "server/args.h"
+#include "server/worker_pool.h"
+
+#include "util/trace.h"
+#include "util/util.h"
+
+#include <cmath>
+#include <sstream>
+
+namespace live {
+namespace util {
+namespace hls {
+
+void SegmentCache::Put(const std::string& path, Blob data, bool pinned) {
+  std::lock_guard<std::mutex> g(mutex_);
+  auto it = index_.find(path);
+  if (it != index_.end()) {
+    bytes_ -= it->second->data->size();
+    lru_.erase(it->second);
+  }
+  bytes_ += data->size();
+  lru_.push_front({path, std::move(data), pinned});
+  index_[path] = lru_.begin();
+
+  // 从最久未访问的开始淘汰，跳过固定的项，至少保留刚放入的一项。
+  // 固定的项可使总大小超出预算，其上限受播放列表长度限制
+  const size_t budget = size_t(std::max(server::FLAGS_hls_cache_size, 0));
+  auto victim = lru_.end();
+  while (bytes_ > budget && --victim != lru_.begin()) {
+    if (victim->pinned) {
+      continue;
+    }
+    bytes_ -= victim->data->size();
+    index_.erase(victim->path);
+    victim = lru_.erase(victim);
+  }
+}
+
+void SegmentCache::Unpin(const std::string& path) {
+  std::lock_guard<std::mutex> g(mutex_);
+  auto it = index_.find(path);
+  if (it != index_.end()) {
+    it->second->pinned = false;
+  }
+}
+
+Blob SegmentCache::Get(const std::string& path) {
+  std::lock_guard<std::mutex> g(mutex_);
+  auto it = index_.find(path);
+  if (it == index_.end()) {
+    return nullptr;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second);
+  return it->second->data;
+}
+
+void Segmenter::Write(const MediaMessage& msg) {
+  TRACE_SCOPE("hls.mux");
+  if (msg.type == 9) {
+    WriteVideo(msg);
+  } else if (msg.type == 8) {
+    WriteAudio(msg);
+  }
+}
+
+void Segmenter::WriteVideo(const MediaMessage& msg) {
+  if (msg.codec != MediaCodec::AVC) {
+    return;
+  }
+  if (msg.is_config) {
+    has_avc_ = avc_.Parse(msg.Data(), msg.DataSize());
+    if (!has_avc_) {
+      LOG_ERROR << "invalid avc sequence header, room_id: " << room_id_;
+    }
+    return;
+  }
+  if (!msg.is_frame || !has_avc_) {
+    return;
+  }
+
+  const bool is_key_frame = msg.IsKeyFrame();
+  if (is_key_frame &&
+      (!segment_open_ || msg.timestamp - segment_start_ >=
+                             uint32_t(server::FLAGS_hls_segment_duration))) {
+    if (segment_open_) {
+      CloseSegment(msg.timestamp);
+    }
+    OpenSegment(msg.timestamp);
+  }
+  // 切片须从关键帧开始
+  if (!segment_open_) {
+    return;
+  }
+
+  // 与 MPEG-TS 输出共用同一份 Annex B 帧
+  auto frame = avc_.GetAnnexB(msg);
+  if (!frame) {
+    LOG_ERROR << "invalid avc frame, room_id: " << room_id_;
+    return;
+  }
+  uint64_t dts = uint64_t(msg.timestamp) * 90;
+  uint64_t pts = msg.cts > 0 ? dts + uint64_t(msg.cts) * 90 : dts;
+  muxer_.WriteVideo(pts, dts, is_key_frame, frame->data(), frame->size(),
+                    &segment_);
+  last_timestamp_ = msg.timestamp;
+}
+
+void Segmenter::WriteAudio(const MediaMessage& msg) {
+  if (msg.codec != MediaCodec::AAC) {
+    return;
+  }
+  if (msg.is_config) {
+    has_aac_ = aac_.Parse(msg.Data(), msg.DataSize());
+    if (!has_aac_) {
+      LOG_ERROR << "invalid aac sequence header, room_id: " << room_id_;
+    }
+    return;
+  }
+  if (!has_aac_) {
+    return;
+  }
+
+  // 有视频时只在关键帧处切分
+  if (!has_avc_ &&
+      (!segment_open_ || msg.timestamp - segment_start_ >=
+                             uint32_t(server::FLAGS_hls_segment_duration))) {
+    if (segment_open_) {
+      CloseSegment(msg.timestamp);
+    }
+    OpenSegment(msg.timestamp);
+  }
+  if (!segment_open_) {
+    return;
+  }
+
+  auto frame = aac_.GetADTS(msg);
+  if (!frame) {
+    return;
+  }
+  muxer_.WriteAudio(uint64_t(msg.timestamp) * 90, frame->data(),
+                    frame->size(), &segment_);
+  last_timestamp_ = msg.timestamp;
+}
+
+std::string Segmenter::SegmentPath(uint64_t sequence) const {
+  return "/live/" + std::to_string(room_id_) + "/" + std::to_string(sequence) +
+         ".ts";
+}
+
+void Segmenter::OpenSegment(uint32_t timestamp) {
+  segment_.clear();
+  muxer_.SetStreams(has_avc_, has_aac_);
+  muxer_.WriteTables(&segment_);
+  segment_open_ = true;
+  segment_start_ = timestamp;
+  last_timestamp_ = timestamp;
+}
+
+void Segmenter::CloseSegment(uint32_t end_timestamp) {
+  segment_open_ = false;
+  const double duration = (end_timestamp - segment_start_) / 1000.0;
+
+  SegmentCache& cache = SegmentCache::GetInstance();
+  cache.Put(SegmentPath(sequence_),
+            std::make_shared<const std::vector<uint8_t>>(std::move(segment_)),
+            true);
+  segment_ = std::vector<uint8_t>();
+
+  playlist_.push_back({sequence_, duration});
+  while (playlist_.size() >
+         size_t(std::max(server::FLAGS_hls_playlist_size, 1))) {
+    // 移出播放列表后才允许淘汰
+    cache.Unpin(SegmentPath(playlist_.front().sequence));
+    playlist_.pop_front();
+  }
+  sequence_++;
+  UpdatePlaylist(false);
+}
+
+void Segmenter::UpdatePlaylist(bool ended) {
+  if (playlist_.empty()) {
+    return;
+  }
+  double max_duration = 0;
+  for (const auto& e : playlist_) {
+    max_duration = std::max(max_duration, e.duration);
+  }
+
+  std::ostringstream oss;
+  oss << "#EXTM3U\n"
+      << "#EXT-X-VERSION:3\n"
+      << "#EXT-X-TARGETDURATION:" << int64_t(std::ceil(max_duration)) << "\n"
+      << "#EXT-X-MEDIA-SEQUENCE:" << playlist_.front().sequence << "\n";
+  oss.setf(std::ios::fixed);
+  oss.precision(3);
+  for (const auto& e : playlist_) {
+    // 相对于 /live/<room>.m3u8
+    oss << "#EXTINF:" << e.duration << ",\n"
+        << room_id_ << "/" << e.sequence << ".ts\n";
+  }
+  if (ended) {
+    oss << "#EXT-X-ENDLIST\n";
+  }
+  std::string text = oss.str();
+  SegmentCache::GetInstance().Put(
+      "/live/" + std::to_string(room_id_) + ".m3u8",
+      std::make_shared<const std::vector<uint8_t>>(text.begin(), text.end()),
+      !ended);
+}
+
+void Segmenter::Finish() {
+  if (segment_open_) {
+    CloseSegment(last_timestamp_);
+  }
+  UpdatePlaylist(true);
+  // 直播已结束，房间 id 复用后序号接着增长，不再固定以免一直占用缓存
+  for (const auto& e : playlist_) {
+    SegmentCache::GetInstance().Unpin(SegmentPath(e.sequence));
+  }
+}
+
+std::shared_ptr<HlsManager::Channel> HlsManager::GetChannel(int32_t room_id) {
+  std::lock_guard<std::mutex> g(mutex_);
+  std::shared_ptr<Channel>& channel = channels_[room_id];
+  if (!channel) {
+    channel = std::make_shared<Channel>();
+    channel->strand = std::make_shared<Strand>(&GetWorkerPool());
+    channel->ll_state = std::make_shared<LowLatencyState>();
+  }
+  return channel;
+}
+
+std::shared_ptr<LowLatencyState> HlsManager::FindLowLatencyState(
+    int32_t room_id) {
+  if (!server::FLAGS_llhls) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> g(mutex_);
+  auto it = channels_.find(room_id);
+  return it == channels_.end() ? nullptr : it->second->ll_state;
+}
+
+void HlsManager::OpenRoom(int32_t room_id) {
+  if (!server::FLAGS_hls && !server::FLAGS_llhls) {
+    return;
+  }
+  auto channel = GetChannel(room_id);
+  channel->strand->Post([channel, room_id]() {
+    if (server::FLAGS_hls) {
+      channel->segmenter.reset(new Segmenter(room_id, channel->next_sequence));
+    }
+    if (server::FLAGS_llhls) {
+      channel->ll_segmenter.reset(new LowLatencySegmenter(
+          room_id, channel->next_ll_sequence, channel->ll_state));
+    }
+  });
+}
+
+void HlsManager::CloseRoom(int32_t room_id) {
+  if (!server::FLAGS_hls && !server::FLAGS_llhls) {
+    return;
+  }
+  auto channel = GetChannel(room_id);
+  channel->strand->Post([channel]() {
+    if (channel->segmenter) {
+      channel->segmenter->Finish();
+      channel->next_sequence = channel->segmenter->NextSequence();
+      channel->segmenter.reset();
+    }
+    if (channel->ll_segmenter) {
+      channel->ll_segmenter->Finish();
+      channel->next_ll_sequence = channel->ll_segmenter->NextSequence();
+      channel->ll_segmenter.reset();
+    }
+  });
+}
+
+void HlsManager::Publish(int32_t room_id, MediaBatch batch) {
+  if (!server::FLAGS_hls && !server::FLAGS_llhls) {
+    return;
+  }
+  auto channel = GetChannel(room_id);
+  channel->strand->Post([channel, batch]() {
+    for (const auto& msg : *batch) {
+      if (channel->segmenter) {
+        channel->segmenter->Write(*msg);
+      }
+      if (channel->ll_segmenter) {
+        channel->ll_segmenter->Write(msg);
+      }
+    }
+    // 每批消息输出一个 CMAF chunk，等待中的 part 请求可以立即读到
+    if (channel->ll_segmenter) {
+      channel->ll_segmenter->Flush();
+    }
+  });
+}
+
+}  // namespace hls
+}  // namespace util
+}  // namespace live
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "server/codec.h"
+#include "server/llhls.h"
+#include "server/media_message.h"
+#include "server/ts.h"
+#include "util/thread_pool.h"
+
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace live {
+namespace util {
+namespace hls {
+
+// 切片及播放列表的内存缓存，按 URL 路径索引，总大小超出预算时淘汰最久未访问的。
+// 仍在直播播放列表中的切片被固定，不被淘汰，播放器总能取到列表中的切片。
+// 线程安全，取出的数据只读，可直接以引用方式交给 bufferevent
+class SegmentCache {
+  struct Entry {
+    std::string path;
+    Blob data;
+    bool pinned;
+  };
+
+  std::mutex mutex_;
+  std::list<Entry> lru_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  size_t bytes_ = 0;
+
+  SegmentCache() = default;
+  SegmentCache(const SegmentCache&) = delete;
+  SegmentCache& operator=(const SegmentCache&) = delete;
+
+ public:
+  static SegmentCache& GetInstance() {
+    static SegmentCache cache;
+    return cache;
+  }
+
+  // pinned 为 true 时不被淘汰，直到 Unpin 或以 pinned 为 false 再次放入
+  void Put(const std::string& path, Blob data, bool pinned = false);
+  void Unpin(const std::string& path);
+  // @return 不存在时返回空指针
+  Blob Get(const std::string& path);
+};
+
+// 一个房间的切片器，只在房间的 Strand 中访问。
+// 视频在关键帧处切分，纯音频流按时长切分，每个切片都以 PAT、PMT 开头。
+// 切片路径为 /live/<room>/<sequence>.ts，播放列表路径为 /live/<room>.m3u8
+class Segmenter {
+  int32_t room_id_;
+  uint64_t sequence_;
+
+  AVCConfig avc_;
+  bool has_avc_ = false;
+  AACConfig aac_;
+  bool has_aac_ = false;
+
+  ts::TsMuxer muxer_;
+  std::vector<uint8_t> segment_;
+  bool segment_open_ = false;
+  uint32_t segment_start_ = 0;
+  uint32_t last_timestamp_ = 0;
+
+  struct Entry {
+    uint64_t sequence;
+    double duration;
+  };
+  std::deque<Entry> playlist_;
+
+  std::string SegmentPath(uint64_t sequence) const;
+  void OpenSegment(uint32_t timestamp);
+  void CloseSegment(uint32_t end_timestamp);
+  void UpdatePlaylist(bool ended);
+  void WriteVideo(const MediaMessage& msg);
+  void WriteAudio(const MediaMessage& msg);
+
+ public:
+  Segmenter(int32_t room_id, uint64_t first_sequence)
+      : room_id_(room_id), sequence_(first_sequence) {}
+
+  void Write(const MediaMessage& msg);
+  // 房间关闭，输出最后一个切片并结束播放列表
+  void Finish();
+
+  uint64_t NextSequence() const {
+    return sequence_;
+  }
+};
+
+// 在工作线程池中为每个房间切片，各房间的任务经各自的 Strand 保序执行，
+// 不占用主播所在的 EventLoop。-hls 生成 MPEG-TS 切片，-llhls 生成 fMP4 part
+class HlsManager {
+  struct Channel {
+    std::shared_ptr<Strand> strand;
+    // EventLoop 线程经此读取 LL-HLS 的播放列表及 part，不随房间重建
+    std::shared_ptr<LowLatencyState> ll_state;
+    // 以下只在 strand 中访问
+    std::unique_ptr<Segmenter> segmenter;
+    std::unique_ptr<LowLatencySegmenter> ll_segmenter;
+    // 房间 id 被复用时切片序号接着上一次的，避免播放器取到旧切片
+    uint64_t next_sequence = 0;
+    uint64_t next_ll_sequence = 0;
+  };
+
+  std::mutex mutex_;
+  std::unordered_map<int32_t, std::shared_ptr<Channel>> channels_;
+
+  HlsManager() = default;
+  HlsManager(const HlsManager&) = delete;
+  HlsManager& operator=(const HlsManager&) = delete;
+
+  std::shared_ptr<Channel> GetChannel(int32_t room_id);
+
+ public:
+  static HlsManager& GetInstance() {
+    static HlsManager hm;
+    return hm;
+  }
+
+  // 以下函数线程安全，-hls 及 -llhls 均关闭时什么都不做
+  void OpenRoom(int32_t room_id);
+  void CloseRoom(int32_t room_id);
+  using MediaBatch = std::shared_ptr<const std::vector<MediaMessagePtr>>;
+  void Publish(int32_t room_id, MediaBatch batch);
+
+  // @return 房间从未开启过 LL-HLS 时返回空指针
+  std::shared_ptr<LowLatencyState> FindLowLatencyState(int32_t room_id);
+};
+
+}  // namespace hls
+}  // namespace util
+}  // namespace live
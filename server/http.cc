@@ -0,0 +1,829 @@
+#include "server/http.h"
+#include "server/abr.h"
+#include "server/admission.h"
+#include "server/args.h"
+#include "server/flv.h"
+#include "server/hls.h"
+#include "server/metrics.h"
+#include "server/relay.h"
+#include "server/room.h"
+#include "server/thumbnail.h"
+#include "util/trace.h"
+
+#include <algorithm>
+#include <sstream>
+
+extern "C" {
+#include <libavutil/base64.h>
+#include <libavutil/mem.h>
+#include <libavutil/sha.h>
+}
+
+namespace live {
+namespace util {
+namespace http {
+
+// 请求头的长度上限
+static const size_t MAX_REQUEST_HEADER_SIZE = 8192;
+
+// 客户端发来的单个 WebSocket frame 的长度上限，只会是 close、ping 等控制消息
+static const size_t MAX_WS_CLIENT_FRAME_SIZE = 4096;
+
+enum WebSocketOpcode {
+  WS_BINARY = 0x2,
+  WS_CLOSE = 0x8,
+  WS_PING = 0x9,
+  WS_PONG = 0xA,
+};
+
+static std::string ToLower(std::string str) {
+  std::transform(str.begin(), str.end(), str.begin(), ::tolower);
+  return str;
+}
+
+static std::string Trim(const std::string& str) {
+  size_t begin = str.find_first_not_of(" \t\r");
+  if (begin == std::string::npos) {
+    return "";
+  }
+  return str.substr(begin, str.find_last_not_of(" \t\r") - begin + 1);
+}
+
+bool HttpSession::OnRead() {
+  std::vector<uint8_t>& bytes = ReadDataBuffer();
+  if (state_ == STREAMING && websocket_) {
+    return OnReadWebSocketFrames();
+  }
+
+  // HLS 请求可以在同一个连接上依次发送，直播流请求之后不再处理新的请求
+  static const char DELIMITER[] = "\r\n\r\n";
+  while (state_ == READING_REQUEST) {
+    auto end = std::search(bytes.begin(), bytes.end(), DELIMITER,
+                           DELIMITER + sizeof(DELIMITER) - 1);
+    if (end == bytes.end()) {
+      if (bytes.size() > MAX_REQUEST_HEADER_SIZE) {
+        SendErrorResponse(431, "Request Header Fields Too Large", "");
+      }
+      return true;
+    }
+
+    std::string header(bytes.begin(), end);
+    bytes.erase(bytes.begin(), end + sizeof(DELIMITER) - 1);
+
+    // 请求行形如 GET /live/3.flv HTTP/1.1，其后每行一个 Key: Value
+    std::istringstream iss(header);
+    std::string line;
+    std::getline(iss, line);
+    std::istringstream request_line(line);
+    std::string method, target, version;
+    request_line >> method >> target >> version;
+
+    Headers headers;
+    while (std::getline(iss, line)) {
+      size_t colon = line.find(':');
+      if (colon != std::string::npos) {
+        headers[ToLower(Trim(line.substr(0, colon)))] =
+            Trim(line.substr(colon + 1));
+      }
+    }
+
+    LOG_ERROR << "http request from " << GetPeerAddress() << ", " << method
+              << " " << target;
+    if (!HandleRequest(method, target, version, headers)) {
+      return false;
+    }
+  }
+
+  // 等待 LL-HLS 时保留之后的请求，直播流开始后客户端发来的数据均丢弃
+  if (state_ != WAITING_PLAYLIST && state_ != STREAMING_PART) {
+    bytes.resize(0);
+  }
+  return true;
+}
+
+bool HttpSession::HandleRequest(const std::string& method,
+                                const std::string& target,
+                                const std::string& version,
+                                const Headers& headers) {
+  if (method != "GET") {
+    SendErrorResponse(405, "Method Not Allowed", "");
+    return true;
+  }
+
+  // 路径形如 /live/3.flv?only=audio
+  static const std::string PREFIX = "/live/";
+  static const std::string SUFFIX = ".flv";
+  std::string path;
+  auto params = ParseQueryString(target, &path);
+  // 缩略图、统计、跟踪导出与 HLS 一样是普通的 HTTP 请求
+  const bool is_metrics = path == "/metrics";
+  const bool is_trace = path == "/debug/trace";
+  const bool is_thumbnail = IsThumbnailPath(path);
+  if (is_metrics || is_trace || is_thumbnail || IsHlsPath(path)) {
+    auto connection = headers.find("connection");
+    keep_alive_ =
+        version == "HTTP/1.1" && (connection == headers.end() ||
+                                  ToLower(connection->second) != "close");
+    if (is_metrics) {
+      return SendMetrics();
+    }
+    if (is_trace) {
+      return SendTrace();
+    }
+    if (is_thumbnail) {
+      return SendThumbnail(path);
+    }
+    return HandleHlsRequest(path, params);
+  }
+  // 点播路径形如 /vod/<file>.flv?start=30
+  static const std::string VOD_PREFIX = "/vod/";
+  if (!path.compare(0, VOD_PREFIX.size(), VOD_PREFIX)) {
+    return HandleVodRequest(path.substr(VOD_PREFIX.size()), params, headers);
+  }
+  if (path.size() <= PREFIX.size() + SUFFIX.size() ||
+      path.compare(0, PREFIX.size(), PREFIX) ||
+      path.compare(path.size() - SUFFIX.size(), SUFFIX.size(), SUFFIX)) {
+    SendErrorResponse(404, "Not Found", "");
+    return true;
+  }
+  std::string name = path.substr(
+      PREFIX.size(), path.size() - PREFIX.size() - SUFFIX.size());
+  // /live/3_720p.flv 观看 3 号房间的 720p 转码档位
+  int32_t source_id = -1;
+  std::string rendition;
+  if (abr::AbrManager::ParseRenditionName(name, &source_id, &rendition)) {
+    room_id_ =
+        abr::AbrManager::GetInstance().FindRendition(source_id, rendition);
+    if (room_id_ < 0) {
+      SendErrorResponse(404, "Not Found", "");
+      return true;
+    }
+  } else if (name.size() > 9 ||
+             name.find_first_not_of("0123456789") != std::string::npos) {
+    SendErrorResponse(404, "Not Found", "");
+    return true;
+  } else {
+    room_id_ = std::stoi(name);
+  }
+  // 边缘节点上本地不存在的房间会回源
+  if (server::FLAGS_origin.empty() &&
+      !RoomManager::GetInstance().HasLocalRoom(room_id_)) {
+    SendErrorResponse(404, "Not Found", "");
+    return true;
+  }
+
+  Subscription subscription = Subscription::ALL;
+  if (!ParseSubscription(params["only"], &subscription)) {
+    LOG_ERROR << "invalid subscription " << params["only"];
+  }
+
+  std::string reason;
+  if (!AdmissionController::GetInstance().Admit(room_id_, GetPeerAddress(),
+                                                &reason)) {
+    LOG_ERROR << "reject viewer, room_id: " << room_id_
+              << ", ip: " << GetPeerAddress() << ", reason: " << reason;
+    SendErrorResponse(503, "Service Unavailable", reason);
+    return true;
+  }
+  admitted_ = true;
+  GetMetrics().SetRoom(room_id_, false);
+
+  // 进入房间时会立即收到缓存的数据，须在响应头之后
+  if (!StartFlvStream(headers)) {
+    return false;
+  }
+  if (state_ != STREAMING) {
+    return true;
+  }
+  // /live/3.flv?timeshift=60 从 60 秒前开始回看
+  if (params.count("timeshift")) {
+    timeshift_ = timeshift::TimeShiftPlayer::Create(
+        this, room_id_, subscription, params["timeshift"]);
+    if (timeshift_) {
+      return true;
+    }
+  }
+  if (!EnterRoomOrRelay(this, room_id_, subscription, name, &relayed_)) {
+    LOG_ERROR << "enter room failed, room_id: " << room_id_;
+    return false;
+  }
+  entered_ = true;
+  return true;
+}
+
+// 解析不超过 18 位的十进制数
+static bool ParseNumber(const std::string& str, int64_t* value) {
+  if (str.empty() || str.size() > 18 ||
+      str.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  *value = std::stoll(str);
+  return true;
+}
+
+bool HttpSession::StartFlvStream(const Headers& headers) {
+  auto upgrade = headers.find("upgrade");
+  websocket_ = upgrade != headers.end() &&
+               ToLower(upgrade->second).find("websocket") != std::string::npos;
+  if (websocket_ && !headers.count("sec-websocket-key")) {
+    websocket_ = false;
+    SendErrorResponse(400, "Bad Request", "missing Sec-WebSocket-Key");
+    return true;
+  }
+
+  if (websocket_) {
+    if (!AcceptWebSocket(headers)) {
+      return false;
+    }
+  } else {
+    static const std::string RESPONSE =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: video/x-flv\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "Connection: close\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "\r\n";
+    std::vector<uint8_t>& out = WriteDataBuffer();
+    out.insert(out.end(), RESPONSE.begin(), RESPONSE.end());
+  }
+
+  // FLV header 及 PreviousTagSize0 作为第一个 chunk 或 frame
+  std::vector<uint8_t> flv_header;
+  ByteStream(flv_header) << flv::Header() << uint32_t(0)
+                         << ByteStream::Commit();
+  AppendFramed(&flv_header[0], flv_header.size());
+  if (!Write()) {
+    return false;
+  }
+  state_ = STREAMING;
+  return true;
+}
+
+bool HttpSession::HandleVodRequest(
+    const std::string& name,
+    std::unordered_map<std::string, std::string>& params,
+    const Headers& headers) {
+  Subscription subscription = Subscription::ALL;
+  if (!ParseSubscription(params["only"], &subscription)) {
+    LOG_ERROR << "invalid subscription " << params["only"];
+  }
+  int64_t start = 0;
+  if (!params["start"].empty() && !ParseNumber(params["start"], &start)) {
+    SendErrorResponse(400, "Bad Request", "invalid start");
+    return true;
+  }
+  // 文件打开前不再读取之后的请求
+  state_ = OPENING_VOD;
+  EventLoop* loop = GetEventLoop();
+  uint64_t id = GetId();
+  vod::VodManager::GetInstance().Open(
+      name, [loop, id, subscription, start,
+             headers](std::shared_ptr<const vod::VodFile> file) {
+        HttpSession* session =
+            static_cast<HttpSession*>(loop->FindSession(id));
+        if (session && (!session->StartVod(std::move(file), subscription,
+                                           start, headers) ||
+                        session->IsNeedClose())) {
+          loop->CloseSession(id);
+        }
+      });
+  return true;
+}
+
+bool HttpSession::StartVod(std::shared_ptr<const vod::VodFile> file,
+                           Subscription subscription, int64_t start,
+                           const Headers& headers) {
+  if (!file) {
+    SendErrorResponse(404, "Not Found", "");
+    return true;
+  }
+  if (!StartFlvStream(headers)) {
+    return false;
+  }
+  if (state_ != STREAMING) {
+    return true;
+  }
+  // 发送完毕后结束响应，数据发完后关闭连接
+  vod_.reset(new vod::VodPlayer(file, this, subscription, [this]() {
+    if (websocket_) {
+      SendWebSocketFrame(WS_CLOSE, nullptr, 0);
+    } else {
+      static const char LAST_CHUNK[] = "0\r\n\r\n";
+      std::vector<uint8_t>& out = WriteDataBuffer();
+      out.insert(out.end(), LAST_CHUNK, LAST_CHUNK + sizeof(LAST_CHUNK) - 1);
+    }
+    state_ = CLOSING;
+    Session::SetFlag(Session::FLAG::CLOSE_AFTER_WRITE);
+    if (!Write()) {
+      Session::SetFlag(Session::FLAG::NEED_CLOSE);
+    }
+  }));
+  vod_->Seek(uint32_t(std::min<int64_t>(start, UINT32_MAX / 1000)) * 1000);
+  return true;
+}
+
+static bool EndsWith(const std::string& str, const std::string& suffix) {
+  return str.size() > suffix.size() &&
+         !str.compare(str.size() - suffix.size(), suffix.size(), suffix);
+}
+
+bool HttpSession::IsHlsPath(const std::string& path) {
+  static const std::string PREFIX = "/live/";
+  return !path.compare(0, PREFIX.size(), PREFIX) &&
+         (EndsWith(path, ".m3u8") || EndsWith(path, ".ts") ||
+          EndsWith(path, ".m4s") || EndsWith(path, ".mp4"));
+}
+
+bool HttpSession::IsThumbnailPath(const std::string& path) {
+  static const std::string PREFIX = "/live/";
+  return !path.compare(0, PREFIX.size(), PREFIX) && EndsWith(path, ".jpg");
+}
+
+bool HttpSession::HandleHlsRequest(
+    const std::string& path,
+    std::unordered_map<std::string, std::string>& params) {
+  // LL-HLS 的播放列表 /live/<room>.ll.m3u8?_HLS_msn=<M>&_HLS_part=<N>
+  // 及 part /live/<room>/<M>.<N>.m4s 需要等待切片线程，其他均直接从缓存返回
+  static const std::string PREFIX = "/live/";
+  static const std::string PLAYLIST_SUFFIX = ".ll.m3u8";
+  static const std::string PART_SUFFIX = ".m4s";
+  int64_t room_id = -1;
+  if (EndsWith(path, PLAYLIST_SUFFIX)) {
+    if (!ParseNumber(path.substr(PREFIX.size(), path.size() - PREFIX.size() -
+                                                    PLAYLIST_SUFFIX.size()),
+                     &room_id)) {
+      SendErrorResponse(404, "Not Found", "");
+      return true;
+    }
+    ll_msn_ = ll_part_ = -1;
+    if (params.count("_HLS_msn") &&
+        !ParseNumber(params["_HLS_msn"], &ll_msn_)) {
+      SendErrorResponse(400, "Bad Request", "invalid _HLS_msn");
+      return true;
+    }
+    if (params.count("_HLS_part") &&
+        (ll_msn_ < 0 || !ParseNumber(params["_HLS_part"], &ll_part_))) {
+      SendErrorResponse(400, "Bad Request", "invalid _HLS_part");
+      return true;
+    }
+    state_ = WAITING_PLAYLIST;
+  } else if (EndsWith(path, PART_SUFFIX)) {
+    // 形如 <M>.<N>.m4s 的是 part，<M>.m4s 为整个切片
+    size_t slash = path.rfind('/');
+    std::string name = path.substr(
+        slash + 1, path.size() - slash - 1 - PART_SUFFIX.size());
+    size_t dot = name.find('.');
+    if (dot == std::string::npos) {
+      return SendHlsFile(path);
+    }
+    if (!ParseNumber(path.substr(PREFIX.size(), slash - PREFIX.size()),
+                     &room_id) ||
+        !ParseNumber(name.substr(0, dot), &ll_msn_) ||
+        !ParseNumber(name.substr(dot + 1), &ll_part_)) {
+      SendErrorResponse(404, "Not Found", "");
+      return true;
+    }
+    ll_chunks_sent_ = 0;
+    ll_header_sent_ = false;
+    state_ = STREAMING_PART;
+  } else {
+    return SendHlsFile(path);
+  }
+
+  ll_state_ = hls::HlsManager::GetInstance().FindLowLatencyState(
+      int32_t(room_id));
+  if (room_id > INT32_MAX || !ll_state_) {
+    SendErrorResponse(404, "Not Found", "");
+    return true;
+  }
+  if (state_ == WAITING_PLAYLIST && ll_msn_ >= 0) {
+    // 协议建议等待至多 3 倍切片目标时长
+    if (!ll_timer_) {
+      ll_timer_.reset(event_new(GetEventLoop()->GetEventBase(), -1, 0,
+                                LowLatencyTimeoutCallback, this));
+    }
+    int32_t ms = server::FLAGS_hls_segment_duration * 3;
+    timeval tv = {ms / 1000, ms % 1000 * 1000};
+    event_add(ll_timer_.get(), &tv);
+  }
+  return OnLowLatencyUpdate();
+}
+
+void HttpSession::LowLatencyTimeoutCallback(evutil_socket_t, short,
+                                            void* ptr) {
+  EventLoop::Current()->BeginWork();
+  HttpSession* session = reinterpret_cast<HttpSession*>(ptr);
+  if (session->state_ == WAITING_PLAYLIST) {
+    session->SendErrorResponse(503, "Service Unavailable",
+                               "playlist update timeout");
+  }
+}
+
+hls::LowLatencyState::Waiter HttpSession::MakeWaiter() {
+  // 在切片线程中调用，回到本 session 所在的 EventLoop 处理
+  EventLoop* loop = GetEventLoop();
+  uint64_t id = GetId();
+  return [loop, id]() {
+    loop->RunInLoop([loop, id]() {
+      HttpSession* session = static_cast<HttpSession*>(loop->FindSession(id));
+      if (!session) {
+        return;
+      }
+      if (!session->OnLowLatencyUpdate() ||
+          (session->state_ == READING_REQUEST && !session->OnRead()) ||
+          session->IsNeedClose()) {
+        loop->CloseSession(id);
+      }
+    });
+  };
+}
+
+bool HttpSession::OnLowLatencyUpdate() {
+  if (state_ == WAITING_PLAYLIST) {
+    hls::Blob playlist;
+    auto status =
+        ll_state_->GetPlaylist(ll_msn_, ll_part_, &playlist, MakeWaiter());
+    if (status == hls::LowLatencyState::PENDING) {
+      return true;
+    }
+    if (ll_timer_) {
+      event_del(ll_timer_.get());
+    }
+    if (status == hls::LowLatencyState::NOT_FOUND) {
+      SendErrorResponse(ll_msn_ >= 0 ? 400 : 404,
+                        ll_msn_ >= 0 ? "Bad Request" : "Not Found", "");
+      return true;
+    }
+    return SendResponse(playlist, "application/vnd.apple.mpegurl",
+                        "no-cache");
+  }
+
+  if (state_ != STREAMING_PART) {
+    return true;
+  }
+  std::vector<hls::Blob> chunks;
+  bool complete = false;
+  auto status = ll_state_->ReadPart(ll_msn_, ll_part_, ll_chunks_sent_,
+                                    &chunks, &complete, MakeWaiter());
+  if (status == hls::LowLatencyState::NOT_FOUND) {
+    if (!ll_header_sent_) {
+      SendErrorResponse(404, "Not Found", "");
+      return true;
+    }
+    // 房间已重建，结束已开始的响应
+    complete = true;
+  }
+
+  std::vector<uint8_t>& out = WriteDataBuffer();
+  if (!ll_header_sent_) {
+    // part 生成后不再变化，可由 CDN 缓存
+    std::ostringstream oss;
+    oss << "HTTP/1.1 200 OK\r\n"
+        << "Content-Type: video/mp4\r\n"
+        << "Transfer-Encoding: chunked\r\n"
+        << "Connection: " << (keep_alive_ ? "keep-alive" : "close") << "\r\n"
+        << "Cache-Control: max-age=60\r\n"
+        << "Access-Control-Allow-Origin: *\r\n"
+        << "\r\n";
+    std::string header = oss.str();
+    out.insert(out.end(), header.begin(), header.end());
+    ll_header_sent_ = true;
+  }
+  for (const auto& chunk : chunks) {
+    char size_line[16];
+    int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", chunk->size());
+    out.insert(out.end(), size_line, size_line + n);
+    if (!WriteReference(chunk->data(), chunk->size(), chunk)) {
+      return false;
+    }
+    out.push_back('\r');
+    out.push_back('\n');
+  }
+  ll_chunks_sent_ += chunks.size();
+  if (!complete) {
+    return Write();
+  }
+  static const char LAST_CHUNK[] = "0\r\n\r\n";
+  out.insert(out.end(), LAST_CHUNK, LAST_CHUNK + sizeof(LAST_CHUNK) - 1);
+  return FinishResponse();
+}
+
+bool HttpSession::SendHlsFile(const std::string& path) {
+  hls::Blob data = hls::SegmentCache::GetInstance().Get(path);
+  if (!data) {
+    SendErrorResponse(404, "Not Found", "");
+    return true;
+  }
+  // 播放列表随新切片更新，切片生成后不再变化
+  if (EndsWith(path, ".m3u8")) {
+    return SendResponse(data, "application/vnd.apple.mpegurl", "no-cache");
+  }
+  if (EndsWith(path, ".ts")) {
+    return SendResponse(data, "video/mp2t", "max-age=3600");
+  }
+  return SendResponse(data, "video/mp4", "max-age=3600");
+}
+
+bool HttpSession::SendThumbnail(const std::string& path) {
+  // 去掉 /live/ 及 .jpg
+  std::string name = path.substr(6, path.size() - 10);
+  if (name.empty() || name.size() > 9 ||
+      name.find_first_not_of("0123456789") != std::string::npos) {
+    SendErrorResponse(404, "Not Found", "");
+    return true;
+  }
+  thumbnail::Blob jpeg =
+      thumbnail::ThumbnailManager::GetInstance().Get(std::stoi(name));
+  if (!jpeg) {
+    SendErrorResponse(404, "Not Found", "");
+    return true;
+  }
+  // 缩略图至多每 -thumbnail_interval 秒更新一次
+  return SendResponse(
+      jpeg, "image/jpeg",
+      "max-age=" + std::to_string(server::FLAGS_thumbnail_interval));
+}
+
+bool HttpSession::SendMetrics() {
+  std::string text = metrics::MetricsManager::GetInstance().Export();
+  return SendResponse(
+      std::make_shared<const std::vector<uint8_t>>(text.begin(), text.end()),
+      "text/plain; version=0.0.4; charset=utf-8", "no-cache");
+}
+
+bool HttpSession::SendTrace() {
+  if (!server::FLAGS_trace) {
+    SendErrorResponse(404, "Not Found", "");
+    return true;
+  }
+  // 只在排查问题时请求，直接在 EventLoop 中导出
+  std::string json = trace::DumpJson();
+  return SendResponse(
+      std::make_shared<const std::vector<uint8_t>>(json.begin(), json.end()),
+      "application/json", "no-cache");
+}
+
+bool HttpSession::SendResponse(const hls::Blob& data,
+                               const std::string& content_type,
+                               const std::string& cache_control) {
+  std::ostringstream oss;
+  oss << "HTTP/1.1 200 OK\r\n"
+      << "Content-Type: " << content_type << "\r\n"
+      << "Content-Length: " << data->size() << "\r\n"
+      << "Connection: " << (keep_alive_ ? "keep-alive" : "close") << "\r\n"
+      << "Cache-Control: " << cache_control << "\r\n"
+      << "Access-Control-Allow-Origin: *\r\n"
+      << "\r\n";
+  std::string response = oss.str();
+
+  std::vector<uint8_t>& out = WriteDataBuffer();
+  out.insert(out.end(), response.begin(), response.end());
+  // data 由缓存等共享，以引用方式发送
+  if (!data->empty() && !WriteReference(data->data(), data->size(), data)) {
+    return false;
+  }
+  return FinishResponse();
+}
+
+bool HttpSession::FinishResponse() {
+  ll_state_.reset();
+  if (keep_alive_) {
+    state_ = READING_REQUEST;
+  } else {
+    state_ = CLOSING;
+    Session::SetFlag(Session::FLAG::CLOSE_AFTER_WRITE);
+  }
+  return Write();
+}
+
+bool HttpSession::AcceptWebSocket(const Headers& headers) {
+  // Sec-WebSocket-Accept = base64(sha1(key + GUID))
+  static const std::string GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  std::string key = headers.at("sec-websocket-key") + GUID;
+
+  uint8_t digest[20];
+  struct AVSHA* sha = av_sha_alloc();
+  if (!sha) {
+    LOG_ERROR << "av_sha_alloc failed";
+    return false;
+  }
+  av_sha_init(sha, 160);
+  av_sha_update(sha, reinterpret_cast<const uint8_t*>(key.data()),
+                key.size());
+  av_sha_final(sha, digest);
+  av_free(sha);
+
+  char accept[AV_BASE64_SIZE(sizeof(digest))];
+  av_base64_encode(accept, sizeof(accept), digest, sizeof(digest));
+
+  std::ostringstream oss;
+  oss << "HTTP/1.1 101 Switching Protocols\r\n"
+      << "Upgrade: websocket\r\n"
+      << "Connection: Upgrade\r\n"
+      << "Sec-WebSocket-Accept: " << accept << "\r\n"
+      << "\r\n";
+  std::string response = oss.str();
+
+  std::vector<uint8_t>& out = WriteDataBuffer();
+  out.insert(out.end(), response.begin(), response.end());
+  return true;
+}
+
+bool HttpSession::OnReadWebSocketFrames() {
+  std::vector<uint8_t>& bytes = ReadDataBuffer();
+  size_t pos = 0;
+  while (bytes.size() - pos >= 2) {
+    const uint8_t* p = &bytes[pos];
+    uint8_t opcode = p[0] & 0x0F;
+    bool masked = p[1] & 0x80;
+    uint64_t len = p[1] & 0x7F;
+    size_t header_size = 2;
+    if (len == 126) {
+      header_size += 2;
+    } else if (len == 127) {
+      header_size += 8;
+    }
+    if (bytes.size() - pos < header_size) {
+      break;
+    }
+    if (len >= 126) {
+      len = 0;
+      for (size_t i = 2; i < header_size; i++) {
+        len = len << 8 | p[i];
+      }
+    }
+    if (len > MAX_WS_CLIENT_FRAME_SIZE) {
+      LOG_ERROR << "websocket frame too large, " << len;
+      return false;
+    }
+    size_t mask_offset = header_size;
+    if (masked) {
+      header_size += 4;
+    }
+    if (bytes.size() - pos < header_size + len) {
+      break;
+    }
+
+    std::vector<uint8_t> data(p + header_size, p + header_size + len);
+    if (masked) {
+      for (size_t i = 0; i < data.size(); i++) {
+        data[i] ^= p[mask_offset + i % 4];
+      }
+    }
+    pos += header_size + len;
+
+    if (opcode == WS_CLOSE) {
+      // 回复 close，数据发完后断开
+      SendWebSocketFrame(WS_CLOSE, data.data(),
+                         std::min(data.size(), size_t(2)));
+      state_ = CLOSING;
+      Session::SetFlag(Session::FLAG::CLOSE_AFTER_WRITE);
+      bytes.resize(0);
+      return Write();
+    }
+    if (opcode == WS_PING) {
+      SendWebSocketFrame(WS_PONG, data.data(), data.size());
+    }
+  }
+  bytes.erase(bytes.begin(), bytes.begin() + pos);
+  return Write();
+}
+
+void HttpSession::SendWebSocketFrame(uint8_t opcode, const uint8_t* data,
+                                     size_t len) {
+  uint8_t header[MediaMessage::MAX_WS_FRAME_HEADER_SIZE];
+  size_t n = MediaMessage::BuildWebSocketFrameHeader(len, header);
+  header[0] = 0x80 | opcode;
+  std::vector<uint8_t>& out = WriteDataBuffer();
+  out.insert(out.end(), header, header + n);
+  out.insert(out.end(), data, data + len);
+}
+
+void HttpSession::AppendFramed(const uint8_t* data, size_t len) {
+  if (websocket_) {
+    SendWebSocketFrame(WS_BINARY, data, len);
+    return;
+  }
+  char size_line[16];
+  int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+  std::vector<uint8_t>& out = WriteDataBuffer();
+  out.insert(out.end(), size_line, size_line + n);
+  out.insert(out.end(), data, data + len);
+  out.push_back('\r');
+  out.push_back('\n');
+}
+
+void HttpSession::SendErrorResponse(int32_t code, const std::string& reason,
+                                    const std::string& body) {
+  std::ostringstream oss;
+  oss << "HTTP/1.1 " << code << " " << reason << "\r\n"
+      << "Content-Type: text/plain\r\n"
+      << "Content-Length: " << body.size() << "\r\n"
+      << "Connection: close\r\n"
+      << "\r\n"
+      << body;
+  std::string response = oss.str();
+
+  std::vector<uint8_t>& out = WriteDataBuffer();
+  out.insert(out.end(), response.begin(), response.end());
+  state_ = CLOSING;
+  Session::SetFlag(Session::FLAG::CLOSE_AFTER_WRITE);
+  if (!Write()) {
+    Session::SetFlag(Session::FLAG::NEED_CLOSE);
+  }
+}
+
+void HttpSession::SendFlvTag(const MediaMessagePtr& msg, uint32_t timestamp) {
+  if (state_ != STREAMING || msg->payload.empty()) {
+    return;
+  }
+
+  const uint64_t enqueue_us = GetPassedTimeSinceStartedInMicroSeconds();
+  // frame header 或 chunk size 行
+  std::vector<uint8_t>& out = WriteDataBuffer();
+  if (websocket_) {
+    out.insert(out.end(), msg->ws_frame_header,
+               msg->ws_frame_header + msg->ws_frame_header_size);
+  } else {
+    const size_t tag_size = MediaMessage::FLV_TAG_HEADER_SIZE +
+                            msg->payload.size() +
+                            sizeof(msg->flv_previous_tag_size);
+    char size_line[16];
+    int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", tag_size);
+    out.insert(out.end(), size_line, size_line + n);
+  }
+
+  if (timestamp == msg->timestamp) {
+    out.insert(out.end(), msg->flv_tag_header,
+               msg->flv_tag_header + MediaMessage::FLV_TAG_HEADER_SIZE);
+  } else {
+    // 时间戳被改写，只能为该观众单独生成 tag header
+    uint8_t tag_header[MediaMessage::FLV_TAG_HEADER_SIZE];
+    MediaMessage::BuildFlvTagHeader(msg->type, msg->payload.size(), timestamp,
+                                    tag_header);
+    out.insert(out.end(), tag_header,
+               tag_header + MediaMessage::FLV_TAG_HEADER_SIZE);
+  }
+
+  bool ok = WriteReference(&msg->payload[0], msg->payload.size(), msg);
+
+  out.insert(out.end(), msg->flv_previous_tag_size,
+             msg->flv_previous_tag_size + sizeof(msg->flv_previous_tag_size));
+  if (!websocket_) {
+    out.push_back('\r');
+    out.push_back('\n');
+  }
+
+  if (!ok || !Write()) {
+    LOG_ERROR << "send flv tag failed";
+    Session::SetFlag(Session::FLAG::NEED_CLOSE);
+    return;
+  }
+  GetMetrics().messages_out.Add();
+  MarkMessageSent(enqueue_us);
+}
+
+void HttpSession::SendMetaData(const MediaMessagePtr& msg) {
+  SendFlvTag(msg, msg->timestamp);
+}
+
+void HttpSession::SendMediaData(const MediaMessagePtr& msg,
+                                uint32_t timestamp) {
+  if (msg->type == 9 && !msg->IsAVCSequenceHeader()) {
+    bool is_key_frame = msg->IsKeyFrame();
+    if (waiting_for_key_frame_ && !is_key_frame) {
+      GetMetrics().dropped_frames.Add();
+      return;
+    }
+    if (!is_key_frame &&
+        GetOutputBufferSize() > size_t(server::FLAGS_http_buffer_size)) {
+      LOG_ERROR << "output buffer overflow, drop video until next key frame, "
+                << "peer: " << GetPeerAddress()
+                << ", buffered bytes: " << GetOutputBufferSize();
+      waiting_for_key_frame_ = true;
+      GetMetrics().dropped_frames.Add();
+      return;
+    }
+    waiting_for_key_frame_ = false;
+  }
+  SendFlvTag(msg, timestamp);
+}
+
+void HttpSession::OnClose() {
+  timeshift_.reset();
+  vod_.reset();
+  if (entered_) {
+    RoomManager::GetInstance().LeaveRoom(room_id_, this);
+  }
+  if (admitted_) {
+    AdmissionController::GetInstance().Release(room_id_, GetPeerAddress());
+  }
+  if (relayed_) {
+    RelayManager::GetInstance().Release(room_id_);
+  }
+}
+
+}  // namespace http
+}  // namespace util
+}  // namespace live
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "server/hls.h"
+#include "server/media_message.h"
+#include "server/net.h"
+#include "server/timeshift.h"
+#include "server/visitor.h"
+#include "server/vod.h"
+
+#include "util/util.h"
+
+#include <string>
+#include <unordered_map>
+
+namespace live {
+namespace util {
+namespace http {
+
+// HTTP-FLV 观众：GET /live/<room>.flv 以 chunked 编码持续返回 FLV 数据；
+// 请求带有 Upgrade: websocket 时升级为 WebSocket，每个 FLV tag 作为一个
+// binary frame 发送。tag header 及 frame header 由 MediaMessage 预先生成，
+// payload 以引用方式交给 bufferevent，所有观众共享同一份数据。
+// HLS、LL-HLS 的播放列表及切片同样由此返回，支持 keep-alive。
+class HttpSession : public Session, public Visitor {
+  enum State {
+    READING_REQUEST,
+    STREAMING,
+    // LL-HLS 阻塞式刷新，等待播放列表包含指定的 part
+    WAITING_PLAYLIST,
+    // 以 chunked 编码边生成边返回 LL-HLS part
+    STREAMING_PART,
+    // 等待工作线程打开点播文件
+    OPENING_VOD,
+    // 已回复错误，等待数据发完后关闭
+    CLOSING,
+  };
+
+  State state_ = READING_REQUEST;
+  bool websocket_ = false;
+
+  int32_t room_id_ = -1;
+  bool entered_ = false;
+  bool admitted_ = false;
+  bool relayed_ = false;
+  // 带 timeshift 参数的观众
+  std::unique_ptr<timeshift::TimeShiftPlayer> timeshift_;
+  // GET /vod/<file>.flv 的播放器
+  std::unique_ptr<vod::VodPlayer> vod_;
+
+  // 输出缓冲区过大时丢弃视频帧，之后从下一个关键帧开始发送
+  bool waiting_for_key_frame_ = false;
+
+  // HLS 响应之后是否继续读取下一个请求
+  bool keep_alive_ = false;
+
+  // 正在处理的 LL-HLS 请求
+  std::shared_ptr<hls::LowLatencyState> ll_state_;
+  int64_t ll_msn_ = -1;
+  int64_t ll_part_ = -1;
+  size_t ll_chunks_sent_ = 0;
+  bool ll_header_sent_ = false;
+  // 阻塞式刷新的超时
+  struct event_deleter {
+    void operator()(event* ptr) {
+      event_free(ptr);
+    }
+  };
+  std::unique_ptr<event, event_deleter> ll_timer_;
+
+  static void LowLatencyTimeoutCallback(evutil_socket_t, short, void* ptr);
+
+  using Headers = std::unordered_map<std::string, std::string>;
+  bool HandleRequest(const std::string& method, const std::string& target,
+                     const std::string& version, const Headers& headers);
+  // /live/ 下的 .m3u8、.ts、.m4s 及 .mp4
+  static bool IsHlsPath(const std::string& path);
+  // 缩略图，形如 /live/3.jpg
+  static bool IsThumbnailPath(const std::string& path);
+  // 返回 FLV 流的响应头及 FLV header，请求带 Upgrade: websocket 时升级为
+  // WebSocket。成功后 state_ 为 STREAMING，回复了错误时为 CLOSING
+  // @return 写出失败时返回 false
+  bool StartFlvStream(const Headers& headers);
+  bool HandleVodRequest(const std::string& name,
+                        std::unordered_map<std::string, std::string>& params,
+                        const Headers& headers);
+  // 点播文件打开后开始返回 FLV 流，file 为空时回复 404
+  bool StartVod(std::shared_ptr<const vod::VodFile> file,
+                Subscription subscription, int64_t start,
+                const Headers& headers);
+  bool HandleHlsRequest(const std::string& path,
+                        std::unordered_map<std::string, std::string>& params);
+  // 从 HLS 缓存中返回播放列表或切片
+  bool SendHlsFile(const std::string& path);
+  // 从缩略图缓存中返回 /live/<room>.jpg
+  bool SendThumbnail(const std::string& path);
+  // 以 Prometheus 文本格式返回各房间及连接的统计
+  bool SendMetrics();
+  // 以 Chrome trace JSON 返回各线程最近的跟踪事件，-trace 关闭时返回 404
+  bool SendTrace();
+  // 返回一个完整的 200 响应，如 HLS 切片、缩略图、统计，
+  // 之后按 keep_alive_ 继续读取请求或关闭连接
+  bool SendResponse(const hls::Blob& data, const std::string& content_type,
+                    const std::string& cache_control);
+  // 响应已写入 WriteDataBuffer 后调用
+  bool FinishResponse();
+  // 继续处理 LL-HLS 请求，条件未满足时登记 waiter 等待切片线程唤醒
+  bool OnLowLatencyUpdate();
+  hls::LowLatencyState::Waiter MakeWaiter();
+  // 返回 101 Switching Protocols
+  bool AcceptWebSocket(const Headers& headers);
+  // 处理客户端发来的 WebSocket frame，只关心 close 和 ping
+  bool OnReadWebSocketFrames();
+  void SendWebSocketFrame(uint8_t opcode, const uint8_t* data, size_t len);
+  // 将 data 封装为一个 chunk 或 WebSocket binary frame 写入 WriteDataBuffer
+  void AppendFramed(const uint8_t* data, size_t len);
+  void SendErrorResponse(int32_t code, const std::string& reason,
+                         const std::string& body);
+  void SendFlvTag(const MediaMessagePtr& msg, uint32_t timestamp);
+
+ public:
+  bool OnRead() override;
+  void OnClose() override;
+  const char* GetProtocol() const override {
+    return "http";
+  }
+
+  void SendMetaData(const MediaMessagePtr& msg) override;
+  void SendMediaData(const MediaMessagePtr& msg, uint32_t timestamp) override;
+
+  static std::unique_ptr<Session> CreateHttpSession() {
+    return std::unique_ptr<Session>(new HttpSession());
+  }
+};
+
+}  // namespace http
+}  // namespace util
+}  // namespace live
@@ -0,0 +1,517 @@
+#include "server/llhls.h"
+#include "server/args.h"
+#include "server/hls.h"
+
+#include "util/util.h"
+
+#include <cmath>
+#include <sstream>
+
+namespace live {
+namespace util {
+namespace hls {
+
+// AAC 每帧的采样数
+static const uint32_t AAC_FRAME_SAMPLES = 1024;
+
+void LowLatencyState::Reset() {
+  std::vector<Waiter> waiters;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    parts_.clear();
+    started_ = false;
+    ended_ = false;
+    msn_ = 0;
+    part_ = 0;
+    segment_complete_ = false;
+    playlist_.reset();
+    waiters = TakeWaiters();
+  }
+  Notify(waiters);
+}
+
+void LowLatencyState::BeginPart(uint64_t msn, uint32_t part) {
+  std::vector<Waiter> waiters;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    parts_[std::make_pair(msn, part)];
+    started_ = true;
+    msn_ = msn;
+    part_ = part;
+    segment_complete_ = false;
+    waiters = TakeWaiters();
+  }
+  Notify(waiters);
+}
+
+void LowLatencyState::AppendChunk(Blob chunk) {
+  std::vector<Waiter> waiters;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    parts_[std::make_pair(msn_, part_)].chunks.push_back(std::move(chunk));
+    waiters = TakeWaiters();
+  }
+  Notify(waiters);
+}
+
+void LowLatencyState::CompletePart(Blob playlist, bool segment_complete,
+                                   uint64_t min_msn) {
+  std::vector<Waiter> waiters;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    parts_[std::make_pair(msn_, part_)].complete = true;
+    segment_complete_ = segment_complete;
+    playlist_ = std::move(playlist);
+    parts_.erase(parts_.begin(),
+                 parts_.lower_bound(std::make_pair(min_msn, uint32_t(0))));
+    waiters = TakeWaiters();
+  }
+  Notify(waiters);
+}
+
+void LowLatencyState::Finish(Blob playlist) {
+  std::vector<Waiter> waiters;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    ended_ = true;
+    playlist_ = std::move(playlist);
+    for (auto& p : parts_) {
+      p.second.complete = true;
+    }
+    waiters = TakeWaiters();
+  }
+  Notify(waiters);
+}
+
+LowLatencyState::Status LowLatencyState::GetPlaylist(int64_t msn,
+                                                     int64_t part,
+                                                     Blob* playlist,
+                                                     const Waiter& waiter) {
+  std::lock_guard<std::mutex> g(mutex_);
+  bool ready = msn < 0 || ended_;
+  if (!ready && started_) {
+    // 协议规定只能等待至多领先两个切片的播放列表
+    if (uint64_t(msn) > msn_ + 2) {
+      return NOT_FOUND;
+    }
+    const uint64_t m = uint64_t(msn);
+    if (part < 0) {
+      ready = m < msn_ || (m == msn_ && segment_complete_);
+    } else {
+      auto it = parts_.find(std::make_pair(msn_, part_));
+      bool current_complete = it != parts_.end() && it->second.complete;
+      ready = m < msn_ ||
+              (m == msn_ && (uint32_t(part) < part_ ||
+                             (uint32_t(part) == part_ && current_complete)));
+    }
+  }
+  if (ready && playlist_) {
+    *playlist = playlist_;
+    return READY;
+  }
+  if (ready) {
+    // 房间还没有生成任何 part
+    return NOT_FOUND;
+  }
+  waiters_.push_back(waiter);
+  return PENDING;
+}
+
+LowLatencyState::Status LowLatencyState::ReadPart(
+    uint64_t msn, uint32_t part, size_t offset, std::vector<Blob>* chunks,
+    bool* complete, const Waiter& waiter) {
+  std::lock_guard<std::mutex> g(mutex_);
+  auto it = parts_.find(std::make_pair(msn, part));
+  if (it == parts_.end()) {
+    // preload hint 指向的 part 可能还没开始生成
+    bool upcoming = started_ && !ended_ &&
+                    ((msn == msn_ && part == part_ + 1) ||
+                     (msn == msn_ + 1 && part == 0));
+    if (!upcoming) {
+      return NOT_FOUND;
+    }
+    *complete = false;
+    waiters_.push_back(waiter);
+    return PENDING;
+  }
+
+  const Part& p = it->second;
+  for (size_t i = offset; i < p.chunks.size(); i++) {
+    chunks->push_back(p.chunks[i]);
+  }
+  *complete = p.complete || ended_;
+  if (!*complete) {
+    waiters_.push_back(waiter);
+  }
+  return READY;
+}
+
+LowLatencySegmenter::LowLatencySegmenter(
+    int32_t room_id, uint64_t first_msn,
+    std::shared_ptr<LowLatencyState> state)
+    : room_id_(room_id), state_(std::move(state)), msn_(first_msn) {
+  state_->Reset();
+}
+
+void LowLatencySegmenter::Write(const MediaMessagePtr& msg) {
+  if (msg->type == 9) {
+    WriteVideo(msg);
+  } else if (msg->type == 8) {
+    WriteAudio(msg);
+  }
+}
+
+void LowLatencySegmenter::WriteVideo(const MediaMessagePtr& msg) {
+  if (msg->codec != MediaCodec::AVC) {
+    return;
+  }
+  if (msg->is_config) {
+    AVCConfig avc;
+    if (!avc.Parse(msg->Data(), msg->DataSize())) {
+      // 已生成 init segment 后忽略无法解析的配置
+      if (!has_init_) {
+        has_avc_ = false;
+      }
+      return;
+    }
+    // 推流端重连或重发时配置通常不变
+    if (has_avc_ && avc.record == avc_.record) {
+      return;
+    }
+    ResetInit();
+    avc_ = std::move(avc);
+    has_avc_ = true;
+    return;
+  }
+  if (!msg->is_frame || !has_avc_) {
+    return;
+  }
+
+  const bool is_key_frame = msg->IsKeyFrame();
+  // 第一个切片从关键帧开始
+  if (!segment_open_ && !is_key_frame) {
+    return;
+  }
+  // 上一帧的时长直到这一帧到来才能确定
+  if (pending_video_) {
+    uint32_t duration = msg->timestamp - pending_video_->timestamp;
+    if (duration == 0 || duration > 10000) {
+      duration = last_video_duration_;
+    }
+    last_video_duration_ = duration;
+    AddVideoSample(pending_video_, duration);
+    pending_video_.reset();
+  }
+  CutIfNeeded(msg->timestamp, is_key_frame, last_video_duration_);
+  if (video_track_) {
+    pending_video_ = msg;
+  }
+  last_timestamp_ = msg->timestamp;
+}
+
+void LowLatencySegmenter::WriteAudio(const MediaMessagePtr& msg) {
+  if (msg->codec != MediaCodec::AAC) {
+    return;
+  }
+  if (msg->is_config) {
+    AACConfig aac;
+    if (!aac.Parse(msg->Data(), msg->DataSize())) {
+      if (!has_init_) {
+        has_aac_ = false;
+      }
+      return;
+    }
+    if (has_aac_ && aac.record == aac_.record) {
+      return;
+    }
+    ResetInit();
+    aac_ = std::move(aac);
+    has_aac_ = true;
+    return;
+  }
+  if (!has_aac_) {
+    return;
+  }
+  // 有视频时只在视频帧处切分
+  if (!has_avc_) {
+    CutIfNeeded(msg->timestamp, true,
+                AAC_FRAME_SAMPLES * 1000 / aac_.SampleRate());
+    last_timestamp_ = msg->timestamp;
+  }
+  if (segment_open_ && audio_track_) {
+    AddAudioSample(msg);
+  }
+}
+
+void LowLatencySegmenter::AddVideoSample(const MediaMessagePtr& msg,
+                                         uint32_t duration) {
+  if (video_samples_.empty()) {
+    video_decode_time_ = uint64_t(msg->timestamp) * 90;
+  }
+
+  // fMP4 的 sample 即长度前缀格式的帧，直接引用 payload
+  fmp4::Sample sample;
+  sample.data = msg->Data();
+  sample.size = msg->DataSize();
+  sample.duration = duration * 90;
+  sample.composition_offset = msg->cts * 90;
+  sample.is_key_frame = msg->IsKeyFrame();
+  video_samples_.push_back(sample);
+  holders_.push_back(msg);
+}
+
+void LowLatencySegmenter::FlushPendingVideo() {
+  if (pending_video_) {
+    AddVideoSample(pending_video_, last_video_duration_);
+    last_timestamp_ = pending_video_->timestamp + last_video_duration_;
+    pending_video_.reset();
+  }
+}
+
+void LowLatencySegmenter::ResetInit() {
+  if (!has_init_) {
+    return;
+  }
+  // 已写入的帧按旧配置封装，先结束当前切片。
+  // 下一个切片从关键帧开始，使用新的 init segment
+  has_init_ = false;
+  discontinuity_ = true;
+  audio_time_valid_ = false;
+  FlushPendingVideo();
+  if (segment_open_) {
+    ClosePart(last_timestamp_, true);
+  }
+}
+
+std::string LowLatencySegmenter::InitName(uint32_t init) {
+  return init == 0 ? "init.mp4" : "init." + std::to_string(init) + ".mp4";
+}
+
+void LowLatencySegmenter::AddAudioSample(const MediaMessagePtr& msg) {
+  const uint64_t rate = aac_.SampleRate();
+  const uint64_t expected = uint64_t(msg->timestamp) * rate / 1000;
+  if (!audio_time_valid_ ||
+      std::max(expected, next_audio_time_) -
+              std::min(expected, next_audio_time_) >
+          AAC_FRAME_SAMPLES) {
+    next_audio_time_ = expected;
+    audio_time_valid_ = true;
+  }
+  if (audio_samples_.empty()) {
+    audio_decode_time_ = next_audio_time_;
+  }
+  next_audio_time_ += AAC_FRAME_SAMPLES;
+
+  fmp4::Sample sample;
+  sample.data = msg->Data();
+  sample.size = msg->DataSize();
+  sample.duration = AAC_FRAME_SAMPLES;
+  sample.is_key_frame = true;
+  audio_samples_.push_back(sample);
+  holders_.push_back(msg);
+}
+
+void LowLatencySegmenter::CutIfNeeded(uint32_t timestamp, bool is_key_frame,
+                                      uint32_t frame_duration) {
+  if (!segment_open_) {
+    OpenSegment(timestamp, is_key_frame);
+    return;
+  }
+  if (is_key_frame && timestamp - segment_start_ >=
+                          uint32_t(server::FLAGS_hls_segment_duration)) {
+    ClosePart(timestamp, true);
+    OpenSegment(timestamp, is_key_frame);
+    return;
+  }
+  if (timestamp - part_start_ + frame_duration >
+      uint32_t(server::FLAGS_llhls_part_duration)) {
+    ClosePart(timestamp, false);
+    OpenPart(timestamp, is_key_frame);
+  }
+}
+
+void LowLatencySegmenter::OpenSegment(uint32_t timestamp, bool is_key_frame) {
+  if (!has_init_) {
+    video_track_ = has_avc_;
+    audio_track_ = has_aac_;
+    muxer_.SetTracks(video_track_ ? &avc_ : nullptr,
+                     audio_track_ ? &aac_ : nullptr);
+    auto init = std::make_shared<std::vector<uint8_t>>();
+    muxer_.WriteInitSegment(init.get());
+    init_ = next_init_++;
+    // 播放列表中还有切片使用时不能被淘汰
+    SegmentCache::GetInstance().Put(
+        "/live/" + std::to_string(room_id_) + "/" + InitName(init_),
+        std::move(init), true);
+    has_init_ = true;
+  }
+  segment_open_ = true;
+  segment_discontinuity_ = discontinuity_;
+  discontinuity_ = false;
+  segment_start_ = timestamp;
+  segment_.clear();
+  current_parts_.clear();
+  part_ = 0;
+  OpenPart(timestamp, is_key_frame);
+}
+
+void LowLatencySegmenter::OpenPart(uint32_t timestamp, bool is_key_frame) {
+  part_start_ = timestamp;
+  part_independent_ = is_key_frame;
+  state_->BeginPart(msn_, part_);
+}
+
+void LowLatencySegmenter::Flush() {
+  FlushChunk();
+}
+
+void LowLatencySegmenter::FlushChunk() {
+  if (video_samples_.empty() && audio_samples_.empty()) {
+    return;
+  }
+  auto chunk = std::make_shared<std::vector<uint8_t>>();
+  muxer_.WriteChunk(video_decode_time_, video_samples_, audio_decode_time_,
+                    audio_samples_, chunk.get());
+  video_samples_.clear();
+  audio_samples_.clear();
+  holders_.clear();
+  segment_.insert(segment_.end(), chunk->begin(), chunk->end());
+  state_->AppendChunk(std::move(chunk));
+}
+
+void LowLatencySegmenter::ClosePart(uint32_t end_timestamp,
+                                    bool close_segment) {
+  FlushChunk();
+  current_parts_.push_back(
+      {(end_timestamp - part_start_) / 1000.0, part_independent_});
+
+  if (close_segment) {
+    SegmentCache::GetInstance().Put(
+        "/live/" + std::to_string(room_id_) + "/" + std::to_string(msn_) +
+            ".m4s",
+        std::make_shared<const std::vector<uint8_t>>(std::move(segment_)));
+    segment_ = std::vector<uint8_t>();
+    segments_.push_back({msn_, (end_timestamp - segment_start_) / 1000.0,
+                         std::move(current_parts_), init_,
+                         segment_discontinuity_});
+    current_parts_.clear();
+    while (segments_.size() >
+           size_t(std::max(server::FLAGS_hls_playlist_size, 1))) {
+      const uint32_t init = segments_.front().init;
+      if (segments_.front().discontinuity) {
+        discontinuity_sequence_++;
+      }
+      segments_.pop_front();
+      // 已没有切片使用的 init segment 允许淘汰
+      if (init != segments_.front().init) {
+        SegmentCache::GetInstance().Unpin("/live/" + std::to_string(room_id_) +
+                                          "/" + InitName(init));
+      }
+    }
+    segment_open_ = false;
+    msn_++;
+    part_ = 0;
+  } else {
+    part_++;
+  }
+  state_->CompletePart(BuildPlaylist(false), close_segment,
+                       FirstMsnWithParts());
+}
+
+uint64_t LowLatencySegmenter::FirstMsnWithParts() const {
+  // 最近两个已结束的切片及正在生成的切片列出 part
+  if (segments_.size() >= 2) {
+    return segments_[segments_.size() - 2].msn;
+  }
+  return segments_.empty() ? msn_ : segments_.front().msn;
+}
+
+Blob LowLatencySegmenter::BuildPlaylist(bool ended) const {
+  const double part_target = server::FLAGS_llhls_part_duration / 1000.0;
+  double max_duration = server::FLAGS_hls_segment_duration / 1000.0;
+  for (const auto& s : segments_) {
+    max_duration = std::max(max_duration, s.duration);
+  }
+  const std::string prefix = std::to_string(room_id_) + "/";
+
+  std::ostringstream oss;
+  oss.setf(std::ios::fixed);
+  oss.precision(3);
+  oss << "#EXTM3U\n"
+      << "#EXT-X-VERSION:6\n"
+      << "#EXT-X-TARGETDURATION:" << int64_t(std::ceil(max_duration)) << "\n"
+      << "#EXT-X-PART-INF:PART-TARGET=" << part_target << "\n"
+      << "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK="
+      << part_target * 3 << "\n"
+      << "#EXT-X-MEDIA-SEQUENCE:"
+      << (segments_.empty() ? msn_ : segments_.front().msn) << "\n";
+  if (discontinuity_sequence_ > 0) {
+    oss << "#EXT-X-DISCONTINUITY-SEQUENCE:" << discontinuity_sequence_
+        << "\n";
+  }
+
+  // 第一个切片及 init segment 变化的切片之前指定 init segment
+  bool has_map = false;
+  uint32_t map = 0;
+  auto write_boundary = [&](uint32_t init, bool discontinuity) {
+    if (discontinuity) {
+      oss << "#EXT-X-DISCONTINUITY\n";
+    }
+    if (!has_map || init != map) {
+      oss << "#EXT-X-MAP:URI=\"" << prefix << InitName(init) << "\"\n";
+      has_map = true;
+      map = init;
+    }
+  };
+
+  auto write_parts = [&](uint64_t msn, const std::vector<PartInfo>& parts) {
+    for (size_t i = 0; i < parts.size(); i++) {
+      oss << "#EXT-X-PART:DURATION=" << parts[i].duration << ",URI=\""
+          << prefix << msn << "." << i << ".m4s\""
+          << (parts[i].independent ? ",INDEPENDENT=YES" : "") << "\n";
+    }
+  };
+  const uint64_t first_msn_with_parts = FirstMsnWithParts();
+  for (const auto& s : segments_) {
+    write_boundary(s.init, s.discontinuity);
+    if (s.msn >= first_msn_with_parts) {
+      write_parts(s.msn, s.parts);
+    }
+    oss << "#EXTINF:" << s.duration << ",\n"
+        << prefix << s.msn << ".m4s\n";
+  }
+  if (ended) {
+    oss << "#EXT-X-ENDLIST\n";
+  } else {
+    if (segment_open_) {
+      write_boundary(init_, segment_discontinuity_);
+      write_parts(msn_, current_parts_);
+    }
+    // 正在生成的 part，播放器可以提前请求，数据边生成边返回。
+    // 解码配置变化后的下一个切片使用的 init segment 尚未确定，不提前提示
+    if (segment_open_ || !discontinuity_) {
+      oss << "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"" << prefix << msn_ << "."
+          << part_ << ".m4s\"\n";
+    }
+  }
+  std::string text = oss.str();
+  return std::make_shared<const std::vector<uint8_t>>(text.begin(),
+                                                      text.end());
+}
+
+void LowLatencySegmenter::Finish() {
+  FlushPendingVideo();
+  if (segment_open_) {
+    ClosePart(last_timestamp_, true);
+  }
+  state_->Finish(BuildPlaylist(true));
+  // 直播已结束，不再固定 init segment
+  for (uint32_t i = 0; i < next_init_; i++) {
+    SegmentCache::GetInstance().Unpin("/live/" + std::to_string(room_id_) +
+                                      "/" + InitName(i));
+  }
+}
+
+}  // namespace hls
+}  // namespace util
+}  // namespace live
@@ -0,0 +1,197 @@
+#pragma once
+
+#include "server/codec.h"
+#include "server/fmp4.h"
+#include "server/media_message.h"
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace live {
+namespace util {
+namespace hls {
+
+using Blob = std::shared_ptr<const std::vector<uint8_t>>;
+
+// 房间当前的 LL-HLS 播放列表及最近的 part，由切片线程写入，EventLoop 线程读取。
+// part 由若干 CMAF chunk 组成，生成一个 chunk 就能读取，不必等 part 结束。
+// 读取时条件未满足则登记 waiter，状态变化后调用一次，之后须重新读取及登记
+class LowLatencyState {
+ public:
+  using Waiter = std::function<void()>;
+
+  enum Status {
+    READY,
+    // 条件未满足，已登记 waiter
+    PENDING,
+    // 请求的切片或 part 不存在，或超出可等待的范围
+    NOT_FOUND,
+  };
+
+ private:
+  struct Part {
+    std::vector<Blob> chunks;
+    bool complete = false;
+  };
+
+  std::mutex mutex_;
+  // 按 (msn, part) 排序，只保留播放列表中列出 part 的切片
+  std::map<std::pair<uint64_t, uint32_t>, Part> parts_;
+  bool started_ = false;
+  bool ended_ = false;
+  // 正在生成的 part
+  uint64_t msn_ = 0;
+  uint32_t part_ = 0;
+  bool segment_complete_ = false;
+  Blob playlist_;
+  std::vector<Waiter> waiters_;
+
+  // 调用者持有 mutex_，返回待调用的 waiter
+  std::vector<Waiter> TakeWaiters() {
+    std::vector<Waiter> waiters;
+    waiters.swap(waiters_);
+    return waiters;
+  }
+
+  static void Notify(const std::vector<Waiter>& waiters) {
+    for (const auto& w : waiters) {
+      w();
+    }
+  }
+
+ public:
+  // 以下由切片线程调用
+  void Reset();
+  void BeginPart(uint64_t msn, uint32_t part);
+  void AppendChunk(Blob chunk);
+  // 当前 part 结束，segment_complete 表示所在切片也已结束，
+  // 早于 min_msn 的切片不再列出 part，将其丢弃
+  void CompletePart(Blob playlist, bool segment_complete, uint64_t min_msn);
+  // 房间关闭，未结束的 part 视为结束
+  void Finish(Blob playlist);
+
+  // 以下由 EventLoop 线程调用。
+  // part 小于 0 时等待整个切片 msn 结束，msn 小于 0 时直接返回当前播放列表
+  Status GetPlaylist(int64_t msn, int64_t part, Blob* playlist,
+                     const Waiter& waiter);
+  // 从第 offset 个 chunk 开始读取，complete 表示 part 已结束，
+  // 正在生成及即将生成的 part 未结束时登记 waiter
+  Status ReadPart(uint64_t msn, uint32_t part, size_t offset,
+                  std::vector<Blob>* chunks, bool* complete,
+                  const Waiter& waiter);
+};
+
+// 一个房间的 LL-HLS 切片器，只在房间的 Strand 中访问。
+// 每批消息生成一个 CMAF chunk，约 -llhls_part_duration 生成一个 part，
+// 切片在达到 -hls_segment_duration 后的第一个关键帧处切分。
+// 路径为 /live/<room>.ll.m3u8、/live/<room>/init.mp4、
+// /live/<room>/<msn>.m4s 及 /live/<room>/<msn>.<part>.m4s。
+// 解码配置变化时结束当前切片，之后的切片使用新的 init segment
+// /live/<room>/init.<n>.mp4，并在播放列表中标记不连续
+class LowLatencySegmenter {
+  int32_t room_id_;
+  std::shared_ptr<LowLatencyState> state_;
+
+  AVCConfig avc_;
+  bool has_avc_ = false;
+  AACConfig aac_;
+  bool has_aac_ = false;
+  fmp4::Fmp4Muxer muxer_;
+  bool has_init_ = false;
+  // 当前 init segment 的序号，每次重新生成加一
+  uint32_t init_ = 0;
+  uint32_t next_init_ = 0;
+  // 解码配置已变化，下一个切片前标记不连续
+  bool discontinuity_ = false;
+  bool segment_discontinuity_ = false;
+  // 已移出播放列表的不连续标记数
+  uint64_t discontinuity_sequence_ = 0;
+  // init segment 中包含的轨道
+  bool video_track_ = false;
+  bool audio_track_ = false;
+
+  // 等待下一帧以确定时长的视频帧
+  MediaMessagePtr pending_video_;
+  uint32_t last_video_duration_ = 40;
+
+  // 当前 chunk 中的 sample，数据指向其所属的 MediaMessage
+  std::vector<fmp4::Sample> video_samples_;
+  std::vector<fmp4::Sample> audio_samples_;
+  std::vector<MediaMessagePtr> holders_;
+  uint64_t video_decode_time_ = 0;
+  uint64_t audio_decode_time_ = 0;
+  // 音频按每帧 1024 个采样连续计时，与毫秒时间戳偏差过大时才重新对齐
+  uint64_t next_audio_time_ = 0;
+  bool audio_time_valid_ = false;
+
+  bool segment_open_ = false;
+  uint64_t msn_;
+  uint32_t segment_start_ = 0;
+  std::vector<uint8_t> segment_;
+
+  // 正在生成的 part 在切片中的序号
+  uint32_t part_ = 0;
+  uint32_t part_start_ = 0;
+  bool part_independent_ = false;
+  uint32_t last_timestamp_ = 0;
+
+  struct PartInfo {
+    double duration;
+    bool independent;
+  };
+  struct SegmentInfo {
+    uint64_t msn;
+    double duration;
+    std::vector<PartInfo> parts;
+    uint32_t init;
+    bool discontinuity;
+  };
+  // 已结束的切片
+  std::deque<SegmentInfo> segments_;
+  std::vector<PartInfo> current_parts_;
+
+  void WriteVideo(const MediaMessagePtr& msg);
+  void WriteAudio(const MediaMessagePtr& msg);
+  void AddVideoSample(const MediaMessagePtr& msg, uint32_t duration);
+  void AddAudioSample(const MediaMessagePtr& msg);
+  // 等待下一帧的视频帧按上一帧的时长写入
+  void FlushPendingVideo();
+  // 收到与 init segment 不同的解码配置时调用，结束当前切片
+  void ResetInit();
+  // init segment 的文件名，第一个为 init.mp4
+  static std::string InitName(uint32_t init);
+  // 在 timestamp 处按需切分 part 或切片，is_key_frame 表示此处可以开始新切片。
+  // part 加上下一帧将超出目标时长时即切分，frame_duration 为预估的帧时长
+  void CutIfNeeded(uint32_t timestamp, bool is_key_frame,
+                   uint32_t frame_duration);
+  void OpenSegment(uint32_t timestamp, bool is_key_frame);
+  void OpenPart(uint32_t timestamp, bool is_key_frame);
+  void FlushChunk();
+  void ClosePart(uint32_t end_timestamp, bool close_segment);
+  // 列出 part 的第一个切片，更早的切片只列出整个切片
+  uint64_t FirstMsnWithParts() const;
+  Blob BuildPlaylist(bool ended) const;
+
+ public:
+  LowLatencySegmenter(int32_t room_id, uint64_t first_msn,
+                      std::shared_ptr<LowLatencyState> state);
+
+  void Write(const MediaMessagePtr& msg);
+  // 一批消息写完后输出 chunk
+  void Flush();
+  void Finish();
+
+  // Finish 之后调用，房间 id 被复用时接着使用
+  uint64_t NextSequence() const {
+    return msn_;
+  }
+};
+
+}  // namespace hls
+}  // namespace util
+}  // namespace live
@@ -1,16 +1,57 @@
+#include "server/abr.h"
+#include "server/args.h"
+#include "server/http.h"
 #include "server/net.h"
+#include "server/room.h"
 #include "server/rtmp.h"
-
-#include <gflags/gflags.h>
+#include "server/rtsp.h"
+#include "server/ts_udp.h"
+#include "util/log.h"
+#include "util/trace.h"
 
 using namespace live::util;
-
-DEFINE_int32(port, 9527, "对外提供服务的端口");
+using namespace live::server;
 
 int main(int argc, char** argv) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
+  trace::Enable(FLAGS_trace);
+
+  // 每个推流房间还要为各档位各占用一个房间
+  const size_t ladder = abr::AbrManager::GetInstance().LadderSize();
+  const int32_t capacity = RoomManager::GetInstance().Capacity();
+  if (ladder > 0 && int64_t(ladder) + 1 > capacity) {
+    LOG_ERROR << "-room_capacity " << capacity << " too small for "
+              << ladder << " abr renditions, need at least " << ladder + 1;
+    return 1;
+  }
+
+  EventLoopGroup::GetInstance().Init(FLAGS_event_loops);
+
+  Listener listener(FLAGS_port, &rtmp::RTMPSession::CreateRTMPSession);
+  std::unique_ptr<Listener> http_listener;
+  if (FLAGS_http_port > 0) {
+    http_listener.reset(
+        new Listener(FLAGS_http_port, &http::HttpSession::CreateHttpSession));
+  }
+  std::unique_ptr<Listener> rtsp_listener;
+  if (FLAGS_rtsp_port > 0) {
+    rtsp_listener.reset(
+        new Listener(FLAGS_rtsp_port, &rtsp::RtspSession::CreateRtspSession));
+  }
+  std::vector<std::unique_ptr<ts::TsIngest>> ts_ingests;
+  const std::string& ingests = FLAGS_ts_ingest;
+  for (size_t begin = 0, end = 0; begin < ingests.size(); begin = end + 1) {
+    end = ingests.find(',', begin);
+    if (end == std::string::npos) {
+      end = ingests.size();
+    }
+    if (end > begin) {
+      ts_ingests.emplace_back(
+          new ts::TsIngest(ingests.substr(begin, end - begin)));
+    }
+  }
 
-  Listener(FLAGS_port, &rtmp::RTMPSession::CreateRTMPSession).Listen();
+  EventLoopGroup::GetInstance().Run();
 
   return 0;
 }
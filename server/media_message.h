@@ -0,0 +1,250 @@
+#pragma once
+
+#include "util/util.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace live {
+namespace util {
+
+enum class MediaCodec : uint8_t {
+  NONE = 0,
+  AVC,
+  AAC,
+};
+
+// 一个 NALU 在 payload 中的位置，不含长度前缀
+struct NaluRange {
+  uint32_t offset = 0;
+  uint32_t size = 0;
+};
+
+// 主播推送的一条音视频消息，创建后只读，在各个 EventLoop 间共享，不再拷贝。
+// 创建时解析一次编码信息，各输出协议不再自行解析 FLV payload
+struct MediaMessage {
+  uint8_t type = 0;
+  // 即 DTS，单位 ms
+  uint32_t timestamp = 0;
+  std::vector<uint8_t> payload;
+  // 收到或生成这条消息的时间，用于统计分发延迟
+  uint64_t created_us = 0;
+
+  MediaCodec codec = MediaCodec::NONE;
+  // 视频的 FrameType 为 1，sequence header 也是
+  bool is_key_frame = false;
+  // AVC 或 AAC 的 sequence header
+  bool is_config = false;
+  // AVC NALU 或 AAC raw 帧
+  bool is_frame = false;
+  // PTS 与 DTS 之差，单位 ms，只有 AVC 有
+  int32_t cts = 0;
+  // 编码数据在 payload 中的起始位置，AVC 为 5，AAC 为 2
+  size_t data_offset = 0;
+  // 按 4 字节长度前缀切分的 NALU，长度前缀不是 4 字节或数据不完整时为空
+  std::vector<NaluRange> nalus;
+
+  // 各输出格式对这一帧的封装，第一次用到时生成并缓存，
+  // 所有 EventLoop 及线程池的观众共享，每种格式每帧只封装一次
+  enum Packaging {
+    ANNEX_B = 0,
+    ADTS,
+    RTP,
+    PACKAGING_COUNT,
+  };
+
+  // 以 FLV 格式发送时 payload 前的 tag header 及其后的 PreviousTagSize，
+  // 创建时生成一次，所有 HTTP-FLV 观众共享
+  static const size_t FLV_TAG_HEADER_SIZE = 11;
+  uint8_t flv_tag_header[FLV_TAG_HEADER_SIZE];
+  uint8_t flv_previous_tag_size[4];
+
+  // 整个 FLV tag 作为一个 WebSocket binary frame 发送时的 frame header，
+  // 只取决于 tag 的大小，同样只生成一次
+  static const size_t MAX_WS_FRAME_HEADER_SIZE = 10;
+  uint8_t ws_frame_header[MAX_WS_FRAME_HEADER_SIZE];
+  size_t ws_frame_header_size = 0;
+
+  MediaMessage(uint8_t t, uint32_t ts, std::vector<uint8_t>&& p)
+      : type(t),
+        timestamp(ts),
+        payload(std::move(p)),
+        created_us(GetPassedTimeSinceStartedInMicroSeconds()) {
+    BuildFlvTagHeader(type, payload.size(), timestamp, flv_tag_header);
+    uint32_t size = FLV_TAG_HEADER_SIZE + payload.size();
+    for (int i = 0; i < 4; i++) {
+      flv_previous_tag_size[i] = uint8_t(size >> (24 - 8 * i));
+    }
+    ws_frame_header_size = BuildWebSocketFrameHeader(
+        size + sizeof(flv_previous_tag_size), ws_frame_header);
+    Parse();
+  }
+
+  bool IsKeyFrame() const {
+    return is_key_frame;
+  }
+
+  bool IsAVCSequenceHeader() const {
+    return codec == MediaCodec::AVC && is_config;
+  }
+
+  bool IsAACSequenceHeader() const {
+    return codec == MediaCodec::AAC && is_config;
+  }
+
+  const uint8_t* Data() const {
+    return payload.data() + data_offset;
+  }
+
+  size_t DataSize() const {
+    return payload.size() - data_offset;
+  }
+
+  // PTS，单位 ms
+  int64_t Pts() const {
+    return int64_t(timestamp) + cts;
+  }
+
+  // 取 packaging 格式的缓存，没有时以 build 生成，build 返回
+  // std::shared_ptr<const T>，失败时返回空指针，同样会被缓存。
+  // 同一帧的封装只取决于它之前的 sequence header，所有观众的结果相同
+  template <typename T, typename Build>
+  std::shared_ptr<const T> GetPackaged(Packaging packaging,
+                                       Build&& build) const {
+    PackagingCache& cache = packaging_caches_[packaging];
+    std::call_once(cache.once, [&cache, &build]() { cache.data = build(); });
+    return std::static_pointer_cast<const T>(cache.data);
+  }
+
+  // 将长度前缀为 length_size 字节的 NALU 序列切分后追加到 out，
+  // base 为 data 在 payload 中的位置
+  static bool SplitNalus(const uint8_t* data, size_t size, uint8_t length_size,
+                         size_t base, std::vector<NaluRange>* out) {
+    size_t pos = 0;
+    while (pos + length_size <= size) {
+      size_t len = 0;
+      for (uint8_t i = 0; i < length_size; i++) {
+        len = (len << 8) | data[pos + i];
+      }
+      pos += length_size;
+      if (len == 0 || pos + len > size) {
+        return false;
+      }
+      out->push_back(NaluRange{uint32_t(base + pos), uint32_t(len)});
+      pos += len;
+    }
+    return pos == size;
+  }
+
+  // 服务端发出的 binary frame 不加掩码，out 至少 MAX_WS_FRAME_HEADER_SIZE 字节
+  // @return frame header 的长度
+  static size_t BuildWebSocketFrameHeader(uint64_t payload_size,
+                                          uint8_t* out) {
+    // FIN 及 opcode 2
+    out[0] = 0x82;
+    if (payload_size < 126) {
+      out[1] = uint8_t(payload_size);
+      return 2;
+    }
+    if (payload_size <= 0xFFFF) {
+      out[1] = 126;
+      out[2] = uint8_t(payload_size >> 8);
+      out[3] = uint8_t(payload_size);
+      return 4;
+    }
+    out[1] = 127;
+    for (int i = 0; i < 8; i++) {
+      out[2 + i] = uint8_t(payload_size >> (56 - 8 * i));
+    }
+    return 10;
+  }
+
+  // 布局同 flv::TagHeader，时间戳被改写时用来生成观众自己的 tag header
+  static void BuildFlvTagHeader(uint8_t type, uint32_t data_size,
+                                uint32_t timestamp, uint8_t* out) {
+    out[0] = type;
+    out[1] = uint8_t(data_size >> 16);
+    out[2] = uint8_t(data_size >> 8);
+    out[3] = uint8_t(data_size);
+    out[4] = uint8_t(timestamp >> 16);
+    out[5] = uint8_t(timestamp >> 8);
+    out[6] = uint8_t(timestamp);
+    out[7] = uint8_t(timestamp >> 24);
+    out[8] = out[9] = out[10] = 0;
+  }
+
+ private:
+  struct PackagingCache {
+    std::once_flag once;
+    std::shared_ptr<const void> data;
+  };
+  mutable PackagingCache packaging_caches_[PACKAGING_COUNT];
+
+  void Parse() {
+    if (type == 9 && !payload.empty()) {
+      is_key_frame = (payload[0] >> 4) == 1;
+      // CodecID 7 为 AVC，AVCPacketType 0 为 sequence header，1 为 NALU
+      if ((payload[0] & 0x0F) != 7 || payload.size() < 5) {
+        return;
+      }
+      codec = MediaCodec::AVC;
+      data_offset = 5;
+      is_config = payload[1] == 0;
+      is_frame = payload[1] == 1;
+      // CompositionTime 为 24 bit 有符号数
+      cts = (payload[2] << 16) | (payload[3] << 8) | payload[4];
+      cts = (cts ^ 0x800000) - 0x800000;
+      if (is_frame &&
+          !SplitNalus(Data(), DataSize(), 4, data_offset, &nalus)) {
+        nalus.clear();
+      }
+    } else if (type == 8 && payload.size() >= 2 && (payload[0] >> 4) == 10) {
+      // SoundFormat 10 为 AAC，AACPacketType 0 为 sequence header
+      codec = MediaCodec::AAC;
+      data_offset = 2;
+      is_config = payload[1] == 0;
+      is_frame = payload[1] == 1 && payload.size() > 2;
+    }
+  }
+};
+using MediaMessagePtr = std::shared_ptr<const MediaMessage>;
+
+// 按位置缓存最近从文件或缓冲区读出的消息，同一位置的多个观众共享同一个
+// MediaMessage 及其各协议的封装。直接映射，冲突时替换旧的。不加锁，
+// 由调用者保护
+class MediaMessageCache {
+  struct Slot {
+    uint64_t key = UINT64_MAX;
+    MediaMessagePtr msg;
+  };
+  std::vector<Slot> slots_;
+
+  size_t Index(uint64_t key) const {
+    // 位置可能是字节偏移，散列后再取模
+    return size_t((key * 0x9E3779B97F4A7C15ULL) >> 32) % slots_.size();
+  }
+
+ public:
+  explicit MediaMessageCache(size_t slots) : slots_(slots) {}
+
+  // @return 没有时返回空指针
+  MediaMessagePtr Get(uint64_t key) const {
+    const Slot& slot = slots_[Index(key)];
+    return slot.key == key ? slot.msg : nullptr;
+  }
+  void Put(uint64_t key, MediaMessagePtr msg) {
+    Slot& slot = slots_[Index(key)];
+    slot.key = key;
+    slot.msg = std::move(msg);
+  }
+  void Clear() {
+    for (Slot& slot : slots_) {
+      slot = Slot();
+    }
+  }
+};
+
+}  // namespace util
+}  // namespace live
@@ -0,0 +1,259 @@
+#include "server/metrics.h"
+#include "server/net.h"
+#include "server/room.h"
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <vector>
+
+namespace live {
+namespace util {
+namespace metrics {
+
+namespace {
+
+using Totals = MetricsManager::Totals;
+
+// 连接及房间共用的指标，导出时分别加上 live_、live_room_、live_session_ 前缀
+struct Field {
+  const char* name;
+  const char* type;
+  const char* help;
+  uint64_t Totals::*member;
+};
+
+const Field FIELDS[] = {
+    {"bytes_in_total", "counter", "Bytes read from sockets.",
+     &Totals::bytes_in},
+    {"bytes_out_total", "counter", "Bytes handed to sockets for sending.",
+     &Totals::bytes_out},
+    {"messages_in_total", "counter", "Media messages received from publishers.",
+     &Totals::messages_in},
+    {"messages_out_total", "counter", "Media messages sent to viewers.",
+     &Totals::messages_out},
+    {"dropped_frames_total", "counter",
+     "Frames dropped because the viewer could not keep up.",
+     &Totals::dropped_frames},
+    {"send_buffer_bytes", "gauge", "Bytes buffered but not yet sent.",
+     &Totals::send_buffer_bytes},
+    {"send_queue_messages", "gauge", "Messages queued but not yet serialized.",
+     &Totals::send_queue_messages},
+};
+
+uint64_t NonNegative(const Gauge& g) {
+  return uint64_t(std::max<int64_t>(g.Get(), 0));
+}
+
+std::string Escape(const std::string& s) {
+  std::string out;
+  for (char c : s) {
+    if (c == '\\' || c == '"') {
+      out += '\\';
+      out += c;
+    } else if (c == '\n') {
+      out += "\\n";
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+void AppendHeader(std::ostringstream& oss, const std::string& name,
+                  const char* type, const char* help) {
+  oss << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' '
+      << type << '\n';
+}
+
+// Prometheus summary，分位数为启动以来的累计分布
+void AppendSummary(std::ostringstream& oss, const std::string& name,
+                   const std::string& labels,
+                   const Histogram::Snapshot& snapshot) {
+  static const struct {
+    const char* label;
+    double value;
+  } QUANTILES[] = {{"0.5", 0.5}, {"0.99", 0.99}, {"0.999", 0.999}};
+  const std::string sep = labels.empty() ? "" : labels + ",";
+  for (const auto& q : QUANTILES) {
+    oss << name << '{' << sep << "quantile=\"" << q.label << "\"} "
+        << snapshot.Percentile(q.value) << '\n';
+  }
+  const std::string suffix = labels.empty() ? "" : '{' + labels + '}';
+  oss << name << "_sum" << suffix << ' ' << snapshot.sum << '\n';
+  oss << name << "_count" << suffix << ' ' << snapshot.count << '\n';
+}
+
+}  // namespace
+
+void MetricsManager::Totals::Add(const SessionMetrics& m) {
+  bytes_in += m.bytes_in.Get();
+  bytes_out += m.bytes_out.Get();
+  messages_in += m.messages_in.Get();
+  messages_out += m.messages_out.Get();
+  dropped_frames += m.dropped_frames.Get();
+  send_buffer_bytes += NonNegative(m.send_buffer_bytes);
+  send_queue_messages += NonNegative(m.send_queue_messages);
+}
+
+void MetricsManager::Totals::Add(const Totals& t) {
+  for (const Field& f : FIELDS) {
+    this->*f.member += t.*f.member;
+  }
+}
+
+void MetricsManager::AddSession(SessionMetrics* m) {
+  std::lock_guard<std::mutex> g(mutex_);
+  sessions_.insert(m);
+  total_sessions_++;
+}
+
+void MetricsManager::RemoveSession(SessionMetrics* m) {
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!sessions_.erase(m)) {
+    return;
+  }
+  Totals t;
+  t.Add(*m);
+  t.send_buffer_bytes = 0;
+  t.send_queue_messages = 0;
+  retired_.Add(t);
+  const int32_t room_id = m->room_id.load(std::memory_order_relaxed);
+  if (room_id >= 0) {
+    retired_rooms_[room_id].Add(t);
+  }
+}
+
+std::string MetricsManager::Export() {
+  struct Row {
+    std::string labels;
+    Totals totals;
+  };
+  Totals all;
+  std::map<int32_t, Totals> rooms;
+  std::vector<Row> rows;
+  size_t sessions = 0;
+  uint64_t total_sessions = 0;
+  {
+    // 只在锁内读取计数，格式化在锁外进行
+    std::lock_guard<std::mutex> g(mutex_);
+    all = retired_;
+    for (const auto& pr : retired_rooms_) {
+      rooms[pr.first] = pr.second;
+    }
+    for (SessionMetrics* m : sessions_) {
+      Totals t;
+      t.Add(*m);
+      all.Add(t);
+      const int32_t room_id = m->room_id.load(std::memory_order_relaxed);
+      if (room_id < 0) {
+        continue;
+      }
+      rooms[room_id].Add(t);
+      std::ostringstream labels;
+      labels << "id=\"" << m->id << "\",protocol=\"" << m->protocol
+             << "\",peer=\"" << Escape(m->peer) << "\",room=\"" << room_id
+             << "\",role=\""
+             << (m->publisher.load(std::memory_order_relaxed) ? "publisher"
+                                                              : "viewer")
+             << '"';
+      rows.push_back({labels.str(), t});
+    }
+    sessions = sessions_.size();
+    total_sessions = total_sessions_;
+  }
+
+  std::ostringstream oss;
+  AppendHeader(oss, "live_sessions", "gauge", "Open connections.");
+  oss << "live_sessions " << sessions << '\n';
+  AppendHeader(oss, "live_sessions_total", "counter",
+               "Connections accepted or initiated.");
+  oss << "live_sessions_total " << total_sessions << '\n';
+  for (const Field& f : FIELDS) {
+    const std::string name = std::string("live_") + f.name;
+    AppendHeader(oss, name, f.type, f.help);
+    oss << name << ' ' << all.*f.member << '\n';
+  }
+
+  auto& group = EventLoopGroup::GetInstance();
+  AppendHeader(oss, "live_event_loop_lag_microseconds", "gauge",
+               "Latest scheduling delay of each event loop.");
+  for (size_t i = 0; i < group.Size(); i++) {
+    oss << "live_event_loop_lag_microseconds{loop=\"" << i << "\"} "
+        << group.GetLoop(i)->GetLagUs() << '\n';
+  }
+  AppendHeader(oss, "live_event_loop_iteration_microseconds", "summary",
+               "Time each event loop iteration spends handling events.");
+  for (size_t i = 0; i < group.Size(); i++) {
+    Histogram::Snapshot snapshot;
+    snapshot.Add(group.GetLoop(i)->GetMetrics().iteration_us);
+    AppendSummary(oss, "live_event_loop_iteration_microseconds",
+                  "loop=\"" + std::to_string(i) + '"', snapshot);
+  }
+  // 以下两项合并所有 EventLoop 的记录
+  Histogram::Snapshot fanout;
+  Histogram::Snapshot send;
+  for (size_t i = 0; i < group.Size(); i++) {
+    fanout.Add(group.GetLoop(i)->GetMetrics().fanout_us);
+    send.Add(group.GetLoop(i)->GetMetrics().send_us);
+  }
+  AppendHeader(oss, "live_fanout_latency_microseconds", "summary",
+               "Time from reading a media message to handing it to the "
+               "viewers of the last event loop.");
+  AppendSummary(oss, "live_fanout_latency_microseconds", "", fanout);
+  AppendHeader(oss, "live_send_latency_microseconds", "summary",
+               "Time from handing a message to a viewer to writing its last "
+               "byte to the socket.");
+  AppendSummary(oss, "live_send_latency_microseconds", "", send);
+
+  // 房间的统计由主播线程及房间副本更新，连接部分为房间内所有连接之和
+  auto& rm = RoomManager::GetInstance();
+  struct RoomField {
+    const char* name;
+    const char* type;
+    const char* help;
+    uint64_t (*get)(const RoomMetrics&);
+  };
+  static const RoomField ROOM_FIELDS[] = {
+      {"live_room_ingest_bytes_total", "counter",
+       "Media payload bytes published into the room.",
+       [](const RoomMetrics& r) { return r.ingest_bytes.Get(); }},
+      {"live_room_ingest_messages_total", "counter",
+       "Media messages published into the room.",
+       [](const RoomMetrics& r) { return r.ingest_messages.Get(); }},
+      {"live_room_gop_cache_bytes", "gauge",
+       "Video bytes of the cached GOP sent to joining viewers.",
+       [](const RoomMetrics& r) { return NonNegative(r.gop_cache_bytes); }},
+      {"live_room_viewers", "gauge", "Viewers in the room.",
+       [](const RoomMetrics& r) { return NonNegative(r.viewers); }},
+  };
+  for (const RoomField& f : ROOM_FIELDS) {
+    AppendHeader(oss, f.name, f.type, f.help);
+    for (int32_t id = 0; id < rm.Capacity(); id++) {
+      oss << f.name << "{room=\"" << id << "\"} "
+          << f.get(*rm.GetRoomMetrics(id)) << '\n';
+    }
+  }
+  for (const Field& f : FIELDS) {
+    const std::string name = std::string("live_room_") + f.name;
+    AppendHeader(oss, name, f.type, f.help);
+    for (const auto& pr : rooms) {
+      oss << name << "{room=\"" << pr.first << "\"} "
+          << pr.second.*f.member << '\n';
+    }
+  }
+
+  for (const Field& f : FIELDS) {
+    const std::string name = std::string("live_session_") + f.name;
+    AppendHeader(oss, name, f.type, f.help);
+    for (const Row& row : rows) {
+      oss << name << '{' << row.labels << "} " << row.totals.*f.member
+          << '\n';
+    }
+  }
+  return oss.str();
+}
+
+}  // namespace metrics
+}  // namespace util
+}  // namespace live
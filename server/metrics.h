@@ -0,0 +1,112 @@
+#pragma once
+
+#include "util/metrics.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace live {
+namespace util {
+namespace metrics {
+
+// 单个连接的统计，计数器只由连接所属 EventLoop 的线程更新
+struct SessionMetrics : public CacheLineAligned {
+  // 登记后不再修改
+  uint64_t id = 0;
+  const char* protocol = "";
+  std::string peer;
+
+  // 所在房间，-1 表示不在任何房间
+  std::atomic<int32_t> room_id{-1};
+  std::atomic<bool> publisher{false};
+
+  Counter bytes_in;
+  Counter bytes_out;
+  Counter messages_in;
+  Counter messages_out;
+  // 因发送不及时而丢弃的音视频帧
+  Counter dropped_frames;
+  // 已交给 bufferevent 但尚未发出的字节数
+  Gauge send_buffer_bytes;
+  // 尚未序列化的排队消息数，只有 RTMP 观众会排队
+  Gauge send_queue_messages;
+
+  void SetRoom(int32_t room, bool is_publisher) {
+    publisher.store(is_publisher, std::memory_order_relaxed);
+    room_id.store(room, std::memory_order_relaxed);
+  }
+};
+
+// 房间的统计，与房间的生命周期无关，同一 room id 的房间重新创建后继续累计
+struct RoomMetrics : public CacheLineAligned {
+  // 以下两个只由主播所在线程更新
+  Counter ingest_bytes;
+  Counter ingest_messages;
+  // 缓存的最近一个 GOP 的视频字节数，由房间在第 0 个 EventLoop 上的副本更新
+  Gauge gop_cache_bytes;
+  // 各 EventLoop 上的房间副本在观众进出时更新
+  Gauge viewers;
+};
+
+// 单个 EventLoop 的延迟分布，单位 us，只由该 EventLoop 的线程记录
+struct LoopMetrics : public CacheLineAligned {
+  // 每轮事件循环处理就绪事件所用的时间，不含等待
+  Histogram iteration_us;
+  // 消息从收到到房间的最后一个 EventLoop 分发给自己的观众，
+  // 由最后完成的 EventLoop 记录
+  Histogram fanout_us;
+  // 消息交给观众到其最后一个字节写入 socket
+  Histogram send_us;
+};
+
+// 汇总所有连接的统计，以 Prometheus 文本格式导出。
+// 更新计数器不加锁；锁只在连接建立、关闭及导出时使用。
+// 连接关闭时其计数累加到所在房间及全局的历史值中，导出的计数单调递增
+class MetricsManager {
+ public:
+  // 若干连接的计数之和
+  struct Totals {
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t messages_in = 0;
+    uint64_t messages_out = 0;
+    uint64_t dropped_frames = 0;
+    uint64_t send_buffer_bytes = 0;
+    uint64_t send_queue_messages = 0;
+
+    void Add(const SessionMetrics& m);
+    void Add(const Totals& t);
+  };
+
+ private:
+  std::mutex mutex_;
+  std::unordered_set<SessionMetrics*> sessions_;
+  uint64_t total_sessions_ = 0;
+  // 已关闭的连接的计数，不含 send_buffer_bytes 等当前值
+  Totals retired_;
+  std::unordered_map<int32_t, Totals> retired_rooms_;
+
+  MetricsManager() = default;
+  MetricsManager(const MetricsManager&) = delete;
+  MetricsManager& operator=(const MetricsManager&) = delete;
+
+ public:
+  // 不析构，进程退出时 EventLoop 析构 Session 仍会用到
+  static MetricsManager& GetInstance() {
+    static MetricsManager* mm = new MetricsManager();
+    return *mm;
+  }
+
+  // 以下函数线程安全。m 在 RemoveSession 之前须保持有效
+  void AddSession(SessionMetrics* m);
+  void RemoveSession(SessionMetrics* m);
+
+  // 只为进入了房间的连接导出单独的时间序列，HLS 等短连接只计入全局统计
+  std::string Export();
+};
+
+}  // namespace metrics
+}  // namespace util
+}  // namespace live
@@ -1,47 +1,226 @@
 #include "server/net.h"
+#include "server/admission.h"
+#include "util/trace.h"
 #include "util/util.h"
 
+#include <algorithm>
+
+#include <event2/thread.h>
+
 namespace live {
 namespace util {
 
-void Listener::ListenCallabck(evconnlistener*, evutil_socket_t fd,
-                              sockaddr* addr, int len, void* ptr) {
-  Listener* listener = reinterpret_cast<Listener*>(ptr);
+static thread_local EventLoop* current_event_loop = nullptr;
+static std::atomic<uint64_t> next_session_id{1};
+
+EventLoop::EventLoop(int32_t index) : index_(index) {
+  event_base_.reset(event_base_new());
+  if (event_base_.get() == nullptr) {
+    throw std::string("event_base_new failed");
+  }
+  notify_event_.reset(
+      event_new(event_base_.get(), -1, 0, NotifyCallback, this));
+  if (notify_event_.get() == nullptr) {
+    throw std::string("event_new failed");
+  }
+  lag_timer_.reset(
+      event_new(event_base_.get(), -1, 0, LagTimerCallback, this));
+  if (lag_timer_.get() == nullptr) {
+    throw std::string("event_new failed");
+  }
+}
+
+EventLoop::~EventLoop() {
+  // Session 析构时会释放 bufferevent，须先于 event_base 释放
+  sessions_.clear();
+  notify_event_.reset();
+  lag_timer_.reset();
+}
+
+EventLoop* EventLoop::Current() {
+  return current_event_loop;
+}
+
+void EventLoop::RunInLoop(Task&& task) {
+  tasks_.Put(std::move(task));
+  if (!notified_.exchange(true, std::memory_order_acq_rel)) {
+    event_active(notify_event_.get(), EV_READ, 0);
+  }
+}
+
+void Session::OutputCallback(evbuffer*, const evbuffer_cb_info* info,
+                             void* ptr) {
+  Session* session = reinterpret_cast<Session*>(ptr);
+  if (info->n_deleted == 0) {
+    return;
+  }
+  session->bytes_drained_ += info->n_deleted;
+  auto& marks = session->send_marks_;
+  if (marks.empty() || marks.front().end > session->bytes_drained_) {
+    return;
+  }
+  const uint64_t now = GetPassedTimeSinceStartedInMicroSeconds();
+  metrics::Histogram& h = session->event_loop_->GetMetrics().send_us;
+  while (!marks.empty() && marks.front().end <= session->bytes_drained_) {
+    const uint64_t enqueue_us = marks.front().enqueue_us;
+    h.Record(now > enqueue_us ? now - enqueue_us : 0);
+    marks.pop_front();
+  }
+}
+
+void EventLoop::NotifyCallback(evutil_socket_t, short, void* ptr) {
+  EventLoop* loop = reinterpret_cast<EventLoop*>(ptr);
+  loop->BeginWork();
+  // 先清除标记再取任务，保证之后投递的任务一定能再次唤醒
+  loop->notified_.store(false, std::memory_order_release);
+  Task task;
+  while (loop->tasks_.TryToGet(&task)) {
+    task();
+  }
+}
+
+void EventLoop::StartLagTimer() {
+  timeval tv = {0, LAG_CHECK_INTERVAL_US};
+  lag_timer_expected_us_ =
+      GetPassedTimeSinceStartedInMicroSeconds() + LAG_CHECK_INTERVAL_US;
+  event_add(lag_timer_.get(), &tv);
+}
 
-  std::unique_ptr<Session> session = listener->create_session_();
+void EventLoop::LagTimerCallback(evutil_socket_t, short, void* ptr) {
+  EventLoop* loop = reinterpret_cast<EventLoop*>(ptr);
+  loop->BeginWork();
+  uint64_t now = GetPassedTimeSinceStartedInMicroSeconds();
+  uint64_t expected = loop->lag_timer_expected_us_;
+  uint64_t lag = now > expected ? now - expected : 0;
+  loop->lag_us_.store(uint32_t(std::min<uint64_t>(lag, UINT32_MAX)),
+                      std::memory_order_relaxed);
+  // 借第 0 个 EventLoop 的定时器采样 CPU 使用率，准入时只读取最近的结果
+  if (loop->index_ == 0) {
+    AdmissionController::GetInstance().SampleCpuUsage();
+  }
+  loop->StartLagTimer();
+}
 
+void EventLoop::Loop() {
+  current_event_loop = this;
+  trace::SetThreadName("event loop " + std::to_string(index_));
+  StartLagTimer();
+  // 每次只处理一轮就绪事件，以便统计每轮的耗时
+  event_base* base = event_base_.get();
+  while (!event_base_got_exit(base) && !event_base_got_break(base)) {
+    work_start_us_ = 0;
+    if (event_base_loop(base, EVLOOP_ONCE | EVLOOP_NO_EXIT_ON_EMPTY) < 0) {
+      LOG_ERROR << "event_base_loop failed, index: " << index_;
+      break;
+    }
+    if (work_start_us_) {
+      metrics_->iteration_us.Record(GetPassedTimeSinceStartedInMicroSeconds() -
+                                    work_start_us_);
+    }
+  }
+  current_event_loop = nullptr;
+}
+
+void EventLoop::AddSession(evutil_socket_t fd, std::unique_ptr<Session> session,
+                           const std::string& peer_address) {
   if (session.get() == nullptr) {
     LOG_ERROR << "error create session";
+    evutil_closesocket(fd);
     return;
   }
 
-  struct bufferevent* bev = bufferevent_socket_new(listener->event_base_.get(),
-                                                   fd, BEV_OPT_CLOSE_ON_FREE);
+  struct bufferevent* bev =
+      bufferevent_socket_new(event_base_.get(), fd, BEV_OPT_CLOSE_ON_FREE);
   if (!bev) {
     LOG_ERROR << "error constructing bufferevent";
+    evutil_closesocket(fd);
     return;
   }
 
+  session->SetPeerAddress(peer_address);
+  AttachSession(bev, std::move(session));
+}
+
+uint64_t EventLoop::Connect(const std::string& address,
+                            std::unique_ptr<Session> session) {
+  if (session.get() == nullptr) {
+    LOG_ERROR << "error create session";
+    return 0;
+  }
+
+  sockaddr_storage addr;
+  int len = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  if (evutil_parse_sockaddr_port(address.c_str(),
+                                 reinterpret_cast<sockaddr*>(&addr), &len)) {
+    LOG_ERROR << "invalid address " << address;
+    return 0;
+  }
+
+  struct bufferevent* bev =
+      bufferevent_socket_new(event_base_.get(), -1, BEV_OPT_CLOSE_ON_FREE);
+  if (!bev) {
+    LOG_ERROR << "error constructing bufferevent";
+    return 0;
+  }
+
+  session->SetPeerAddress(address);
+  Session* s = session.get();
+  if (!AttachSession(bev, std::move(session))) {
+    return 0;
+  }
+  uint64_t id = s->GetId();
+  if (bufferevent_socket_connect(bev, reinterpret_cast<sockaddr*>(&addr),
+                                 len)) {
+    LOG_ERROR << "connect " << address << " failed";
+    // 连接未能发起，Session 还未开始工作，不触发 OnClose
+    session_ids_.erase(id);
+    sessions_.erase(bev);
+    return 0;
+  }
+  return id;
+}
+
+bool EventLoop::AttachSession(bufferevent* bev,
+                              std::unique_ptr<Session> session) {
   void* key = reinterpret_cast<void*>(bev);
 
   session->SetBufferEvent(bev);
-  if (!listener->sessions_.insert({key, std::move(session)}).second) {
+  session->SetEventLoop(this);
+  session->SetId(next_session_id.fetch_add(1));
+  Session* s = session.get();
+  metrics::SessionMetrics& m = s->GetMetrics();
+  m.id = s->GetId();
+  m.protocol = s->GetProtocol();
+  m.peer = s->GetPeerAddress();
+  metrics::MetricsManager::GetInstance().AddSession(&m);
+  if (!sessions_.insert({key, std::move(session)}).second) {
     LOG_ERROR << "fatal error, duplicate key in sessions_, " << key;
-    listener->CloseSession(bev);
-    return;
+    CloseSession(bev);
+    return false;
   }
+  session_ids_[s->GetId()] = s;
 
-  bufferevent_setcb(bev, ReadCallback, WriteCallback, EventCallback, ptr);
+  bufferevent_setcb(bev, ReadCallback, WriteCallback, EventCallback, this);
   bufferevent_enable(bev, EV_WRITE | EV_READ);
+  return true;
 }
 
-void Listener::ReadCallback(bufferevent* bev, void* ptr) {
-  Listener* listener = reinterpret_cast<Listener*>(ptr);
+void EventLoop::CloseSession(uint64_t id) {
+  Session* session = FindSession(id);
+  if (session) {
+    CloseSession(session->GetBufferEvent());
+  }
+}
+
+void EventLoop::ReadCallback(bufferevent* bev, void* ptr) {
+  EventLoop* loop = reinterpret_cast<EventLoop*>(ptr);
+  loop->BeginWork();
 
-  auto& session = listener->GetSession(bev);
+  auto& session = loop->GetSession(bev);
   if (!session) {
     LOG_ERROR << "not found corresponding session";
-    listener->CloseSession(bev);
+    loop->CloseSession(bev);
     return;
   }
 
@@ -49,6 +228,7 @@ void Listener::ReadCallback(bufferevent* bev, void* ptr) {
   int cnt = evbuffer_get_length(input);
 
   std::vector<uint8_t>& bytes = session->ReadDataBuffer();
+  const size_t buffered = bytes.size();
 
   while (cnt > 0) {
     int now = bytes.size();
@@ -60,6 +240,7 @@ void Listener::ReadCallback(bufferevent* bev, void* ptr) {
     }
     cnt = evbuffer_get_length(input);
   }
+  session->GetMetrics().bytes_in.Add(bytes.size() - buffered);
 
   // LOG_ERROR << "read data buffer size is " << bytes.size();
 
@@ -67,18 +248,51 @@ void Listener::ReadCallback(bufferevent* bev, void* ptr) {
        pre != cur && cur;) {
     if (!session->OnRead() || session->IsNeedClose()) {
       LOG_ERROR << "OnRead failed";
-      listener->CloseSession(bev);
+      loop->CloseSession(bev);
       return;
     }
     pre = cur;
     cur = session->ReadDataBuffer().size();
   }
+  session->OnReadDone();
   // LOG_ERROR << "after readed data buffer size is " << bytes.size();
 }
 
-void Listener::WriteCallback(bufferevent* bev, void* data) {}
+void EventLoop::WriteCallback(bufferevent* bev, void* ptr) {
+  EventLoop* loop = reinterpret_cast<EventLoop*>(ptr);
+  loop->BeginWork();
+
+  auto& session = loop->GetSession(bev);
+  if (!session) {
+    return;
+  }
+  session->UpdateSendBufferMetrics();
+  if (session->IsCloseAfterWrite() && session->GetOutputBufferSize() == 0) {
+    loop->CloseSession(bev);
+    return;
+  }
+  if (!session->OnWrite() || session->IsNeedClose()) {
+    LOG_ERROR << "OnWrite failed";
+    loop->CloseSession(bev);
+  }
+}
+
+void EventLoop::EventCallback(bufferevent* bev, short events, void* ptr) {
+  EventLoop* loop = reinterpret_cast<EventLoop*>(ptr);
+  loop->BeginWork();
+  if (events == BEV_EVENT_CONNECTED) {
+    auto& session = loop->GetSession(bev);
+    if (!session) {
+      return;
+    }
+    if (session->OnConnected() && !session->IsNeedClose()) {
+      return;
+    }
+    LOG_ERROR << "OnConnected failed";
+    loop->CloseSession(bev);
+    return;
+  }
 
-void Listener::EventCallback(bufferevent* bev, short events, void* ptr) {
   static std::vector<std::pair<int, std::function<void()>>> handlers = {
       std::make_pair(BEV_EVENT_READING,
                      []() {
@@ -116,7 +330,58 @@ void Listener::EventCallback(bufferevent* bev, short events, void* ptr) {
     }
   }
 
-  reinterpret_cast<Listener*>(ptr)->CloseSession(bev);
+  loop->CloseSession(bev);
+}
+
+void EventLoopGroup::Init(int32_t count) {
+  if (!loops_.empty()) {
+    LOG_ERROR << "EventLoopGroup is already initialized";
+    return;
+  }
+  if (count <= 0) {
+    count = std::max(1u, std::thread::hardware_concurrency());
+  }
+  // 跨线程 event_active 依赖 libevent 的线程支持
+  if (evthread_use_pthreads()) {
+    throw std::string("evthread_use_pthreads failed");
+  }
+  for (int32_t i = 0; i < count; i++) {
+    loops_.emplace_back(new EventLoop(i));
+  }
+  LOG_ERROR << "event loop count: " << count;
+}
+
+void EventLoopGroup::Run() {
+  if (loops_.empty()) {
+    throw std::string("EventLoopGroup is not initialized");
+  }
+  for (size_t i = 1; i < loops_.size(); i++) {
+    EventLoop* loop = loops_[i].get();
+    threads_.emplace_back([loop]() { loop->Loop(); });
+  }
+  loops_[0]->Loop();
+  for (auto& t : threads_) {
+    t.join();
+  }
+}
+
+void Listener::ListenCallabck(evconnlistener*, evutil_socket_t fd,
+                              sockaddr* addr, int len, void* ptr) {
+  EventLoop::Current()->BeginWork();
+  Listener* listener = reinterpret_cast<Listener*>(ptr);
+
+  char ip[INET_ADDRSTRLEN] = {0};
+  if (addr && addr->sa_family == AF_INET) {
+    evutil_inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in*>(addr)->sin_addr,
+                     ip, sizeof(ip));
+  }
+  std::string peer_address(ip);
+
+  // Session 在目标 EventLoop 的线程中创建，之后只会在该线程中被访问
+  EventLoop* loop = EventLoopGroup::GetInstance().NextLoop();
+  loop->RunInLoop([listener, loop, fd, peer_address]() {
+    loop->AddSession(fd, listener->create_session_(), peer_address);
+  });
 }
 
 }  // namespace util
@@ -1,10 +1,16 @@
 #pragma once
 
+#include "server/metrics.h"
+#include "util/queue.h"
 #include "util/util.h"
 
+#include <atomic>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <string>
+#include <thread>
 #include <unordered_map>
 
 #include <event2/buffer.h>
@@ -15,32 +21,74 @@
 namespace live {
 namespace util {
 
+class EventLoop;
+
 class Session {
  public:
   enum FLAG {
     NEED_CLOSE = 0x01,
+    // 输出缓冲区中的数据全部发出后关闭
+    CLOSE_AFTER_WRITE = 0x02,
   };
 
  private:
   uint32_t flag_ = 0;
+  // 进程内唯一，跨线程投递任务时用来代替 Session*，避免访问已销毁的 Session
+  uint64_t id_ = 0;
   std::vector<uint8_t> read_data_buffer_;
   std::vector<uint8_t> write_data_buffer_;
 
   bufferevent* be_ = nullptr;
+  EventLoop* event_loop_ = nullptr;
+  // 对端 IP
+  std::string peer_address_;
+  // 由 EventLoop 登记到 MetricsManager，析构时注销
+  std::unique_ptr<metrics::SessionMetrics> metrics_{
+      new metrics::SessionMetrics()};
+
+  // 发送延迟的统计：消息最后一个字节在输出字节流中的位置及交给本连接的时间
+  struct SendMark {
+    uint64_t end;
+    uint64_t enqueue_us;
+  };
+  std::deque<SendMark> send_marks_;
+  // 已交给 bufferevent 及已写入 socket 的字节数
+  uint64_t bytes_written_ = 0;
+  uint64_t bytes_drained_ = 0;
+  evbuffer_cb_entry* output_cb_ = nullptr;
+
+  // 输出缓冲区中的数据写入 socket 后调用
+  static void OutputCallback(evbuffer* buffer, const evbuffer_cb_info* info,
+                             void* ptr);
 
  public:
   bool IsNeedClose() {
     return flag_ & FLAG::NEED_CLOSE;
   }
+  bool IsCloseAfterWrite() {
+    return flag_ & FLAG::CLOSE_AFTER_WRITE;
+  }
   void SetFlag(FLAG f) {
     flag_ |= f;
   }
   virtual bool OnRead() {
     return true;
   }
+  // 主动发起的连接建立成功后调用
+  virtual bool OnConnected() {
+    return true;
+  }
+  // 本轮可读事件中的数据均已交给 OnRead 处理后调用，用于批量提交本轮产生的数据
+  virtual void OnReadDone() {}
   virtual void OnClose() {}
 
-  bool OnWrite() {
+  // 统计中的协议名
+  virtual const char* GetProtocol() const {
+    return "tcp";
+  }
+
+  // 输出缓冲区中的数据降到写水位以下时调用
+  virtual bool OnWrite() {
     return Write();
   }
 
@@ -53,6 +101,58 @@ class Session {
 
   void SetBufferEvent(bufferevent* be) {
     be_ = be;
+    output_cb_ = evbuffer_add_cb(bufferevent_get_output(be_), OutputCallback,
+                                 this);
+  }
+  bufferevent* GetBufferEvent() {
+    return be_;
+  }
+
+  void SetId(uint64_t id) {
+    id_ = id;
+  }
+  uint64_t GetId() const {
+    return id_;
+  }
+
+  void SetEventLoop(EventLoop* loop) {
+    event_loop_ = loop;
+  }
+  // Session 只会在所属 EventLoop 的线程中被访问
+  EventLoop* GetEventLoop() {
+    return event_loop_;
+  }
+
+  void SetPeerAddress(const std::string& address) {
+    peer_address_ = address;
+  }
+  const std::string& GetPeerAddress() const {
+    return peer_address_;
+  }
+
+  metrics::SessionMetrics& GetMetrics() {
+    return *metrics_;
+  }
+
+  // 已交给 bufferevent 但尚未发送到网络的字节数
+  size_t GetOutputBufferSize() {
+    return evbuffer_get_length(bufferevent_get_output(be_));
+  }
+
+  void UpdateSendBufferMetrics() {
+    metrics_->send_buffer_bytes.Set(int64_t(GetOutputBufferSize()));
+  }
+
+  // 一条消息已全部写入 WriteDataBuffer 或输出缓冲区后调用，其最后一个字节
+  // 写入 socket 时记录发送延迟。enqueue_us 为消息交给本连接的时间
+  void MarkMessageSent(uint64_t enqueue_us) {
+    send_marks_.push_back(
+        {bytes_written_ + write_data_buffer_.size(), enqueue_us});
+  }
+
+  // 输出缓冲区中的数据降到 low 字节及以下时触发 OnWrite
+  void SetWriteWatermark(size_t low) {
+    bufferevent_setwatermark(be_, EV_WRITE, low, 0);
   }
 
   bool Write() {
@@ -63,85 +163,167 @@ class Session {
                           write_data_buffer_.size())) {
       return false;
     }
+    bytes_written_ += write_data_buffer_.size();
+    metrics_->bytes_out.Add(write_data_buffer_.size());
+    UpdateSendBufferMetrics();
     write_data_buffer_.resize(0);
     return true;
   }
 
+  // 将 data 以引用的方式追加至输出缓冲区，不做拷贝，holder 保证 data 在发出前有效。
+  // WriteDataBuffer 中已有的数据先写出。
+  bool WriteReference(const void* data, size_t len,
+                      std::shared_ptr<const void> holder) {
+    if (!Write()) {
+      return false;
+    }
+    auto* h = new std::shared_ptr<const void>(std::move(holder));
+    if (evbuffer_add_reference(
+            bufferevent_get_output(be_), data, len,
+            [](const void*, size_t, void* ptr) {
+              delete reinterpret_cast<std::shared_ptr<const void>*>(ptr);
+            },
+            h)) {
+      delete h;
+      return false;
+    }
+    bytes_written_ += len;
+    metrics_->bytes_out.Add(len);
+    UpdateSendBufferMetrics();
+    return true;
+  }
+
   virtual ~Session() {
+    metrics::MetricsManager::GetInstance().RemoveSession(metrics_.get());
+    if (output_cb_) {
+      evbuffer_remove_cb_entry(bufferevent_get_output(be_), output_cb_);
+    }
     bufferevent_free(be_);
   }
 };
 
-class Listener {
-  static void ListenCallabck(evconnlistener* listener, evutil_socket_t fd,
-                             sockaddr* addr, int len, void* ptr);
+// 每个 EventLoop 独占一个线程及一个 event_base，其上的 Session 只在该线程中处理。
+// 其他线程通过 RunInLoop 向其投递任务。
+class EventLoop {
+ public:
+  using Task = std::function<void()>;
 
-  static void ReadCallback(bufferevent* bev, void* ptr);
+  EventLoop(int32_t index);
+  ~EventLoop();
 
-  static void WriteCallback(bufferevent* bev, void* ptr);
+  int32_t Index() const {
+    return index_;
+  }
 
-  static void EventCallback(bufferevent* bev, short events, void* ptr);
+  event_base* GetEventBase() {
+    return event_base_.get();
+  }
 
- public:
-  using CreateSessionFunc = std::function<std::unique_ptr<Session>()>;
+  bool IsInLoopThread() const {
+    return Current() == this;
+  }
 
-  Listener(int32_t port, CreateSessionFunc cs)
-      : port_(port), create_session_(std::move(cs)) {
-    if (!create_session_) {
-      throw std::string("CreateSessionFunc is not callable");
-    }
-    struct sockaddr_in server;
-    memset(&server, 0, sizeof(server));
-    server.sin_family = AF_INET;
-    server.sin_port = htons(port_);
-    server.sin_addr.s_addr = htonl(INADDR_ANY);
+  // 线程安全，task 会在本 EventLoop 的线程中按投递顺序执行
+  void RunInLoop(Task&& task);
 
-    event_base_.reset(event_base_new());
+  // 接管 fd，只能在本 EventLoop 的线程中调用
+  void AddSession(evutil_socket_t fd, std::unique_ptr<Session> session,
+                  const std::string& peer_address);
 
-    if (event_base_.get() == nullptr) {
-      throw std::string("event_base_new failed");
-    }
+  // 以非阻塞方式连接 address（形如 127.0.0.1:9527），连接建立后触发
+  // session->OnConnected，只能在本 EventLoop 的线程中调用。
+  // @return 失败返回 0，否则返回 session id
+  uint64_t Connect(const std::string& address, std::unique_ptr<Session> session);
 
-    ev_conn_listener_.reset(
-        evconnlistener_new_bind(event_base_.get(), ListenCallabck, this,
-                                LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
-                                (struct sockaddr*)&server, sizeof(server)));
+  // 以下两个函数只能在本 EventLoop 的线程中调用。
+  // @return Session 已关闭时返回 nullptr
+  Session* FindSession(uint64_t id) {
+    auto it = session_ids_.find(id);
+    return it == session_ids_.end() ? nullptr : it->second;
+  }
+  // 关闭 Session，会触发其 OnClose
+  void CloseSession(uint64_t id);
 
-    if (event_base_.get() == nullptr) {
-      throw std::string("evconnlistener_new_bind failed");
-    }
+  // 最近一次检测到的事件循环调度延迟，单位 us，可在任意线程读取。
+  // 延迟越大，说明该线程越忙，其上的 Session 越不能及时得到处理。
+  uint32_t GetLagUs() const {
+    return lag_us_.load(std::memory_order_relaxed);
   }
 
-  void Listen() {
-    event_base_dispatch(event_base_.get());
+  // 只能在本 EventLoop 的线程中记录
+  metrics::LoopMetrics& GetMetrics() {
+    return *metrics_;
   }
 
+  // 挂在 event_base 上的每个事件回调都须在开始时调用，
+  // 本轮第一个回调开始到本轮结束即为本轮的耗时
+  void BeginWork() {
+    if (!work_start_us_) {
+      work_start_us_ = GetPassedTimeSinceStartedInMicroSeconds();
+    }
+  }
+
+  // 在当前线程运行事件循环，直到 event_base 退出
+  void Loop();
+
+  // 返回当前线程所运行的 EventLoop，非 EventLoop 线程返回 nullptr
+  static EventLoop* Current();
+
  private:
+  static void NotifyCallback(evutil_socket_t fd, short events, void* ptr);
+
+  static void LagTimerCallback(evutil_socket_t fd, short events, void* ptr);
+  void StartLagTimer();
+
+  static void ReadCallback(bufferevent* bev, void* ptr);
+
+  static void WriteCallback(bufferevent* bev, void* ptr);
+
+  static void EventCallback(bufferevent* bev, short events, void* ptr);
+
+  // 为 session 设置 bufferevent 并登记
+  bool AttachSession(bufferevent* bev, std::unique_ptr<Session> session);
+
   struct event_base_deleter {
     void operator()(event_base* ptr) {
       event_base_free(ptr);
     }
   };
-  struct evconnlistener_deleter {
-    void operator()(evconnlistener* ptr) {
-      evconnlistener_free(ptr);
+  struct event_deleter {
+    void operator()(event* ptr) {
+      event_free(ptr);
     }
   };
 
-  int32_t port_ = 0;
+  int32_t index_ = 0;
   std::unique_ptr<event_base, event_base_deleter> event_base_;
-  std::unique_ptr<evconnlistener, evconnlistener_deleter> ev_conn_listener_;
+  std::unique_ptr<event, event_deleter> notify_event_;
 
-  // fd 到 Session* 的映射
-  std::unordered_map<void*, std::unique_ptr<Session>> sessions_;
+  // 每隔 LAG_CHECK_INTERVAL_US 检测一次定时器实际触发时间与预期的差值
+  static const uint32_t LAG_CHECK_INTERVAL_US = 100000;
+  std::unique_ptr<event, event_deleter> lag_timer_;
+  uint64_t lag_timer_expected_us_ = 0;
+  std::atomic<uint32_t> lag_us_{0};
 
-  CreateSessionFunc create_session_;
+  std::unique_ptr<metrics::LoopMetrics> metrics_{new metrics::LoopMetrics()};
+  // 本轮第一个回调开始的时间，为 0 表示本轮还没有处理事件
+  uint64_t work_start_us_ = 0;
+
+  LockFreeQueue<Task> tasks_;
+  // 合并多次唤醒，避免每个任务都触发一次 event_active
+  std::atomic<bool> notified_{false};
+
+  // bufferevent* 到 Session* 的映射
+  std::unordered_map<void*, std::unique_ptr<Session>> sessions_;
+  // session id 到 Session* 的映射
+  std::unordered_map<uint64_t, Session*> session_ids_;
 
   // 关闭 bufferevent
   void CloseSession(bufferevent* bev) {
     auto it = sessions_.find(bev);
     if (it != sessions_.end()) {
       it->second->OnClose();
+      session_ids_.erase(it->second->GetId());
       sessions_.erase(bev);
     }
   }
@@ -156,5 +338,93 @@ class Listener {
   }
 };
 
+class EventLoopGroup {
+  EventLoopGroup() = default;
+  EventLoopGroup(const EventLoopGroup&) = delete;
+  EventLoopGroup& operator=(const EventLoopGroup&) = delete;
+
+  std::vector<std::unique_ptr<EventLoop>> loops_;
+  std::vector<std::thread> threads_;
+  std::atomic<uint32_t> next_{0};
+
+ public:
+  static EventLoopGroup& GetInstance() {
+    static EventLoopGroup group;
+    return group;
+  }
+
+  // 创建 count 个 EventLoop，须在 Run 及其他任何网络操作之前调用
+  void Init(int32_t count);
+
+  size_t Size() const {
+    return loops_.size();
+  }
+
+  EventLoop* GetLoop(size_t index) {
+    return loops_[index].get();
+  }
+
+  // 轮询选择一个 EventLoop 承接新连接
+  EventLoop* NextLoop() {
+    return loops_[next_.fetch_add(1) % loops_.size()].get();
+  }
+
+  // 向所有 EventLoop 投递 task
+  void RunInAllLoops(const EventLoop::Task& task) {
+    for (auto& loop : loops_) {
+      EventLoop::Task t = task;
+      loop->RunInLoop(std::move(t));
+    }
+  }
+
+  // 第 0 个 EventLoop 运行在调用线程，其余各自启动一个线程
+  void Run();
+};
+
+class Listener {
+  static void ListenCallabck(evconnlistener* listener, evutil_socket_t fd,
+                             sockaddr* addr, int len, void* ptr);
+
+ public:
+  using CreateSessionFunc = std::function<std::unique_ptr<Session>()>;
+
+  // 监听 socket 挂在第 0 个 EventLoop 上，新连接轮询分发给各个 EventLoop
+  Listener(int32_t port, CreateSessionFunc cs)
+      : port_(port), create_session_(std::move(cs)) {
+    if (!create_session_) {
+      throw std::string("CreateSessionFunc is not callable");
+    }
+    if (EventLoopGroup::GetInstance().Size() == 0) {
+      throw std::string("EventLoopGroup is not initialized");
+    }
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port_);
+    server.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    ev_conn_listener_.reset(evconnlistener_new_bind(
+        EventLoopGroup::GetInstance().GetLoop(0)->GetEventBase(),
+        ListenCallabck, this, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
+        (struct sockaddr*)&server, sizeof(server)));
+
+    if (ev_conn_listener_.get() == nullptr) {
+      throw std::string("evconnlistener_new_bind failed");
+    }
+  }
+
+ private:
+  struct evconnlistener_deleter {
+    void operator()(evconnlistener* ptr) {
+      evconnlistener_free(ptr);
+    }
+  };
+
+  int32_t port_ = 0;
+  std::unique_ptr<evconnlistener, evconnlistener_deleter> ev_conn_listener_;
+
+  CreateSessionFunc create_session_;
+};
+
 }  // namespace util
 }  // namespace live
@@ -0,0 +1,188 @@
+#pragma once
+
+#include "server/args.h"
+#include "server/net.h"
+#include "server/room.h"
+#include "server/rtmp_client.h"
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace live {
+namespace util {
+
+// 边缘节点回源：观众播放本地不存在的房间时，向源站发起一个拉流连接，
+// 拉到的数据作为本地房间的主播数据分发，多个观众共享同一个回源连接。
+// 本地房间沿用源站的 room id，最后一个观众离开后断开回源连接并关闭房间。
+class RelayManager {
+  RelayManager() = default;
+  RelayManager(const RelayManager&) = delete;
+  RelayManager& operator=(const RelayManager&) = delete;
+
+  struct Relay {
+    // 回源连接所在的 EventLoop 及其 session id
+    EventLoop* loop = nullptr;
+    uint64_t session_id = 0;
+    uint32_t viewers = 0;
+    // 最后一个观众已离开，回源连接及房间正在关闭，关闭后记录才被移除
+    bool closing = false;
+    // 关闭期间到来的观众，房间关闭后在各自的 EventLoop 上重试
+    std::vector<std::pair<EventLoop*, std::function<void()>>> waiters;
+  };
+
+  std::mutex mutex_;
+  std::unordered_map<int32_t, Relay> relays_;
+
+ public:
+  static RelayManager& GetInstance() {
+    static RelayManager rm;
+    return rm;
+  }
+
+  enum class Result {
+    // 房间由回源提供，之后须调用 Release
+    RELAYED,
+    // 房间由本地主播提供或回源失败
+    LOCAL,
+    // 上一个回源连接正在关闭，关闭后在调用者的 EventLoop 上执行 retry
+    CLOSING,
+  };
+
+  // 只能在 EventLoop 线程中调用，回源连接建立在调用者的 EventLoop 上
+  Result Acquire(int32_t room_id, const std::string& stream_name,
+                 std::function<void()> retry) {
+    std::lock_guard<std::mutex> g(mutex_);
+    auto it = relays_.find(room_id);
+    if (it != relays_.end()) {
+      if (it->second.closing) {
+        it->second.waiters.emplace_back(EventLoop::Current(),
+                                        std::move(retry));
+        return Result::CLOSING;
+      }
+      it->second.viewers++;
+      return Result::RELAYED;
+    }
+
+    JoinMode mode = JoinMode::GOP;
+    ParseJoinMode(server::FLAGS_join_mode, &mode);
+    if (!RoomManager::GetInstance().CreateRoom(room_id, mode)) {
+      return Result::LOCAL;
+    }
+
+    std::string tc_url = "rtmp://" + server::FLAGS_origin +
+                         "/live?room=" + std::to_string(room_id);
+    EventLoop* loop = EventLoop::Current();
+    uint64_t session_id = loop->Connect(
+        server::FLAGS_origin,
+        rtmp::RTMPClientSession::CreateRTMPClientSession(
+            rtmp::RTMPClientSession::PLAY, room_id, tc_url, stream_name));
+    if (session_id == 0) {
+      LOG_ERROR << "relay from origin failed, room_id: " << room_id;
+      RoomManager::GetInstance().CloseRoom(room_id);
+      return Result::LOCAL;
+    }
+
+    LOG_ERROR << "relay from origin " << server::FLAGS_origin
+              << ", room_id: " << room_id;
+    Relay& relay = relays_[room_id];
+    relay.loop = loop;
+    relay.session_id = session_id;
+    relay.viewers = 1;
+    return Result::RELAYED;
+  }
+
+  // 线程安全，与返回 RELAYED 的 Acquire 一一对应
+  void Release(int32_t room_id) {
+    std::lock_guard<std::mutex> g(mutex_);
+    auto it = relays_.find(room_id);
+    if (it == relays_.end() || it->second.viewers == 0 ||
+        --it->second.viewers > 0) {
+      return;
+    }
+    // 在回源连接所在线程中再次确认没有观众，期间可能又有新观众加入。
+    // 确认后标记为关闭中，房间关闭前 id 仍被占用，之后的 Acquire 排队等待
+    EventLoop* loop = it->second.loop;
+    uint64_t session_id = it->second.session_id;
+    loop->RunInLoop([this, loop, room_id, session_id]() {
+      {
+        std::lock_guard<std::mutex> g(mutex_);
+        auto it = relays_.find(room_id);
+        if (it == relays_.end() || it->second.session_id != session_id ||
+            it->second.viewers > 0) {
+          return;
+        }
+        it->second.closing = true;
+      }
+      LOG_ERROR << "last viewer left, stop relay, room_id: " << room_id;
+      loop->CloseSession(session_id);
+    });
+  }
+
+  // 回源连接关闭并关闭房间后由其所在线程调用，移除记录并唤醒排队的观众
+  void OnRelayClosed(int32_t room_id, uint64_t session_id) {
+    std::vector<std::pair<EventLoop*, std::function<void()>>> waiters;
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      auto it = relays_.find(room_id);
+      if (it == relays_.end() || it->second.session_id != session_id) {
+        return;
+      }
+      waiters.swap(it->second.waiters);
+      relays_.erase(it);
+    }
+    for (auto& waiter : waiters) {
+      waiter.first->RunInLoop(std::move(waiter.second));
+    }
+  }
+};
+
+// 观众进入房间，边缘节点上本地不存在的房间先回源。
+// 只能在 session 所属 EventLoop 的线程中调用，T 须同时继承 Session 和 Visitor。
+// @return 失败返回 false。relayed 为 true 时，观众离开后须调用 RelayManager::Release
+template <typename T>
+bool EnterRoomOrRelay(T* session, int32_t room_id, Subscription subscription,
+                      const std::string& stream_name, bool* relayed) {
+  *relayed = false;
+  if (server::FLAGS_origin.empty()) {
+    return RoomManager::GetInstance().EnterRoom(room_id, session,
+                                                subscription);
+  }
+  EventLoop* loop = session->GetEventLoop();
+  uint64_t id = session->GetId();
+  // 上一个回源连接关闭后重新进入。session 仍存在时 relayed 仍指向其成员
+  auto retry = [loop, id, room_id, subscription, stream_name, relayed]() {
+    Session* s = loop->FindSession(id);
+    if (s && !EnterRoomOrRelay(static_cast<T*>(s), room_id, subscription,
+                               stream_name, relayed)) {
+      LOG_ERROR << "enter room failed, room_id: " << room_id;
+      loop->CloseSession(id);
+    }
+  };
+  switch (RelayManager::GetInstance().Acquire(room_id, stream_name, retry)) {
+    case RelayManager::Result::LOCAL:
+      return RoomManager::GetInstance().EnterRoom(room_id, session,
+                                                  subscription);
+    case RelayManager::Result::CLOSING:
+      return true;
+    case RelayManager::Result::RELAYED:
+      break;
+  }
+  *relayed = true;
+  // 回源房间的副本可能还在本 EventLoop 的任务队列中等待创建，排在其后进入房间
+  loop->RunInLoop([loop, id, room_id, subscription]() {
+    Session* s = loop->FindSession(id);
+    if (s && !RoomManager::GetInstance().EnterRoom(
+                 room_id, static_cast<T*>(s), subscription)) {
+      LOG_ERROR << "enter room failed, room_id: " << room_id;
+      loop->CloseSession(id);
+    }
+  });
+  return true;
+}
+
+}  // namespace util
+}  // namespace live
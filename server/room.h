@@ -1,8 +1,24 @@
 #pragma once
 
-#include "server/rtmp.h"
+#include "server/abr.h"
+#include "server/args.h"
+#include "server/dvr.h"
+#include "server/hls.h"
+#include "server/media_message.h"
+#include "server/metrics.h"
+#include "server/net.h"
+#include "server/thumbnail.h"
+#include "server/timeshift.h"
+#include "server/ts_udp.h"
+#include "server/visitor.h"
 #include "util/queue.h"
+#include "util/token_bucket.h"
+#include "util/trace.h"
 
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <tuple>
 #include <unordered_map>
 #include <unordered_set>
@@ -11,115 +27,502 @@
 namespace live {
 namespace util {
 
+// 新观众加入房间时如何发送缓存的 GOP
+enum class JoinMode {
+  // 按原时间戳发送整个 GOP，观众的延迟会多出 GOP 已播放的时长
+  GOP,
+  // 发送整个 GOP，但时间戳均改写为最新一帧的时间戳，播放器快速解码后从直播点开始显示
+  LIVE_EDGE,
+  // 只发送关键帧，时间戳改写为最新一帧的时间戳，之后从下一个关键帧开始发送视频
+  KEYFRAME,
+};
+
+// @return 不认识的 name 返回 false
+inline bool ParseJoinMode(const std::string& name, JoinMode* mode) {
+  if (name == "gop") {
+    *mode = JoinMode::GOP;
+  } else if (name == "live_edge") {
+    *mode = JoinMode::LIVE_EDGE;
+  } else if (name == "keyframe") {
+    *mode = JoinMode::KEYFRAME;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// 观众订阅的轨道，由播放名的 only 参数指定，如 stream?only=audio
+enum class Subscription {
+  ALL,
+  // 只要音频，适合只听声音的客户端
+  AUDIO,
+  // 只要视频
+  VIDEO,
+  // 只要视频关键帧，适合监控墙、缩略图等场景
+  KEYFRAME,
+};
+
+// @return 不认识的 name 返回 false
+inline bool ParseSubscription(const std::string& name, Subscription* sub) {
+  if (name == "" || name == "all") {
+    *sub = Subscription::ALL;
+  } else if (name == "audio") {
+    *sub = Subscription::AUDIO;
+  } else if (name == "video") {
+    *sub = Subscription::VIDEO;
+  } else if (name == "keyframe") {
+    *sub = Subscription::KEYFRAME;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// 房间在某个 EventLoop 上的副本，只在该 EventLoop 的线程中访问。
+// 各副本独立维护缓存，但缓存的 MediaMessage 是共享的。
 class Room {
-  std::vector<uint8_t> meta_payload_;
+  MediaMessagePtr meta_message_;
 
   bool is_alive_;
 
-  std::vector<uint8_t> aac_header_payload_;
+  JoinMode join_mode_;
+
+  // 解码配置单独缓存，新观众加入时总是先于 GOP 发送。
+  // AVC sequence header 的 FrameType 也是关键帧，不能放进 GOP 缓存，
+  // 否则下一个关键帧到来时就被清掉了，之后加入的观众将无法解码。
+  MediaMessagePtr avc_header_message_;
+  MediaMessagePtr aac_header_message_;
   // 缓存最近一个关键帧及其之后的非关键帧
-  std::vector<std::pair<uint32_t, std::vector<uint8_t>>> cached_video_payload_;
+  std::vector<MediaMessagePtr> cached_video_messages_;
+  size_t cached_video_bytes_ = 0;
+
+  // 待发送给观众的消息，timestamp 可能被 JoinMode 改写，与 msg 中的不同
+  struct Pending {
+    MediaMessagePtr msg;
+    uint32_t timestamp;
+  };
 
   struct State {
+    Subscription subscription = Subscription::ALL;
     bool has_sent_audio = false;
     bool has_sent_video = false;
+    // 加入房间时待发送的 GOP 缓存，以及追赶期间到达的直播数据。
+    // 非空时说明观众仍在追赶，新数据只能排在队尾，以保证顺序。
+    std::deque<Pending> catch_up;
+    // catch_up 中 payload 的总字节数，受 join_burst_queue_size 限制
+    size_t catch_up_bytes = 0;
+    TokenBucket bucket;
+    uint64_t enter_time_us = 0;
+  };
+
+  std::unordered_map<Visitor*, State> visitors_;
+
+  // 所有 EventLoop 上的副本共用
+  metrics::RoomMetrics* metrics_;
+  // 各副本的 GOP 缓存相同，只由第 0 个 EventLoop 上的副本更新 gop_cache_bytes
+  bool report_gop_cache_ = false;
+
+  // 按 join_burst_interval 周期性为追赶中的观众发送数据，没有追赶中的观众时停止
+  struct event_deleter {
+    void operator()(event* ptr) {
+      event_free(ptr);
+    }
   };
+  std::unique_ptr<event, event_deleter> catch_up_timer_;
+  bool catch_up_timer_pending_ = false;
+
+  static void CatchUpCallback(evutil_socket_t, short, void* ptr) {
+    EventLoop::Current()->BeginWork();
+    reinterpret_cast<Room*>(ptr)->CatchUp();
+  }
+
+  void StartCatchUpTimer() {
+    if (catch_up_timer_pending_ || !catch_up_timer_) {
+      return;
+    }
+    int32_t ms = server::FLAGS_join_burst_interval;
+    timeval tv = {ms / 1000, ms % 1000 * 1000};
+    event_add(catch_up_timer_.get(), &tv);
+    catch_up_timer_pending_ = true;
+  }
+
+  // 追赶中的观众收得比直播产生的慢时积压会一直增长，超出上限后丢弃积压，
+  // 重新发送解码配置，视频从最新的关键帧开始
+  void PushCatchUp(State& state, const MediaMessagePtr& msg,
+                   uint32_t timestamp) {
+    state.catch_up.push_back({msg, timestamp});
+    state.catch_up_bytes += msg->payload.size();
+    const int32_t limit = server::FLAGS_join_burst_queue_size;
+    if (limit <= 0 || state.catch_up_bytes <= size_t(limit)) {
+      return;
+    }
+    LOG_ERROR << "catch up backlog overflow, restart from latest key frame, "
+              << "backlog bytes: " << state.catch_up_bytes;
+    state.catch_up.clear();
+    state.catch_up_bytes = 0;
+
+    const bool want_audio = IsSubscribed(state.subscription, 8, false);
+    const bool want_video = IsSubscribed(state.subscription, 9, true) &&
+                            !cached_video_messages_.empty();
+    // 配置消息排在重新开始的第一帧之前，时间戳不回退
+    uint32_t restart = want_video ? cached_video_messages_.front()->timestamp
+                                  : timestamp;
+    std::vector<MediaMessagePtr> restart_messages;
+    if (meta_message_) {
+      restart_messages.push_back(meta_message_);
+    }
+    if (avc_header_message_ && want_video) {
+      restart_messages.push_back(avc_header_message_);
+    }
+    if (aac_header_message_ && want_audio) {
+      restart_messages.push_back(aac_header_message_);
+    }
+    // GOP 本身超出上限或只订阅关键帧时只发关键帧，之后从下一个关键帧开始
+    bool whole_gop = want_video &&
+                     state.subscription != Subscription::KEYFRAME &&
+                     cached_video_bytes_ <= size_t(limit);
+    if (want_video) {
+      if (whole_gop) {
+        restart_messages.insert(restart_messages.end(),
+                                cached_video_messages_.begin(),
+                                cached_video_messages_.end());
+      } else {
+        restart_messages.push_back(cached_video_messages_.front());
+      }
+    }
+    state.has_sent_video = whole_gop;
+    for (const auto& m : restart_messages) {
+      state.catch_up.push_back({m, std::max(m->timestamp, restart)});
+      state.catch_up_bytes += m->payload.size();
+    }
+  }
+
+  static void Send(Visitor* session, const Pending& p) {
+    if (p.msg->type == 18) {
+      session->SendMetaData(p.msg);
+    } else {
+      session->SendMediaData(p.msg, p.timestamp);
+    }
+  }
 
-  std::unordered_map<rtmp::RTMPSession*, State> visitors_;
+  // 在追赶中的观众间轮转，每轮每人至多一条消息，受各自令牌桶和本次预算限制，
+  // 使加入风暴不会长时间占用 EventLoop，直播数据仍能及时发给已在观看的观众。
+  void CatchUp() {
+    const uint64_t now = GetPassedTimeSinceStartedInMicroSeconds();
+    int64_t budget = server::FLAGS_join_burst_budget;
+    bool progress = true;
+    while (progress && budget > 0) {
+      progress = false;
+      for (auto& v : visitors_) {
+        auto& queue = v.second.catch_up;
+        if (queue.empty() || budget <= 0) {
+          continue;
+        }
+        const Pending& p = queue.front();
+        const size_t size = p.msg->payload.size();
+        if (!v.second.bucket.TryConsume(size, now)) {
+          continue;
+        }
+        Send(v.first, p);
+        budget -= size;
+        v.second.catch_up_bytes -= size;
+        queue.pop_front();
+        progress = true;
+        if (queue.empty()) {
+          LOG_ERROR << "viewer reached live edge, join_to_live_ms: "
+                    << (now - v.second.enter_time_us) / 1000;
+        }
+      }
+    }
+
+    catch_up_timer_pending_ = false;
+    for (const auto& v : visitors_) {
+      if (!v.second.catch_up.empty()) {
+        StartCatchUpTimer();
+        break;
+      }
+    }
+  }
 
  public:
-  Room() : is_alive_(true) {}
+  // 在序列化之前过滤掉观众未订阅的数据
+  static bool IsSubscribed(Subscription sub, uint8_t type, bool is_key_frame) {
+    switch (sub) {
+      case Subscription::ALL: {
+        return true;
+      }
+      case Subscription::AUDIO: {
+        return type != 9;
+      }
+      case Subscription::VIDEO: {
+        return type != 8;
+      }
+      case Subscription::KEYFRAME: {
+        return type == 18 || (type == 9 && is_key_frame);
+      }
+    }
+    return true;
+  }
+
+  Room(metrics::RoomMetrics* metrics, JoinMode mode = JoinMode::GOP)
+      : is_alive_(true), join_mode_(mode), metrics_(metrics) {
+    EventLoop* loop = EventLoop::Current();
+    if (loop) {
+      catch_up_timer_.reset(
+          event_new(loop->GetEventBase(), -1, 0, CatchUpCallback, this));
+      report_gop_cache_ = loop->Index() == 0;
+    }
+  }
 
   ~Room() {
     is_alive_ = false;
+    metrics_->viewers.Add(-int64_t(visitors_.size()));
+    if (report_gop_cache_) {
+      metrics_->gop_cache_bytes.Set(0);
+    }
   }
 
-  void InitMetaData(const std::vector<uint8_t>& mp) {
-    meta_payload_ = mp;
+  void InitMetaData(const MediaMessagePtr& msg) {
+    meta_message_ = msg;
     // broadcast to all visitors
-    for (auto v : visitors_) {
-      v.first->SendMetaData(meta_payload_);
+    for (auto& v : visitors_) {
+      if (v.second.catch_up.empty()) {
+        v.first->SendMetaData(meta_message_);
+      } else {
+        PushCatchUp(v.second, msg, msg->timestamp);
+      }
     }
   }
 
-  void AddData(uint8_t type, uint32_t timestamp,
-               const std::vector<uint8_t>& payload) {
+  void AddData(const MediaMessagePtr& msg) {
     // 现在只能广播 AAC 和 H264
     // broadcast to all visitors
+    const uint8_t type = msg->type;
+    const uint32_t timestamp = msg->timestamp;
+
+    if (msg->payload.empty()) { return; }
 
-    if (payload.empty()) { return; }
-    
-    bool is_key_frame = false;
+    // 编码信息在创建消息时已解析
+    const bool is_key_frame = msg->IsKeyFrame();
+    const bool is_avc_seq_header = msg->IsAVCSequenceHeader();
     if (type == 9) {
-      is_key_frame = ((payload[0]>>4) == 1);
-      if (is_key_frame) {
-        cached_video_payload_.resize(0);
+      if (is_avc_seq_header) {
+        avc_header_message_ = msg;
+      } else {
+        if (is_key_frame) {
+          cached_video_messages_.resize(0);
+          cached_video_bytes_ = 0;
+        }
+        // 缓存须从关键帧开始
+        if (is_key_frame || cached_video_messages_.size()) {
+          cached_video_messages_.emplace_back(msg);
+          cached_video_bytes_ += msg->payload.size();
+        }
+        if (report_gop_cache_) {
+          metrics_->gop_cache_bytes.Set(int64_t(cached_video_bytes_));
+        }
       }
-      cached_video_payload_.emplace_back(std::make_pair(timestamp, payload));
     }
 
-    bool is_aac_seq_header = false;
-    if (type == 8) {
-      // AAC 会有 1 byte 的情形吗？
-      is_aac_seq_header = ((payload[0]>>4) == 10 && (payload[1] == 0));
-      if (is_aac_seq_header) {
-        aac_header_payload_ = payload;
-      }
+    const bool is_aac_seq_header = msg->IsAACSequenceHeader();
+    if (is_aac_seq_header) {
+      aac_header_message_ = msg;
     }
 
     for (auto &v : visitors_) {
+      if (!IsSubscribed(v.second.subscription, type, is_key_frame)) {
+        continue;
+      }
       // 8 音频，9 视频
+      bool need_send = false;
       if (type == 8) {
         if (v.second.has_sent_audio || is_aac_seq_header) {
-          v.first->SendMediaData(type, timestamp, payload);
+          need_send = true;
           v.second.has_sent_audio = true;
         }
       } else if (type == 9) {
-        if (v.second.has_sent_video || is_key_frame) {
-          v.first->SendMediaData(type, timestamp, payload);
+        // 解码配置变化时所有观众都需要，但它不代表观众可以开始解码后续的非关键帧
+        if (is_avc_seq_header) {
+          need_send = true;
+        } else if (v.second.has_sent_video || is_key_frame) {
+          need_send = true;
           v.second.has_sent_video = true;
         }
       }
+      if (!need_send) {
+        continue;
+      }
+      if (v.second.catch_up.empty()) {
+        v.first->SendMediaData(msg, timestamp);
+      } else {
+        PushCatchUp(v.second, msg, timestamp);
+      }
     }
   }
 
-  bool Enter(rtmp::RTMPSession* session) {
+  // send_cache 为 false 时不发送缓存的 metadata、解码配置及 GOP，
+  // 直接从下一条直播数据开始，供已从时移缓冲区取得这些数据的观众使用
+  bool Enter(Visitor* session,
+             Subscription subscription = Subscription::ALL,
+             bool send_cache = true) {
     if (!is_alive_) {
       return false;
     }
     State state;
+    state.subscription = subscription;
+    if (!send_cache) {
+      state.has_sent_audio = true;
+      state.has_sent_video = true;
+      if (!visitors_.insert(std::make_pair(session, std::move(state)))
+               .second) {
+        return false;
+      }
+      metrics_->viewers.Add(1);
+      return true;
+    }
     // send meta
-    if (meta_payload_.size()) {
-      session->SendMetaData(meta_payload_);
+    if (meta_message_) {
+      session->SendMetaData(meta_message_);
     }
-    if (aac_header_payload_.size()) {
-      session->SendMediaData(8, 0, aac_header_payload_);
+    const bool want_audio = IsSubscribed(subscription, 8, false);
+    const bool want_video = IsSubscribed(subscription, 9, true);
+    if (avc_header_message_ && want_video) {
+      session->SendMediaData(avc_header_message_, 0);
+    }
+    if (aac_header_message_ && want_audio) {
+      session->SendMediaData(aac_header_message_, 0);
       state.has_sent_audio = true;
     }
-    if (cached_video_payload_.size()) {
-      for (const auto &p : cached_video_payload_) {
-        session->SendMediaData(9, p.first, p.second);
+    // GOP 缓存可能很大，不在这里同步发出，交给 CatchUp 按令牌桶限速发送
+    state.enter_time_us = GetPassedTimeSinceStartedInMicroSeconds();
+    if (cached_video_messages_.size() && want_video) {
+      const uint32_t live_edge = cached_video_messages_.back()->timestamp;
+      int32_t rate = server::FLAGS_join_burst_rate;
+      // 只订阅关键帧时，缓存中也只有第一个是关键帧
+      switch (subscription == Subscription::KEYFRAME ? JoinMode::KEYFRAME
+                                                     : join_mode_) {
+        case JoinMode::GOP: {
+          for (const auto& m : cached_video_messages_) {
+            state.catch_up.push_back({m, m->timestamp});
+          }
+          state.catch_up_bytes = cached_video_bytes_;
+          state.has_sent_video = true;
+          break;
+        }
+        case JoinMode::LIVE_EDGE: {
+          for (const auto& m : cached_video_messages_) {
+            state.catch_up.push_back({m, live_edge});
+          }
+          state.catch_up_bytes = cached_video_bytes_;
+          state.has_sent_video = true;
+          rate = std::max(rate, server::FLAGS_live_edge_burst_rate);
+          break;
+        }
+        case JoinMode::KEYFRAME: {
+          // 其后的非关键帧依赖未发送的帧，视频需从下一个关键帧重新开始
+          state.catch_up.push_back({cached_video_messages_.front(), live_edge});
+          state.catch_up_bytes =
+              cached_video_messages_.front()->payload.size();
+          state.has_sent_video = false;
+          break;
+        }
       }
-      state.has_sent_video = true;
+      state.bucket = TokenBucket(rate, server::FLAGS_join_burst_capacity,
+                                 state.enter_time_us);
+    }
+    bool need_catch_up = !state.catch_up.empty();
+    if (!visitors_.insert(std::make_pair(session, std::move(state))).second) {
+      return false;
     }
-    return visitors_.insert(std::make_pair(session, state)).second;
+    metrics_->viewers.Add(1);
+    if (need_catch_up) {
+      StartCatchUpTimer();
+    }
+    return true;
   }
 
-  void Leave(rtmp::RTMPSession* session) {
+  void Leave(Visitor* session) {
     if (!is_alive_) {
       return;
     }
-    visitors_.erase(session);
+    if (visitors_.erase(session)) {
+      metrics_->viewers.Add(-1);
+    }
+  }
+
+  // 尚未收到时为空指针
+  const MediaMessagePtr& GetAVCHeader() const {
+    return avc_header_message_;
+  }
+  const MediaMessagePtr& GetAACHeader() const {
+    return aac_header_message_;
   }
 };
 
+// 房间由主播所在的 EventLoop 拥有：主播线程把一批消息打包后，
+// 每个 EventLoop 只投递一次，再由各 EventLoop 分发给自己线程上的观众。
 class RoomManager {
-  RoomManager() : id_pool_{0, 1, 2, 3}, rooms_(id_pool_.size()) {}
+  RoomManager() : capacity_(std::max(server::FLAGS_room_capacity, 1)) {
+    for (int32_t i = 0; i < capacity_; i++) {
+      id_pool_.insert(i);
+      metrics_.emplace_back(new metrics::RoomMetrics());
+    }
+  }
   RoomManager(const RoomManager&) = delete;
   RoomManager& operator=(const RoomManager&) = delete;
 
+  // 保护 id_pool_ 及 live_rooms_，只在创建、关闭房间及补建副本时使用
+  std::mutex mutex_;
   std::unordered_set<int32_t> id_pool_;
-  std::vector<Room*> rooms_;
+  // 已创建且尚未开始关闭的房间及其 JoinMode
+  std::unordered_map<int32_t, JoinMode> live_rooms_;
+  const int32_t capacity_;
+  // 下标为 room id，构造后不再修改
+  std::vector<std::unique_ptr<metrics::RoomMetrics>> metrics_;
+
+  using MediaBatch = std::shared_ptr<const std::vector<MediaMessagePtr>>;
+
+  // 当前 EventLoop 线程上的房间副本
+  static std::unordered_map<int32_t, std::unique_ptr<Room>>& LocalRooms() {
+    static thread_local std::unordered_map<int32_t, std::unique_ptr<Room>>
+        rooms;
+    return rooms;
+  }
+
+  // 副本由 CreateRoom 投递到各 EventLoop 异步创建，本线程的创建任务尚未执行时
+  // 就地补建，之后到达的创建任务保留已有的副本
+  static Room* GetLocalRoom(int32_t room_id) {
+    auto& rooms = LocalRooms();
+    auto it = rooms.find(room_id);
+    if (it != rooms.end()) {
+      return it->second.get();
+    }
+    return GetInstance().CreateLocalRoom(room_id);
+  }
+
+  Room* CreateLocalRoom(int32_t room_id) {
+    JoinMode mode;
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      auto it = live_rooms_.find(room_id);
+      if (it == live_rooms_.end()) {
+        return nullptr;
+      }
+      mode = it->second;
+    }
+    Room* room = new Room(metrics_[room_id].get(), mode);
+    LocalRooms()[room_id].reset(room);
+    return room;
+  }
+
+  static void CreateLocalRoomIfAbsent(int32_t room_id,
+                                      metrics::RoomMetrics* metrics,
+                                      JoinMode mode) {
+    auto& room = LocalRooms()[room_id];
+    if (!room) {
+      room.reset(new Room(metrics, mode));
+    }
+  }
 
  public:
   static RoomManager& GetInstance() {
@@ -127,49 +530,172 @@ class RoomManager {
     return rm;
   }
 
+  int32_t Capacity() const {
+    return capacity_;
+  }
+
+  // 线程安全，room id 无效时返回 nullptr
+  metrics::RoomMetrics* GetRoomMetrics(int32_t room_id) {
+    if (room_id < 0 || room_id >= capacity_) {
+      return nullptr;
+    }
+    return metrics_[room_id].get();
+  }
+
+  // transcode 为 false 时不按 -abr_ladder 转码，用于创建档位房间本身
   // @return 返回负数表示失败，非负数表示 room id。
-  int32_t CreateRoom() {
-    if (id_pool_.size() <= 0) {
-      return -1;
+  int32_t CreateRoom(JoinMode mode = JoinMode::GOP, bool transcode = true) {
+    int32_t id = -1;
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      if (id_pool_.size() <= 0) {
+        return -1;
+      }
+      id = *id_pool_.begin();
+      id_pool_.erase(id_pool_.begin());
+      live_rooms_[id] = mode;
+    }
+    metrics::RoomMetrics* m = metrics_[id].get();
+    EventLoopGroup::GetInstance().RunInAllLoops(
+        [id, m, mode]() { CreateLocalRoomIfAbsent(id, m, mode); });
+    hls::HlsManager::GetInstance().OpenRoom(id);
+    ts::TsEgressManager::GetInstance().OpenRoom(id);
+    dvr::DvrManager::GetInstance().OpenRoom(id);
+    timeshift::TimeShiftManager::GetInstance().OpenRoom(id);
+    thumbnail::ThumbnailManager::GetInstance().OpenRoom(id);
+    if (transcode) {
+      abr::AbrManager::GetInstance().OpenRoom(id, mode);
     }
-    auto id = *id_pool_.begin();
-    id_pool_.erase(id_pool_.begin());
-    rooms_[id] = new Room();
     return id;
   }
 
+  // 以指定的 id 创建房间，从源站拉流的房间沿用源站的 room id
+  // @return id 无效或已被占用时返回 false
+  bool CreateRoom(int32_t room_id, JoinMode mode) {
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      if (!id_pool_.erase(room_id)) {
+        return false;
+      }
+      live_rooms_[room_id] = mode;
+    }
+    metrics::RoomMetrics* m = metrics_[room_id].get();
+    EventLoopGroup::GetInstance().RunInAllLoops([room_id, m, mode]() {
+      CreateLocalRoomIfAbsent(room_id, m, mode);
+    });
+    hls::HlsManager::GetInstance().OpenRoom(room_id);
+    ts::TsEgressManager::GetInstance().OpenRoom(room_id);
+    dvr::DvrManager::GetInstance().OpenRoom(room_id);
+    timeshift::TimeShiftManager::GetInstance().OpenRoom(room_id);
+    thumbnail::ThumbnailManager::GetInstance().OpenRoom(room_id);
+    return true;
+  }
+
   void CloseRoom(int32_t room_id) {
-    if (room_id < 0 || room_id >= rooms_.size()) {
+    if (room_id < 0 || room_id >= capacity_) {
       LOG_ERROR << "invalid room id " << room_id
-                << ", it should be between 0 and " << rooms_.size() - 1;
+                << ", it should be between 0 and " << capacity_ - 1;
       return;
     }
-    if (id_pool_.count(room_id)) {
-      LOG_ERROR << room_id << " room is already closed";
-      return;
+    // 先移出 live_rooms_ 再投递销毁任务，销毁之后不会再补建副本
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      if (!live_rooms_.erase(room_id)) {
+        LOG_ERROR << room_id << " room is already closed";
+        return;
+      }
     }
-    delete rooms_[room_id];
-    rooms_[room_id] = nullptr;
+    // 先投递销毁任务再归还 id，保证各 EventLoop 上销毁总在下一次创建之前执行
+    EventLoopGroup::GetInstance().RunInAllLoops(
+        [room_id]() { LocalRooms().erase(room_id); });
+    hls::HlsManager::GetInstance().CloseRoom(room_id);
+    ts::TsEgressManager::GetInstance().CloseRoom(room_id);
+    dvr::DvrManager::GetInstance().CloseRoom(room_id);
+    thumbnail::ThumbnailManager::GetInstance().CloseRoom(room_id);
+    abr::AbrManager::GetInstance().CloseRoom(room_id);
+    std::lock_guard<std::mutex> g(mutex_);
     id_pool_.insert(room_id);
   }
 
-  bool EnterRoom(int32_t room_id, rtmp::RTMPSession* session) {
-    return rooms_[room_id] && rooms_[room_id]->Enter(session);
+  // 以下函数只能在 EventLoop 的线程中调用
+  bool HasLocalRoom(int32_t room_id) {
+    return GetLocalRoom(room_id) != nullptr;
   }
 
-  void LeaveRoom(int32_t room_id, rtmp::RTMPSession* session) {
-    if (rooms_[room_id]) {
-      rooms_[room_id]->Leave(session);
+  bool EnterRoom(int32_t room_id, Visitor* session,
+                 Subscription subscription = Subscription::ALL,
+                 bool send_cache = true) {
+    Room* room = GetLocalRoom(room_id);
+    return room && room->Enter(session, subscription, send_cache);
+  }
+
+  void LeaveRoom(int32_t room_id, Visitor* session) {
+    Room* room = GetLocalRoom(room_id);
+    if (room) {
+      room->Leave(session);
     }
   }
 
-  void InitMetaData(int32_t room_id, const std::vector<uint8_t>& mp) {
-    rooms_[room_id]->InitMetaData(mp);
+  // 取房间当前的 AVC、AAC sequence header，RTSP 据此生成 SDP
+  // @return 房间不存在时返回 false
+  bool GetCodecHeaders(int32_t room_id, MediaMessagePtr* avc,
+                       MediaMessagePtr* aac) {
+    Room* room = GetLocalRoom(room_id);
+    if (!room) {
+      return false;
+    }
+    *avc = room->GetAVCHeader();
+    *aac = room->GetAACHeader();
+    return true;
   }
 
-  void AddData(int32_t room_id, uint8_t type, uint32_t timestamp,
-               const std::vector<uint8_t>& payload) {
-    rooms_[room_id]->AddData(type, timestamp, payload);
+  // 由主播所在线程调用，将一批消息投递给所有 EventLoop
+  void Publish(int32_t room_id, std::vector<MediaMessagePtr>&& messages) {
+    if (messages.empty()) {
+      return;
+    }
+    metrics::RoomMetrics* m = GetRoomMetrics(room_id);
+    if (m) {
+      for (const auto& msg : messages) {
+        m->ingest_bytes.Add(msg->payload.size());
+      }
+      m->ingest_messages.Add(messages.size());
+    }
+    MediaBatch batch =
+        std::make_shared<const std::vector<MediaMessagePtr>>(
+            std::move(messages));
+    // 切片在工作线程中进行，与分发共享同一批消息
+    hls::HlsManager::GetInstance().Publish(room_id, batch);
+    // 录制在写盘线程中进行
+    dvr::DvrManager::GetInstance().Publish(room_id, batch);
+    // 时移缓冲区的写入同样在工作线程中
+    timeshift::TimeShiftManager::GetInstance().Publish(room_id, batch);
+    // 缩略图只取关键帧，在低优先级线程中生成
+    thumbnail::ThumbnailManager::GetInstance().Publish(room_id, batch);
+    // 转码在各自的解码、编码线程中进行
+    abr::AbrManager::GetInstance().Publish(room_id, batch);
+    // 最后一个完成分发的 EventLoop 记录这批消息中最早的一条的分发延迟
+    auto& group = EventLoopGroup::GetInstance();
+    auto remaining = std::make_shared<std::atomic<size_t>>(group.Size());
+    group.RunInAllLoops([room_id, batch, remaining]() {
+      TRACE_SCOPE("room.fanout");
+      Room* room = GetLocalRoom(room_id);
+      if (room) {
+        for (const auto& msg : *batch) {
+          if (msg->type == 18) {
+            room->InitMetaData(msg);
+          } else {
+            room->AddData(msg);
+          }
+        }
+      }
+      if (remaining->fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        const uint64_t now = GetPassedTimeSinceStartedInMicroSeconds();
+        const uint64_t created_us = batch->front()->created_us;
+        EventLoop::Current()->GetMetrics().fanout_us.Record(
+            now > created_us ? now - created_us : 0);
+      }
+    });
   }
 };
 
@@ -1,6 +1,12 @@
 #include "server/rtmp.h"
+#include "server/abr.h"
+#include "server/admission.h"
+#include "server/args.h"
 #include "server/flv.h"
+#include "server/relay.h"
 #include "server/room.h"
+#include "server/rtmp_client.h"
+#include "util/trace.h"
 
 #include <fstream>
 
@@ -8,37 +14,212 @@ namespace live {
 namespace util {
 namespace rtmp {
 
-void RTMPSession::SendMetaData(const std::vector<uint8_t>& meta_payload) {
-  try {
-    Message msg;
-    msg.type = 18;
-    msg.timestamp = 0;
-    msg.stream_id = msid_for_create_stream_;
-    msg.payload_length = meta_payload.size();
-    msg.payload = meta_payload;
-    ByteStream(WriteDataBuffer())
-        << ChunkSerializeHelper(this, std::move(msg)) << ByteStream::Commit();
-    Write();
-  } catch (...) {
-    LOG_ERROR << "catch exception";
+void RTMPSession::SendMetaData(const MediaMessagePtr& msg) {
+  EnqueueMessage(DATA_PRIORITY, msg, msg->timestamp);
+}
+
+void RTMPSession::SendMediaData(const MediaMessagePtr& msg,
+                                uint32_t timestamp) {
+  EnqueueMessage(msg->type == 8 ? AUDIO_PRIORITY : VIDEO_PRIORITY, msg,
+                 timestamp);
+}
+
+void RTMPSession::EnqueueMessage(Priority priority, const MediaMessagePtr& msg,
+                                 uint32_t timestamp) {
+  if (msg->payload.empty()) {
+    return;
+  }
+  if (max_queued_bytes_) {
+    const std::vector<uint8_t>& payload = msg->payload;
+    bool is_video = msg->type == 9;
+    bool is_key_frame = msg->IsKeyFrame();
+    bool is_seq_header = msg->IsAVCSequenceHeader();
+    if (is_video && !is_seq_header && waiting_for_key_frame_) {
+      if (!is_key_frame) {
+        GetMetrics().dropped_frames.Add();
+        return;
+      }
+      waiting_for_key_frame_ = false;
+    }
+    if (queued_bytes_ + payload.size() > max_queued_bytes_) {
+      LOG_ERROR << "send queue overflow, drop video until next key frame, "
+                << "peer: " << GetPeerAddress()
+                << ", queued bytes: " << queued_bytes_;
+      size_t dropped = DropQueuedMessages(send_queues_[VIDEO_PRIORITY]);
+      // 只丢视频还放不下时音频也丢弃
+      if (queued_bytes_ + payload.size() > max_queued_bytes_) {
+        dropped += DropQueuedMessages(send_queues_[AUDIO_PRIORITY]);
+      }
+      GetMetrics().dropped_frames.Add(dropped);
+      waiting_for_key_frame_ = !is_key_frame;
+      if (is_video && !is_key_frame && !is_seq_header) {
+        GetMetrics().dropped_frames.Add();
+        return;
+      }
+    }
+    if (queued_bytes_ + payload.size() > max_queued_bytes_) {
+      if (msg->type == 8 && !msg->IsAACSequenceHeader()) {
+        GetMetrics().dropped_frames.Add();
+        return;
+      }
+      // 剩下的都是不能丢的消息，对端长期收不动，断开
+      LOG_ERROR << "send queue stays over limit, close, peer: "
+                << GetPeerAddress() << ", queued bytes: " << queued_bytes_;
+      Session::SetFlag(Session::FLAG::NEED_CLOSE);
+      return;
+    }
+    queued_bytes_ += payload.size();
+    assert(queued_bytes_ <= max_queued_bytes_);
+  }
+  OutgoingMessage out;
+  out.msg = msg;
+  out.timestamp = timestamp;
+  out.enqueue_us = GetPassedTimeSinceStartedInMicroSeconds();
+  send_queues_[priority].emplace_back(std::move(out));
+  if (!FlushSendQueues()) {
+    LOG_ERROR << "flush send queues failed";
+    Session::SetFlag(Session::FLAG::NEED_CLOSE);
   }
 }
 
-void RTMPSession::SendMediaData(uint8_t type, uint32_t timestamp,
-                                const std::vector<uint8_t>& payload) {
-  try {
-    Message msg;
-    msg.type = type;
-    msg.timestamp = timestamp;
-    msg.stream_id = msid_for_create_stream_;
-    msg.payload_length = payload.size();
-    msg.payload = payload;
-    ByteStream(WriteDataBuffer())
-        << ChunkSerializeHelper(this, std::move(msg)) << ByteStream::Commit();
-    Write();
-  } catch (...) {
-    LOG_ERROR << "catch exception";
+size_t RTMPSession::DropQueuedMessages(std::deque<OutgoingMessage>& queue) {
+  std::deque<OutgoingMessage> kept;
+  size_t dropped = 0;
+  for (auto& out : queue) {
+    // 已发出部分 chunk 的消息须发完，sequence header 不能丢
+    if (out.offset || out.msg->IsAVCSequenceHeader() ||
+        out.msg->IsAACSequenceHeader()) {
+      kept.emplace_back(std::move(out));
+    } else {
+      // 不限制时 queued_bytes_ 不计数
+      if (max_queued_bytes_) {
+        queued_bytes_ -= out.msg->payload.size();
+      }
+      dropped++;
+    }
+  }
+  queue.swap(kept);
+  return dropped;
+}
+
+void RTMPSession::SerializeNextChunk(OutgoingMessage& out) {
+  const std::vector<uint8_t>& payload = out.msg->payload;
+
+  ChunkHeader header;
+  header.basic.format = out.offset ? 3 : 0;
+  header.basic.chunk_stream_id = GetChunkStreamIdForSending(out.msg->type);
+  header.common.timestamp = out.timestamp;
+  header.common.length = payload.size();
+  header.common.type = out.msg->type;
+  header.common.message_stream_id = msid_for_create_stream_;
+
+  uint32_t len = std::min(size_t(GetMaxChunkSizeForSending()),
+                          payload.size() - out.offset);
+  ByteStream(WriteDataBuffer())
+      << header << ByteStream::ConstRawPtrWrapper(&payload[out.offset], len)
+      << ByteStream::Commit();
+  out.offset += len;
+}
+
+bool RTMPSession::FlushSendQueues() {
+  TRACE_SCOPE("rtmp.serialize");
+  if (!write_watermark_set_) {
+    SetWriteWatermark(server::FLAGS_send_buffer_size / 2);
+    write_watermark_set_ = true;
+  }
+  const size_t limit = server::FLAGS_send_buffer_size;
+  size_t buffered = GetOutputBufferSize();
+  while (buffered + WriteDataBuffer().size() < limit) {
+    // 每个 chunk 之后都重新挑选，高优先级的消息总能插到低优先级消息的 chunk 之间
+    std::deque<OutgoingMessage>* queue = nullptr;
+    for (auto& q : send_queues_) {
+      if (!q.empty()) {
+        queue = &q;
+        break;
+      }
+    }
+    if (!queue) {
+      break;
+    }
+    OutgoingMessage& out = queue->front();
+    SerializeNextChunk(out);
+    if (out.offset == out.msg->payload.size()) {
+      if (max_queued_bytes_) {
+        queued_bytes_ -= out.msg->payload.size();
+      }
+      MarkMessageSent(out.enqueue_us);
+      queue->pop_front();
+      GetMetrics().messages_out.Add();
+    }
   }
+  size_t queued = 0;
+  for (const auto& q : send_queues_) {
+    queued += q.size();
+  }
+  GetMetrics().send_queue_messages.Set(int64_t(queued));
+  return Write();
+}
+
+bool RTMPSession::OnWrite() {
+  return FlushSendQueues();
+}
+
+void RTMPSession::StartForwarding(const std::string& stream_name) {
+  // 转推连接与主播在同一个 EventLoop 上，作为本地房间的观众接收数据
+  std::string urls = server::FLAGS_forward;
+  for (size_t begin = 0, end = 0; begin < urls.size(); begin = end + 1) {
+    end = urls.find(',', begin);
+    if (end == std::string::npos) {
+      end = urls.size();
+    }
+    std::string tc_url = urls.substr(begin, end - begin);
+    // tcUrl 形如 rtmp://10.0.0.2:1935/live
+    size_t host_begin = tc_url.find("://");
+    host_begin = host_begin == std::string::npos ? 0 : host_begin + 3;
+    std::string address =
+        tc_url.substr(host_begin, tc_url.find('/', host_begin) - host_begin);
+    if (address.empty()) {
+      continue;
+    }
+    uint64_t id = GetEventLoop()->Connect(
+        address, RTMPClientSession::CreateRTMPClientSession(
+                     RTMPClientSession::PUBLISH, room_id_, tc_url,
+                     stream_name));
+    if (id == 0) {
+      LOG_ERROR << "forward to " << tc_url << " failed";
+      continue;
+    }
+    LOG_ERROR << "forward room " << room_id_ << " to " << tc_url;
+    forwarders_.push_back(id);
+  }
+}
+
+void RTMPSession::SendOnStatus(double id, const std::string& level,
+                               const std::string& code,
+                               const std::string& description) {
+  CommandMessage cm("onStatus", id);
+
+  cm.obj1.marker = ActionScriptObject::Type::NULL_TYPE;
+
+  std::shared_ptr<ActionScriptObject> desc(new ActionScriptObject());
+  desc->marker = ActionScriptObject::Type::STRING;
+  desc->string_value = description;
+
+  std::shared_ptr<ActionScriptObject> lv(new ActionScriptObject());
+  lv->marker = ActionScriptObject::Type::STRING;
+  lv->string_value = level;
+
+  std::shared_ptr<ActionScriptObject> cd(new ActionScriptObject());
+  cd->marker = ActionScriptObject::Type::STRING;
+  cd->string_value = code;
+
+  cm.obj2.marker = ActionScriptObject::Type::OBJECT;
+  cm.obj2.dict_value["level"] = lv;
+  cm.obj2.dict_value["code"] = cd;
+  cm.obj2.dict_value["description"] = desc;
+
+  ByteStream(WriteDataBuffer())
+      << ChunkSerializeHelper(this, std::move(cm)) << ByteStream::Commit();
 }
 
 void RTMPSession::HandleCommandMessage(uint32_t csid, const Message& msg,
@@ -87,7 +268,19 @@ void RTMPSession::HandleCommandMessage(uint32_t csid, const Message& msg,
       return;
     }
 
-    room_id_ = RoomManager::GetInstance().CreateRoom();
+    JoinMode join_mode = JoinMode::GOP;
+    if (!ParseJoinMode(server::FLAGS_join_mode, &join_mode)) {
+      LOG_ERROR << "invalid join_mode flag " << server::FLAGS_join_mode;
+    }
+    // 推流名形如 stream?join=live_edge
+    std::string name;
+    auto params = ParseQueryString(command.obj2.string_value, &name);
+    auto it = params.find("join");
+    if (it != params.end() && !ParseJoinMode(it->second, &join_mode)) {
+      LOG_ERROR << "invalid join mode " << it->second;
+    }
+
+    room_id_ = RoomManager::GetInstance().CreateRoom(join_mode);
     if (room_id_ < 0) {
       LOG_ERROR << "create room failed";
       Session::SetFlag(Session::FLAG::NEED_CLOSE);
@@ -95,30 +288,12 @@ void RTMPSession::HandleCommandMessage(uint32_t csid, const Message& msg,
     }
 
     LOG_ERROR << "crate room success, room_id: " << room_id_;
+    GetMetrics().SetRoom(room_id_, true);
 
-    CommandMessage cm("onStatus", command.id);
-
-    cm.obj1.marker = ActionScriptObject::Type::NULL_TYPE;
-
-    std::shared_ptr<ActionScriptObject> desc(new ActionScriptObject());
-    desc->marker = ActionScriptObject::Type::STRING;
-    desc->string_value = "NetStream.Publish.Start";
-
-    std::shared_ptr<ActionScriptObject> level(new ActionScriptObject());
-    level->marker = ActionScriptObject::Type::STRING;
-    level->string_value = "info";
-
-    std::shared_ptr<ActionScriptObject> code(new ActionScriptObject());
-    code->marker = ActionScriptObject::Type::STRING;
-    code->string_value = "NetStream.Publish.Start";
+    StartForwarding(name);
 
-    cm.obj2.marker = ActionScriptObject::Type::OBJECT;
-    cm.obj2.dict_value["level"] = level;
-    cm.obj2.dict_value["code"] = code;
-    cm.obj2.dict_value["description"] = desc;
-
-    ByteStream(WriteDataBuffer())
-        << ChunkSerializeHelper(this, std::move(cm)) << ByteStream::Commit();
+    SendOnStatus(command.id, "info", "NetStream.Publish.Start",
+                 "NetStream.Publish.Start");
   } else if (command.name == "play") {
     if (type_ == Type::UNDEFINED) {
       type_ = Type::PULL;
@@ -128,35 +303,88 @@ void RTMPSession::HandleCommandMessage(uint32_t csid, const Message& msg,
       return;
     }
 
-    if (!RoomManager::GetInstance().EnterRoom(room_id_, this)) {
-      LOG_ERROR << "enter room failed, room_id: " << room_id_;
-      Session::SetFlag(Session::FLAG::NEED_CLOSE);
-      return;
+    // 播放名形如 stream?only=audio
+    Subscription subscription = Subscription::ALL;
+    std::string name;
+    auto params = ParseQueryString(command.obj2.string_value, &name);
+    if (!ParseSubscription(params["only"], &subscription)) {
+      LOG_ERROR << "invalid subscription " << params["only"];
     }
 
-    CommandMessage cm("onStatus", command.id);
-
-    cm.obj1.marker = ActionScriptObject::Type::NULL_TYPE;
-
-    std::shared_ptr<ActionScriptObject> desc(new ActionScriptObject());
-    desc->marker = ActionScriptObject::Type::STRING;
-    desc->string_value = "NetStream.Publish.Start";
+    // 播放名形如 <file>.flv?start=30 时点播 -vod_dir 下的文件，不进入房间
+    if (vod::VodManager::IsVodName(name)) {
+      PlayVod(command.id, name, subscription, params["start"]);
+      Write();
+      return;
+    }
 
-    std::shared_ptr<ActionScriptObject> level(new ActionScriptObject());
-    level->marker = ActionScriptObject::Type::STRING;
-    level->string_value = "info";
+    // 播放名形如 3_720p 时观看 3 号房间的 720p 转码档位
+    int32_t source_id = -1;
+    std::string rendition;
+    if (abr::AbrManager::ParseRenditionName(name, &source_id, &rendition)) {
+      room_id_ =
+          abr::AbrManager::GetInstance().FindRendition(source_id, rendition);
+      if (room_id_ < 0) {
+        LOG_ERROR << "rendition " << name << " not found";
+        SendOnStatus(command.id, "error", "NetStream.Play.StreamNotFound",
+                     name);
+        Write();
+        return;
+      }
+    }
 
-    std::shared_ptr<ActionScriptObject> code(new ActionScriptObject());
-    code->marker = ActionScriptObject::Type::STRING;
-    code->string_value = "NetStream.Play.Start";
+    // 被拒绝的观众收到 onStatus 错误后由客户端自行断开
+    std::string reason;
+    if (!AdmissionController::GetInstance().Admit(room_id_, GetPeerAddress(),
+                                                  &reason)) {
+      LOG_ERROR << "reject viewer, room_id: " << room_id_
+                << ", ip: " << GetPeerAddress() << ", reason: " << reason;
+      SendOnStatus(command.id, "error", "NetStream.Play.Failed", reason);
+      Write();
+      return;
+    }
+    admitted_ = true;
+    GetMetrics().SetRoom(room_id_, false);
 
-    cm.obj2.marker = ActionScriptObject::Type::OBJECT;
-    cm.obj2.dict_value["level"] = level;
-    cm.obj2.dict_value["code"] = code;
-    cm.obj2.dict_value["description"] = desc;
+    // stream?timeshift=60 从 60 秒前开始回看，没有时移数据时直接观看直播
+    if (params.count("timeshift")) {
+      timeshift_ = timeshift::TimeShiftPlayer::Create(
+          this, room_id_, subscription, params["timeshift"]);
+    }
+    if (!timeshift_ &&
+        !EnterRoomOrRelay(this, room_id_, subscription, name, &relayed_)) {
+      LOG_ERROR << "enter room failed, room_id: " << room_id_;
+      Session::SetFlag(Session::FLAG::NEED_CLOSE);
+      return;
+    }
 
-    ByteStream(WriteDataBuffer())
-        << ChunkSerializeHelper(this, std::move(cm)) << ByteStream::Commit();
+    SendOnStatus(command.id, "info", "NetStream.Play.Start",
+                 "NetStream.Publish.Start");
+  } else if (command.name == "seek" && vod_) {
+    // 参数为毫秒数，丢弃排队中的旧数据
+    DropQueuedMessages(send_queues_[AUDIO_PRIORITY]);
+    DropQueuedMessages(send_queues_[VIDEO_PRIORITY]);
+    vod_->Seek(command.obj2.marker == ActionScriptObject::Type::DOUBLE
+                   ? uint32_t(std::max(command.obj2.double_value, 0.0))
+                   : 0);
+    SendOnStatus(command.id, "status", "NetStream.Seek.Notify",
+                 "NetStream.Seek.Notify");
+  } else if (command.name == "pause" && vod_) {
+    // 参数为是否暂停及当前的毫秒数，恢复时从该位置重新开始
+    if (command.obj2.marker == ActionScriptObject::Type::BOOLEAN &&
+        command.obj2.bool_value) {
+      vod_->Pause();
+      SendOnStatus(command.id, "status", "NetStream.Pause.Notify",
+                   "NetStream.Pause.Notify");
+    } else {
+      DropQueuedMessages(send_queues_[AUDIO_PRIORITY]);
+      DropQueuedMessages(send_queues_[VIDEO_PRIORITY]);
+      vod_->Seek(command.obj3.marker == ActionScriptObject::Type::DOUBLE
+                     ? uint32_t(std::max(command.obj3.double_value, 0.0))
+                     : 0);
+      SendOnStatus(command.id, "status", "NetStream.Unpause.Notify",
+                   "NetStream.Unpause.Notify");
+    }
   } else if (command.name == "deleteStream" ||
              command.name == "getStreamLength") {
     // response nothing
@@ -172,21 +400,77 @@ void RTMPSession::HandleCommandMessage(uint32_t csid, const Message& msg,
   }
 }
 
+void RTMPSession::PlayVod(double id, const std::string& name,
+                          Subscription subscription,
+                          const std::string& start) {
+  uint32_t start_ms = 0;
+  if (!start.empty() && start.size() <= 6 &&
+      start.find_first_not_of("0123456789") == std::string::npos) {
+    start_ms = uint32_t(std::stoi(start)) * 1000;
+  }
+  EventLoop* loop = GetEventLoop();
+  uint64_t session_id = GetId();
+  vod::VodManager::GetInstance().Open(
+      name, [loop, session_id, id, name, subscription,
+             start_ms](std::shared_ptr<const vod::VodFile> file) {
+        Session* s = loop->FindSession(session_id);
+        if (s && !static_cast<RTMPSession*>(s)->StartVod(
+                     id, name, std::move(file), subscription, start_ms)) {
+          loop->CloseSession(session_id);
+        }
+      });
+}
+
+bool RTMPSession::StartVod(double id, const std::string& name,
+                           std::shared_ptr<const vod::VodFile> file,
+                           Subscription subscription, uint32_t start_ms) {
+  if (!file) {
+    SendOnStatus(id, "error", "NetStream.Play.StreamNotFound", name);
+  } else {
+    vod_.reset(new vod::VodPlayer(file, this, subscription, [this]() {
+      SendOnStatus(0, "status", "NetStream.Play.Stop", "NetStream.Play.Stop");
+      if (!Write()) {
+        Session::SetFlag(Session::FLAG::NEED_CLOSE);
+      }
+    }));
+    vod_->Seek(start_ms);
+    SendOnStatus(id, "info", "NetStream.Play.Start", "NetStream.Play.Start");
+  }
+  if (!Write()) {
+    LOG_ERROR << "send command response failed";
+    return false;
+  }
+  return true;
+}
+
 void RTMPSession::HandleMessage(uint32_t csid, Message&& msg) {
   try {
     switch (msg.type) {
+      case 1: {
+        // Set Chunk Size，最高位须为 0
+        uint32_t size = 0;
+        ByteStream(msg.payload) >> size;
+        max_chunk_size_ = size & 0x7FFFFFFF;
+        LOG_ERROR << "peer chunk size: " << max_chunk_size_;
+        break;
+      }
       case 3: {
         break;
       }
       case 8:
       case 9: {
-        RoomManager::GetInstance().AddData(room_id_, msg.type, msg.timestamp,
-                                           msg.payload);
+        if (type_ == Type::PUSH) {
+          pending_messages_.emplace_back(std::make_shared<const MediaMessage>(
+              msg.type, msg.timestamp, std::move(msg.payload)));
+        }
         break;
       }
       case 18: {
         try {
-          RoomManager::GetInstance().InitMetaData(room_id_, msg.payload);
+          if (type_ == Type::PUSH) {
+            pending_messages_.emplace_back(std::make_shared<const MediaMessage>(
+                msg.type, msg.timestamp, std::vector<uint8_t>(msg.payload)));
+          }
           ByteStream bs(msg.payload);
           while (bs.Remain()) {
             ActionScriptObject obj;
@@ -475,6 +759,7 @@ bool RTMPSession::OnReadInHandeShakeDoneState() {
 }
 
 bool RTMPSession::OnRead() {
+  TRACE_SCOPE("rtmp.parse");
   switch (state_) {
     case UNINTIALIZED: {
       return OnReadInUninitializedState();
@@ -495,11 +780,54 @@ bool RTMPSession::OnRead() {
   }
 }
 
+void RTMPSession::UpdateIngestBitrate(size_t bytes) {
+  static const uint64_t WINDOW_US = 1000000;
+  uint64_t now = GetPassedTimeSinceStartedInMicroSeconds();
+  if (ingest_window_start_us_ == 0) {
+    ingest_window_start_us_ = now;
+  }
+  ingest_bytes_ += bytes;
+  if (now - ingest_window_start_us_ >= WINDOW_US) {
+    AdmissionController::GetInstance().UpdateRoomBitrate(
+        room_id_, ingest_bytes_ * 8 * 1000000 / (now - ingest_window_start_us_));
+    ingest_bytes_ = 0;
+    ingest_window_start_us_ = now;
+  }
+}
+
+void RTMPSession::OnReadDone() {
+  if (type_ == Type::PUSH && !pending_messages_.empty()) {
+    size_t bytes = 0;
+    for (const auto& msg : pending_messages_) {
+      bytes += msg->payload.size();
+    }
+    UpdateIngestBitrate(bytes);
+    GetMetrics().messages_in.Add(pending_messages_.size());
+    RoomManager::GetInstance().Publish(room_id_, std::move(pending_messages_));
+    pending_messages_.clear();
+  }
+}
+
 void RTMPSession::OnClose() {
   if (type_ == Type::PULL) {
+    timeshift_.reset();
+    vod_.reset();
     RoomManager::GetInstance().LeaveRoom(room_id_, this);
+    if (admitted_) {
+      AdmissionController::GetInstance().Release(room_id_, GetPeerAddress());
+    }
+    if (relayed_) {
+      RelayManager::GetInstance().Release(room_id_);
+    }
   } else if (type_ == Type::PUSH) {
+    OnReadDone();
+    AdmissionController::GetInstance().UpdateRoomBitrate(room_id_, 0);
     RoomManager::GetInstance().CloseRoom(room_id_);
+    // 排在房间关闭之后，转推连接先发完已排队的数据
+    EventLoop* loop = GetEventLoop();
+    for (uint64_t id : forwarders_) {
+      loop->RunInLoop([loop, id]() { loop->CloseSession(id); });
+    }
   }
 }
 
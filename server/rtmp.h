@@ -4,16 +4,23 @@
 #include "server/command_message.h"
 #include "server/control_message.h"
 #include "server/handshake_message.h"
+#include "server/media_message.h"
 #include "server/net.h"
 #include "server/stream.h"
+#include "server/timeshift.h"
+#include "server/visitor.h"
+#include "server/vod.h"
 
 #include "util/util.h"
 
+#include <deque>
+
 namespace live {
 namespace util {
 namespace rtmp {
 
-class RTMPSession : public Session {
+class RTMPSession : public Session, public Visitor {
+ protected:
   // 从客户端的视角定义的
   enum Type {
     UNDEFINED,
@@ -65,9 +72,13 @@ class RTMPSession : public Session {
     return uint64_t(csid) << 32 | msid;
   }
 
+  // 将 onStatus 命令序列化至 WriteDataBuffer
+  void SendOnStatus(double id, const std::string& level,
+                    const std::string& code, const std::string& description);
+
   void HandleMessage(uint32_t csid, Message&& msg);
-  void HandleCommandMessage(uint32_t csid, const Message& msg,
-                            const CommandMessage& command);
+  virtual void HandleCommandMessage(uint32_t csid, const Message& msg,
+                                    const CommandMessage& command);
 
   uint32_t max_chunk_size_ = 128;
   uint32_t max_chunk_size_for_sending_ = 128;
@@ -76,16 +87,92 @@ class RTMPSession : public Session {
 
   int32_t room_id_ = -1;
 
+  // 观众是否已通过准入控制，关闭时据此归还名额
+  bool admitted_ = false;
+  // 观众所在房间是否从源站拉流，关闭时据此归还拉流引用
+  bool relayed_ = false;
+  // 时移观看时由它读取时移缓冲区并在追上直播后进入房间
+  std::unique_ptr<timeshift::TimeShiftPlayer> timeshift_;
+  // 点播观众的播放器
+  std::unique_ptr<vod::VodPlayer> vod_;
+  // start 为开始播放的秒数。点播文件在工作线程中打开，之后在本 EventLoop
+  // 中调用 StartVod，file 为空时回复 StreamNotFound
+  void PlayVod(double id, const std::string& name, Subscription subscription,
+               const std::string& start);
+  // @return 写出失败时返回 false
+  bool StartVod(double id, const std::string& name,
+                std::shared_ptr<const vod::VodFile> file,
+                Subscription subscription, uint32_t start_ms);
+
+  // 主播转推连接的 session id，主播离开时一并关闭
+  std::vector<uint64_t> forwarders_;
+  void StartForwarding(const std::string& stream_name);
+
+  // 主播统计推流码率用
+  uint64_t ingest_bytes_ = 0;
+  uint64_t ingest_window_start_us_ = 0;
+  void UpdateIngestBitrate(size_t bytes);
+
+  // 主播在本轮读事件中收到的音视频消息，在 OnReadDone 中一次性投递给房间
+  std::vector<MediaMessagePtr> pending_messages_;
+
+  // 发给观众的消息按优先级分别排队：metadata，音频，视频。
+  // 命令等控制消息不排队，直接写出。
+  enum Priority {
+    DATA_PRIORITY = 0,
+    AUDIO_PRIORITY = 1,
+    VIDEO_PRIORITY = 2,
+    PRIORITY_COUNT,
+  };
+
+  struct OutgoingMessage {
+    MediaMessagePtr msg;
+    uint32_t timestamp = 0;
+    // 已经序列化的 payload 字节数
+    size_t offset = 0;
+    // 交给本连接的时间，用于统计发送延迟
+    uint64_t enqueue_us = 0;
+  };
+
+  std::deque<OutgoingMessage> send_queues_[PRIORITY_COUNT];
+  bool write_watermark_set_ = false;
+
+  // 各队列中消息的总字节数超过 max_queued_bytes_ 时丢弃排队的视频帧，
+  // 之后的视频从下一个关键帧开始发送；仍超出时再丢弃音频，只剩不能丢的
+  // 消息时断开，总字节数不超过上限。为 0 表示不限制。
+  size_t max_queued_bytes_ = 0;
+  size_t queued_bytes_ = 0;
+  bool waiting_for_key_frame_ = false;
+  // 丢弃 queue 中尚未开始发送的非 sequence header 消息
+  // @return 丢弃的消息数
+  size_t DropQueuedMessages(std::deque<OutgoingMessage>& queue);
+
+  void EnqueueMessage(Priority priority, const MediaMessagePtr& msg,
+                      uint32_t timestamp);
+  // 将 msg 的下一个 chunk 序列化至 WriteDataBuffer
+  void SerializeNextChunk(OutgoingMessage& msg);
+  // 以 chunk 为粒度按优先级写出排队的消息，直到输出缓冲区达到 send_buffer_size。
+  // 大的视频帧发送期间，音频可以插入其 chunk 之间。
+  bool FlushSendQueues();
+
  public:
   bool OnRead() override;
+  void OnReadDone() override;
+  bool OnWrite() override;
   void OnClose() override;
+  const char* GetProtocol() const override {
+    return "rtmp";
+  }
 
-  void SendMetaData(const std::vector<uint8_t>& meta_payload);
-  void SendMediaData(uint8_t type, uint32_t timestamp,
-                     const std::vector<uint8_t>& payload);
+  void SendMetaData(const MediaMessagePtr& msg) override;
+  void SendMediaData(const MediaMessagePtr& msg, uint32_t timestamp) override;
 
   uint32_t GetChunkStreamIdForSending(const Message& msg) {
-    switch (msg.type) {
+    return GetChunkStreamIdForSending(msg.type);
+  }
+
+  uint32_t GetChunkStreamIdForSending(uint8_t type) {
+    switch (type) {
       case 1:
       case 2:
       case 3:
@@ -94,16 +181,21 @@ class RTMPSession : public Session {
       case 6: {
         return 2;
       }
-      case 8:
-      case 9:
-      case 18: {
+      // 音频、元数据、视频使用不同的 chunk stream，其 chunk 才能交错发送
+      case 8: {
         return 4;
       }
+      case 18: {
+        return 5;
+      }
+      case 9: {
+        return 6;
+      }
       case 20: {
         return 3;
       }
     }
-    LOG_ERROR << "not handle this type " << uint16_t(msg.type);
+    LOG_ERROR << "not handle this type " << uint16_t(type);
     assert(false);
     return -1;
   }
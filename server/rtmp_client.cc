@@ -0,0 +1,203 @@
+#include "server/rtmp_client.h"
+#include "server/relay.h"
+#include "server/room.h"
+
+namespace live {
+namespace util {
+namespace rtmp {
+
+// 命令的 transaction id
+static const double CONNECT_ID = 1;
+static const double CREATE_STREAM_ID = 2;
+static const double PLAY_OR_PUBLISH_ID = 3;
+
+static std::shared_ptr<ActionScriptObject> NewStringObject(
+    const std::string& value) {
+  std::shared_ptr<ActionScriptObject> obj(new ActionScriptObject());
+  obj->marker = ActionScriptObject::Type::STRING;
+  obj->string_value = value;
+  return obj;
+}
+
+RTMPClientSession::RTMPClientSession(Mode mode, int32_t room_id,
+                                     const std::string& tc_url,
+                                     const std::string& stream_name)
+    : mode_(mode), tc_url_(tc_url), stream_name_(stream_name) {
+  // 拉流时本连接是本地房间的主播，转推时是本地房间的观众
+  type_ = mode == PLAY ? Type::PUSH : Type::PULL;
+  room_id_ = room_id;
+  GetMetrics().SetRoom(room_id, mode == PLAY);
+  // 转推的目的地较慢时只丢弃本连接的数据，不影响房间及其他观众
+  if (mode == PUBLISH) {
+    max_queued_bytes_ = server::FLAGS_forward_queue_size;
+  }
+}
+
+bool RTMPClientSession::OnConnected() {
+  LOG_ERROR << "connected to " << GetPeerAddress() << ", tcUrl: " << tc_url_;
+
+  client_c0_.version = 3;
+  client_c1_.timestamp = GetPassedTimeSinceStartedInMicroSeconds() / 1000;
+  client_c1_.timestamp_sent = 0;
+  memset(client_c1_.random_data, 0, sizeof(client_c1_.random_data));
+
+  ByteStream(WriteDataBuffer())
+      << client_c0_ << client_c1_ << ByteStream::Commit();
+  return Write();
+}
+
+bool RTMPClientSession::OnReadInC0C1SentState() {
+  try {
+    ByteStream(ReadDataBuffer())
+        >> server_s0_ >> server_s1_ >> ByteStream::Commit();
+  } catch (const ByteStream::NotEnoughException& e) {
+    return true;
+  }
+
+  if (server_s0_.version != 3) {
+    LOG_ERROR << "only support version3, but got "
+              << uint32_t(server_s0_.version);
+    return false;
+  }
+
+  client_c2_.timestamp = server_s1_.timestamp;
+  client_c2_.timestamp_sent = client_c1_.timestamp;
+  memcpy(client_c2_.random_data, server_s1_.random_data,
+         sizeof(client_c2_.random_data));
+  ByteStream(WriteDataBuffer()) << client_c2_ << ByteStream::Commit();
+  if (!Write()) {
+    LOG_ERROR << "send c2 failed";
+    return false;
+  }
+
+  handshake_state_ = S1_RECEIVED;
+  return OnReadInS1ReceivedState();
+}
+
+bool RTMPClientSession::OnReadInS1ReceivedState() {
+  try {
+    ByteStream(ReadDataBuffer()) >> server_s2_ >> ByteStream::Commit();
+  } catch (const ByteStream::NotEnoughException& e) {
+    return true;
+  }
+
+  handshake_state_ = DONE;
+  state_ = HANDESHAKE_DONE;
+
+  SendConnect();
+  if (!Write()) {
+    LOG_ERROR << "send connect failed";
+    return false;
+  }
+  return OnReadInHandeShakeDoneState();
+}
+
+bool RTMPClientSession::OnRead() {
+  switch (handshake_state_) {
+    case C0_C1_SENT: {
+      return OnReadInC0C1SentState();
+    }
+    case S1_RECEIVED: {
+      return OnReadInS1ReceivedState();
+    }
+    case DONE: {
+      return RTMPSession::OnRead();
+    }
+  }
+  return false;
+}
+
+void RTMPClientSession::SendConnect() {
+  // tcUrl 形如 rtmp://127.0.0.1:9527/live?room=3，app 为其路径部分
+  std::string app;
+  size_t pos = tc_url_.find("://");
+  pos = tc_url_.find('/', pos == std::string::npos ? 0 : pos + 3);
+  if (pos != std::string::npos) {
+    app = tc_url_.substr(pos + 1, tc_url_.find('?', pos) - pos - 1);
+  }
+
+  CommandMessage cmd("connect", CONNECT_ID);
+  cmd.obj1.marker = ActionScriptObject::Type::OBJECT;
+  cmd.obj1.dict_value["app"] = NewStringObject(app);
+  cmd.obj1.dict_value["tcUrl"] = NewStringObject(tc_url_);
+  cmd.obj1.dict_value["type"] = NewStringObject("nonprivate");
+  cmd.obj1.dict_value["flashVer"] = NewStringObject("FMLE/3.0");
+
+  ByteStream(WriteDataBuffer())
+      << ChunkSerializeHelper(this, std::move(cmd)) << ByteStream::Commit();
+}
+
+void RTMPClientSession::SendCreateStream() {
+  CommandMessage cmd("createStream", CREATE_STREAM_ID);
+  cmd.obj1.marker = ActionScriptObject::Type::NULL_TYPE;
+
+  ByteStream(WriteDataBuffer())
+      << ChunkSerializeHelper(this, std::move(cmd)) << ByteStream::Commit();
+}
+
+void RTMPClientSession::SendPlayOrPublish() {
+  CommandMessage cmd(mode_ == PLAY ? "play" : "publish", PLAY_OR_PUBLISH_ID);
+  cmd.obj1.marker = ActionScriptObject::Type::NULL_TYPE;
+  cmd.obj2.marker = ActionScriptObject::Type::STRING;
+  cmd.obj2.string_value = stream_name_;
+  if (mode_ == PUBLISH) {
+    cmd.obj3.marker = ActionScriptObject::Type::STRING;
+    cmd.obj3.string_value = "live";
+  }
+
+  ByteStream(WriteDataBuffer())
+      << ChunkSerializeHelper(this, std::move(cmd)) << ByteStream::Commit();
+}
+
+void RTMPClientSession::HandleCommandMessage(uint32_t, const Message&,
+                                             const CommandMessage& command) {
+  if (command.name == "_result" && command.id == CONNECT_ID) {
+    SendCreateStream();
+  } else if (command.name == "_result" && command.id == CREATE_STREAM_ID) {
+    // 之后的音视频消息须使用对端分配的 msid
+    msid_for_create_stream_ = uint32_t(command.obj2.double_value);
+    SendPlayOrPublish();
+  } else if (command.name == "onStatus") {
+    auto level = command.obj2.dict_value.find("level");
+    auto code = command.obj2.dict_value.find("code");
+    std::string code_value =
+        code == command.obj2.dict_value.end() ? "" : code->second->string_value;
+    LOG_ERROR << "onStatus from " << GetPeerAddress() << ", " << code_value;
+
+    if (level != command.obj2.dict_value.end() &&
+        level->second->string_value == "error") {
+      Session::SetFlag(Session::FLAG::NEED_CLOSE);
+      return;
+    }
+    if (mode_ == PUBLISH && code_value == "NetStream.Publish.Start" &&
+        !RoomManager::GetInstance().EnterRoom(room_id_, this)) {
+      LOG_ERROR << "enter room failed, room_id: " << room_id_;
+      Session::SetFlag(Session::FLAG::NEED_CLOSE);
+      return;
+    }
+  } else if (command.name == "_error") {
+    LOG_ERROR << "command failed, id: " << command.id;
+    Session::SetFlag(Session::FLAG::NEED_CLOSE);
+    return;
+  } else {
+    // onBWDone 等无需处理
+    return;
+  }
+
+  if (!Write()) {
+    LOG_ERROR << "send command failed";
+  }
+}
+
+void RTMPClientSession::OnClose() {
+  LOG_ERROR << "disconnected from " << GetPeerAddress()
+            << ", room_id: " << room_id_;
+  RTMPSession::OnClose();
+  if (mode_ == PLAY) {
+    RelayManager::GetInstance().OnRelayClosed(room_id_, GetId());
+  }
+}
+
+}  // namespace rtmp
+}  // namespace util
+}  // namespace live
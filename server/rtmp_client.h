@@ -0,0 +1,66 @@
+#pragma once
+
+#include "server/rtmp.h"
+
+namespace live {
+namespace util {
+namespace rtmp {
+
+// 由 server 主动发起的 RTMP 连接
+class RTMPClientSession : public RTMPSession {
+ public:
+  enum Mode {
+    // 从源站拉流，作为本地房间的主播
+    PLAY,
+    // 将本地房间转推至其他服务器，作为本地房间的观众
+    PUBLISH,
+  };
+
+ private:
+  enum HandshakeState {
+    C0_C1_SENT,
+    S1_RECEIVED,
+    DONE,
+  };
+
+  Mode mode_;
+  HandshakeState handshake_state_ = C0_C1_SENT;
+  std::string tc_url_;
+  std::string stream_name_;
+
+  HandshakeMessage0 client_c0_;
+  HandshakeMessage1 client_c1_;
+  HandshakeMessage2 client_c2_;
+  HandshakeMessage0 server_s0_;
+  HandshakeMessage1 server_s1_;
+  HandshakeMessage2 server_s2_;
+
+  bool OnReadInC0C1SentState();
+  bool OnReadInS1ReceivedState();
+
+  void SendConnect();
+  void SendCreateStream();
+  void SendPlayOrPublish();
+
+  void HandleCommandMessage(uint32_t csid, const Message& msg,
+                            const CommandMessage& command) override;
+
+ public:
+  RTMPClientSession(Mode mode, int32_t room_id, const std::string& tc_url,
+                    const std::string& stream_name);
+
+  bool OnConnected() override;
+  bool OnRead() override;
+  void OnClose() override;
+
+  static std::unique_ptr<Session> CreateRTMPClientSession(
+      Mode mode, int32_t room_id, const std::string& tc_url,
+      const std::string& stream_name) {
+    return std::unique_ptr<Session>(
+        new RTMPClientSession(mode, room_id, tc_url, stream_name));
+  }
+};
+
+}  // namespace rtmp
+}  // namespace util
+}  // namespace live
@@ -0,0 +1,129 @@
+#include "server/rtp.h"
+#include "util/util.h"
+
+#include <algorithm>
+
+namespace live {
+namespace util {
+namespace rtp {
+
+// FU-A 的 NALU type
+static const uint8_t FU_A = 28;
+
+static void PacketizeNalu(const uint8_t* nalu, size_t size, Packets* out) {
+  if (size <= MAX_PAYLOAD_SIZE) {
+    Packet packet;
+    packet.payload.assign(nalu, nalu + size);
+    out->push_back(std::move(packet));
+    return;
+  }
+  // FU indicator 沿用 NALU header 的 F、NRI，FU header 带上原 type
+  const uint8_t indicator = (nalu[0] & 0xE0) | FU_A;
+  const uint8_t type = nalu[0] & 0x1F;
+  size_t pos = 1;
+  while (pos < size) {
+    size_t len = std::min(size - pos, MAX_PAYLOAD_SIZE - 2);
+    uint8_t header = type;
+    if (pos == 1) {
+      header |= 0x80;
+    }
+    if (pos + len == size) {
+      header |= 0x40;
+    }
+    Packet packet;
+    packet.payload.reserve(len + 2);
+    packet.payload.push_back(indicator);
+    packet.payload.push_back(header);
+    packet.payload.insert(packet.payload.end(), nalu + pos, nalu + pos + len);
+    out->push_back(std::move(packet));
+    pos += len;
+  }
+}
+
+bool PacketizeH264(const AVCConfig& config, const MediaMessage& msg,
+                   Packets* out) {
+  const std::vector<uint8_t>& payload = msg.payload;
+  std::vector<NaluRange> scratch;
+  const std::vector<NaluRange>* nalus = config.GetNalus(msg, &scratch);
+  if (msg.codec != MediaCodec::AVC || !nalus) {
+    return false;
+  }
+  const size_t begin = out->size();
+  const bool is_key_frame = msg.IsKeyFrame();
+  if (is_key_frame) {
+    for (auto* list : {&config.sps, &config.pps}) {
+      for (const auto& nalu : *list) {
+        PacketizeNalu(nalu.data(), nalu.size(), out);
+      }
+    }
+  }
+
+  for (const NaluRange& nalu : *nalus) {
+    const uint8_t type = payload[nalu.offset] & 0x1F;
+    // AUD 对 RTP 没有意义；关键帧前已发过配置中的 SPS、PPS，帧内的不再重复
+    if (type == 9 || (is_key_frame && type == 7 && !config.sps.empty()) ||
+        (is_key_frame && type == 8 && !config.pps.empty())) {
+      continue;
+    }
+    PacketizeNalu(&payload[nalu.offset], nalu.size, out);
+  }
+  if (out->size() == begin) {
+    return false;
+  }
+  // 一帧的最后一个包
+  out->back().marker = true;
+  return true;
+}
+
+bool PacketizeAAC(const MediaMessage& msg, Packets* out) {
+  if (!msg.is_frame || msg.codec != MediaCodec::AAC) {
+    return false;
+  }
+  // AU-headers-length 为 16 bit，AU-header 为 13 bit 长度及 3 bit index
+  const size_t size = msg.DataSize();
+  if (size >= (1 << 13)) {
+    return false;
+  }
+  Packet packet;
+  packet.payload.reserve(size + 4);
+  packet.payload.push_back(0x00);
+  packet.payload.push_back(0x10);
+  packet.payload.push_back(uint8_t(size >> 5));
+  packet.payload.push_back(uint8_t((size & 0x1F) << 3));
+  packet.payload.insert(packet.payload.end(), msg.Data(), msg.Data() + size);
+  packet.marker = true;
+  out->push_back(std::move(packet));
+  return true;
+}
+
+std::shared_ptr<const Packets> Packetize(const AVCConfig& avc,
+                                         const MediaMessage& msg) {
+  return msg.GetPackaged<Packets>(
+      MediaMessage::RTP, [&avc, &msg]() -> std::shared_ptr<const Packets> {
+        auto packets = std::make_shared<Packets>();
+        bool ok = msg.type == 9 ? PacketizeH264(avc, msg, packets.get())
+                                : PacketizeAAC(msg, packets.get());
+        if (!ok) {
+          LOG_ERROR << "packetize rtp failed, type: " << int32_t(msg.type);
+          packets->clear();
+        }
+        return packets;
+      });
+}
+
+void BuildHeader(uint8_t payload_type, bool marker, uint16_t sequence,
+                 uint32_t timestamp, uint32_t ssrc, uint8_t* out) {
+  // version 2，无 padding、extension、CSRC
+  out[0] = 0x80;
+  out[1] = uint8_t((marker ? 0x80 : 0) | (payload_type & 0x7F));
+  out[2] = uint8_t(sequence >> 8);
+  out[3] = uint8_t(sequence);
+  for (int i = 0; i < 4; i++) {
+    out[4 + i] = uint8_t(timestamp >> (24 - 8 * i));
+    out[8 + i] = uint8_t(ssrc >> (24 - 8 * i));
+  }
+}
+
+}  // namespace rtp
+}  // namespace util
+}  // namespace live
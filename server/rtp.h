@@ -0,0 +1,46 @@
+#pragma once
+
+#include "server/codec.h"
+#include "server/media_message.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace live {
+namespace util {
+namespace rtp {
+
+// RTP payload 的上限，加上各层头部后不超过以太网 MTU
+static const size_t MAX_PAYLOAD_SIZE = 1400;
+static const size_t HEADER_SIZE = 12;
+
+static const uint8_t H264_PAYLOAD_TYPE = 96;
+static const uint8_t AAC_PAYLOAD_TYPE = 97;
+
+// 不含 RTP header 的一个包，header 中的序号、SSRC 因观众而异，发送时再生成
+struct Packet {
+  std::vector<uint8_t> payload;
+  bool marker = false;
+};
+using Packets = std::vector<Packet>;
+
+// RFC 6184，不超过 MAX_PAYLOAD_SIZE 的 NALU 单独成包，否则拆分为 FU-A。
+// 关键帧前先发送 config 中的 SPS、PPS
+bool PacketizeH264(const AVCConfig& config, const MediaMessage& msg,
+                   Packets* out);
+
+// RFC 3640 AAC-hbr，每个包一个 AAC 帧
+bool PacketizeAAC(const MediaMessage& msg, Packets* out);
+
+// 缓存在 msg 上的封包结果，所有 RTSP 观众共享，失败时为空
+std::shared_ptr<const Packets> Packetize(const AVCConfig& avc,
+                                         const MediaMessage& msg);
+
+void BuildHeader(uint8_t payload_type, bool marker, uint16_t sequence,
+                 uint32_t timestamp, uint32_t ssrc, uint8_t* out);
+
+}  // namespace rtp
+}  // namespace util
+}  // namespace live
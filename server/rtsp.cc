@@ -0,0 +1,551 @@
+#include "server/rtsp.h"
+#include "server/admission.h"
+#include "server/args.h"
+#include "server/room.h"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <random>
+#include <sstream>
+
+extern "C" {
+#include <libavutil/base64.h>
+}
+
+namespace live {
+namespace util {
+namespace rtsp {
+
+// 请求头及 body 的长度上限
+static const size_t MAX_REQUEST_SIZE = 8192;
+
+static const char PUBLIC_METHODS[] =
+    "OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER, SET_PARAMETER";
+
+static std::string ToLower(std::string str) {
+  std::transform(str.begin(), str.end(), str.begin(), ::tolower);
+  return str;
+}
+
+static std::string Trim(const std::string& str) {
+  size_t begin = str.find_first_not_of(" \t\r");
+  if (begin == std::string::npos) {
+    return "";
+  }
+  return str.substr(begin, str.find_last_not_of(" \t\r") - begin + 1);
+}
+
+static uint32_t Random32() {
+  static thread_local std::mt19937 engine{std::random_device()()};
+  return engine();
+}
+
+// 每个 EventLoop 一个非阻塞 UDP socket，发送本线程上所有 UDP 观众的 RTP
+// @return 失败时返回 -1
+static int GetUdpSocket(uint16_t* port) {
+  static thread_local int fd = -1;
+  static thread_local uint16_t local_port = 0;
+  if (fd < 0) {
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    socklen_t len = sizeof(addr);
+    if (fd < 0 ||
+        bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) < 0 ||
+        evutil_make_socket_nonblocking(fd) < 0) {
+      LOG_ERROR << "create rtp udp socket failed, errno: " << errno;
+      if (fd >= 0) {
+        close(fd);
+      }
+      fd = -1;
+      return -1;
+    }
+    local_port = ntohs(addr.sin_port);
+  }
+  if (port) {
+    *port = local_port;
+  }
+  return fd;
+}
+
+// url 形如 rtsp://host:port/live/3/trackID=0，control 为房间之后的部分
+static bool ParseUrl(const std::string& url, int32_t* room_id,
+                     std::string* control) {
+  static const std::string PREFIX = "/live/";
+  size_t scheme = url.find("://");
+  size_t begin = url.find('/', scheme == std::string::npos ? 0 : scheme + 3);
+  if (begin == std::string::npos) {
+    return false;
+  }
+  std::string path = url.substr(begin, url.find('?') - begin);
+  if (path.compare(0, PREFIX.size(), PREFIX)) {
+    return false;
+  }
+  size_t end = path.find('/', PREFIX.size());
+  std::string name = path.substr(PREFIX.size(), end - PREFIX.size());
+  if (name.empty() || name.size() > 9 ||
+      name.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  *room_id = std::stoi(name);
+  *control = end == std::string::npos ? "" : path.substr(end + 1);
+  return true;
+}
+
+bool RtspSession::OnRead() {
+  std::vector<uint8_t>& bytes = ReadDataBuffer();
+  static const char DELIMITER[] = "\r\n\r\n";
+  while (!bytes.empty() && state_ != CLOSING) {
+    // interleaved 模式下客户端会发来 RTCP，直接丢弃
+    if (bytes[0] == '$') {
+      if (bytes.size() < 4) {
+        break;
+      }
+      size_t size = 4 + (bytes[2] << 8 | bytes[3]);
+      if (bytes.size() < size) {
+        break;
+      }
+      bytes.erase(bytes.begin(), bytes.begin() + size);
+      continue;
+    }
+
+    auto end = std::search(bytes.begin(), bytes.end(), DELIMITER,
+                           DELIMITER + sizeof(DELIMITER) - 1);
+    if (end == bytes.end()) {
+      if (bytes.size() > MAX_REQUEST_SIZE) {
+        LOG_ERROR << "rtsp request too large, peer: " << GetPeerAddress();
+        return false;
+      }
+      break;
+    }
+
+    // 请求行形如 DESCRIBE rtsp://host/live/3 RTSP/1.0
+    std::istringstream iss(std::string(bytes.begin(), end));
+    std::string line;
+    std::getline(iss, line);
+    std::istringstream request_line(line);
+    std::string method, url, version;
+    request_line >> method >> url >> version;
+
+    Headers headers;
+    while (std::getline(iss, line)) {
+      size_t colon = line.find(':');
+      if (colon != std::string::npos) {
+        headers[ToLower(Trim(line.substr(0, colon)))] =
+            Trim(line.substr(colon + 1));
+      }
+    }
+
+    // SET_PARAMETER 等请求可能带有 body，忽略其内容
+    size_t size = end - bytes.begin() + sizeof(DELIMITER) - 1;
+    auto length = headers.find("content-length");
+    if (length != headers.end()) {
+      const std::string& value = length->second;
+      if (value.empty() || value.size() > 4 ||
+          value.find_first_not_of("0123456789") != std::string::npos ||
+          size + std::stoul(value) > MAX_REQUEST_SIZE) {
+        LOG_ERROR << "invalid rtsp content length " << value;
+        return false;
+      }
+      size += std::stoul(value);
+    }
+    if (bytes.size() < size) {
+      break;
+    }
+    bytes.erase(bytes.begin(), bytes.begin() + size);
+
+    LOG_ERROR << "rtsp request from " << GetPeerAddress() << ", " << method
+              << " " << url;
+    if (!HandleRequest(method, url, headers)) {
+      return false;
+    }
+  }
+
+  if (state_ == CLOSING) {
+    bytes.resize(0);
+  }
+  return true;
+}
+
+bool RtspSession::HandleRequest(const std::string& method,
+                                const std::string& url,
+                                const Headers& headers) {
+  if (method == "OPTIONS") {
+    SendResponse(200, "OK", headers,
+                 std::string("Public: ") + PUBLIC_METHODS + "\r\n", "");
+  } else if (method == "DESCRIBE") {
+    return HandleDescribe(url, headers);
+  } else if (method == "SETUP") {
+    return HandleSetup(url, headers);
+  } else if (method == "PLAY") {
+    return HandlePlay(url, headers);
+  } else if (method == "TEARDOWN") {
+    SendResponse(200, "OK", headers, "", "");
+    state_ = CLOSING;
+    Session::SetFlag(Session::FLAG::CLOSE_AFTER_WRITE);
+  } else if (method == "GET_PARAMETER" || method == "SET_PARAMETER") {
+    // 客户端以此保活
+    SendResponse(200, "OK", headers, "", "");
+  } else {
+    // 直播不支持 PAUSE、RECORD 等，回复错误但不断开
+    SendResponse(501, "Not Implemented", headers, "", "");
+  }
+  return !IsNeedClose();
+}
+
+bool RtspSession::LoadRoom(const std::string& url) {
+  int32_t room_id = -1;
+  std::string control;
+  if (!ParseUrl(url, &room_id, &control) ||
+      (room_id_ >= 0 && room_id != room_id_)) {
+    return false;
+  }
+  MediaMessagePtr avc, aac;
+  if (!RoomManager::GetInstance().GetCodecHeaders(room_id, &avc, &aac)) {
+    return false;
+  }
+  room_id_ = room_id;
+  has_avc_ = avc && avc_.Parse(avc->Data(), avc->DataSize());
+  has_aac_ = aac && aac_.Parse(aac->Data(), aac->DataSize());
+  return has_avc_ || has_aac_;
+}
+
+std::string RtspSession::BuildSDP() const {
+  std::ostringstream oss;
+  oss << "v=0\r\n"
+      << "o=- " << GetId() << " 1 IN IP4 0.0.0.0\r\n"
+      << "s=live " << room_id_ << "\r\n"
+      << "c=IN IP4 0.0.0.0\r\n"
+      << "t=0 0\r\n"
+      << "a=control:*\r\n";
+  if (has_avc_) {
+    oss << "m=video 0 RTP/AVP " << int32_t(rtp::H264_PAYLOAD_TYPE) << "\r\n"
+        << "a=rtpmap:" << int32_t(rtp::H264_PAYLOAD_TYPE) << " H264/90000\r\n"
+        << "a=fmtp:" << int32_t(rtp::H264_PAYLOAD_TYPE)
+        << " packetization-mode=1";
+    if (!avc_.sps.empty() && avc_.sps[0].size() >= 4) {
+      char profile[8];
+      snprintf(profile, sizeof(profile), "%02X%02X%02X", avc_.sps[0][1],
+               avc_.sps[0][2], avc_.sps[0][3]);
+      oss << ";profile-level-id=" << profile;
+    }
+    // sprop-parameter-sets 为 base64 编码的 SPS、PPS，以逗号分隔
+    std::string sets;
+    for (auto* list : {&avc_.sps, &avc_.pps}) {
+      for (const auto& nalu : *list) {
+        std::vector<char> text(AV_BASE64_SIZE(nalu.size()));
+        av_base64_encode(text.data(), text.size(), nalu.data(), nalu.size());
+        sets += (sets.empty() ? "" : ",") + std::string(text.data());
+      }
+    }
+    if (!sets.empty()) {
+      oss << ";sprop-parameter-sets=" << sets;
+    }
+    oss << "\r\n"
+        << "a=control:trackID=0\r\n";
+  }
+  if (has_aac_) {
+    std::string config;
+    for (uint8_t b : aac_.record) {
+      char hex[4];
+      snprintf(hex, sizeof(hex), "%02X", b);
+      config += hex;
+    }
+    oss << "m=audio 0 RTP/AVP " << int32_t(rtp::AAC_PAYLOAD_TYPE) << "\r\n"
+        << "a=rtpmap:" << int32_t(rtp::AAC_PAYLOAD_TYPE) << " MPEG4-GENERIC/"
+        << aac_.SampleRate() << "/" << int32_t(aac_.channels) << "\r\n"
+        << "a=fmtp:" << int32_t(rtp::AAC_PAYLOAD_TYPE)
+        << " streamtype=5;profile-level-id=1;mode=AAC-hbr;sizelength=13;"
+        << "indexlength=3;indexdeltalength=3;config=" << config << "\r\n"
+        << "a=control:trackID=1\r\n";
+  }
+  return oss.str();
+}
+
+bool RtspSession::HandleDescribe(const std::string& url,
+                                 const Headers& headers) {
+  if (!LoadRoom(url)) {
+    SendErrorResponse(404, "Not Found", headers);
+    return !IsNeedClose();
+  }
+  std::string base = url.substr(0, url.find('?'));
+  if (base.back() != '/') {
+    base += '/';
+  }
+  SendResponse(200, "OK", headers,
+               "Content-Type: application/sdp\r\n"
+               "Content-Base: " + base + "\r\n",
+               BuildSDP());
+  return !IsNeedClose();
+}
+
+bool RtspSession::HandleSetup(const std::string& url,
+                              const Headers& headers) {
+  if (state_ == PLAYING) {
+    SendErrorResponse(455, "Method Not Valid in This State", headers);
+    return !IsNeedClose();
+  }
+  int32_t room_id = -1;
+  std::string control;
+  // 客户端可以不经 DESCRIBE 直接 SETUP
+  if (!ParseUrl(url, &room_id, &control) ||
+      (room_id_ < 0 && !LoadRoom(url))) {
+    SendErrorResponse(404, "Not Found", headers);
+    return !IsNeedClose();
+  }
+  int32_t index = -1;
+  if (control == "trackID=0" && has_avc_) {
+    index = 0;
+  } else if (control == "trackID=1" && has_aac_) {
+    index = 1;
+  }
+  if (room_id != room_id_ || index < 0) {
+    SendErrorResponse(404, "Not Found", headers);
+    return !IsNeedClose();
+  }
+
+  // Transport 形如 RTP/AVP/TCP;unicast;interleaved=0-1
+  // 或 RTP/AVP;unicast;client_port=5000-5001
+  auto it = headers.find("transport");
+  std::string transport = it == headers.end() ? "" : it->second;
+  Track& track = tracks_[index];
+  track.interleaved = transport.find("/TCP") != std::string::npos;
+  track.channel = uint8_t(index * 2);
+  int32_t client_port = -1;
+  std::istringstream iss(transport);
+  std::string item;
+  while (std::getline(iss, item, ';')) {
+    if (!item.compare(0, 12, "interleaved=")) {
+      track.channel = uint8_t(atoi(item.c_str() + 12));
+    } else if (!item.compare(0, 12, "client_port=")) {
+      client_port = atoi(item.c_str() + 12);
+    }
+  }
+
+  uint16_t server_port = 0;
+  if (!track.interleaved) {
+    track.address = sockaddr_in();
+    track.address.sin_family = AF_INET;
+    track.address.sin_port = htons(uint16_t(client_port));
+    if (client_port <= 0 || client_port > 65535 ||
+        inet_pton(AF_INET, GetPeerAddress().c_str(),
+                  &track.address.sin_addr) != 1 ||
+        GetUdpSocket(&server_port) < 0) {
+      SendErrorResponse(461, "Unsupported Transport", headers);
+      return !IsNeedClose();
+    }
+  }
+  track.setup = true;
+  track.sequence = uint16_t(Random32());
+  track.ssrc = Random32();
+
+  char ssrc[16];
+  snprintf(ssrc, sizeof(ssrc), "%08X", track.ssrc);
+  std::ostringstream oss;
+  if (track.interleaved) {
+    oss << "Transport: RTP/AVP/TCP;unicast;interleaved="
+        << int32_t(track.channel) << "-" << int32_t(track.channel) + 1;
+  } else {
+    oss << "Transport: RTP/AVP;unicast;client_port=" << client_port << "-"
+        << client_port + 1 << ";server_port=" << server_port << "-"
+        << server_port + 1;
+  }
+  oss << ";ssrc=" << ssrc << "\r\n";
+  SendResponse(200, "OK", headers, oss.str(), "");
+  return !IsNeedClose();
+}
+
+bool RtspSession::HandlePlay(const std::string& url, const Headers& headers) {
+  if (state_ == PLAYING) {
+    SendResponse(200, "OK", headers, "Range: npt=0.000-\r\n", "");
+    return !IsNeedClose();
+  }
+  if (!tracks_[0].setup && !tracks_[1].setup) {
+    SendErrorResponse(455, "Method Not Valid in This State", headers);
+    return !IsNeedClose();
+  }
+
+  std::string reason;
+  if (!AdmissionController::GetInstance().Admit(room_id_, GetPeerAddress(),
+                                                &reason)) {
+    LOG_ERROR << "reject viewer, room_id: " << room_id_
+              << ", ip: " << GetPeerAddress() << ", reason: " << reason;
+    SendErrorResponse(503, "Service Unavailable", headers);
+    return !IsNeedClose();
+  }
+  admitted_ = true;
+  GetMetrics().SetRoom(room_id_, false);
+
+  SendResponse(200, "OK", headers, "Range: npt=0.000-\r\n", "");
+  if (IsNeedClose()) {
+    return false;
+  }
+
+  // 进入房间时会立即收到缓存的数据，须在响应之后
+  Subscription subscription = Subscription::ALL;
+  if (!tracks_[0].setup) {
+    subscription = Subscription::AUDIO;
+  } else if (!tracks_[1].setup) {
+    subscription = Subscription::VIDEO;
+  }
+  state_ = PLAYING;
+  if (!RoomManager::GetInstance().EnterRoom(room_id_, this, subscription)) {
+    LOG_ERROR << "enter room failed, room_id: " << room_id_;
+    return false;
+  }
+  entered_ = true;
+  return true;
+}
+
+void RtspSession::SendResponse(int32_t code, const std::string& reason,
+                               const Headers& headers,
+                               const std::string& extra,
+                               const std::string& body) {
+  std::ostringstream oss;
+  oss << "RTSP/1.0 " << code << " " << reason << "\r\n";
+  auto cseq = headers.find("cseq");
+  if (cseq != headers.end()) {
+    oss << "CSeq: " << cseq->second << "\r\n";
+  }
+  if (tracks_[0].setup || tracks_[1].setup) {
+    oss << "Session: " << GetId() << ";timeout=60\r\n";
+  }
+  oss << extra;
+  if (!body.empty()) {
+    oss << "Content-Length: " << body.size() << "\r\n";
+  }
+  oss << "\r\n" << body;
+  std::string response = oss.str();
+
+  std::vector<uint8_t>& out = WriteDataBuffer();
+  out.insert(out.end(), response.begin(), response.end());
+  if (!Write()) {
+    Session::SetFlag(Session::FLAG::NEED_CLOSE);
+  }
+}
+
+void RtspSession::SendErrorResponse(int32_t code, const std::string& reason,
+                                    const Headers& headers) {
+  SendResponse(code, reason, headers, "", "");
+  state_ = CLOSING;
+  Session::SetFlag(Session::FLAG::CLOSE_AFTER_WRITE);
+}
+
+void RtspSession::SendPackets(
+    int32_t index, uint8_t payload_type,
+    const std::shared_ptr<const rtp::Packets>& packets, uint32_t timestamp) {
+  Track& track = tracks_[index];
+  if (!track.interleaved) {
+    int fd = GetUdpSocket(nullptr);
+    if (fd < 0) {
+      return;
+    }
+    for (const auto& p : *packets) {
+      uint8_t header[rtp::HEADER_SIZE];
+      rtp::BuildHeader(payload_type, p.marker, track.sequence++, timestamp,
+                       track.ssrc, header);
+      iovec iov[2] = {{header, sizeof(header)},
+                      {const_cast<uint8_t*>(p.payload.data()),
+                       p.payload.size()}};
+      msghdr msg = {};
+      msg.msg_name = &track.address;
+      msg.msg_namelen = sizeof(track.address);
+      msg.msg_iov = iov;
+      msg.msg_iovlen = 2;
+      // socket 缓冲区满时直接丢包，由客户端按序号发现
+      sendmsg(fd, &msg, 0);
+    }
+    return;
+  }
+
+  // interleaved 时每个包前加 $、channel 及 16 bit 长度
+  const uint64_t enqueue_us = GetPassedTimeSinceStartedInMicroSeconds();
+  std::vector<uint8_t>& out = WriteDataBuffer();
+  for (const auto& p : *packets) {
+    const size_t size = rtp::HEADER_SIZE + p.payload.size();
+    uint8_t header[4 + rtp::HEADER_SIZE] = {'$', track.channel,
+                                            uint8_t(size >> 8),
+                                            uint8_t(size)};
+    rtp::BuildHeader(payload_type, p.marker, track.sequence++, timestamp,
+                     track.ssrc, header + 4);
+    out.insert(out.end(), header, header + sizeof(header));
+    if (!WriteReference(p.payload.data(), p.payload.size(), packets)) {
+      LOG_ERROR << "send rtp packet failed";
+      Session::SetFlag(Session::FLAG::NEED_CLOSE);
+      return;
+    }
+  }
+  if (!Write()) {
+    LOG_ERROR << "send rtp packet failed";
+    Session::SetFlag(Session::FLAG::NEED_CLOSE);
+    return;
+  }
+  MarkMessageSent(enqueue_us);
+}
+
+void RtspSession::SendMediaData(const MediaMessagePtr& msg,
+                                uint32_t timestamp) {
+  if (state_ != PLAYING) {
+    return;
+  }
+  if (msg->codec == MediaCodec::AVC) {
+    if (msg->IsAVCSequenceHeader()) {
+      has_avc_ = avc_.Parse(msg->Data(), msg->DataSize());
+      return;
+    }
+    if (!tracks_[0].setup || !has_avc_ || !msg->is_frame) {
+      return;
+    }
+    bool is_key_frame = msg->IsKeyFrame();
+    if (waiting_for_key_frame_ && !is_key_frame) {
+      GetMetrics().dropped_frames.Add();
+      return;
+    }
+    if (!is_key_frame &&
+        GetOutputBufferSize() > size_t(server::FLAGS_rtsp_buffer_size)) {
+      LOG_ERROR << "output buffer overflow, drop video until next key frame, "
+                << "peer: " << GetPeerAddress()
+                << ", buffered bytes: " << GetOutputBufferSize();
+      waiting_for_key_frame_ = true;
+      GetMetrics().dropped_frames.Add();
+      return;
+    }
+    waiting_for_key_frame_ = false;
+    // RTP 时间戳为 90kHz 的 PTS
+    SendPackets(0, rtp::H264_PAYLOAD_TYPE, rtp::Packetize(avc_, *msg),
+                uint32_t((timestamp + msg->cts) * 90));
+    GetMetrics().messages_out.Add();
+  } else if (msg->codec == MediaCodec::AAC) {
+    if (msg->is_config) {
+      has_aac_ = aac_.Parse(msg->Data(), msg->DataSize());
+      return;
+    }
+    if (!tracks_[1].setup || !has_aac_) {
+      return;
+    }
+    // RTP 时间戳以采样率为单位
+    SendPackets(1, rtp::AAC_PAYLOAD_TYPE, rtp::Packetize(avc_, *msg),
+                uint32_t(uint64_t(timestamp) * aac_.SampleRate() / 1000));
+    GetMetrics().messages_out.Add();
+  }
+}
+
+void RtspSession::OnClose() {
+  if (entered_) {
+    RoomManager::GetInstance().LeaveRoom(room_id_, this);
+  }
+  if (admitted_) {
+    AdmissionController::GetInstance().Release(room_id_, GetPeerAddress());
+  }
+}
+
+}  // namespace rtsp
+}  // namespace util
+}  // namespace live
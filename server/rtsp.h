@@ -0,0 +1,93 @@
+#pragma once
+
+#include "server/codec.h"
+#include "server/media_message.h"
+#include "server/net.h"
+#include "server/rtp.h"
+#include "server/visitor.h"
+
+#include "util/util.h"
+
+#include <netinet/in.h>
+
+#include <string>
+#include <unordered_map>
+
+namespace live {
+namespace util {
+namespace rtsp {
+
+// RTSP 观众：rtsp://host:port/live/<room>，DESCRIBE 返回 H.264 及 AAC 的 SDP，
+// SETUP 支持 RTP over TCP（interleaved）及 RTP over UDP。
+// 每条消息在每个 EventLoop 上只封包一次，RTP payload 由所有观众共享，
+// 只有 12 字节的 RTP header 为每个观众单独生成。
+class RtspSession : public Session, public Visitor {
+  enum State {
+    INIT,
+    PLAYING,
+    // 已回复错误或 TEARDOWN，等待数据发完后关闭
+    CLOSING,
+  };
+
+  // 0 为视频，1 为音频，与 SDP 中的 trackID 一致
+  struct Track {
+    bool setup = false;
+    bool interleaved = false;
+    // interleaved 时 RTP 所用的 channel
+    uint8_t channel = 0;
+    // UDP 时客户端的 RTP 地址
+    sockaddr_in address;
+    uint16_t sequence = 0;
+    uint32_t ssrc = 0;
+  };
+
+  State state_ = INIT;
+  int32_t room_id_ = -1;
+  bool entered_ = false;
+  bool admitted_ = false;
+  Track tracks_[2];
+
+  AVCConfig avc_;
+  bool has_avc_ = false;
+  AACConfig aac_;
+  bool has_aac_ = false;
+
+  // 输出缓冲区过大时丢弃视频帧，之后从下一个关键帧开始发送
+  bool waiting_for_key_frame_ = false;
+
+  using Headers = std::unordered_map<std::string, std::string>;
+  bool HandleRequest(const std::string& method, const std::string& url,
+                     const Headers& headers);
+  bool HandleDescribe(const std::string& url, const Headers& headers);
+  bool HandleSetup(const std::string& url, const Headers& headers);
+  bool HandlePlay(const std::string& url, const Headers& headers);
+  // 由 url 得到房间并读取其解码配置
+  bool LoadRoom(const std::string& url);
+  std::string BuildSDP() const;
+  void SendResponse(int32_t code, const std::string& reason,
+                    const Headers& headers, const std::string& extra,
+                    const std::string& body);
+  void SendErrorResponse(int32_t code, const std::string& reason,
+                         const Headers& headers);
+  void SendPackets(int32_t track, uint8_t payload_type,
+                   const std::shared_ptr<const rtp::Packets>& packets,
+                   uint32_t timestamp);
+
+ public:
+  bool OnRead() override;
+  void OnClose() override;
+  const char* GetProtocol() const override {
+    return "rtsp";
+  }
+
+  void SendMetaData(const MediaMessagePtr& msg) override {}
+  void SendMediaData(const MediaMessagePtr& msg, uint32_t timestamp) override;
+
+  static std::unique_ptr<Session> CreateRtspSession() {
+    return std::unique_ptr<Session>(new RtspSession());
+  }
+};
+
+}  // namespace rtsp
+}  // namespace util
+}  // namespace live
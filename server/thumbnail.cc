@@ -0,0 +1,247 @@
+#include "server/thumbnail.h"
+#include "server/args.h"
+
+#include "util/base.h"
+#include "util/trace.h"
+#include "util/util.h"
+#include "util/video_scale_helper.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <pthread.h>
+#else
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+namespace live {
+namespace util {
+namespace thumbnail {
+
+// JPEG 的量化参数，越大文件越小，缩略图不需要太高的画质
+static const int JPEG_QSCALE = 5;
+
+// 把当前线程调到最低优先级，缩略图不与推流、分发争抢 CPU
+static void LowerThreadPriority() {
+  static thread_local bool lowered = false;
+  if (lowered) {
+    return;
+  }
+  lowered = true;
+#ifdef __APPLE__
+  pthread_set_qos_class_self_np(QOS_CLASS_BACKGROUND, 0);
+#else
+  // Linux 上 nice 值按线程设置
+  setpriority(PRIO_PROCESS, pid_t(syscall(SYS_gettid)), 19);
+#endif
+}
+
+// 解码一个关键帧，缩放到不超过 max_width 的宽度后编码为 JPEG
+// @return 失败时返回空指针
+static Blob Render(const MediaMessage& header, const MediaMessage& key_frame,
+                   int32_t max_width) {
+  AVCodecContext* decoder = nullptr;
+  AVCodecContext* encoder = nullptr;
+  AVPacket* packet = nullptr;
+  auto release = [&decoder, &encoder, &packet]() {
+    avcodec_free_context(&decoder);
+    avcodec_free_context(&encoder);
+    av_packet_free(&packet);
+  };
+  ScopeGuard<decltype(release)> guard(std::move(release));
+
+  const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+  if (codec == nullptr || !(decoder = avcodec_alloc_context3(codec)) ||
+      !(packet = av_packet_alloc())) {
+    LOG_ERROR << "alloc thumbnail decoder failed";
+    return nullptr;
+  }
+  // AVCDecoderConfigurationRecord 作为 extradata，帧为长度前缀格式
+  const size_t extradata_size = header.DataSize();
+  decoder->extradata = static_cast<uint8_t*>(
+      av_mallocz(extradata_size + AV_INPUT_BUFFER_PADDING_SIZE));
+  if (!decoder->extradata) {
+    return nullptr;
+  }
+  memcpy(decoder->extradata, header.Data(), extradata_size);
+  decoder->extradata_size = int(extradata_size);
+  // 只解码一帧，不需要帧级多线程
+  decoder->thread_count = 1;
+  int ret = avcodec_open2(decoder, codec, nullptr);
+  if (ret < 0) {
+    LOG_ERROR << "avcodec_open2 failed, error: " << av_err2str(ret);
+    return nullptr;
+  }
+
+  const size_t size = key_frame.DataSize();
+  if (av_new_packet(packet, int(size)) < 0) {
+    return nullptr;
+  }
+  memcpy(packet->data, key_frame.Data(), size);
+  packet->flags |= AV_PKT_FLAG_KEY;
+  // 送入关键帧后立即 flush，解码器不必等后续的帧即可输出
+  ret = avcodec_send_packet(decoder, packet);
+  av_packet_unref(packet);
+  if (ret >= 0) {
+    ret = avcodec_send_packet(decoder, nullptr);
+  }
+  AVFrameWrapper frame(av_frame_alloc());
+  if (ret < 0 || !frame.GetRawPtr() ||
+      (ret = avcodec_receive_frame(decoder, frame.GetRawPtr())) < 0) {
+    LOG_ERROR << "decode key frame failed, error: " << av_err2str(ret);
+    return nullptr;
+  }
+
+  // 不放大，宽高须为偶数
+  const int32_t width = std::min(max_width, frame->width) & ~1;
+  const int32_t height =
+      int32_t(int64_t(frame->height) * width / std::max(frame->width, 1)) &
+      ~1;
+  // 各线程的 SwsContext 在尺寸不变时复用
+  static thread_local VideoScaleHelper scale_helper;
+  if (width <= 0 || height <= 0 ||
+      !scale_helper.Scale(frame, width, height, AV_PIX_FMT_YUVJ420P)) {
+    LOG_ERROR << "scale thumbnail failed";
+    return nullptr;
+  }
+
+  codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+  if (codec == nullptr || !(encoder = avcodec_alloc_context3(codec))) {
+    LOG_ERROR << "alloc thumbnail encoder failed";
+    return nullptr;
+  }
+  encoder->width = width;
+  encoder->height = height;
+  encoder->pix_fmt = AV_PIX_FMT_YUVJ420P;
+  encoder->time_base = AVRational{1, 25};
+  encoder->flags |= AV_CODEC_FLAG_QSCALE;
+  encoder->global_quality = FF_QP2LAMBDA * JPEG_QSCALE;
+  ret = avcodec_open2(encoder, codec, nullptr);
+  if (ret < 0) {
+    LOG_ERROR << "avcodec_open2 failed, error: " << av_err2str(ret);
+    return nullptr;
+  }
+  frame->quality = encoder->global_quality;
+  frame->pict_type = AV_PICTURE_TYPE_I;
+  frame->pts = 0;
+  ret = avcodec_send_frame(encoder, frame.GetRawPtr());
+  if (ret >= 0) {
+    ret = avcodec_send_frame(encoder, nullptr);
+  }
+  if (ret < 0 || (ret = avcodec_receive_packet(encoder, packet)) < 0) {
+    LOG_ERROR << "encode thumbnail failed, error: " << av_err2str(ret);
+    return nullptr;
+  }
+  Blob jpeg = std::make_shared<const std::vector<uint8_t>>(
+      packet->data, packet->data + packet->size);
+  av_packet_unref(packet);
+  return jpeg;
+}
+
+ThumbnailManager::ThumbnailManager() {
+  if (server::FLAGS_thumbnail_interval <= 0) {
+    return;
+  }
+  enabled_ = true;
+  interval_us_ = uint64_t(server::FLAGS_thumbnail_interval) * 1000000;
+  pool_.reset(new ThreadPool(std::max(server::FLAGS_thumbnail_threads, 1),
+                             "thumbnail"));
+}
+
+void ThumbnailManager::OpenRoom(int32_t room_id) {
+  if (!enabled_) {
+    return;
+  }
+  std::lock_guard<std::mutex> g(mutex_);
+  Channel& channel = channels_[room_id];
+  channel = Channel();
+  channel.generation = ++next_generation_;
+}
+
+void ThumbnailManager::CloseRoom(int32_t room_id) {
+  if (!enabled_) {
+    return;
+  }
+  std::lock_guard<std::mutex> g(mutex_);
+  channels_.erase(room_id);
+}
+
+void ThumbnailManager::Publish(int32_t room_id, MediaBatch batch) {
+  if (!enabled_) {
+    return;
+  }
+  // 一批中只取最后一个关键帧
+  MediaMessagePtr header;
+  MediaMessagePtr key_frame;
+  for (const auto& msg : *batch) {
+    if (msg->IsAVCSequenceHeader()) {
+      header = msg;
+    } else if (msg->IsKeyFrame() && msg->is_frame &&
+               msg->codec == MediaCodec::AVC) {
+      key_frame = msg;
+    }
+  }
+  if (!header && !key_frame) {
+    return;
+  }
+
+  const uint64_t now = GetPassedTimeSinceStartedInMicroSeconds();
+  uint64_t generation = 0;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    auto it = channels_.find(room_id);
+    if (it == channels_.end()) {
+      return;
+    }
+    Channel& channel = it->second;
+    if (header && header->DataSize() > 0) {
+      channel.avc_header = header;
+    }
+    if (!key_frame || !channel.avc_header || channel.pending ||
+        (channel.last_us && now - channel.last_us < interval_us_)) {
+      return;
+    }
+    channel.pending = true;
+    channel.last_us = now;
+    generation = channel.generation;
+    header = channel.avc_header;
+  }
+  pool_->Post([this, room_id, generation, header, key_frame]() {
+    Generate(room_id, generation, header, key_frame);
+  });
+}
+
+void ThumbnailManager::Generate(int32_t room_id, uint64_t generation,
+                                MediaMessagePtr header,
+                                MediaMessagePtr key_frame) {
+  LowerThreadPriority();
+  TRACE_SCOPE("thumbnail.render");
+  Blob jpeg = Render(*header, *key_frame, server::FLAGS_thumbnail_width);
+
+  std::lock_guard<std::mutex> g(mutex_);
+  auto it = channels_.find(room_id);
+  if (it == channels_.end() || it->second.generation != generation) {
+    return;
+  }
+  it->second.pending = false;
+  if (jpeg) {
+    it->second.jpeg = std::move(jpeg);
+  }
+}
+
+Blob ThumbnailManager::Get(int32_t room_id) {
+  std::lock_guard<std::mutex> g(mutex_);
+  auto it = channels_.find(room_id);
+  return it == channels_.end() ? nullptr : it->second.jpeg;
+}
+
+}  // namespace thumbnail
+}  // namespace util
+}  // namespace live
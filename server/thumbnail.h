@@ -0,0 +1,67 @@
+#pragma once
+
+#include "server/media_message.h"
+
+#include "util/thread_pool.h"
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace live {
+namespace util {
+namespace thumbnail {
+
+using Blob = std::shared_ptr<const std::vector<uint8_t>>;
+
+// 为每个房间生成 JPEG 缩略图，以 /live/<room>.jpg 访问。只解码推流中的
+// 关键帧，不解码任何非关键帧，每个房间每 -thumbnail_interval 秒至多生成
+// 一次，且同时只有一个任务。解码、缩放及编码在单独的低优先级线程池中进行，
+// 结果缓存在内存中。-thumbnail_interval 为 0 时关闭
+class ThumbnailManager {
+  struct Channel {
+    // 房间每次创建时递增，丢弃房间重建之前投递的任务的结果
+    uint64_t generation = 0;
+    MediaMessagePtr avc_header;
+    uint64_t last_us = 0;
+    bool pending = false;
+    Blob jpeg;
+  };
+
+  // 构造后不再修改
+  bool enabled_ = false;
+  uint64_t interval_us_ = 0;
+
+  std::mutex mutex_;
+  std::unordered_map<int32_t, Channel> channels_;
+  uint64_t next_generation_ = 0;
+
+  std::unique_ptr<ThreadPool> pool_;
+
+  ThumbnailManager();
+  ThumbnailManager(const ThumbnailManager&) = delete;
+  ThumbnailManager& operator=(const ThumbnailManager&) = delete;
+
+  void Generate(int32_t room_id, uint64_t generation, MediaMessagePtr header,
+                MediaMessagePtr key_frame);
+
+ public:
+  static ThumbnailManager& GetInstance() {
+    static ThumbnailManager tm;
+    return tm;
+  }
+
+  // 以下函数线程安全
+  void OpenRoom(int32_t room_id);
+  void CloseRoom(int32_t room_id);
+  using MediaBatch = std::shared_ptr<const std::vector<MediaMessagePtr>>;
+  void Publish(int32_t room_id, MediaBatch batch);
+
+  // @return 还没有生成缩略图时返回空指针
+  Blob Get(int32_t room_id);
+};
+
+}  // namespace thumbnail
+}  // namespace util
+}  // namespace live
@@ -0,0 +1,462 @@
+#include "server/timeshift.h"
+#include "server/args.h"
+#include "server/room.h"
+#include "server/worker_pool.h"
+
+#include "util/util.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace live {
+namespace util {
+namespace timeshift {
+
+// 读取缓冲区的周期
+static const int32_t TIMER_INTERVAL_US = 10000;
+// 每个周期至多读出的消息数，避免长时间占用 EventLoop
+static const int32_t MAX_MESSAGES_PER_TICK = 256;
+// 切换到直播时等待缓冲区与直播数据衔接的时长上限
+static const uint64_t SWITCH_TIMEOUT_US = 1000000;
+// 纯音频时索引的间隔
+static const uint32_t AUDIO_INDEX_INTERVAL_MS = 1000;
+
+static const size_t PREVIOUS_TAG_SIZE = 4;
+// 读缓存的槽数，覆盖同时回看的观众之间数秒的距离
+static const size_t READ_CACHE_SLOTS = 256;
+
+TimeShiftStore::TimeShiftStore(const std::string& path, size_t size)
+    : size_(size), read_cache_(READ_CACHE_SLOTS) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    throw "open " + path + " failed, errno: " + std::to_string(errno);
+  }
+  // 只需要映射，文件名不再有用，进程退出后空间自动回收
+  unlink(path.c_str());
+  if (ftruncate(fd, off_t(size_))) {
+    int err = errno;
+    close(fd);
+    throw "truncate " + path + " failed, errno: " + std::to_string(err);
+  }
+  void* data = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  int err = errno;
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw "mmap " + path + " failed, errno: " + std::to_string(err);
+  }
+  data_ = reinterpret_cast<uint8_t*>(data);
+}
+
+TimeShiftStore::~TimeShiftStore() {
+  munmap(data_, size_);
+}
+
+void TimeShiftStore::CopyIn(uint64_t position, const uint8_t* data,
+                            size_t len) {
+  size_t offset = position % size_;
+  size_t n = std::min(len, size_ - offset);
+  memcpy(data_ + offset, data, n);
+  memcpy(data_, data + n, len - n);
+}
+
+void TimeShiftStore::CopyOut(uint64_t position, uint8_t* out,
+                             size_t len) const {
+  size_t offset = position % size_;
+  size_t n = std::min(len, size_ - offset);
+  memcpy(out, data_ + offset, n);
+  memcpy(out + n, data_, len - n);
+}
+
+size_t TimeShiftStore::RecordSize(uint64_t position) const {
+  uint8_t header[MediaMessage::FLV_TAG_HEADER_SIZE];
+  CopyOut(position, header, sizeof(header));
+  size_t size = size_t(header[1]) << 16 | size_t(header[2]) << 8 | header[3];
+  return sizeof(header) + size + PREVIOUS_TAG_SIZE;
+}
+
+void TimeShiftStore::Reset() {
+  std::lock_guard<std::mutex> g(mutex_);
+  begin_ = end_;
+  last_timestamp_ = 0;
+  has_video_ = false;
+  key_frames_.clear();
+  meta_.reset();
+  avc_header_.reset();
+  aac_header_.reset();
+  read_cache_.Clear();
+}
+
+void TimeShiftStore::Write(const MediaMessagePtr& msg) {
+  const uint8_t type = msg->type;
+  const size_t size = msg->payload.size();
+  if (size == 0 || (type != 8 && type != 9 && type != 18)) {
+    return;
+  }
+  const size_t len =
+      MediaMessage::FLV_TAG_HEADER_SIZE + size + PREVIOUS_TAG_SIZE;
+  // 过大的消息会挤掉大部分缓冲区
+  if (len > size_ / 2) {
+    LOG_ERROR << "message too large for timeshift, size: " << size;
+    return;
+  }
+
+  std::lock_guard<std::mutex> g(mutex_);
+  while (end_ + len - begin_ > size_) {
+    begin_ += RecordSize(begin_);
+  }
+  while (!key_frames_.empty() && key_frames_.front().position < begin_) {
+    key_frames_.pop_front();
+  }
+  CopyIn(end_, msg->flv_tag_header, MediaMessage::FLV_TAG_HEADER_SIZE);
+  CopyIn(end_ + MediaMessage::FLV_TAG_HEADER_SIZE, &msg->payload[0], size);
+  CopyIn(end_ + MediaMessage::FLV_TAG_HEADER_SIZE + size,
+         msg->flv_previous_tag_size, PREVIOUS_TAG_SIZE);
+
+  if (type == 18) {
+    meta_ = msg;
+  } else if (msg->IsAVCSequenceHeader()) {
+    avc_header_ = msg;
+  } else if (msg->IsAACSequenceHeader()) {
+    aac_header_ = msg;
+  } else {
+    if (msg->IsKeyFrame()) {
+      // 出现视频后只从关键帧开始播放
+      if (!has_video_) {
+        has_video_ = true;
+        key_frames_.clear();
+      }
+      key_frames_.push_back({end_, msg->timestamp});
+    } else if (type == 8 && !has_video_) {
+      if (key_frames_.empty() ||
+          msg->timestamp - key_frames_.back().timestamp >=
+              AUDIO_INDEX_INTERVAL_MS) {
+        key_frames_.push_back({end_, msg->timestamp});
+      }
+    }
+    last_timestamp_ = msg->timestamp;
+  }
+  end_ += len;
+}
+
+bool TimeShiftStore::Seek(uint32_t offset_ms, uint64_t* position,
+                          uint32_t* timestamp) {
+  std::lock_guard<std::mutex> g(mutex_);
+  if (key_frames_.empty()) {
+    return false;
+  }
+  auto it = key_frames_.begin();
+  if (offset_ms < last_timestamp_) {
+    const uint32_t target = last_timestamp_ - offset_ms;
+    it = std::upper_bound(key_frames_.begin(), key_frames_.end(), target,
+                          [](uint32_t ts, const KeyFrame& k) {
+                            return ts < k.timestamp;
+                          });
+    if (it != key_frames_.begin()) {
+      --it;
+    }
+  }
+  *position = it->position;
+  *timestamp = it->timestamp;
+  return true;
+}
+
+TimeShiftStore::ReadResult TimeShiftStore::Read(uint64_t* position,
+                                                MediaMessagePtr* msg) {
+  std::lock_guard<std::mutex> g(mutex_);
+  if (*position < begin_) {
+    return LAPPED;
+  }
+  if (*position >= end_) {
+    return END;
+  }
+  // 位置只增不减，Reset 之后也不会复用，缓存中的消息不会过期
+  *msg = read_cache_.Get(*position);
+  if (*msg) {
+    *position += MediaMessage::FLV_TAG_HEADER_SIZE + (*msg)->payload.size() +
+                 PREVIOUS_TAG_SIZE;
+    return OK;
+  }
+  uint8_t header[MediaMessage::FLV_TAG_HEADER_SIZE];
+  CopyOut(*position, header, sizeof(header));
+  const size_t size =
+      size_t(header[1]) << 16 | size_t(header[2]) << 8 | header[3];
+  const uint32_t timestamp = uint32_t(header[7]) << 24 |
+                             uint32_t(header[4]) << 16 |
+                             uint32_t(header[5]) << 8 | header[6];
+  std::vector<uint8_t> payload(size);
+  CopyOut(*position + sizeof(header), &payload[0], size);
+  *msg = std::make_shared<const MediaMessage>(header[0], timestamp,
+                                              std::move(payload));
+  read_cache_.Put(*position, *msg);
+  *position += sizeof(header) + size + PREVIOUS_TAG_SIZE;
+  return OK;
+}
+
+void TimeShiftStore::GetHeaders(MediaMessagePtr* meta, MediaMessagePtr* avc,
+                                MediaMessagePtr* aac) {
+  std::lock_guard<std::mutex> g(mutex_);
+  *meta = meta_;
+  *avc = avc_header_;
+  *aac = aac_header_;
+}
+
+std::shared_ptr<TimeShiftManager::Channel> TimeShiftManager::GetChannel(
+    int32_t room_id) {
+  std::lock_guard<std::mutex> g(mutex_);
+  std::shared_ptr<Channel>& channel = channels_[room_id];
+  if (!channel) {
+    channel = std::make_shared<Channel>();
+    channel->strand = std::make_shared<Strand>(&GetWorkerPool());
+    std::string path = server::FLAGS_timeshift_dir + "/timeshift-" +
+                       std::to_string(getpid()) + "-" +
+                       std::to_string(room_id) + ".ring";
+    try {
+      channel->store = std::make_shared<TimeShiftStore>(
+          path, size_t(server::FLAGS_timeshift_size));
+    } catch (const std::string& e) {
+      LOG_ERROR << "create timeshift store failed, room_id: " << room_id
+                << ", " << e;
+    }
+  }
+  return channel;
+}
+
+void TimeShiftManager::OpenRoom(int32_t room_id) {
+  if (server::FLAGS_timeshift_size <= 0) {
+    return;
+  }
+  auto channel = GetChannel(room_id);
+  if (!channel->store) {
+    return;
+  }
+  channel->strand->Post([channel]() { channel->store->Reset(); });
+}
+
+void TimeShiftManager::Publish(int32_t room_id, MediaBatch batch) {
+  if (server::FLAGS_timeshift_size <= 0) {
+    return;
+  }
+  auto channel = GetChannel(room_id);
+  if (!channel->store) {
+    return;
+  }
+  channel->strand->Post([channel, batch]() {
+    for (const auto& msg : *batch) {
+      channel->store->Write(msg);
+    }
+  });
+}
+
+std::shared_ptr<TimeShiftStore> TimeShiftManager::FindStore(int32_t room_id) {
+  if (server::FLAGS_timeshift_size <= 0) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> g(mutex_);
+  auto it = channels_.find(room_id);
+  return it == channels_.end() ? nullptr : it->second->store;
+}
+
+TimeShiftPlayer::TimeShiftPlayer(Visitor* target, int32_t room_id,
+                                 Subscription subscription,
+                                 std::shared_ptr<TimeShiftStore> store)
+    : target_(target),
+      room_id_(room_id),
+      subscription_(subscription),
+      store_(std::move(store)) {}
+
+TimeShiftPlayer::~TimeShiftPlayer() {
+  if (entered_) {
+    RoomManager::GetInstance().LeaveRoom(room_id_, this);
+  }
+}
+
+std::unique_ptr<TimeShiftPlayer> TimeShiftPlayer::Create(
+    Visitor* target, int32_t room_id, Subscription subscription,
+    const std::string& seconds) {
+  if (seconds.empty() || seconds.size() > 6 ||
+      seconds.find_first_not_of("0123456789") != std::string::npos) {
+    LOG_ERROR << "invalid timeshift " << seconds;
+    return nullptr;
+  }
+  auto store = TimeShiftManager::GetInstance().FindStore(room_id);
+  if (!store) {
+    return nullptr;
+  }
+  std::unique_ptr<TimeShiftPlayer> player(
+      new TimeShiftPlayer(target, room_id, subscription, std::move(store)));
+  if (!player->Start(uint32_t(std::stoi(seconds)) * 1000)) {
+    return nullptr;
+  }
+  return player;
+}
+
+bool TimeShiftPlayer::Start(uint32_t offset_ms) {
+  if (!store_->Seek(offset_ms, &position_, &start_timestamp_)) {
+    return false;
+  }
+  start_us_ = GetPassedTimeSinceStartedInMicroSeconds();
+  LOG_ERROR << "timeshift viewer, room_id: " << room_id_
+            << ", offset: " << offset_ms
+            << "ms, start timestamp: " << start_timestamp_;
+
+  // 从中途的关键帧开始，先发送最新的 metadata 及解码配置
+  MediaMessagePtr meta, avc, aac;
+  store_->GetHeaders(&meta, &avc, &aac);
+  if (meta) {
+    target_->SendMetaData(meta);
+  }
+  if (avc && Room::IsSubscribed(subscription_, 9, true)) {
+    target_->SendMediaData(avc, 0);
+  }
+  if (aac && Room::IsSubscribed(subscription_, 8, false)) {
+    target_->SendMediaData(aac, 0);
+  }
+
+  timer_.reset(event_new(EventLoop::Current()->GetEventBase(), -1,
+                         EV_PERSIST, TimerCallback, this));
+  timeval tv = {0, TIMER_INTERVAL_US};
+  event_add(timer_.get(), &tv);
+  return true;
+}
+
+void TimeShiftPlayer::TimerCallback(evutil_socket_t, short, void* ptr) {
+  EventLoop::Current()->BeginWork();
+  reinterpret_cast<TimeShiftPlayer*>(ptr)->OnTimer();
+}
+
+void TimeShiftPlayer::OnTimer() {
+  const uint64_t now = GetPassedTimeSinceStartedInMicroSeconds();
+  if (state_ == CATCHING_UP) {
+    const uint64_t speed = std::max(server::FLAGS_timeshift_speed, 1);
+    const uint32_t until =
+        start_timestamp_ + uint32_t((now - start_us_) / 1000 * speed);
+    if (ReadStore(until)) {
+      StartSwitching();
+    }
+    return;
+  }
+  if (state_ != SWITCHING) {
+    return;
+  }
+  ReadStore(UINT32_MAX);
+  // 缓冲区读到的数据已经追上第一条直播数据
+  bool caught_up = false;
+  for (const auto& msg : live_messages_) {
+    if (msg->type == 8 || msg->type == 9) {
+      caught_up = store_timestamp_ >= msg->timestamp;
+      break;
+    }
+  }
+  if (caught_up || now - switch_us_ >= SWITCH_TIMEOUT_US) {
+    GoLive();
+  }
+}
+
+bool TimeShiftPlayer::ReadStore(uint32_t until) {
+  for (int32_t i = 0; i < MAX_MESSAGES_PER_TICK; i++) {
+    if (!next_) {
+      TimeShiftStore::ReadResult r = store_->Read(&position_, &next_);
+      if (r == TimeShiftStore::END) {
+        return true;
+      }
+      if (r == TimeShiftStore::LAPPED) {
+        // 读得比写得慢，从最旧的关键帧继续，并重新计时
+        if (!store_->Seek(UINT32_MAX, &position_, &start_timestamp_)) {
+          return true;
+        }
+        start_us_ = GetPassedTimeSinceStartedInMicroSeconds();
+        LOG_ERROR << "timeshift viewer lapped, room_id: " << room_id_
+                  << ", restart from timestamp: " << start_timestamp_;
+        continue;
+      }
+    }
+    if (next_->timestamp > until) {
+      return false;
+    }
+    store_timestamp_ = std::max(store_timestamp_, next_->timestamp);
+    Forward(next_);
+    next_.reset();
+  }
+  return false;
+}
+
+void TimeShiftPlayer::Forward(const MediaMessagePtr& msg) {
+  if (!Room::IsSubscribed(subscription_, msg->type, msg->IsKeyFrame())) {
+    return;
+  }
+  if (msg->type == 18) {
+    target_->SendMetaData(msg);
+    return;
+  }
+  const int i = msg->type == 9 ? 1 : 0;
+  sent_[i] = true;
+  last_timestamp_[i] = msg->timestamp;
+  target_->SendMediaData(msg, msg->timestamp);
+}
+
+void TimeShiftPlayer::StartSwitching() {
+  state_ = SWITCHING;
+  switch_us_ = GetPassedTimeSinceStartedInMicroSeconds();
+  // 缓存的数据已从缓冲区发出，只接收之后的直播数据
+  entered_ = RoomManager::GetInstance().EnterRoom(room_id_, this,
+                                                  subscription_, false);
+  if (!entered_) {
+    LOG_ERROR << "timeshift viewer enter room failed, room_id: " << room_id_;
+  }
+}
+
+void TimeShiftPlayer::GoLive() {
+  state_ = LIVE;
+  timer_.reset();
+  next_.reset();
+  for (const auto& msg : live_messages_) {
+    SendLive(msg);
+  }
+  live_messages_.clear();
+  LOG_ERROR << "timeshift viewer reached live, room_id: " << room_id_
+            << ", join_to_live_ms: "
+            << (GetPassedTimeSinceStartedInMicroSeconds() - start_us_) / 1000;
+}
+
+void TimeShiftPlayer::SendLive(const MediaMessagePtr& msg) {
+  if (msg->type == 18) {
+    target_->SendMetaData(msg);
+    return;
+  }
+  const int i = msg->type == 9 ? 1 : 0;
+  // 写入缓冲区与分发给房间并行进行，切换后仍可能收到缓冲区中已发出的
+  // 数据，每个轨道在第一条更新的数据之前去重
+  if (!deduplicated_[i]) {
+    if (sent_[i] && msg->timestamp <= last_timestamp_[i]) {
+      return;
+    }
+    deduplicated_[i] = true;
+  }
+  target_->SendMediaData(msg, msg->timestamp);
+}
+
+void TimeShiftPlayer::SendMetaData(const MediaMessagePtr& msg) {
+  if (state_ == LIVE) {
+    SendLive(msg);
+  } else {
+    live_messages_.push_back(msg);
+  }
+}
+
+void TimeShiftPlayer::SendMediaData(const MediaMessagePtr& msg,
+                                    uint32_t timestamp) {
+  if (state_ == LIVE) {
+    SendLive(msg);
+  } else {
+    live_messages_.push_back(msg);
+  }
+}
+
+}  // namespace timeshift
+}  // namespace util
+}  // namespace live
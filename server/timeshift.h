@@ -0,0 +1,194 @@
+#pragma once
+
+#include "server/media_message.h"
+#include "server/net.h"
+#include "server/visitor.h"
+
+#include "util/thread_pool.h"
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace live {
+namespace util {
+
+// 定义在 room.h 中，room.h 依赖本文件
+enum class Subscription;
+
+namespace timeshift {
+
+// 一个房间的时移缓冲区：-timeshift_dir 下固定 -timeshift_size 大小的
+// mmap 环形文件，顺序存放 FLV tag（含 PreviousTagSize），写满后覆盖最旧的
+// 数据。另在内存中维护关键帧的位置及时间戳索引，纯音频时每秒索引一帧。
+// 文件打开后即删除，只由页缓存承载，不需要落盘。写入在房间的 Strand 中，
+// 读取在观众的 EventLoop 中，以 mutex 保护
+class TimeShiftStore {
+  uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+
+  std::mutex mutex_;
+  // 环中数据的起止位置，为不回绕的绝对位置，对 size_ 取模后为文件偏移
+  uint64_t begin_ = 0;
+  uint64_t end_ = 0;
+  uint32_t last_timestamp_ = 0;
+  bool has_video_ = false;
+
+  struct KeyFrame {
+    uint64_t position;
+    uint32_t timestamp;
+  };
+  std::deque<KeyFrame> key_frames_;
+
+  // 最新的 metadata 及解码配置，观众从中途的关键帧开始播放时先发送
+  MediaMessagePtr meta_;
+  MediaMessagePtr avc_header_;
+  MediaMessagePtr aac_header_;
+
+  // 以位置为键，同时回看的观众共享读出的消息
+  MediaMessageCache read_cache_;
+
+  // 以下按字节回绕读写，不加锁
+  void CopyIn(uint64_t position, const uint8_t* data, size_t len);
+  void CopyOut(uint64_t position, uint8_t* out, size_t len) const;
+  // 位于 position 的 tag 连同 PreviousTagSize 的总长度
+  size_t RecordSize(uint64_t position) const;
+
+ public:
+  // 失败时抛出 std::string
+  TimeShiftStore(const std::string& path, size_t size);
+  ~TimeShiftStore();
+  TimeShiftStore(const TimeShiftStore&) = delete;
+  TimeShiftStore& operator=(const TimeShiftStore&) = delete;
+
+  // 房间重新创建时清空，已有的读取位置都将失效
+  void Reset();
+  void Write(const MediaMessagePtr& msg);
+
+  // 找到 offset_ms 之前最近的关键帧，超出缓冲区时取最旧的关键帧
+  // @return 还没有可供开始播放的关键帧时返回 false
+  bool Seek(uint32_t offset_ms, uint64_t* position, uint32_t* timestamp);
+
+  enum ReadResult {
+    OK,
+    // 已读到最新的数据
+    END,
+    // 读取位置已被覆盖
+    LAPPED,
+  };
+  // 读出 position 处的 tag 并前进到下一个
+  ReadResult Read(uint64_t* position, MediaMessagePtr* msg);
+
+  void GetHeaders(MediaMessagePtr* meta, MediaMessagePtr* avc,
+                  MediaMessagePtr* aac);
+};
+
+// 为每个房间维护 TimeShiftStore，写入在工作线程池中经房间的 Strand 保序
+// 执行，与 HLS 切片共享同一批消息。-timeshift_size 为 0 时关闭
+class TimeShiftManager {
+  struct Channel {
+    std::shared_ptr<Strand> strand;
+    // 创建失败时为空，房间 id 被复用时沿用
+    std::shared_ptr<TimeShiftStore> store;
+  };
+
+  std::mutex mutex_;
+  std::unordered_map<int32_t, std::shared_ptr<Channel>> channels_;
+
+  TimeShiftManager() = default;
+  TimeShiftManager(const TimeShiftManager&) = delete;
+  TimeShiftManager& operator=(const TimeShiftManager&) = delete;
+
+  std::shared_ptr<Channel> GetChannel(int32_t room_id);
+
+ public:
+  static TimeShiftManager& GetInstance() {
+    static TimeShiftManager tm;
+    return tm;
+  }
+
+  // 以下函数线程安全
+  void OpenRoom(int32_t room_id);
+  using MediaBatch = std::shared_ptr<const std::vector<MediaMessagePtr>>;
+  void Publish(int32_t room_id, MediaBatch batch);
+
+  // @return 未开启时移或房间从未创建过时返回空指针
+  std::shared_ptr<TimeShiftStore> FindStore(int32_t room_id);
+};
+
+// 时移观众：从 TimeShiftStore 中指定时长之前的关键帧开始，以
+// -timeshift_speed 倍速读出并转发给 target，读到最新数据后进入房间，
+// 暂存房间发来的直播数据，直到缓冲区的数据与之衔接，去掉重复的部分后
+// 转为直接转发。只在 target 所属 EventLoop 的线程中使用
+class TimeShiftPlayer : public Visitor {
+  Visitor* target_;
+  int32_t room_id_;
+  Subscription subscription_;
+  std::shared_ptr<TimeShiftStore> store_;
+
+  enum State {
+    // 按倍速读取缓冲区
+    CATCHING_UP,
+    // 已进入房间，尽快读完缓冲区并暂存直播数据
+    SWITCHING,
+    LIVE,
+  };
+  State state_ = CATCHING_UP;
+  bool entered_ = false;
+
+  uint64_t position_ = 0;
+  // 已读出但未到发送时间的消息
+  MediaMessagePtr next_;
+  uint32_t start_timestamp_ = 0;
+  uint64_t start_us_ = 0;
+  uint64_t switch_us_ = 0;
+
+  // 已发出的音频、视频的最大时间戳，用于去掉与直播数据重复的部分
+  bool sent_[2] = {false, false};
+  uint32_t last_timestamp_[2] = {0, 0};
+  bool deduplicated_[2] = {false, false};
+  // 缓冲区已读到的最大时间戳
+  uint32_t store_timestamp_ = 0;
+  std::deque<MediaMessagePtr> live_messages_;
+
+  struct event_deleter {
+    void operator()(event* ptr) {
+      event_free(ptr);
+    }
+  };
+  std::unique_ptr<event, event_deleter> timer_;
+
+  static void TimerCallback(evutil_socket_t, short, void* ptr);
+  void OnTimer();
+  // 读取缓冲区直到时间戳超过 until 或没有更多数据
+  // @return 缓冲区已读完时返回 true
+  bool ReadStore(uint32_t until);
+  void Forward(const MediaMessagePtr& msg);
+  void StartSwitching();
+  void GoLive();
+  void SendLive(const MediaMessagePtr& msg);
+
+  TimeShiftPlayer(Visitor* target, int32_t room_id, Subscription subscription,
+                  std::shared_ptr<TimeShiftStore> store);
+  bool Start(uint32_t offset_ms);
+
+ public:
+  ~TimeShiftPlayer();
+
+  // seconds 为回看的秒数，如播放名 stream?timeshift=60 中的 60
+  // @return 参数无效或房间没有时移数据时返回空指针，调用者应直接进入房间
+  static std::unique_ptr<TimeShiftPlayer> Create(Visitor* target,
+                                                 int32_t room_id,
+                                                 Subscription subscription,
+                                                 const std::string& seconds);
+
+  void SendMetaData(const MediaMessagePtr& msg) override;
+  void SendMediaData(const MediaMessagePtr& msg, uint32_t timestamp) override;
+};
+
+}  // namespace timeshift
+}  // namespace util
+}  // namespace live
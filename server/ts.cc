@@ -0,0 +1,425 @@
+#include "server/ts.h"
+#include "server/codec.h"
+
+#include "util/util.h"
+
+#include <algorithm>
+
+namespace live {
+namespace util {
+namespace ts {
+
+static const uint16_t PROGRAM_NUMBER = 1;
+static const uint8_t STREAM_TYPE_H264 = 0x1B;
+static const uint8_t STREAM_TYPE_AAC = 0x0F;
+static const uint8_t STREAM_ID_VIDEO = 0xE0;
+static const uint8_t STREAM_ID_AUDIO = 0xC0;
+
+// MPEG-2 CRC32，多项式 0x04C11DB7，不反转
+static uint32_t Crc32(const uint8_t* data, size_t size) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= uint32_t(data[i]) << 24;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+// 补上 section_length 及 CRC32，section 中 section_length 之前的 3 字节须已写好
+static void FinishSection(std::vector<uint8_t>* section) {
+  // section_length 计入之后的所有字节，包括 CRC32
+  size_t length = section->size() - 3 + 4;
+  (*section)[1] = uint8_t(0xB0 | (length >> 8 & 0x0F));
+  (*section)[2] = uint8_t(length);
+  uint32_t crc = Crc32(section->data(), section->size());
+  for (int i = 0; i < 4; i++) {
+    section->push_back(uint8_t(crc >> (24 - 8 * i)));
+  }
+}
+
+// prefix 为 PTS、DTS 前的 4 bit 标识
+static void WriteTimestamp(uint8_t prefix, uint64_t ts,
+                           std::vector<uint8_t>* out) {
+  out->push_back(uint8_t(prefix << 4 | (ts >> 29 & 0x0E) | 1));
+  out->push_back(uint8_t(ts >> 22));
+  out->push_back(uint8_t((ts >> 14 & 0xFE) | 1));
+  out->push_back(uint8_t(ts >> 7));
+  out->push_back(uint8_t((ts << 1 & 0xFE) | 1));
+}
+
+static std::vector<uint8_t> BuildPES(uint8_t stream_id, uint64_t pts,
+                                     uint64_t dts, bool with_dts,
+                                     const uint8_t* data, size_t size) {
+  std::vector<uint8_t> pes;
+  pes.reserve(size + 19);
+  pes.insert(pes.end(), {0, 0, 1, stream_id});
+  size_t header_data_length = with_dts ? 10 : 5;
+  // 超出 16 bit 时写 0，只允许视频流这样做
+  size_t length = 3 + header_data_length + size;
+  if (length > 0xFFFF) {
+    length = 0;
+  }
+  pes.push_back(uint8_t(length >> 8));
+  pes.push_back(uint8_t(length));
+  // data_alignment_indicator
+  pes.push_back(0x84);
+  pes.push_back(with_dts ? 0xC0 : 0x80);
+  pes.push_back(uint8_t(header_data_length));
+  WriteTimestamp(with_dts ? 0x3 : 0x2, pts, &pes);
+  if (with_dts) {
+    WriteTimestamp(0x1, dts, &pes);
+  }
+  pes.insert(pes.end(), data, data + size);
+  return pes;
+}
+
+void TsMuxer::WriteSection(uint16_t pid, uint8_t* cc,
+                           const std::vector<uint8_t>& section,
+                           std::vector<uint8_t>* out) {
+  size_t begin = out->size();
+  out->resize(begin + PACKET_SIZE, 0xFF);
+  uint8_t* p = &(*out)[begin];
+  p[0] = 0x47;
+  p[1] = uint8_t(0x40 | (pid >> 8 & 0x1F));
+  p[2] = uint8_t(pid);
+  p[3] = uint8_t(0x10 | (*cc & 0x0F));
+  *cc = (*cc + 1) & 0x0F;
+  // pointer_field
+  p[4] = 0;
+  std::copy(section.begin(), section.end(), p + 5);
+}
+
+void TsMuxer::WriteTables(std::vector<uint8_t>* out) {
+  std::vector<uint8_t> pat = {
+      0x00, 0, 0,
+      0x00, 0x01,  // transport_stream_id
+      0xC1,        // version 0，current_next_indicator
+      0x00, 0x00,  // section_number，last_section_number
+      uint8_t(PROGRAM_NUMBER >> 8), uint8_t(PROGRAM_NUMBER),
+      uint8_t(0xE0 | PMT_PID >> 8), uint8_t(PMT_PID),
+  };
+  FinishSection(&pat);
+  WriteSection(0, &pat_cc_, pat, out);
+
+  uint16_t pcr_pid = has_video_ ? VIDEO_PID : AUDIO_PID;
+  std::vector<uint8_t> pmt = {
+      0x02, 0, 0,
+      uint8_t(PROGRAM_NUMBER >> 8), uint8_t(PROGRAM_NUMBER),
+      0xC1, 0x00, 0x00,
+      uint8_t(0xE0 | pcr_pid >> 8), uint8_t(pcr_pid),
+      0xF0, 0x00,  // program_info_length
+  };
+  if (has_video_) {
+    pmt.insert(pmt.end(), {STREAM_TYPE_H264, uint8_t(0xE0 | VIDEO_PID >> 8),
+                           uint8_t(VIDEO_PID), 0xF0, 0x00});
+  }
+  if (has_audio_) {
+    pmt.insert(pmt.end(), {STREAM_TYPE_AAC, uint8_t(0xE0 | AUDIO_PID >> 8),
+                           uint8_t(AUDIO_PID), 0xF0, 0x00});
+  }
+  FinishSection(&pmt);
+  WriteSection(PMT_PID, &pmt_cc_, pmt, out);
+}
+
+void TsMuxer::WritePES(uint16_t pid, uint8_t* cc,
+                       const std::vector<uint8_t>& pes, bool with_pcr,
+                       uint64_t pcr, bool random_access,
+                       std::vector<uint8_t>* out) {
+  size_t pos = 0;
+  while (pos < pes.size()) {
+    const bool first = pos == 0;
+    // adaptation field 中 length 字节之后的内容
+    std::vector<uint8_t> af;
+    if (first && (with_pcr || random_access)) {
+      af.push_back(uint8_t((random_access ? 0x40 : 0) | (with_pcr ? 0x10 : 0)));
+      if (with_pcr) {
+        af.insert(af.end(), {uint8_t(pcr >> 25), uint8_t(pcr >> 17),
+                             uint8_t(pcr >> 9), uint8_t(pcr >> 1),
+                             uint8_t((pcr & 1) << 7 | 0x7E), 0x00});
+      }
+    }
+    bool has_af = first && !af.empty();
+    size_t space = PACKET_SIZE - 4 - (has_af ? 1 + af.size() : 0);
+    size_t remaining = pes.size() - pos;
+    // 最后一个 packet 不满时以 adaptation field 填充
+    if (remaining < space) {
+      size_t stuffing = space - remaining;
+      if (!has_af) {
+        has_af = true;
+        stuffing--;
+        if (stuffing > 0) {
+          af.push_back(0x00);
+          stuffing--;
+        }
+      }
+      af.insert(af.end(), stuffing, 0xFF);
+      space = remaining;
+    }
+
+    out->push_back(0x47);
+    out->push_back(uint8_t((first ? 0x40 : 0) | (pid >> 8 & 0x1F)));
+    out->push_back(uint8_t(pid));
+    out->push_back(uint8_t((has_af ? 0x30 : 0x10) | (*cc & 0x0F)));
+    *cc = (*cc + 1) & 0x0F;
+    if (has_af) {
+      out->push_back(uint8_t(af.size()));
+      out->insert(out->end(), af.begin(), af.end());
+    }
+    out->insert(out->end(), pes.begin() + pos, pes.begin() + pos + space);
+    pos += space;
+  }
+}
+
+void TsMuxer::WriteVideo(uint64_t pts, uint64_t dts, bool is_key_frame,
+                         const uint8_t* data, size_t size,
+                         std::vector<uint8_t>* out) {
+  std::vector<uint8_t> pes =
+      BuildPES(STREAM_ID_VIDEO, pts, dts, pts != dts, data, size);
+  WritePES(VIDEO_PID, &video_cc_, pes, true, dts, is_key_frame, out);
+}
+
+void TsMuxer::WriteAudio(uint64_t pts, const uint8_t* data, size_t size,
+                         std::vector<uint8_t>* out) {
+  std::vector<uint8_t> pes =
+      BuildPES(STREAM_ID_AUDIO, pts, pts, false, data, size);
+  WritePES(AUDIO_PID, &audio_cc_, pes, !has_video_, pts, !has_video_, out);
+}
+
+// 33 bit 的 PTS、DTS
+static const uint64_t TIMESTAMP_MASK = (uint64_t(1) << 33) - 1;
+
+static uint64_t ReadTimestamp(const uint8_t* p) {
+  return uint64_t(p[0] >> 1 & 0x07) << 30 | uint64_t(p[1]) << 22 |
+         uint64_t(p[2] >> 1) << 15 | uint64_t(p[3]) << 7 | (p[4] >> 1);
+}
+
+void TsDemuxer::Input(const uint8_t* packet,
+                      std::vector<MediaMessagePtr>* out) {
+  // 忽略 transport_error_indicator 置位的 packet
+  if (packet[0] != 0x47 || (packet[1] & 0x80)) {
+    return;
+  }
+  const uint16_t pid = uint16_t((packet[1] & 0x1F) << 8 | packet[2]);
+  const bool unit_start = packet[1] & 0x40;
+  const uint8_t adaptation = packet[3] >> 4 & 0x03;
+  const uint8_t cc = packet[3] & 0x0F;
+  size_t pos = 4;
+  if (adaptation & 0x02) {
+    pos += 1 + packet[4];
+  }
+  if (!(adaptation & 0x01) || pos >= TsMuxer::PACKET_SIZE) {
+    return;
+  }
+
+  // PAT、PMT 均假定只占一个 packet
+  if (pid == 0 || (pmt_pid_ && pid == pmt_pid_)) {
+    if (!unit_start) {
+      return;
+    }
+    pos += 1 + packet[pos];
+    if (pos >= TsMuxer::PACKET_SIZE) {
+      return;
+    }
+    if (pid == 0) {
+      ParsePAT(packet + pos, TsMuxer::PACKET_SIZE - pos);
+    } else {
+      ParsePMT(packet + pos, TsMuxer::PACKET_SIZE - pos);
+    }
+    return;
+  }
+
+  Stream* stream = nullptr;
+  if (video_.pid && pid == video_.pid) {
+    stream = &video_;
+  } else if (audio_.pid && pid == audio_.pid) {
+    stream = &audio_;
+  } else {
+    return;
+  }
+  if (stream->cc != 0xFF && cc != ((stream->cc + 1) & 0x0F)) {
+    // 重复的 packet
+    if (cc == stream->cc) {
+      return;
+    }
+    stream->broken = true;
+  }
+  stream->cc = cc;
+
+  if (unit_start) {
+    FlushPES(stream, out);
+    stream->pes.clear();
+    stream->broken = false;
+  } else if (stream->pes.empty()) {
+    // 等待 PES 开头
+    return;
+  }
+  if (!stream->broken) {
+    stream->pes.insert(stream->pes.end(), packet + pos,
+                       packet + TsMuxer::PACKET_SIZE);
+  }
+  // PES_packet_length 不为 0 时收齐即可输出，不必等待下一个 PES
+  const std::vector<uint8_t>& pes = stream->pes;
+  if (pes.size() >= 6) {
+    size_t length = pes[4] << 8 | pes[5];
+    if (length && pes.size() >= 6 + length) {
+      FlushPES(stream, out);
+      stream->pes.clear();
+    }
+  }
+}
+
+void TsDemuxer::ParsePAT(const uint8_t* data, size_t size) {
+  if (size < 8 || data[0] != 0x00) {
+    return;
+  }
+  size_t length = (data[1] & 0x0F) << 8 | data[2];
+  size_t end = std::min(size, 3 + length);
+  // 跳过 section 头部，末尾 4 字节为 CRC32，取第一个节目
+  for (size_t pos = 8; pos + 4 + 4 <= end; pos += 4) {
+    uint16_t program = uint16_t(data[pos] << 8 | data[pos + 1]);
+    if (program != 0) {
+      pmt_pid_ = uint16_t((data[pos + 2] & 0x1F) << 8 | data[pos + 3]);
+      return;
+    }
+  }
+}
+
+void TsDemuxer::ParsePMT(const uint8_t* data, size_t size) {
+  if (size < 12 || data[0] != 0x02) {
+    return;
+  }
+  size_t length = (data[1] & 0x0F) << 8 | data[2];
+  size_t end = std::min(size, 3 + length);
+  size_t pos = 12 + ((data[10] & 0x0F) << 8 | data[11]);
+  uint16_t video_pid = 0;
+  uint16_t audio_pid = 0;
+  while (pos + 5 + 4 <= end) {
+    uint8_t stream_type = data[pos];
+    uint16_t pid = uint16_t((data[pos + 1] & 0x1F) << 8 | data[pos + 2]);
+    if (stream_type == STREAM_TYPE_H264 && !video_pid) {
+      video_pid = pid;
+    } else if (stream_type == STREAM_TYPE_AAC && !audio_pid) {
+      audio_pid = pid;
+    }
+    pos += 5 + ((data[pos + 3] & 0x0F) << 8 | data[pos + 4]);
+  }
+  if (video_.pid != video_pid) {
+    video_ = Stream();
+    video_.pid = video_pid;
+  }
+  if (audio_.pid != audio_pid) {
+    audio_ = Stream();
+    audio_.pid = audio_pid;
+  }
+}
+
+void TsDemuxer::FlushPES(Stream* stream, std::vector<MediaMessagePtr>* out) {
+  const std::vector<uint8_t>& pes = stream->pes;
+  if (stream->broken || pes.size() < 9 || pes[0] != 0 || pes[1] != 0 ||
+      pes[2] != 1) {
+    return;
+  }
+  const uint8_t flags = pes[7];
+  const size_t begin = 9 + pes[8];
+  size_t end = pes.size();
+  size_t length = pes[4] << 8 | pes[5];
+  if (length) {
+    end = std::min(end, 6 + length);
+  }
+  // 没有 PTS 的 PES 无法确定时间
+  if (!(flags & 0x80) || begin >= end || pes.size() < 14) {
+    return;
+  }
+  uint64_t pts = ReadTimestamp(&pes[9]);
+  uint64_t dts = pts;
+  if ((flags & 0x40) && pes.size() >= 19) {
+    dts = ReadTimestamp(&pes[14]);
+  }
+  if (stream == &video_) {
+    OnVideo(pts, dts, &pes[begin], end - begin, out);
+  } else {
+    OnAudio(pts, &pes[begin], end - begin, out);
+  }
+}
+
+uint32_t TsDemuxer::ToMilliseconds(uint64_t timestamp) {
+  // 以上一个时间戳为参照，允许前后跳动，约 26.5 小时回绕一次
+  if (!has_timestamp_) {
+    has_timestamp_ = true;
+    last_timestamp_ = timestamp;
+  }
+  int64_t delta = int64_t((timestamp - last_timestamp_) & TIMESTAMP_MASK);
+  if (delta > int64_t(TIMESTAMP_MASK / 2)) {
+    delta -= int64_t(TIMESTAMP_MASK) + 1;
+  }
+  last_timestamp_ = timestamp;
+  position_ += delta;
+  return uint32_t(std::max<int64_t>(position_, 0) / 90);
+}
+
+void TsDemuxer::OnVideo(uint64_t pts, uint64_t dts, const uint8_t* data,
+                        size_t size, std::vector<MediaMessagePtr>* out) {
+  const uint32_t timestamp = ToMilliseconds(dts);
+  int32_t cts = int32_t(((pts - dts) & TIMESTAMP_MASK) / 90);
+  std::vector<uint8_t> header;
+  std::vector<uint8_t> frame;
+  avc_converter_.Convert(data, size, cts, &header, &frame);
+  if (!header.empty()) {
+    out->emplace_back(std::make_shared<const MediaMessage>(
+        9, timestamp, std::move(header)));
+  }
+  if (!frame.empty()) {
+    out->emplace_back(
+        std::make_shared<const MediaMessage>(9, timestamp, std::move(frame)));
+  }
+}
+
+void TsDemuxer::OnAudio(uint64_t pts, const uint8_t* data, size_t size,
+                        std::vector<MediaMessagePtr>* out) {
+  // 一个 PES 可以包含多个 ADTS 帧，每帧 1024 个采样
+  size_t pos = 0;
+  for (uint64_t index = 0; pos + 7 <= size; index++) {
+    const uint8_t* p = data + pos;
+    if (p[0] != 0xFF || (p[1] & 0xF0) != 0xF0) {
+      LOG_ERROR << "invalid adts header";
+      return;
+    }
+    size_t header_size = (p[1] & 0x01) ? 7 : 9;
+    size_t frame_length = (p[3] & 0x03) << 11 | p[4] << 3 | p[5] >> 5;
+    if (frame_length <= header_size || pos + frame_length > size) {
+      return;
+    }
+    // ADTS header 转为 2 字节的 AudioSpecificConfig
+    uint8_t object_type = uint8_t((p[2] >> 6) + 1);
+    uint8_t sample_rate_index = p[2] >> 2 & 0x0F;
+    uint8_t channels = uint8_t((p[2] & 0x01) << 2 | p[3] >> 6);
+    std::vector<uint8_t> config = {
+        uint8_t(object_type << 3 | sample_rate_index >> 1),
+        uint8_t((sample_rate_index & 0x01) << 7 | channels << 3)};
+    AACConfig aac;
+    aac.Parse(config.data(), config.size());
+    uint64_t timestamp =
+        pts + index * 1024 * 90000 / std::max<uint32_t>(aac.SampleRate(), 1);
+    const uint32_t ms = ToMilliseconds(timestamp & TIMESTAMP_MASK);
+
+    if (config != aac_config_) {
+      aac_config_ = config;
+      std::vector<uint8_t> header = {0xAF, 0};
+      header.insert(header.end(), config.begin(), config.end());
+      out->emplace_back(
+          std::make_shared<const MediaMessage>(8, ms, std::move(header)));
+    }
+    // SoundFormat 10 为 AAC，其余字段按惯例填 44kHz、16 bit、立体声
+    std::vector<uint8_t> frame = {0xAF, 1};
+    frame.insert(frame.end(), p + header_size, p + frame_length);
+    out->emplace_back(
+        std::make_shared<const MediaMessage>(8, ms, std::move(frame)));
+    pos += frame_length;
+  }
+}
+
+}  // namespace ts
+}  // namespace util
+}  // namespace live
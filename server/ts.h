@@ -0,0 +1,103 @@
+#pragma once
+
+#include "server/codec.h"
+#include "server/media_message.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace live {
+namespace util {
+namespace ts {
+
+// 最简单的 MPEG-TS 封装：一个节目，H.264 视频及 ADTS AAC 音频各至多一路，
+// 每个切片以 PAT、PMT 开头，时间戳单位为 90kHz
+class TsMuxer {
+ public:
+  static const size_t PACKET_SIZE = 188;
+  static const uint16_t PMT_PID = 0x1000;
+  static const uint16_t VIDEO_PID = 0x100;
+  static const uint16_t AUDIO_PID = 0x101;
+
+ private:
+  bool has_video_ = false;
+  bool has_audio_ = false;
+  uint8_t pat_cc_ = 0;
+  uint8_t pmt_cc_ = 0;
+  uint8_t video_cc_ = 0;
+  uint8_t audio_cc_ = 0;
+
+  // 将一个 PSI section 写为单个 TS packet
+  void WriteSection(uint16_t pid, uint8_t* cc,
+                    const std::vector<uint8_t>& section,
+                    std::vector<uint8_t>* out);
+  // 将 PES 拆分为 TS packet，第一个 packet 可携带 PCR 及随机访问标志
+  void WritePES(uint16_t pid, uint8_t* cc, const std::vector<uint8_t>& pes,
+                bool with_pcr, uint64_t pcr, bool random_access,
+                std::vector<uint8_t>* out);
+
+ public:
+  // 之后的 PAT、PMT 中包含哪些流，PCR 取自视频，纯音频时取自音频
+  void SetStreams(bool has_video, bool has_audio) {
+    has_video_ = has_video;
+    has_audio_ = has_audio;
+  }
+
+  void WriteTables(std::vector<uint8_t>* out);
+
+  // data 为 Annex B 格式的一帧
+  void WriteVideo(uint64_t pts, uint64_t dts, bool is_key_frame,
+                  const uint8_t* data, size_t size, std::vector<uint8_t>* out);
+
+  // data 为带 ADTS header 的一帧
+  void WriteAudio(uint64_t pts, const uint8_t* data, size_t size,
+                  std::vector<uint8_t>* out);
+};
+
+// MPEG-TS 解封装：由 PAT、PMT 找到第一个节目中的 H.264 及 ADTS AAC，
+// 重组 PES 后转为 FLV 格式的 payload，与 RTMP 推流得到的 MediaMessage 相同。
+// SPS、PPS 或 AAC 配置变化时先输出 sequence header，时间戳以第一个 PES 为 0
+class TsDemuxer {
+  struct Stream {
+    uint16_t pid = 0;
+    // 上一个 packet 的 continuity_counter，0xFF 表示尚未收到
+    uint8_t cc = 0xFF;
+    std::vector<uint8_t> pes;
+    // 有丢包，丢弃当前 PES
+    bool broken = false;
+  };
+
+  uint16_t pmt_pid_ = 0;
+  Stream video_;
+  Stream audio_;
+
+  // 展开 33 bit 的时间戳
+  bool has_timestamp_ = false;
+  uint64_t last_timestamp_ = 0;
+  int64_t position_ = 0;
+
+  AnnexBConverter avc_converter_;
+  std::vector<uint8_t> aac_config_;
+
+  void ParsePAT(const uint8_t* data, size_t size);
+  void ParsePMT(const uint8_t* data, size_t size);
+  void FlushPES(Stream* stream, std::vector<MediaMessagePtr>* out);
+  void OnVideo(uint64_t pts, uint64_t dts, const uint8_t* data, size_t size,
+               std::vector<MediaMessagePtr>* out);
+  void OnAudio(uint64_t pts, const uint8_t* data, size_t size,
+               std::vector<MediaMessagePtr>* out);
+  uint32_t ToMilliseconds(uint64_t timestamp);
+
+ public:
+  // packet 为 188 字节，得到的消息追加到 out
+  void Input(const uint8_t* packet, std::vector<MediaMessagePtr>* out);
+  // 新的推流，之后重新输出 sequence header，时间戳重新从 0 开始
+  void Reset() {
+    *this = TsDemuxer();
+  }
+};
+
+}  // namespace ts
+}  // namespace util
+}  // namespace live
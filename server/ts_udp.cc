@@ -0,0 +1,379 @@
+#include "server/ts_udp.h"
+#include "server/admission.h"
+#include "server/args.h"
+#include "server/room.h"
+
+#include "util/util.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <unordered_map>
+
+namespace live {
+namespace util {
+namespace ts {
+
+// 每个 UDP 包 7 个 TS packet，不超过以太网 MTU
+static const size_t DATAGRAM_SIZE = 7 * TsMuxer::PACKET_SIZE;
+
+// 每次读事件最多读取的 UDP 包数，避免长时间占用 EventLoop
+static const int MAX_READS_PER_EVENT = 64;
+
+TsIngest::TsIngest(const std::string& address)
+    : address_(address), loop_(EventLoopGroup::GetInstance().NextLoop()) {
+  std::string full = address;
+  if (full.find(':') == std::string::npos) {
+    full = "0.0.0.0:" + full;
+  }
+  sockaddr_storage storage;
+  memset(&storage, 0, sizeof(storage));
+  int len = sizeof(storage);
+  if (evutil_parse_sockaddr_port(full.c_str(),
+                                 reinterpret_cast<sockaddr*>(&storage),
+                                 &len) ||
+      storage.ss_family != AF_INET) {
+    throw std::string("invalid ts ingest address " + address);
+  }
+  sockaddr_in addr = *reinterpret_cast<sockaddr_in*>(&storage);
+  const bool multicast = IN_MULTICAST(ntohl(addr.sin_addr.s_addr));
+
+  fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd_ < 0) {
+    throw std::string("create ts ingest socket failed");
+  }
+  int reuse = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  // 码率突发时内核缓冲区太小会直接丢包
+  int rcvbuf = 4 << 20;
+  setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  if (bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    close(fd_);
+    throw std::string("bind ts ingest address " + address + " failed");
+  }
+  if (multicast) {
+    ip_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_multiaddr = addr.sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(fd_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))) {
+      close(fd_);
+      throw std::string("join multicast group " + address + " failed");
+    }
+  }
+  evutil_make_socket_nonblocking(fd_);
+
+  // 与 Listener 相同，在 EventLoopGroup::Run 之前创建
+  read_event_.reset(event_new(loop_->GetEventBase(), fd_, EV_READ | EV_PERSIST,
+                              ReadCallback, this));
+  timer_.reset(event_new(loop_->GetEventBase(), -1, EV_PERSIST, TimerCallback,
+                         this));
+  if (!read_event_ || !timer_) {
+    close(fd_);
+    throw std::string("event_new failed");
+  }
+  event_add(read_event_.get(), nullptr);
+  timeval tv = {1, 0};
+  event_add(timer_.get(), &tv);
+}
+
+TsIngest::~TsIngest() {
+  read_event_.reset();
+  timer_.reset();
+  close(fd_);
+}
+
+void TsIngest::ReadCallback(evutil_socket_t, short, void* ptr) {
+  EventLoop::Current()->BeginWork();
+  reinterpret_cast<TsIngest*>(ptr)->OnRead();
+}
+
+void TsIngest::TimerCallback(evutil_socket_t, short, void* ptr) {
+  EventLoop::Current()->BeginWork();
+  reinterpret_cast<TsIngest*>(ptr)->OnTimer();
+}
+
+void TsIngest::OnRead() {
+  const uint64_t now = GetPassedTimeSinceStartedInMicroSeconds();
+  std::vector<MediaMessagePtr> messages;
+  size_t bytes = 0;
+  uint8_t buffer[64 << 10];
+  for (int i = 0; i < MAX_READS_PER_EVENT; i++) {
+    ssize_t n = recv(fd_, buffer, sizeof(buffer), 0);
+    if (n <= 0) {
+      break;
+    }
+    last_data_us_ = now;
+    if (room_id_ < 0 && !OpenRoom(now)) {
+      continue;
+    }
+    bytes += n;
+    for (size_t pos = 0; pos + TsMuxer::PACKET_SIZE <= size_t(n);
+         pos += TsMuxer::PACKET_SIZE) {
+      demuxer_.Input(buffer + pos, &messages);
+    }
+  }
+  if (room_id_ < 0 || bytes == 0) {
+    return;
+  }
+
+  // 与 RTMP 推流相同，按 1 秒窗口统计码率供准入控制使用
+  static const uint64_t WINDOW_US = 1000000;
+  if (ingest_window_start_us_ == 0) {
+    ingest_window_start_us_ = now;
+  }
+  ingest_bytes_ += bytes;
+  if (now - ingest_window_start_us_ >= WINDOW_US) {
+    AdmissionController::GetInstance().UpdateRoomBitrate(
+        room_id_, ingest_bytes_ * 8 * 1000000 / (now - ingest_window_start_us_));
+    ingest_bytes_ = 0;
+    ingest_window_start_us_ = now;
+  }
+  RoomManager::GetInstance().Publish(room_id_, std::move(messages));
+}
+
+void TsIngest::OnTimer() {
+  const uint64_t now = GetPassedTimeSinceStartedInMicroSeconds();
+  if (room_id_ >= 0 &&
+      now - last_data_us_ >
+          uint64_t(std::max(server::FLAGS_ts_ingest_timeout, 0)) * 1000) {
+    LOG_ERROR << "ts ingest " << address_ << " timeout, room_id: "
+              << room_id_;
+    CloseRoom();
+  }
+}
+
+bool TsIngest::OpenRoom(uint64_t now) {
+  if (create_failed_us_ && now - create_failed_us_ < 1000000) {
+    return false;
+  }
+  JoinMode join_mode = JoinMode::GOP;
+  if (!ParseJoinMode(server::FLAGS_join_mode, &join_mode)) {
+    LOG_ERROR << "invalid join_mode flag " << server::FLAGS_join_mode;
+  }
+  room_id_ = RoomManager::GetInstance().CreateRoom(join_mode);
+  if (room_id_ < 0) {
+    LOG_ERROR << "create room failed, ts ingest " << address_;
+    create_failed_us_ = now;
+    return false;
+  }
+  create_failed_us_ = 0;
+  demuxer_.Reset();
+  ingest_window_start_us_ = 0;
+  ingest_bytes_ = 0;
+  LOG_ERROR << "ts ingest from " << address_ << ", room_id: " << room_id_;
+  return true;
+}
+
+void TsIngest::CloseRoom() {
+  AdmissionController::GetInstance().UpdateRoomBitrate(room_id_, 0);
+  RoomManager::GetInstance().CloseRoom(room_id_);
+  room_id_ = -1;
+}
+
+TsEgress::TsEgress(int32_t room_id, const std::string& address)
+    : room_id_(room_id), address_(address) {
+  sockaddr_storage addr;
+  memset(&addr, 0, sizeof(addr));
+  int len = sizeof(addr);
+  if (evutil_parse_sockaddr_port(address.c_str(),
+                                 reinterpret_cast<sockaddr*>(&addr), &len)) {
+    throw std::string("invalid ts egress address " + address);
+  }
+  fd_ = socket(addr.ss_family, SOCK_DGRAM, 0);
+  if (fd_ < 0) {
+    throw std::string("create ts egress socket failed");
+  }
+  // connect 之后可以直接 send，组播使用系统缺省的 TTL
+  if (connect(fd_, reinterpret_cast<sockaddr*>(&addr), len) < 0) {
+    close(fd_);
+    throw std::string("connect ts egress address " + address + " failed");
+  }
+  int sndbuf = 1 << 20;
+  setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  evutil_make_socket_nonblocking(fd_);
+}
+
+TsEgress::~TsEgress() {
+  close(fd_);
+}
+
+void TsEgress::WriteTables(uint32_t timestamp) {
+  muxer_.SetStreams(has_avc_, has_aac_);
+  muxer_.WriteTables(&buffer_);
+  last_tables_timestamp_ = timestamp;
+}
+
+void TsEgress::SendMediaData(const MediaMessagePtr& msg, uint32_t timestamp) {
+  if (msg->codec == MediaCodec::AVC) {
+    if (msg->is_config) {
+      has_avc_ = avc_.Parse(msg->Data(), msg->DataSize());
+      return;
+    }
+    if (!msg->is_frame || !has_avc_) {
+      return;
+    }
+    // 每个关键帧前重发 PAT、PMT，接收端可以从任意关键帧开始解码
+    const bool is_key_frame = msg->IsKeyFrame();
+    if (is_key_frame) {
+      WriteTables(timestamp);
+      started_ = true;
+    }
+    if (!started_) {
+      return;
+    }
+    auto frame = avc_.GetAnnexB(*msg);
+    if (!frame) {
+      LOG_ERROR << "invalid avc frame, room_id: " << room_id_;
+      return;
+    }
+    uint64_t dts = uint64_t(timestamp) * 90;
+    uint64_t pts = msg->cts > 0 ? dts + uint64_t(msg->cts) * 90 : dts;
+    muxer_.WriteVideo(pts, dts, is_key_frame, frame->data(), frame->size(),
+                      &buffer_);
+  } else if (msg->codec == MediaCodec::AAC) {
+    if (msg->is_config) {
+      has_aac_ = aac_.Parse(msg->Data(), msg->DataSize());
+      return;
+    }
+    if (!has_aac_) {
+      return;
+    }
+    // 纯音频时每 500ms 重发一次 PAT、PMT
+    if (!has_avc_ &&
+        (!started_ || timestamp - last_tables_timestamp_ >= 500)) {
+      WriteTables(timestamp);
+      started_ = true;
+    }
+    if (!started_) {
+      return;
+    }
+    auto frame = aac_.GetADTS(*msg);
+    if (!frame) {
+      return;
+    }
+    muxer_.WriteAudio(uint64_t(timestamp) * 90, frame->data(), frame->size(),
+                      &buffer_);
+  } else {
+    return;
+  }
+  Flush();
+}
+
+void TsEgress::Flush() {
+  const size_t count = buffer_.size() / DATAGRAM_SIZE;
+  if (count == 0) {
+    return;
+  }
+#ifdef __linux__
+  // 一次系统调用发送所有凑满的 UDP 包
+  std::vector<iovec> iovs(count);
+  std::vector<mmsghdr> msgs(count);
+  for (size_t i = 0; i < count; i++) {
+    iovs[i].iov_base = &buffer_[i * DATAGRAM_SIZE];
+    iovs[i].iov_len = DATAGRAM_SIZE;
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  size_t sent = 0;
+  while (sent < count) {
+    int n = sendmmsg(fd_, &msgs[sent], unsigned(count - sent), 0);
+    // 发送缓冲区满时丢弃剩余的包，接收端按 continuity_counter 发现丢包
+    if (n <= 0) {
+      break;
+    }
+    sent += size_t(n);
+  }
+#else
+  for (size_t i = 0; i < count; i++) {
+    if (send(fd_, &buffer_[i * DATAGRAM_SIZE], DATAGRAM_SIZE, 0) < 0) {
+      break;
+    }
+  }
+#endif
+  buffer_.erase(buffer_.begin(), buffer_.begin() + count * DATAGRAM_SIZE);
+}
+
+// 当前 EventLoop 上各房间的 TsEgress
+static std::unordered_map<int32_t, std::vector<std::unique_ptr<TsEgress>>>&
+LocalEgresses() {
+  static thread_local std::unordered_map<
+      int32_t, std::vector<std::unique_ptr<TsEgress>>>
+      egresses;
+  return egresses;
+}
+
+// -ts_egress 形如 3=239.0.0.1:1234,0=10.0.0.5:5000
+static std::vector<std::string> FindDestinations(int32_t room_id) {
+  std::vector<std::string> addresses;
+  const std::string& list = server::FLAGS_ts_egress;
+  const std::string prefix = std::to_string(room_id) + "=";
+  for (size_t begin = 0, end = 0; begin < list.size(); begin = end + 1) {
+    end = list.find(',', begin);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    std::string item = list.substr(begin, end - begin);
+    if (!item.compare(0, prefix.size(), prefix) &&
+        item.size() > prefix.size()) {
+      addresses.push_back(item.substr(prefix.size()));
+    }
+  }
+  return addresses;
+}
+
+// 同一房间总是选择同一个 EventLoop，创建、销毁任务按投递顺序执行
+static EventLoop* GetEgressLoop(int32_t room_id) {
+  EventLoopGroup& group = EventLoopGroup::GetInstance();
+  return group.GetLoop(size_t(room_id) % group.Size());
+}
+
+void TsEgressManager::OpenRoom(int32_t room_id) {
+  std::vector<std::string> addresses = FindDestinations(room_id);
+  if (addresses.empty()) {
+    return;
+  }
+  GetEgressLoop(room_id)->RunInLoop([room_id, addresses]() {
+    auto& egresses = LocalEgresses()[room_id];
+    for (const auto& address : addresses) {
+      std::unique_ptr<TsEgress> egress;
+      try {
+        egress.reset(new TsEgress(room_id, address));
+      } catch (const std::string& e) {
+        LOG_ERROR << e;
+        continue;
+      }
+      if (!RoomManager::GetInstance().EnterRoom(room_id, egress.get())) {
+        LOG_ERROR << "enter room failed, room_id: " << room_id;
+        continue;
+      }
+      LOG_ERROR << "ts egress room " << room_id << " to " << address;
+      egresses.push_back(std::move(egress));
+    }
+  });
+}
+
+void TsEgressManager::CloseRoom(int32_t room_id) {
+  if (FindDestinations(room_id).empty()) {
+    return;
+  }
+  GetEgressLoop(room_id)->RunInLoop([room_id]() {
+    auto& rooms = LocalEgresses();
+    auto it = rooms.find(room_id);
+    if (it == rooms.end()) {
+      return;
+    }
+    for (const auto& egress : it->second) {
+      RoomManager::GetInstance().LeaveRoom(room_id, egress.get());
+    }
+    rooms.erase(it);
+  });
+}
+
+}  // namespace ts
+}  // namespace util
+}  // namespace live
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "server/codec.h"
+#include "server/media_message.h"
+#include "server/net.h"
+#include "server/ts.h"
+#include "server/visitor.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace live {
+namespace util {
+namespace ts {
+
+// 从一个 UDP 地址接收 MPEG-TS 推流，收到数据时创建房间，超过
+// -ts_ingest_timeout 没有数据时关闭房间。address 形如 9000 或
+// 239.0.0.1:9000，组播地址会加入该组。只在所属 EventLoop 的线程中工作
+class TsIngest {
+  std::string address_;
+  EventLoop* loop_;
+  int fd_ = -1;
+
+  struct event_deleter {
+    void operator()(event* ptr) {
+      event_free(ptr);
+    }
+  };
+  std::unique_ptr<event, event_deleter> read_event_;
+  std::unique_ptr<event, event_deleter> timer_;
+
+  TsDemuxer demuxer_;
+  int32_t room_id_ = -1;
+  uint64_t last_data_us_ = 0;
+  // 房间已满时过一段时间再重试
+  uint64_t create_failed_us_ = 0;
+
+  uint64_t ingest_window_start_us_ = 0;
+  uint64_t ingest_bytes_ = 0;
+
+  static void ReadCallback(evutil_socket_t, short, void* ptr);
+  static void TimerCallback(evutil_socket_t, short, void* ptr);
+  void OnRead();
+  void OnTimer();
+  bool OpenRoom(uint64_t now);
+  void CloseRoom();
+
+ public:
+  // 失败时抛出 std::string
+  explicit TsIngest(const std::string& address);
+  ~TsIngest();
+};
+
+// 作为房间的观众将其封装为 MPEG-TS，以 7 个 TS packet 一个 UDP 包发往
+// 单播或组播地址。Linux 上以 sendmmsg 一次发送多个 UDP 包
+class TsEgress : public Visitor {
+  int32_t room_id_;
+  std::string address_;
+  int fd_ = -1;
+
+  AVCConfig avc_;
+  bool has_avc_ = false;
+  AACConfig aac_;
+  bool has_aac_ = false;
+
+  TsMuxer muxer_;
+  // 有视频时从关键帧开始发送
+  bool started_ = false;
+  uint32_t last_tables_timestamp_ = 0;
+  // 未凑满一个 UDP 包的 TS packet
+  std::vector<uint8_t> buffer_;
+
+  void WriteTables(uint32_t timestamp);
+  void Flush();
+
+ public:
+  // address 形如 239.0.0.1:1234，失败时抛出 std::string
+  TsEgress(int32_t room_id, const std::string& address);
+  ~TsEgress();
+
+  void SendMetaData(const MediaMessagePtr& msg) override {}
+  void SendMediaData(const MediaMessagePtr& msg, uint32_t timestamp) override;
+};
+
+// 按 -ts_egress 为房间创建 TsEgress。同一房间的 TsEgress 总在同一个
+// EventLoop 上创建和销毁，与房间副本的创建、销毁保持顺序
+class TsEgressManager {
+  TsEgressManager() = default;
+  TsEgressManager(const TsEgressManager&) = delete;
+  TsEgressManager& operator=(const TsEgressManager&) = delete;
+
+ public:
+  static TsEgressManager& GetInstance() {
+    static TsEgressManager tm;
+    return tm;
+  }
+
+  // 线程安全，须在房间副本创建之后、销毁之后调用
+  void OpenRoom(int32_t room_id);
+  void CloseRoom(int32_t room_id);
+};
+
+}  // namespace ts
+}  // namespace util
+}  // namespace live
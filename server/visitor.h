@@ -0,0 +1,20 @@
+#pragma once
+
+#include "server/media_message.h"
+
+namespace live {
+namespace util {
+
+// 房间的观众，与具体协议无关。房间只在观众所属 EventLoop 的线程中调用以下接口。
+class Visitor {
+ public:
+  virtual void SendMetaData(const MediaMessagePtr& msg) = 0;
+  // timestamp 为发给该观众的时间戳，加入方式不同时可能与 msg->timestamp 不同
+  virtual void SendMediaData(const MediaMessagePtr& msg,
+                             uint32_t timestamp) = 0;
+
+  virtual ~Visitor() {}
+};
+
+}  // namespace util
+}  // namespace live
@@ -0,0 +1,423 @@
+#include "server/vod.h"
+#include "server/args.h"
+#include "server/flv.h"
+#include "server/room.h"
+#include "server/stream.h"
+#include "server/worker_pool.h"
+
+#include "util/util.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace live {
+namespace util {
+namespace vod {
+
+// 索引文件的格式，变化时修改版本号使旧的索引失效
+static const char INDEX_MAGIC[4] = {'L', 'V', 'I', 'X'};
+static const uint32_t INDEX_VERSION = 1;
+
+struct IndexHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t file_size;
+  int64_t mtime;
+  uint64_t count;
+};
+
+static const size_t FLV_HEADER_SIZE = 9;
+static const size_t PREVIOUS_TAG_SIZE = 4;
+
+// 按时间戳提前发送的数据量，单位 ms
+static const uint32_t VOD_READ_AHEAD_MS = 1000;
+static const int32_t TIMER_INTERVAL_US = 10000;
+// 每个周期至多发送的 tag 数，避免长时间占用 EventLoop
+static const int32_t MAX_TAGS_PER_TICK = 256;
+// 读缓存的槽数
+static const size_t READ_CACHE_SLOTS = 256;
+
+VodFile::VodFile(const std::string& path)
+    : path_(path), read_cache_(READ_CACHE_SLOTS) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw "open " + path + " failed, errno: " + std::to_string(errno);
+  }
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < off_t(FLV_HEADER_SIZE)) {
+    close(fd);
+    throw path + " is not a flv file";
+  }
+  size_ = size_t(st.st_size);
+  mtime_ = int64_t(st.st_mtime);
+  void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  int err = errno;
+  // 映射建立后不再需要 fd
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw "mmap " + path + " failed, errno: " + std::to_string(err);
+  }
+  data_ = reinterpret_cast<const uint8_t*>(data);
+
+  std::vector<uint8_t> bytes(data_, data_ + FLV_HEADER_SIZE);
+  ByteStream bs(bytes);
+  flv::Header header;
+  bs >> header;
+  if (memcmp(header.signature, "FLV", 3) || header.data_offset > size_) {
+    munmap(const_cast<uint8_t*>(data_), size_);
+    throw path + " is not a flv file";
+  }
+
+  if (!LoadIndex()) {
+    const uint64_t begin = GetPassedTimeSinceStartedInMicroSeconds();
+    BuildIndex();
+    LOG_ERROR << "build vod index for " << path_ << ", tags: " << tags_.size()
+              << ", cost: "
+              << (GetPassedTimeSinceStartedInMicroSeconds() - begin) / 1000
+              << "ms";
+    SaveIndex();
+  }
+  BuildSeekPoints();
+}
+
+VodFile::~VodFile() {
+  munmap(const_cast<uint8_t*>(data_), size_);
+}
+
+bool VodFile::LoadIndex() {
+  int fd = open((path_ + ".idx").c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  IndexHeader header;
+  bool ok = read(fd, &header, sizeof(header)) == ssize_t(sizeof(header)) &&
+            !memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) &&
+            header.version == INDEX_VERSION && header.file_size == size_ &&
+            header.mtime == mtime_ &&
+            header.count <= size_ / (MediaMessage::FLV_TAG_HEADER_SIZE +
+                                     PREVIOUS_TAG_SIZE);
+  if (ok) {
+    tags_.resize(header.count);
+    const ssize_t bytes = ssize_t(tags_.size() * sizeof(Tag));
+    ok = bytes == 0 || read(fd, &tags_[0], bytes) == bytes;
+  }
+  close(fd);
+  // 索引须与文件内容一致，否则重新建立
+  for (size_t i = 0; ok && i < tags_.size(); i++) {
+    const Tag& tag = tags_[i];
+    ok = tag.offset + MediaMessage::FLV_TAG_HEADER_SIZE + tag.size <= size_ &&
+         data_[tag.offset] == tag.type;
+  }
+  if (!ok) {
+    tags_.clear();
+  }
+  return ok;
+}
+
+void VodFile::BuildIndex() {
+  std::vector<uint8_t> bytes;
+  size_t pos = FLV_HEADER_SIZE + PREVIOUS_TAG_SIZE;
+  // 正在录制的文件末尾可能有不完整的 tag，只索引完整的部分
+  while (pos + MediaMessage::FLV_TAG_HEADER_SIZE <= size_) {
+    bytes.assign(data_ + pos, data_ + pos + MediaMessage::FLV_TAG_HEADER_SIZE);
+    ByteStream bs(bytes);
+    flv::TagHeader header(0, 0, 0);
+    bs >> header;
+    const size_t end = pos + MediaMessage::FLV_TAG_HEADER_SIZE +
+                       header.data_size + PREVIOUS_TAG_SIZE;
+    if (end > size_) {
+      break;
+    }
+    const uint8_t* payload = data_ + pos + MediaMessage::FLV_TAG_HEADER_SIZE;
+    uint32_t flags = 0;
+    if (header.data_size > 1) {
+      if (header.type == flv::VIDEO_TAG) {
+        // CodecID 7 为 AVC，AVCPacketType 0 为 sequence header
+        if ((payload[0] & 0x0F) == 7 && payload[1] == 0) {
+          flags = SEQUENCE_HEADER;
+        } else if ((payload[0] >> 4) == 1) {
+          flags = KEY_FRAME;
+        }
+      } else if (header.type == flv::AUDIO_TAG && (payload[0] >> 4) == 10 &&
+                 payload[1] == 0) {
+        flags = SEQUENCE_HEADER;
+      }
+    }
+    if (header.data_size > 0 &&
+        (header.type == flv::AUDIO_TAG || header.type == flv::VIDEO_TAG ||
+         header.type == flv::SCRIPT_TAG)) {
+      tags_.push_back({pos, header.timestamp, header.data_size, header.type,
+                       flags});
+    }
+    pos = end;
+  }
+}
+
+void VodFile::SaveIndex() const {
+  // 先写临时文件再改名，其他进程不会读到写了一半的索引
+  const std::string path = path_ + ".idx";
+  const std::string tmp = path + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    LOG_ERROR << "open " << tmp << " failed, errno: " << errno;
+    return;
+  }
+  IndexHeader header;
+  memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  header.version = INDEX_VERSION;
+  header.file_size = size_;
+  header.mtime = mtime_;
+  header.count = tags_.size();
+  const ssize_t bytes = ssize_t(tags_.size() * sizeof(Tag));
+  bool ok = write(fd, &header, sizeof(header)) == ssize_t(sizeof(header)) &&
+            (bytes == 0 || write(fd, &tags_[0], bytes) == bytes);
+  close(fd);
+  if (!ok || rename(tmp.c_str(), path.c_str())) {
+    LOG_ERROR << "save vod index " << path << " failed, errno: " << errno;
+    unlink(tmp.c_str());
+  }
+}
+
+void VodFile::BuildSeekPoints() {
+  bool has_video = false;
+  for (size_t i = 0; i < tags_.size(); i++) {
+    const Tag& tag = tags_[i];
+    if (tag.type == flv::SCRIPT_TAG && meta_ < 0) {
+      meta_ = i;
+    } else if (tag.flags & SEQUENCE_HEADER) {
+      int64_t& header =
+          tag.type == flv::VIDEO_TAG ? avc_header_ : aac_header_;
+      if (header < 0) {
+        header = i;
+      }
+    } else if (tag.flags & KEY_FRAME) {
+      // 出现视频后只从关键帧开始播放
+      if (!has_video) {
+        has_video = true;
+        seek_points_.clear();
+      }
+      seek_points_.push_back(i);
+    } else if (tag.type == flv::AUDIO_TAG && !has_video) {
+      seek_points_.push_back(i);
+    }
+  }
+}
+
+size_t VodFile::Seek(uint32_t timestamp) const {
+  if (seek_points_.empty()) {
+    return tags_.size();
+  }
+  auto it = std::upper_bound(seek_points_.begin(), seek_points_.end(),
+                             timestamp, [this](uint32_t ts, uint32_t i) {
+                               return ts < tags_[i].timestamp;
+                             });
+  if (it != seek_points_.begin()) {
+    --it;
+  }
+  return *it;
+}
+
+MediaMessagePtr VodFile::ReadTag(size_t i) const {
+  {
+    std::lock_guard<std::mutex> g(cache_mutex_);
+    MediaMessagePtr msg = read_cache_.Get(i);
+    if (msg) {
+      return msg;
+    }
+  }
+  // 在锁外拷贝及解析，同时未命中的观众各自生成，以后放入的为准
+  const Tag& tag = tags_[i];
+  const uint8_t* payload =
+      data_ + tag.offset + MediaMessage::FLV_TAG_HEADER_SIZE;
+  MediaMessagePtr msg = std::make_shared<const MediaMessage>(
+      uint8_t(tag.type), tag.timestamp,
+      std::vector<uint8_t>(payload, payload + tag.size));
+  std::lock_guard<std::mutex> g(cache_mutex_);
+  read_cache_.Put(i, msg);
+  return msg;
+}
+
+MediaMessagePtr VodFile::GetMetaData() const {
+  return meta_ < 0 ? nullptr : ReadTag(meta_);
+}
+
+MediaMessagePtr VodFile::GetAVCHeader() const {
+  return avc_header_ < 0 ? nullptr : ReadTag(avc_header_);
+}
+
+MediaMessagePtr VodFile::GetAACHeader() const {
+  return aac_header_ < 0 ? nullptr : ReadTag(aac_header_);
+}
+
+bool VodManager::IsVodName(const std::string& name) {
+  static const std::string SUFFIX = ".flv";
+  return !server::FLAGS_vod_dir.empty() && name.size() > SUFFIX.size() &&
+         !name.compare(name.size() - SUFFIX.size(), SUFFIX.size(), SUFFIX);
+}
+
+void VodManager::Open(const std::string& name, OpenCallback done) {
+  EventLoop* loop = EventLoop::Current();
+  std::shared_ptr<const VodFile> file;
+  // 只允许 -vod_dir 下的文件
+  if (!IsVodName(name) || name[0] == '.' ||
+      name.find_first_not_of("abcdefghijklmnopqrstuvwxyz"
+                             "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                             "0123456789-_.") != std::string::npos) {
+    LOG_ERROR << "invalid vod name " << name;
+    loop->RunInLoop([done, file]() { done(file); });
+    return;
+  }
+  const std::string path = server::FLAGS_vod_dir + "/" + name;
+  struct stat st;
+  if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode)) {
+    LOG_ERROR << "vod file " << path << " not found";
+    loop->RunInLoop([done, file]() { done(file); });
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    Entry& entry = files_[name];
+    file = entry.file.lock();
+    if (!file ||
+        !file->IsSameFile(size_t(st.st_size), int64_t(st.st_mtime))) {
+      file.reset();
+      entry.waiters.emplace_back(loop, std::move(done));
+      if (entry.opening) {
+        return;
+      }
+      entry.opening = true;
+    }
+  }
+  if (file) {
+    loop->RunInLoop([done, file]() { done(file); });
+    return;
+  }
+  GetWorkerPool().Post([this, name, path]() { Load(name, path); });
+}
+
+void VodManager::Load(const std::string& name, const std::string& path) {
+  std::shared_ptr<const VodFile> file;
+  try {
+    file = std::make_shared<const VodFile>(path);
+  } catch (const std::string& e) {
+    LOG_ERROR << "open vod file failed, " << e;
+  }
+  std::vector<std::pair<EventLoop*, OpenCallback>> waiters;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    Entry& entry = files_[name];
+    if (file) {
+      entry.file = file;
+    }
+    entry.opening = false;
+    waiters.swap(entry.waiters);
+    // 顺便清理已经没有观众的文件
+    for (auto it = files_.begin(); it != files_.end();) {
+      if (!it->second.opening && it->second.file.expired()) {
+        it = files_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  // 观众在等待期间可能已经离开，由回调自行检查
+  for (auto& waiter : waiters) {
+    OpenCallback done = std::move(waiter.second);
+    waiter.first->RunInLoop([done, file]() { done(file); });
+  }
+}
+
+VodPlayer::VodPlayer(std::shared_ptr<const VodFile> file, Visitor* target,
+                     Subscription subscription, std::function<void()> on_end)
+    : file_(std::move(file)),
+      target_(target),
+      subscription_(subscription),
+      on_end_(std::move(on_end)) {
+  timer_.reset(event_new(EventLoop::Current()->GetEventBase(), -1,
+                         EV_PERSIST, TimerCallback, this));
+}
+
+void VodPlayer::Seek(uint32_t timestamp) {
+  next_ = file_->Seek(timestamp);
+  start_timestamp_ = next_ < file_->GetTags().size()
+                         ? file_->GetTags()[next_].timestamp
+                         : timestamp;
+  start_us_ = GetPassedTimeSinceStartedInMicroSeconds();
+  headers_sent_ = false;
+  LOG_ERROR << "vod seek to " << timestamp
+            << "ms, start timestamp: " << start_timestamp_;
+  // 第一批数据在下一个周期发出，调用者可以先回复播放命令
+  timeval tv = {0, TIMER_INTERVAL_US};
+  event_add(timer_.get(), &tv);
+}
+
+void VodPlayer::Pause() {
+  event_del(timer_.get());
+}
+
+void VodPlayer::TimerCallback(evutil_socket_t, short, void* ptr) {
+  EventLoop::Current()->BeginWork();
+  reinterpret_cast<VodPlayer*>(ptr)->OnTimer();
+}
+
+void VodPlayer::SendHeaders() {
+  MediaMessagePtr meta = file_->GetMetaData();
+  MediaMessagePtr avc = file_->GetAVCHeader();
+  MediaMessagePtr aac = file_->GetAACHeader();
+  if (meta) {
+    target_->SendMetaData(meta);
+  }
+  if (avc && Room::IsSubscribed(subscription_, 9, true)) {
+    target_->SendMediaData(avc, avc->timestamp);
+  }
+  if (aac && Room::IsSubscribed(subscription_, 8, false)) {
+    target_->SendMediaData(aac, aac->timestamp);
+  }
+  headers_sent_ = true;
+}
+
+void VodPlayer::OnTimer() {
+  if (!headers_sent_) {
+    SendHeaders();
+  }
+  const std::vector<VodFile::Tag>& tags = file_->GetTags();
+  const uint64_t now = GetPassedTimeSinceStartedInMicroSeconds();
+  const uint32_t until = start_timestamp_ +
+                         uint32_t((now - start_us_) / 1000) + VOD_READ_AHEAD_MS;
+  for (int32_t n = 0; n < MAX_TAGS_PER_TICK && next_ < tags.size(); n++) {
+    const VodFile::Tag& tag = tags[next_];
+    if (tag.timestamp > until) {
+      return;
+    }
+    const size_t i = next_++;
+    const bool is_key_frame = tag.flags & VodFile::KEY_FRAME;
+    if (!Room::IsSubscribed(subscription_, tag.type, is_key_frame)) {
+      continue;
+    }
+    MediaMessagePtr msg = file_->ReadTag(i);
+    if (tag.type == flv::SCRIPT_TAG) {
+      target_->SendMetaData(msg);
+    } else {
+      target_->SendMediaData(msg, msg->timestamp);
+    }
+  }
+  if (next_ >= tags.size()) {
+    event_del(timer_.get());
+    LOG_ERROR << "vod play complete, duration: " << file_->GetDuration()
+              << "ms";
+    if (on_end_) {
+      on_end_();
+    }
+  }
+}
+
+}  // namespace vod
+}  // namespace util
+}  // namespace live
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "server/media_message.h"
+#include "server/net.h"
+#include "server/visitor.h"
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace live {
+namespace util {
+
+// 定义在 room.h 中，room.h 依赖 net.h 等，这里只需要声明
+enum class Subscription;
+
+namespace vod {
+
+// 以 mmap 打开的一个 FLV 文件及其 tag 索引，创建后只读，可被多个观众共享。
+// 索引在首次打开时扫描文件建立，并写入同目录下的 <file>.idx，之后文件的
+// 大小及修改时间不变时直接加载，打开及 seek 都不需要再扫描文件
+class VodFile {
+ public:
+  struct Tag {
+    uint64_t offset;
+    uint32_t timestamp;
+    uint32_t size;
+    uint32_t type;
+    uint32_t flags;
+  };
+  enum TagFlag {
+    KEY_FRAME = 0x01,
+    SEQUENCE_HEADER = 0x02,
+  };
+
+ private:
+  std::string path_;
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  int64_t mtime_ = 0;
+
+  std::vector<Tag> tags_;
+  // 可以开始播放的 tag：有视频时为关键帧，纯音频时为每个音频 tag
+  std::vector<uint32_t> seek_points_;
+  // 文件中第一个 metadata 及解码配置在 tags_ 中的下标，没有时为 -1
+  int64_t meta_ = -1;
+  int64_t avc_header_ = -1;
+  int64_t aac_header_ = -1;
+
+  // 以 tag 下标为键，播放位置相近的观众共享读出的消息
+  mutable std::mutex cache_mutex_;
+  mutable MediaMessageCache read_cache_;
+
+  bool LoadIndex();
+  void BuildIndex();
+  void SaveIndex() const;
+  void BuildSeekPoints();
+
+ public:
+  // 失败时抛出 std::string
+  explicit VodFile(const std::string& path);
+  ~VodFile();
+  VodFile(const VodFile&) = delete;
+  VodFile& operator=(const VodFile&) = delete;
+
+  bool IsSameFile(size_t size, int64_t mtime) const {
+    return size == size_ && mtime == mtime_;
+  }
+
+  const std::vector<Tag>& GetTags() const {
+    return tags_;
+  }
+  uint32_t GetDuration() const {
+    return tags_.empty() ? 0 : tags_.back().timestamp;
+  }
+  // 从 timestamp 之前最近的关键帧开始播放时的第一个 tag 的下标
+  size_t Seek(uint32_t timestamp) const;
+
+  // 将第 i 个 tag 拷贝为 MediaMessage，最近读过的直接返回同一个。线程安全
+  MediaMessagePtr ReadTag(size_t i) const;
+  // 没有时返回空指针
+  MediaMessagePtr GetMetaData() const;
+  MediaMessagePtr GetAVCHeader() const;
+  MediaMessagePtr GetAACHeader() const;
+};
+
+// 按播放名在 -vod_dir 下打开 FLV 文件。正在播放的文件只打开、映射一次。
+// 首次打开时扫描文件建立索引可能很慢，在工作线程中进行，不阻塞 EventLoop
+class VodManager {
+ public:
+  // 打开失败时参数为空指针
+  using OpenCallback = std::function<void(std::shared_ptr<const VodFile>)>;
+
+ private:
+  struct Entry {
+    std::weak_ptr<const VodFile> file;
+    // 正在工作线程中打开，同一文件的其他观众等待同一个结果
+    bool opening = false;
+    std::vector<std::pair<EventLoop*, OpenCallback>> waiters;
+  };
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> files_;
+
+  VodManager() = default;
+  VodManager(const VodManager&) = delete;
+  VodManager& operator=(const VodManager&) = delete;
+
+  // 在工作线程中执行，打开后回到各观众的 EventLoop 调用其回调
+  void Load(const std::string& name, const std::string& path);
+
+ public:
+  static VodManager& GetInstance() {
+    static VodManager vm;
+    return vm;
+  }
+
+  // 播放名以 .flv 结尾且开启了 -vod_dir 时为点播
+  static bool IsVodName(const std::string& name);
+
+  // 在 EventLoop 线程中调用。done 总是稍后在同一个 EventLoop 中调用，
+  // 名称无效或文件不存在时参数为空指针
+  void Open(const std::string& name, OpenCallback done);
+};
+
+// 按 tag 时间戳的节奏把 VodFile 发送给观众，预先多发 VOD_READ_AHEAD_MS
+// 以吸收调度抖动。只在观众所属 EventLoop 的线程中使用
+class VodPlayer {
+  std::shared_ptr<const VodFile> file_;
+  Visitor* target_;
+  Subscription subscription_;
+  // 文件发送完毕时调用，其中不能销毁 VodPlayer
+  std::function<void()> on_end_;
+
+  size_t next_ = 0;
+  uint32_t start_timestamp_ = 0;
+  uint64_t start_us_ = 0;
+  // seek 之后需要重新发送 metadata 及解码配置
+  bool headers_sent_ = false;
+
+  struct event_deleter {
+    void operator()(event* ptr) {
+      event_free(ptr);
+    }
+  };
+  std::unique_ptr<event, event_deleter> timer_;
+
+  static void TimerCallback(evutil_socket_t, short, void* ptr);
+  void OnTimer();
+  void SendHeaders();
+
+ public:
+  VodPlayer(std::shared_ptr<const VodFile> file, Visitor* target,
+            Subscription subscription, std::function<void()> on_end);
+
+  // 从 timestamp（ms）之前最近的关键帧开始播放
+  void Seek(uint32_t timestamp);
+  void Pause();
+};
+
+}  // namespace vod
+}  // namespace util
+}  // namespace live
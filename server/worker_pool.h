@@ -0,0 +1,17 @@
+#pragma once
+
+#include "server/args.h"
+#include "util/thread_pool.h"
+
+namespace live {
+namespace util {
+
+// server 进程内共享的工作线程池，首次使用时创建
+inline ThreadPool& GetWorkerPool() {
+  static ThreadPool pool(
+      server::FLAGS_worker_threads > 0 ? server::FLAGS_worker_threads : 1);
+  return pool;
+}
+
+}  // namespace util
+}  // namespace live
@@ -1,5 +1,6 @@
 #include "util/decoder.h"
 #include "util/base.h"
+#include "util/trace.h"
 
 namespace live {
 namespace util {
@@ -17,37 +18,12 @@ Decoder::~Decoder() {
   }
 }
 
-bool Decoder::PixelData::Reset(int w, int h, AVPixelFormat fmt) {
-  if (w == width && h == height && pix_fmt == fmt) {
-    return true;
-  }
-  this->~PixelData();
-  PixelData();
-  data_size = av_image_alloc(data, linesize, w, h, fmt, 1);
-  if (data_size < 0) {
-    LOG_ERROR << "av_image_alloc failed";
-    return false;
-  }
-  w = width, h = height, pix_fmt = fmt;
-  return true;
-}
-
 bool Decoder::DecodeVideoPacket(const AVStream* stream, AVCodecContext* ctx,
                                 const AVPacket* pkt,
                                 std::vector<AVFrameWrapper>* frames) {
-  auto callback = [this, stream, ctx, frames](const AVFrame* av_frame) -> bool {
-    int width = ctx->width;
-    int height = ctx->height;
-    AVPixelFormat pix_fmt = ctx->pix_fmt;
-    if (!pixel_data_.Reset(width, height, pix_fmt)) {
-      LOG_ERROR << "alloc pixel data buffer failed";
-      return false;
-    }
-
-    av_image_copy(pixel_data_.data, pixel_data_.linesize,
-                  (const uint8_t**)(av_frame->data), av_frame->linesize,
-                  pix_fmt, width, height);
-
+  TRACE_SCOPE("decode.video");
+  // AVFrameWrapper 引用解码器输出的缓冲区，不拷贝像素数据
+  auto callback = [stream, frames](const AVFrame* av_frame) -> bool {
     frames->emplace_back(av_frame);
     AVFrameWrapper& frame = frames->back();
     frame->time_base = stream->time_base;
@@ -64,6 +40,7 @@ bool Decoder::DecodeVideoPacket(const AVStream* stream, AVCodecContext* ctx,
 bool Decoder::DecodeAudioPacket(const AVStream* stream, AVCodecContext* ctx,
                                 const AVPacket* pkt,
                                 std::vector<AVFrameWrapper>* samples) {
+  TRACE_SCOPE("decode.audio");
   auto callback = [stream, samples](const AVFrame* av_frame) -> bool {
     // enum AVSampleFormat 定义参见 FFmpeg/libavutil/samplefmt.h
     std::vector<uint8_t> sample_data;
@@ -65,26 +65,6 @@ class Decoder {
 
   // 解码过程中复用的 AVFrame
   AVFrame* av_frame_ = nullptr;
-
-  // 转换视频格式用的数据。
-  // 因 SDL 能播放的格式优先，因此将其他 AVPixelFormat 均转换为 YUV420P，方便
-  // SDL 播放。
-  struct PixelData {
-    static const uint8_t VIDEO_DST_SIZE = 4;
-    uint8_t* data[VIDEO_DST_SIZE] = {nullptr};
-    int linesize[VIDEO_DST_SIZE] = {0};
-    enum AVPixelFormat pix_fmt = AV_PIX_FMT_NONE;
-    int height = -1;
-    int width = -1;
-    int data_size = -1;
-
-    bool Reset(int w, int h, AVPixelFormat fmt);
-
-    ~PixelData() {
-      av_free(data[0]);
-    }
-  };
-  PixelData pixel_data_;
 };
 
 }  // namespace util
@@ -1,4 +1,5 @@
 #include "util/filter.h"
+#include "util/trace.h"
 
 namespace live {
 namespace util {
@@ -94,6 +95,7 @@ Filter::Filter(const std::unordered_map<std::string, std::string>& source_param,
   }
 
   filter_future_ = std::async(std::launch::async, [this]() -> void {
+    trace::SetThreadName("filter");
     std::pair<std::string, AVFrameWrapper> data;
     while (is_alive_) {
       if (!input_queue_.TimedGet(&data, std::chrono::milliseconds(100))) {
@@ -109,6 +111,7 @@ Filter::Filter(const std::unordered_map<std::string, std::string>& source_param,
         LOG_ERROR << "not found input buffer, " << input;
         continue;
       }
+      TRACE_SCOPE("filter");
       AVFilterContext* context = std::get<1>(it->second);
       int ret = av_buffersrc_add_frame_flags(context, frame.GetRawPtr(), 0);
       if (ret < 0) {
@@ -157,6 +160,7 @@ bool Filter::Submit(const std::string& input, AVFrameWrapper&& frame) {
   std::pair<std::string, AVFrameWrapper> res =
       std::make_pair(input, std::move(frame));
   input_queue_.Put(std::move(res));
+  TRACE_COUNTER("filter.queue", input_queue_.Size());
   return true;
 }
 
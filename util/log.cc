@@ -0,0 +1,366 @@
+#include "util/log.h"
+
+#include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace live {
+namespace util {
+namespace log {
+
+// 单个线程的环形缓冲区，单生产者单消费者，生产者与消费者之间没有锁
+class Ring {
+  // 每个线程 256KB，超过一半的单条日志直接丢弃
+  static const size_t CAPACITY = 256 * 1024;
+  // 尾部剩余空间放不下一条日志时写入该长度，消费者跳回开头
+  static const uint32_t WRAP = 0xFFFFFFFF;
+
+  std::unique_ptr<uint8_t[]> data_;
+  // 均为单调递增的位置，对 CAPACITY 取模后才是下标
+  std::atomic<uint64_t> head_{0};
+  std::atomic<uint64_t> tail_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<bool> closed_{false};
+  std::string thread_id_;
+
+ public:
+  explicit Ring(const std::string& thread_id)
+      : data_(new uint8_t[CAPACITY]), thread_id_(thread_id) {}
+
+  const std::string& GetThreadId() const {
+    return thread_id_;
+  }
+
+  // 所属线程退出后由消费者释放
+  void Close() {
+    closed_.store(true, std::memory_order_release);
+  }
+  bool IsClosed() const {
+    return closed_.load(std::memory_order_acquire);
+  }
+
+  uint64_t TakeDropped() {
+    return dropped_.exchange(0, std::memory_order_relaxed);
+  }
+
+  // 只由所属线程调用
+  // @return 缓冲区由空变为非空时返回 true，此时需要唤醒消费者
+  bool Push(const uint8_t* data, size_t size) {
+    const size_t need = sizeof(uint32_t) + size;
+    if (need > CAPACITY / 2) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    size_t offset = tail % CAPACITY;
+    const size_t contiguous = CAPACITY - offset;
+    const size_t skip = contiguous < need ? contiguous : 0;
+    if (tail + skip + need - head > CAPACITY) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    const bool was_empty = tail == head;
+    if (skip) {
+      if (skip >= sizeof(uint32_t)) {
+        memcpy(&data_[offset], &WRAP, sizeof(WRAP));
+      }
+      tail += skip;
+      offset = 0;
+    }
+    const uint32_t len = uint32_t(size);
+    memcpy(&data_[offset], &len, sizeof(len));
+    memcpy(&data_[offset + sizeof(len)], data, size);
+    tail_.store(tail + need, std::memory_order_release);
+    return was_empty;
+  }
+
+  // 只由消费者调用，对每条日志调用 f(data, size)
+  // @return 取出的日志条数
+  template <typename F>
+  size_t Drain(F&& f) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    const uint64_t tail = tail_.load(std::memory_order_acquire);
+    size_t count = 0;
+    while (head < tail) {
+      const size_t offset = head % CAPACITY;
+      const size_t contiguous = CAPACITY - offset;
+      uint32_t len = WRAP;
+      if (contiguous >= sizeof(len)) {
+        memcpy(&len, &data_[offset], sizeof(len));
+      }
+      if (len == WRAP) {
+        head += contiguous;
+        continue;
+      }
+      f(&data_[offset + sizeof(len)], size_t(len));
+      head += sizeof(len) + len;
+      count++;
+    }
+    head_.store(head, std::memory_order_release);
+    return count;
+  }
+};
+
+// 收集各线程的环形缓冲区，在后台线程中格式化并写出
+class Logger {
+  // 只保护 rings_，仅在线程第一次打日志时与后台线程竞争
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<Ring>> rings_;
+
+  // 后台线程与 Flush 都会消费环形缓冲区，二者互斥
+  std::mutex drain_mutex_;
+  std::atomic<bool> synchronous_{false};
+
+  // 后台线程空闲时等待，某个环形缓冲区由空变为非空时被唤醒。
+  // 打日志的线程不加锁直接通知，偶尔错过的唤醒由 MAX_IDLE_MS 的超时兜底，
+  // 同时用于回收已退出线程的缓冲区及报告丢弃的日志
+  static const int32_t MAX_IDLE_MS = 100;
+  std::mutex wake_mutex_;
+  std::condition_variable wake_cv_;
+  std::atomic<bool> wake_pending_{false};
+
+  // 格式化时间的缓存，秒数不变时复用
+  time_t last_second_ = -1;
+  char time_text_[16] = {0};
+
+  std::string err_buffer_;
+  std::string out_buffer_;
+
+  Logger() {
+    std::thread(&Logger::Run, this).detach();
+    std::atexit([]() { Logger::GetInstance().Shutdown(); });
+  }
+
+  void Run() {
+    while (true) {
+      if (DrainAll()) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(wake_mutex_);
+      wake_cv_.wait_for(lock, std::chrono::milliseconds(MAX_IDLE_MS), [this]() {
+        return wake_pending_.load(std::memory_order_acquire);
+      });
+      wake_pending_.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  void Wake() {
+    wake_pending_.store(true, std::memory_order_release);
+    wake_cv_.notify_one();
+  }
+
+  // @return 是否输出了日志
+  bool DrainAll() {
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      rings = rings_;
+    }
+    size_t count = 0;
+    std::lock_guard<std::mutex> g(drain_mutex_);
+    for (auto& ring : rings) {
+      // 先读关闭标记，之后再取一次即可取完线程退出前提交的日志
+      const bool closed = ring->IsClosed();
+      count += ring->Drain([this, &ring](const uint8_t* data, size_t size) {
+        Format(ring->GetThreadId(), data, size);
+      });
+      uint64_t dropped = ring->TakeDropped();
+      if (dropped) {
+        err_buffer_ += "log buffer full, dropped " +
+                       std::to_string(dropped) + " lines, thread: " +
+                       ring->GetThreadId() + "\n";
+      }
+      if (closed) {
+        std::lock_guard<std::mutex> rg(mutex_);
+        for (auto it = rings_.begin(); it != rings_.end(); ++it) {
+          if (*it == ring) {
+            rings_.erase(it);
+            break;
+          }
+        }
+      }
+    }
+    WriteOut();
+    return count > 0;
+  }
+
+  void WriteOut() {
+    if (!err_buffer_.empty()) {
+      fwrite(err_buffer_.data(), 1, err_buffer_.size(), stderr);
+      fflush(stderr);
+      err_buffer_.clear();
+    }
+    if (!out_buffer_.empty()) {
+      fwrite(out_buffer_.data(), 1, out_buffer_.size(), stdout);
+      fflush(stdout);
+      out_buffer_.clear();
+    }
+  }
+
+  // 格式与原先的 StreamLog 相同
+  void Format(const std::string& thread_id, const uint8_t* data,
+              size_t size) {
+    RecordHeader header;
+    if (size < sizeof(header)) {
+      return;
+    }
+    memcpy(&header, data, sizeof(header));
+    std::string& out =
+        header.level == LEVEL_ERROR ? err_buffer_ : out_buffer_;
+
+    const time_t second = time_t(header.timestamp_us / 1000000);
+    if (second != last_second_) {
+      struct tm tm;
+      localtime_r(&second, &tm);
+      strftime(time_text_, sizeof(time_text_), "%H:%M:%S", &tm);
+      last_second_ = second;
+    }
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "%s.%03u:", time_text_,
+             unsigned(header.timestamp_us / 1000 % 1000));
+    out += "\033[2m";
+    out += header.level == LEVEL_ERROR ? 'E' : 'I';
+    out += thread_id;
+    out += ':';
+    out += prefix;
+    out += header.file;
+    snprintf(prefix, sizeof(prefix), ":%05d:", int(header.line));
+    out += prefix;
+    out += header.func;
+    out += ": \033[0m";
+
+    size_t pos = sizeof(header);
+    while (pos < size) {
+      const Tag tag = Tag(data[pos++]);
+      char text[32];
+      switch (tag) {
+        case TAG_INT: {
+          int64_t v;
+          memcpy(&v, data + pos, sizeof(v));
+          pos += sizeof(v);
+          snprintf(text, sizeof(text), "%lld", static_cast<long long>(v));
+          out += text;
+          break;
+        }
+        case TAG_UINT: {
+          uint64_t v;
+          memcpy(&v, data + pos, sizeof(v));
+          pos += sizeof(v);
+          snprintf(text, sizeof(text), "%llu",
+                   static_cast<unsigned long long>(v));
+          out += text;
+          break;
+        }
+        case TAG_DOUBLE: {
+          // 与 ostream 的默认格式相同
+          double v;
+          memcpy(&v, data + pos, sizeof(v));
+          pos += sizeof(v);
+          snprintf(text, sizeof(text), "%g", v);
+          out += text;
+          break;
+        }
+        case TAG_CHAR: {
+          out += char(data[pos]);
+          pos += 1;
+          break;
+        }
+        case TAG_STRING: {
+          uint32_t len;
+          memcpy(&len, data + pos, sizeof(len));
+          pos += sizeof(len);
+          out.append(reinterpret_cast<const char*>(data + pos), len);
+          pos += len;
+          break;
+        }
+        case TAG_POINTER: {
+          uint64_t v;
+          memcpy(&v, data + pos, sizeof(v));
+          pos += sizeof(v);
+          snprintf(text, sizeof(text), "0x%llx",
+                   static_cast<unsigned long long>(v));
+          out += text;
+          break;
+        }
+        default: {
+          pos = size;
+          break;
+        }
+      }
+    }
+    out += '\n';
+  }
+
+ public:
+  // 不析构，静态对象析构期间仍可能打日志
+  static Logger& GetInstance() {
+    static Logger* logger = new Logger();
+    return *logger;
+  }
+
+  std::shared_ptr<Ring> Register() {
+    std::ostringstream oss;
+    oss << std::this_thread::get_id();
+    auto ring = std::make_shared<Ring>(oss.str());
+    std::lock_guard<std::mutex> g(mutex_);
+    rings_.push_back(ring);
+    return ring;
+  }
+
+  void Commit(const std::shared_ptr<Ring>& ring, const uint8_t* data,
+              size_t size) {
+    if (!synchronous_.load(std::memory_order_acquire)) {
+      // 后台线程正忙时缓冲区多半非空，只有空闲后的第一条日志需要唤醒
+      if (ring->Push(data, size)) {
+        Wake();
+      }
+      return;
+    }
+    std::lock_guard<std::mutex> g(drain_mutex_);
+    Format(ring->GetThreadId(), data, size);
+    WriteOut();
+  }
+
+  void Flush() {
+    DrainAll();
+  }
+
+  void Shutdown() {
+    synchronous_.store(true, std::memory_order_release);
+    DrainAll();
+  }
+};
+
+// 线程退出时标记其环形缓冲区，由后台线程取完剩余日志后释放
+struct ThreadRing {
+  std::shared_ptr<Ring> ring;
+  ~ThreadRing() {
+    if (ring) {
+      ring->Close();
+    }
+  }
+};
+
+Line::~Line() {
+  static thread_local ThreadRing thread_ring;
+  Logger& logger = Logger::GetInstance();
+  if (!thread_ring.ring) {
+    thread_ring.ring = logger.Register();
+  }
+  const uint8_t* data = heap_.empty() ? inline_ : heap_.data();
+  logger.Commit(thread_ring.ring, data, size_);
+}
+
+void Flush() {
+  Logger::GetInstance().Flush();
+}
+
+}  // namespace log
+}  // namespace util
+}  // namespace live
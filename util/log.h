@@ -0,0 +1,187 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// 编译期的最低日志级别，低于它的日志连同参数的求值一起被编译器去掉。
+// 如 -DLIVE_LOG_MIN_LEVEL=1 只保留 LOG_ERROR
+#ifndef LIVE_LOG_MIN_LEVEL
+#define LIVE_LOG_MIN_LEVEL 0
+#endif
+
+namespace live {
+namespace util {
+namespace log {
+
+enum Level : uint8_t {
+  LEVEL_INFO = 0,
+  LEVEL_ERROR = 1,
+};
+
+// 参数的类型标记，参数以二进制保存，由后台线程格式化
+enum Tag : uint8_t {
+  TAG_INT = 0,
+  TAG_UINT,
+  TAG_DOUBLE,
+  TAG_CHAR,
+  TAG_STRING,
+  TAG_POINTER,
+};
+
+// 每条日志的头部，file、func 为 __FILE__、__FUNCTION__，不需要拷贝
+struct RecordHeader {
+  uint64_t timestamp_us;
+  const char* file;
+  const char* func;
+  int32_t line;
+  Level level;
+};
+
+// 一条日志，在调用线程中只把参数按二进制追加到栈上的缓冲区，析构时整条
+// 写入本线程的无锁环形缓冲区，格式化及输出都在后台线程中进行，不阻塞调用者。
+// 缓冲区满时丢弃日志
+class Line {
+  static const size_t INLINE_SIZE = 256;
+  uint8_t inline_[INLINE_SIZE];
+  // 超过 INLINE_SIZE 后改用
+  std::vector<uint8_t> heap_;
+  size_t size_ = 0;
+
+  void Append(const void* data, size_t size) {
+    if (heap_.empty() && size_ + size <= INLINE_SIZE) {
+      memcpy(inline_ + size_, data, size);
+    } else {
+      if (heap_.empty()) {
+        heap_.assign(inline_, inline_ + size_);
+      }
+      const uint8_t* p = static_cast<const uint8_t*>(data);
+      heap_.insert(heap_.end(), p, p + size);
+    }
+    size_ += size;
+  }
+
+  template <typename T>
+  void Put(Tag tag, T value) {
+    Append(&tag, 1);
+    Append(&value, sizeof(value));
+  }
+
+  void PutString(const char* s, size_t size) {
+    uint32_t len = uint32_t(size);
+    Put(TAG_STRING, len);
+    Append(s, len);
+  }
+
+  void Capture(bool v) {
+    Put(TAG_INT, int64_t(v));
+  }
+  // 与 ostream 一致，字符类型按字符输出
+  void Capture(char v) {
+    Put(TAG_CHAR, v);
+  }
+  void Capture(signed char v) {
+    Put(TAG_CHAR, char(v));
+  }
+  void Capture(unsigned char v) {
+    Put(TAG_CHAR, char(v));
+  }
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value &&
+                          std::is_signed<T>::value>::type
+  Capture(T v) {
+    Put(TAG_INT, int64_t(v));
+  }
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value &&
+                          std::is_unsigned<T>::value>::type
+  Capture(T v) {
+    Put(TAG_UINT, uint64_t(v));
+  }
+  template <typename T>
+  typename std::enable_if<std::is_floating_point<T>::value>::type Capture(
+      T v) {
+    Put(TAG_DOUBLE, double(v));
+  }
+  void Capture(const char* s) {
+    if (s == nullptr) {
+      s = "(null)";
+    }
+    PutString(s, strlen(s));
+  }
+  void Capture(const std::string& s) {
+    PutString(s.data(), s.size());
+  }
+  template <typename T>
+  typename std::enable_if<
+      !std::is_same<typename std::remove_cv<T>::type, char>::value>::type
+  Capture(T* p) {
+    Put(TAG_POINTER, uint64_t(reinterpret_cast<uintptr_t>(p)));
+  }
+  // 其余类型仍以 operator<< 格式化，在调用线程中进行
+  template <typename T>
+  typename std::enable_if<!std::is_arithmetic<T>::value &&
+                          !std::is_pointer<T>::value &&
+                          !std::is_array<T>::value>::type
+  Capture(const T& v) {
+    std::ostringstream oss;
+    oss << v;
+    const std::string s = oss.str();
+    PutString(s.data(), s.size());
+  }
+
+ public:
+  Line(Level level, const char* file, int32_t line, const char* func) {
+    RecordHeader header;
+    header.timestamp_us = uint64_t(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count());
+    header.file = file;
+    header.func = func;
+    header.line = line;
+    header.level = level;
+    Append(&header, sizeof(header));
+  }
+  ~Line();
+  Line(const Line&) = delete;
+  Line& operator=(const Line&) = delete;
+
+  template <typename T>
+  Line& operator<<(const T& v) {
+    Capture(v);
+    return *this;
+  }
+
+  // std::endl 等操纵符被忽略，每条日志本就单独成行
+  Line& operator<<(std::ostream& (*)(std::ostream&)) {
+    return *this;
+  }
+};
+
+// 让 LOG_ERROR 宏在级别被去掉的分支中也是 void 表达式
+struct Voidify {
+  void operator&(const Line&) {}
+};
+
+// 同步输出所有已提交的日志，进程退出时会自动调用。之后的日志改为同步输出
+void Flush();
+
+}  // namespace log
+}  // namespace util
+}  // namespace live
+
+#define LIVE_LOG(level)                                            \
+  (level) < LIVE_LOG_MIN_LEVEL                                     \
+      ? (void)0                                                    \
+      : live::util::log::Voidify() &                               \
+            live::util::log::Line(level, __FILE__, __LINE__, __FUNCTION__)
+
+#define LOG_ERROR LIVE_LOG(live::util::log::LEVEL_ERROR)
+
+#define LOG_INFO LIVE_LOG(live::util::log::LEVEL_INFO)
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+namespace live {
+namespace util {
+namespace metrics {
+
+static const size_t CACHE_LINE_SIZE = 64;
+
+// 各自独占一个 cache line 的计数器，不同线程更新相邻的计数器时没有伪共享。
+// 更新只是一次 relaxed 原子操作，读取方在导出时汇总，不需要加锁
+class alignas(CACHE_LINE_SIZE) Counter {
+  std::atomic<uint64_t> value_{0};
+
+ public:
+  void Add(uint64_t n = 1) {
+    value_.fetch_add(n, std::memory_order_relaxed);
+  }
+  uint64_t Get() const {
+    return value_.load(std::memory_order_relaxed);
+  }
+};
+
+// 可增可减的当前值，如观众数、排队的字节数
+class alignas(CACHE_LINE_SIZE) Gauge {
+  std::atomic<int64_t> value_{0};
+
+ public:
+  void Add(int64_t n) {
+    value_.fetch_add(n, std::memory_order_relaxed);
+  }
+  void Set(int64_t v) {
+    value_.store(v, std::memory_order_relaxed);
+  }
+  int64_t Get() const {
+    return value_.load(std::memory_order_relaxed);
+  }
+};
+
+// HDR 风格的直方图，记录微秒数等非负整数。小于 128 的值各占一个桶，
+// 之后每个 2 的幂区间等分为 64 个桶，相对误差不超过 1/64，
+// 超过 UINT32_MAX 的值记为 UINT32_MAX。
+// 只能由一个线程记录，记录时没有原子的读改写；可在任意线程中读取
+class Histogram {
+ public:
+  static const int SUB_BUCKET_BITS = 6;
+  static const size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+  static const size_t LINEAR_BUCKETS = SUB_BUCKETS * 2;
+  static const size_t BUCKET_COUNT =
+      (32 - SUB_BUCKET_BITS - 1) * SUB_BUCKETS + LINEAR_BUCKETS;
+
+  static size_t GetBucket(uint64_t v) {
+    if (v > UINT32_MAX) {
+      v = UINT32_MAX;
+    }
+    if (v < LINEAR_BUCKETS) {
+      return size_t(v);
+    }
+    // 保留最高的 SUB_BUCKET_BITS + 1 位
+    const int shift = 63 - __builtin_clzll(v) - SUB_BUCKET_BITS;
+    return size_t(shift) * SUB_BUCKETS + size_t(v >> shift);
+  }
+
+  // 桶中的最大值
+  static uint64_t GetBucketUpperBound(size_t bucket) {
+    if (bucket < LINEAR_BUCKETS) {
+      return bucket;
+    }
+    const int shift = int(bucket / SUB_BUCKETS) - 1;
+    const uint64_t top = SUB_BUCKETS + bucket % SUB_BUCKETS;
+    return ((top + 1) << shift) - 1;
+  }
+
+  void Record(uint64_t v) {
+    Increase(counts_[GetBucket(v)], 1);
+    Increase(count_, 1);
+    Increase(sum_, v);
+    if (v > max_.load(std::memory_order_relaxed)) {
+      max_.store(v, std::memory_order_relaxed);
+    }
+  }
+
+  // 多个直方图合并后的快照
+  struct Snapshot {
+    std::vector<uint64_t> counts = std::vector<uint64_t>(BUCKET_COUNT);
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    // 各桶先于 count 读取，记录并发进行时 count 可能略大于各桶之和
+    void Add(const Histogram& h) {
+      for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        counts[i] += h.counts_[i].load(std::memory_order_relaxed);
+      }
+      count += h.count_.load(std::memory_order_relaxed);
+      sum += h.sum_.load(std::memory_order_relaxed);
+      max = std::max(max, h.max_.load(std::memory_order_relaxed));
+    }
+
+    // 第 q 分位所在桶的最大值，不超过记录过的最大值，如 q 为 0.99
+    uint64_t Percentile(double q) const {
+      uint64_t total = 0;
+      for (uint64_t c : counts) {
+        total += c;
+      }
+      if (total == 0) {
+        return 0;
+      }
+      uint64_t rank = uint64_t(q * total);
+      rank = std::min(std::max<uint64_t>(rank, 1), total);
+      uint64_t seen = 0;
+      for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+          return std::min(GetBucketUpperBound(i), max);
+        }
+      }
+      return max;
+    }
+  };
+
+ private:
+  static void Increase(std::atomic<uint64_t>& a, uint64_t n) {
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> counts_[BUCKET_COUNT] = {};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+};
+
+// 含 Counter、Gauge 的对象须继承它，C++14 的 new 不保证按 cache line 对齐
+struct CacheLineAligned {
+  static void* operator new(size_t size) {
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, CACHE_LINE_SIZE, size)) {
+      throw std::bad_alloc();
+    }
+    return ptr;
+  }
+  static void operator delete(void* ptr) {
+    free(ptr);
+  }
+};
+
+}  // namespace metrics
+}  // namespace util
+}  // namespace live
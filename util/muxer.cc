@@ -1,5 +1,6 @@
 #include "util/muxer.h"
 #include <gflags/gflags.h>
+#include "util/trace.h"
 #include "util/util.h"
 
 namespace live {
@@ -20,6 +21,60 @@ DEFINE_int32(muxer_video_bit_rate, 0, "");
 //      pkt->stream_index);
 //}
 
+void SetupVideoEncoder(AVCodecContext* c, const AVCodec* codec,
+                       MuxerParam* mp) {
+  c->width = mp->video_width;
+  c->height = mp->video_height;
+  c->time_base = mp->video_time_base;
+  c->framerate =
+      AVRational{mp->video_time_base.den, mp->video_time_base.num};
+  c->gop_size = 12;
+  c->pix_fmt = mp->video_pix_fmt;
+  // c->bit_rate = FLAGS_muxer_video_bit_rate;
+  c->flags |= AV_CODEC_FLAG2_LOCAL_HEADER;
+  if (codec->pix_fmts) {
+    c->pix_fmt = codec->pix_fmts[0];
+    for (int i = 0; codec->pix_fmts[i] != AV_PIX_FMT_NONE; i++) {
+      if (codec->pix_fmts[i] == mp->video_pix_fmt) {
+        c->pix_fmt = mp->video_pix_fmt;
+        break;
+      }
+      if (codec->pix_fmts[i] == AV_PIX_FMT_YUV420P) {
+        c->pix_fmt = AV_PIX_FMT_YUV420P;
+      }
+    }
+    LOG_ERROR << "change pix fmt from "
+              << av_get_pix_fmt_name(mp->video_pix_fmt) << " to "
+              << av_get_pix_fmt_name(c->pix_fmt);
+    mp->video_pix_fmt = c->pix_fmt;
+  }
+
+  if (codec->name == std::string("libx264")) {
+    int ret = 0;
+    // ret = av_opt_set(c->priv_data, "crf", "1", 0);
+    // if (ret) {
+    //  LOG_ERROR << "set crf to 1 failed, error: " << av_err2str(ret);
+    //}
+    //// set it to high444
+    // ret = av_opt_set(c->priv_data, "profile", "high444", 0);
+    // if (ret) {
+    //  LOG_ERROR << "set profile to high444 failed, error: " <<
+    //  av_err2str(ret);
+    //}
+    // set it to placebo
+    // ret = av_opt_set(c->priv_data, "preset", "placebo", 0);
+    // if (ret) {
+    //  LOG_ERROR << "set presest to placebo failed, error: " <<
+    //  av_err2str(ret);
+    //}
+    // set it to film
+    ret = av_opt_set(c->priv_data, "tune", "film", 0);
+    if (ret) {
+      LOG_ERROR << "set tune to file failed, error: " << av_err2str(ret);
+    }
+  }
+}
+
 static bool InitStream(OutputStream* ost, AVFormatContext* oc,
                        enum AVMediaType mtype, MuxerParam* mp) {
   const char* codec_name = nullptr;
@@ -131,57 +186,8 @@ static bool InitStream(OutputStream* ost, AVFormatContext* oc,
       break;
     }
     case AVMEDIA_TYPE_VIDEO: {
-      c->width = mp->video_width;
-      c->height = mp->video_height;
-      ost->st->time_base = c->time_base = mp->video_time_base;
-      c->framerate =
-          AVRational{mp->video_time_base.den, mp->video_time_base.num};
-      c->gop_size = 12;
-      c->pix_fmt = mp->video_pix_fmt;
-      // c->bit_rate = FLAGS_muxer_video_bit_rate;
-      c->flags |= AV_CODEC_FLAG2_LOCAL_HEADER;
-      if (codec->pix_fmts) {
-        c->pix_fmt = codec->pix_fmts[0];
-        for (int i = 0; codec->pix_fmts[i] != AV_PIX_FMT_NONE; i++) {
-          if (codec->pix_fmts[i] == mp->video_pix_fmt) {
-            c->pix_fmt = mp->video_pix_fmt;
-            break;
-          }
-          if (codec->pix_fmts[i] == AV_PIX_FMT_YUV420P) {
-            c->pix_fmt = AV_PIX_FMT_YUV420P;
-          }
-        }
-        LOG_ERROR << "change pix fmt from "
-                  << av_get_pix_fmt_name(mp->video_pix_fmt) << " to "
-                  << av_get_pix_fmt_name(c->pix_fmt);
-        mp->video_pix_fmt = c->pix_fmt;
-      }
-
-      if (codec->name == std::string("libx264")) {
-        int ret = 0;
-        // ret = av_opt_set(c->priv_data, "crf", "1", 0);
-        // if (ret) {
-        //  LOG_ERROR << "set crf to 1 failed, error: " << av_err2str(ret);
-        //}
-        //// set it to high444
-        // ret = av_opt_set(c->priv_data, "profile", "high444", 0);
-        // if (ret) {
-        //  LOG_ERROR << "set profile to high444 failed, error: " <<
-        //  av_err2str(ret);
-        //}
-        // set it to placebo
-        // ret = av_opt_set(c->priv_data, "preset", "placebo", 0);
-        // if (ret) {
-        //  LOG_ERROR << "set presest to placebo failed, error: " <<
-        //  av_err2str(ret);
-        //}
-        // set it to film
-        ret = av_opt_set(c->priv_data, "tune", "film", 0);
-        if (ret) {
-          LOG_ERROR << "set tune to file failed, error: " << av_err2str(ret);
-        }
-      }
-
+      SetupVideoEncoder(c, codec, mp);
+      ost->st->time_base = c->time_base;
       break;
     }
     default: {
@@ -254,6 +260,7 @@ Muxer::Muxer(const MuxerParam& mp) {
   muxing_future_ = std::async(std::launch::async, [this]() {
     auto exit_func = [this]() { is_alive_ = false; };
     ScopeGuard<decltype(exit_func)> guard(std::move(exit_func));
+    trace::SetThreadName("muxer");
 
     int ret = 0;
 
@@ -302,6 +309,7 @@ Muxer::Muxer(const MuxerParam& mp) {
         continue;
       }
 
+      TRACE_SCOPE("encode");
       ret = avcodec_send_frame(os->enc, frame.GetRawPtr());
       if (ret < 0) {
         LOG_ERROR << "send frame failed, error: " << av_err2str(ret);
@@ -325,7 +333,10 @@ Muxer::Muxer(const MuxerParam& mp) {
 
         /* Write the compressed frame to the media file. */
         // log_packet(format_context_, os->packet);
-        ret = av_interleaved_write_frame(format_context_, os->packet);
+        {
+          TRACE_SCOPE("mux");
+          ret = av_interleaved_write_frame(format_context_, os->packet);
+        }
         /* pkt is now blank (av_interleaved_write_frame() takes ownership of
          * its contents and resets pkt), so that no unreferencing is necessary.
          * This would be different if one used av_write_frame(). */
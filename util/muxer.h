@@ -3,6 +3,7 @@
 #include "util/audio_resample_helper.h"
 #include "util/base.h"
 #include "util/queue.h"
+#include "util/trace.h"
 #include "util/video_scale_helper.h"
 
 #include <future>
@@ -48,6 +49,11 @@ struct MuxerParam {
   std::string url;
 };
 
+// Muxer 的视频编码设置，供需要自行驱动编码器的模块复用。
+// c 由 codec 创建，尚未打开；mp->video_pix_fmt 会被改为编码器支持的格式
+void SetupVideoEncoder(AVCodecContext* c, const AVCodec* codec,
+                       MuxerParam* mp);
+
 class Muxer {
   AVFormatContext* format_context_ = nullptr;
   const AVOutputFormat* output_format_ = nullptr;
@@ -75,6 +81,7 @@ class Muxer {
       return false;
     }
     queue_.Put(std::move(wrapper));
+    TRACE_COUNTER("muxer.queue", queue_.Size());
     return true;
   }
 };
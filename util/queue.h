@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
@@ -201,5 +202,54 @@ class Queue {
   }
 };
 
+// 多生产者单消费者的无锁队列，Put 可在任意线程调用，TryToGet 只能在消费者线程调用。
+// 实现参考 Dmitry Vyukov 的 intrusive MPSC node-based queue。
+template <typename T>
+class LockFreeQueue {
+  struct Node {
+    std::atomic<Node*> next{nullptr};
+    T value;
+  };
+
+  // 生产者从 head_ 一侧插入，消费者从 tail_ 一侧取出
+  std::atomic<Node*> head_;
+  Node* tail_ = nullptr;
+
+ public:
+  LockFreeQueue() {
+    Node* stub = new Node();
+    head_.store(stub, std::memory_order_relaxed);
+    tail_ = stub;
+  }
+  LockFreeQueue(const LockFreeQueue&) = delete;
+  LockFreeQueue& operator=(const LockFreeQueue&) = delete;
+
+  ~LockFreeQueue() {
+    T t;
+    while (TryToGet(&t)) {
+    }
+    delete tail_;
+  }
+
+  void Put(T&& t) {
+    Node* node = new Node();
+    node->value = std::move(t);
+    Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  bool TryToGet(T* t) {
+    Node* tail = tail_;
+    Node* next = tail->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+      return false;
+    }
+    *t = std::move(next->value);
+    tail_ = next;
+    delete tail;
+    return true;
+  }
+};
+
 }  // namespace util
 }  // namespace live
@@ -1,5 +1,6 @@
 #include "util/renderer.h"
 #include "util/env.h"
+#include "util/trace.h"
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -121,6 +122,7 @@ bool Renderer::ConvertToYUYV422(AVFrameWrapper& frame) {
 void Renderer::Render() {
   SDL_Rect texture_rect;
   SDL_Rect render_rect;
+  trace::SetThreadName("renderer");
 
   while (is_alive_) {
     AVFrameWrapper frame;
@@ -159,6 +161,7 @@ void Renderer::Render() {
     // outfile.write((const char *)&frame.data[0], frame.data.size());
     // outfile.flush();
 
+    TRACE_SCOPE("render");
     SDL_UpdateTexture(texture_, nullptr, frame->data[0], frame->linesize[0]);
     SDL_RenderClear(renderer_);
     SDL_RenderCopy(renderer_, texture_, &texture_rect, &render_rect);
@@ -1,4 +1,5 @@
 #include "util/speaker.h"
+#include "util/trace.h"
 
 namespace live {
 namespace util {
@@ -26,6 +27,13 @@ void Speaker::Speak() {
 }
 
 void Speaker::SDLAudioDeviceCallbackInternal(Uint8* stream, int len) {
+  // SDL 的音频线程不由我们创建，在第一次回调时命名
+  static thread_local bool named = false;
+  if (!named) {
+    trace::SetThreadName("audio callback");
+    named = true;
+  }
+  TRACE_SCOPE("audio.callback");
   SDL_memset(stream, 0, len);
 
   AVFrameWrapper next;
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "util/trace.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace live {
+namespace util {
+
+// 固定数量的工作线程，执行切片、转码等耗 CPU 的任务，避免占用 EventLoop 线程
+class ThreadPool {
+ public:
+  using Task = std::function<void()>;
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Task> tasks_;
+  bool stopped_ = false;
+  std::vector<std::thread> threads_;
+
+  void Run() {
+    for (;;) {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return stopped_ || !tasks_.empty(); });
+        if (tasks_.empty()) {
+          return;
+        }
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      TRACE_SCOPE("task");
+      task();
+    }
+  }
+
+ public:
+  // name 为各线程在跟踪时间轴上的名字
+  explicit ThreadPool(int32_t thread_count,
+                      const std::string& name = "worker") {
+    for (int32_t i = 0; i < thread_count; i++) {
+      threads_.emplace_back([this, name, i]() {
+        trace::SetThreadName(name + " " + std::to_string(i));
+        Run();
+      });
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // 执行完已投递的任务后退出
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      stopped_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_) {
+      t.join();
+    }
+  }
+
+  void Post(Task&& task) {
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+  }
+};
+
+// 投递到同一个 Strand 的任务在 ThreadPool 中按投递顺序串行执行，
+// 不同 Strand 的任务可以并行，用于需要保序的有状态任务，如某个房间的切片
+class Strand : public std::enable_shared_from_this<Strand> {
+  ThreadPool* pool_;
+  std::mutex mutex_;
+  std::deque<ThreadPool::Task> tasks_;
+  // 已有线程在执行本 Strand 的任务
+  bool running_ = false;
+
+  void Drain() {
+    for (;;) {
+      ThreadPool::Task task;
+      {
+        std::lock_guard<std::mutex> g(mutex_);
+        if (tasks_.empty()) {
+          running_ = false;
+          return;
+        }
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+ public:
+  explicit Strand(ThreadPool* pool) : pool_(pool) {}
+
+  // Strand 须由 shared_ptr 管理
+  void Post(ThreadPool::Task&& task) {
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      tasks_.push_back(std::move(task));
+      if (running_) {
+        return;
+      }
+      running_ = true;
+    }
+    auto self = shared_from_this();
+    pool_->Post([self]() { self->Drain(); });
+  }
+};
+
+}  // namespace util
+}  // namespace live
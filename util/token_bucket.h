@@ -0,0 +1,44 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+namespace live {
+namespace util {
+
+// 令牌桶，按 rate 字节每秒补充令牌，最多积攒 capacity 字节。
+// 只要令牌为正就允许发送，不足的部分记为欠账，这样大于桶容量的消息也能发出。
+class TokenBucket {
+  double rate_ = 0;
+  double capacity_ = 0;
+  double tokens_ = 0;
+  uint64_t last_refill_us_ = 0;
+
+ public:
+  TokenBucket(double rate = 0, double capacity = 0, uint64_t now_us = 0)
+      : rate_(rate)
+      , capacity_(capacity)
+      , tokens_(capacity)
+      , last_refill_us_(now_us) {}
+
+  void Refill(uint64_t now_us) {
+    if (now_us <= last_refill_us_) {
+      return;
+    }
+    tokens_ = std::min(
+        capacity_, tokens_ + rate_ * (now_us - last_refill_us_) / 1000000.0);
+    last_refill_us_ = now_us;
+  }
+
+  bool TryConsume(size_t bytes, uint64_t now_us) {
+    Refill(now_us);
+    if (tokens_ <= 0) {
+      return false;
+    }
+    tokens_ -= bytes;
+    return true;
+  }
+};
+
+}  // namespace util
+}  // namespace live
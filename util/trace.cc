@@ -0,0 +1,205 @@
+#include "util/trace.h"
+#include "util/util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace live {
+namespace util {
+namespace trace {
+
+std::atomic<bool> enabled{false};
+
+namespace {
+
+struct Event {
+  const char* name = nullptr;
+  uint64_t timestamp_us = 0;
+  // 区间为时长，计数器为数值
+  int64_t value = 0;
+  // 'X' 区间，'C' 计数器
+  char phase = 0;
+};
+
+// 单个线程的事件，只由所属线程写入，写满后覆盖最早的事件。
+// 导出时先拷贝再检查写入位置，丢弃拷贝期间可能被覆盖的部分
+class Buffer {
+  static const size_t CAPACITY = 32 * 1024;
+
+  std::unique_ptr<Event[]> events_;
+  std::atomic<uint64_t> count_{0};
+
+ public:
+  const uint32_t tid;
+  // 受 Registry::mutex 保护
+  std::string name;
+
+  Buffer(uint32_t t, std::string n)
+      : events_(new Event[CAPACITY]), tid(t), name(std::move(n)) {}
+
+  void Add(const char* name, uint64_t timestamp_us, int64_t value,
+           char phase) {
+    const uint64_t count = count_.load(std::memory_order_relaxed);
+    Event& e = events_[count % CAPACITY];
+    e.name = name;
+    e.timestamp_us = timestamp_us;
+    e.value = value;
+    e.phase = phase;
+    count_.store(count + 1, std::memory_order_release);
+  }
+
+  void Snapshot(std::vector<Event>* out) const {
+    const uint64_t end = count_.load(std::memory_order_acquire);
+    const uint64_t begin = end > CAPACITY ? end - CAPACITY : 0;
+    std::vector<Event> copy;
+    copy.reserve(end - begin);
+    for (uint64_t i = begin; i < end; i++) {
+      copy.push_back(events_[i % CAPACITY]);
+    }
+    // 拷贝期间所属线程又写入了 n 个事件，最早的 n 个可能已被覆盖；
+    // 第 now 个事件可能正在写入，它占用的槽位也不可信
+    const uint64_t now = count_.load(std::memory_order_acquire);
+    const uint64_t valid = now + 1 > CAPACITY ? now + 1 - CAPACITY : 0;
+    for (uint64_t i = std::max(begin, valid); i < end; i++) {
+      out->push_back(copy[i - begin]);
+    }
+  }
+};
+
+// 线程退出后其缓冲区仍保留，之后仍可导出
+class Registry {
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<Buffer>> buffers_;
+  uint32_t next_tid_ = 1;
+
+ public:
+  static Registry& GetInstance() {
+    static Registry* registry = new Registry();
+    return *registry;
+  }
+
+  std::shared_ptr<Buffer> Register(const std::string& name) {
+    std::lock_guard<std::mutex> g(mutex_);
+    const uint32_t tid = next_tid_++;
+    auto buffer = std::make_shared<Buffer>(
+        tid, name.empty() ? "thread " + std::to_string(tid) : name);
+    buffers_.push_back(buffer);
+    return buffer;
+  }
+
+  void SetName(Buffer* buffer, const std::string& name) {
+    std::lock_guard<std::mutex> g(mutex_);
+    buffer->name = name;
+  }
+
+  std::vector<std::pair<std::shared_ptr<Buffer>, std::string>> GetBuffers() {
+    std::lock_guard<std::mutex> g(mutex_);
+    std::vector<std::pair<std::shared_ptr<Buffer>, std::string>> result;
+    for (const auto& buffer : buffers_) {
+      result.emplace_back(buffer, buffer->name);
+    }
+    return result;
+  }
+};
+
+// 缓冲区在线程第一次记录事件时才分配，关闭跟踪时不占内存
+thread_local std::string thread_name;
+thread_local std::shared_ptr<Buffer> thread_buffer;
+
+Buffer* GetThreadBuffer() {
+  if (!thread_buffer) {
+    thread_buffer = Registry::GetInstance().Register(thread_name);
+  }
+  return thread_buffer.get();
+}
+
+void AppendEscaped(std::ostringstream& oss, const std::string& s) {
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      oss << '\\' << c;
+    } else if (uint8_t(c) < 0x20) {
+      oss << ' ';
+    } else {
+      oss << c;
+    }
+  }
+}
+
+}  // namespace
+
+void Enable(bool on) {
+  enabled.store(on, std::memory_order_relaxed);
+}
+
+void SetThreadName(const std::string& name) {
+  thread_name = name;
+  if (thread_buffer) {
+    Registry::GetInstance().SetName(thread_buffer.get(), name);
+  }
+}
+
+uint64_t NowInMicroSeconds() {
+  // 从 1 开始，Span 以 0 表示未开始
+  return GetPassedTimeSinceStartedInMicroSeconds() + 1;
+}
+
+void Complete(const char* name, uint64_t begin_us, uint64_t end_us) {
+  GetThreadBuffer()->Add(name, begin_us, int64_t(end_us - begin_us), 'X');
+}
+
+void Counter(const char* name, int64_t value) {
+  GetThreadBuffer()->Add(name, NowInMicroSeconds(), value, 'C');
+}
+
+std::string DumpJson() {
+  std::ostringstream oss;
+  oss << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  std::vector<Event> events;
+  for (const auto& p : Registry::GetInstance().GetBuffers()) {
+    const Buffer& buffer = *p.first;
+    oss << (first ? "" : ",")
+        << "\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":"
+        << buffer.tid << ",\"args\":{\"name\":\"";
+    AppendEscaped(oss, p.second);
+    oss << "\"}}";
+    first = false;
+
+    events.clear();
+    buffer.Snapshot(&events);
+    for (const Event& e : events) {
+      oss << ",\n{\"ph\":\"" << e.phase << "\",\"name\":\"";
+      AppendEscaped(oss, e.name);
+      oss << "\",\"pid\":1,\"tid\":" << buffer.tid
+          << ",\"ts\":" << e.timestamp_us;
+      if (e.phase == 'X') {
+        oss << ",\"dur\":" << e.value;
+      } else {
+        oss << ",\"args\":{\"value\":" << e.value << "}";
+      }
+      oss << "}";
+    }
+  }
+  oss << "\n]}\n";
+  return oss.str();
+}
+
+bool DumpToFile(const std::string& path) {
+  std::ofstream file(path, std::ios::out | std::ios::trunc);
+  if (!file) {
+    LOG_ERROR << "open trace file failed, path: " << path;
+    return false;
+  }
+  file << DumpJson();
+  return bool(file);
+}
+
+}  // namespace trace
+}  // namespace util
+}  // namespace live
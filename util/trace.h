@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace live {
+namespace util {
+namespace trace {
+
+// 轻量的跟踪：区间及计数器记录在各线程自己的环形缓冲区中，只保留每个线程
+// 最近的事件，可随时导出为 Chrome Trace Event Format 的 JSON，在
+// chrome://tracing 或 Perfetto 中按线程以时间轴查看。
+// 关闭时每个埋点只有一次原子读；定义 LIVE_DISABLE_TRACE 时埋点被编译去掉。
+// name 须为字符串字面量等生命周期与进程相同的字符串
+
+extern std::atomic<bool> enabled;
+
+inline bool IsEnabled() {
+  return enabled.load(std::memory_order_relaxed);
+}
+
+void Enable(bool on);
+
+// 当前线程在时间轴上的名字，如 event loop 0
+void SetThreadName(const std::string& name);
+
+uint64_t NowInMicroSeconds();
+
+// 记录一个从 begin_us 开始、end_us 结束的区间
+void Complete(const char* name, uint64_t begin_us, uint64_t end_us);
+
+void Counter(const char* name, int64_t value);
+
+// 作用域内的区间
+class Span {
+  const char* name_;
+  uint64_t begin_us_ = 0;
+
+ public:
+  explicit Span(const char* name) : name_(name) {
+    if (IsEnabled()) {
+      begin_us_ = NowInMicroSeconds();
+    }
+  }
+  ~Span() {
+    if (begin_us_) {
+      Complete(name_, begin_us_, NowInMicroSeconds());
+    }
+  }
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+};
+
+// 导出所有线程缓冲区中的事件，不清空缓冲区
+std::string DumpJson();
+
+bool DumpToFile(const std::string& path);
+
+}  // namespace trace
+}  // namespace util
+}  // namespace live
+
+#define LIVE_TRACE_CONCAT_INNER(a, b) a##b
+#define LIVE_TRACE_CONCAT(a, b) LIVE_TRACE_CONCAT_INNER(a, b)
+
+#ifdef LIVE_DISABLE_TRACE
+#define TRACE_SCOPE(name)
+#define TRACE_COUNTER(name, value)
+#else
+#define TRACE_SCOPE(name)                                     \
+  live::util::trace::Span LIVE_TRACE_CONCAT(trace_span_, __LINE__)(name)
+#define TRACE_COUNTER(name, value)                  \
+  do {                                              \
+    if (live::util::trace::IsEnabled()) {           \
+      live::util::trace::Counter(name, (value));    \
+    }                                               \
+  } while (0)
+#endif
@@ -16,6 +16,28 @@ uint64_t GetPassedTimeSinceStartedInMicroSeconds() {
              .count();
 }
 
+std::unordered_map<std::string, std::string> ParseQueryString(
+    const std::string& str, std::string* name) {
+  std::unordered_map<std::string, std::string> params;
+  auto pos = str.find('?');
+  if (name) {
+    *name = str.substr(0, pos);
+  }
+  while (pos != std::string::npos && pos < str.size()) {
+    auto end = str.find('&', pos + 1);
+    std::string kv = str.substr(pos + 1, end == std::string::npos
+                                             ? std::string::npos
+                                             : end - pos - 1);
+    auto eq = kv.find('=');
+    if (!kv.empty()) {
+      params[kv.substr(0, eq)] =
+          eq == std::string::npos ? std::string() : kv.substr(eq + 1);
+    }
+    pos = end;
+  }
+  return params;
+}
+
 bool LocalHostIsLittleEndian() {
   union Layout {
     uint32_t ui32;
@@ -1,4 +1,5 @@
 #include "util/video_scale_helper.h"
+#include "util/trace.h"
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -50,6 +51,7 @@ bool VideoScaleHelper::ResetSwsContext(int sw, int sh, AVPixelFormat sfmt,
 
 bool VideoScaleHelper::Scale(AVFrameWrapper& wrapper, int w, int h,
                              AVPixelFormat fmt) {
+  TRACE_SCOPE("scale");
   if (!ResetSwsContext(wrapper->width, wrapper->height,
                        AVPixelFormat(wrapper->format), w, h, fmt)) {
     return false;